@@ -48,6 +48,7 @@
 #include "memory.h"
 #include "conf.h"
 #include "virnetserver.h"
+#include "event_poll.h"
 #include "threads.h"
 #include "remote.h"
 #include "remote_driver.h"
@@ -136,13 +137,18 @@ struct daemonConfig {
 
     int prio_workers;
 
+    int io_loops;
+
     int max_requests;
     int max_client_requests;
 
+    char *event_loop_backend;
+
     int log_level;
     char *log_filters;
     char *log_outputs;
     int log_buffer_size;
+    int log_buffer_level;
 
     int audit_level;
     int audit_logging;
@@ -753,6 +759,8 @@ daemonSetupLogging(struct daemonConfig *config,
     virLogSetFromEnv();
 
     virLogSetBufferSize(config->log_buffer_size);
+    if (config->log_buffer_level != 0)
+        virLogSetBufferPriority(config->log_buffer_level);
 
     if (virLogGetNbFilters() == 0)
         virLogParseFilters(config->log_filters);
@@ -895,6 +903,8 @@ daemonConfigNew(bool privileged ATTRIBUTE_UNUSED)
 
     data->prio_workers = 5;
 
+    data->io_loops = 0;
+
     data->max_requests = 20;
     data->max_client_requests = 5;
 
@@ -967,6 +977,8 @@ daemonConfigFree(struct daemonConfig *data)
     VIR_FREE(data->cert_file);
     VIR_FREE(data->crl_file);
 
+    VIR_FREE(data->event_loop_backend);
+
     VIR_FREE(data->log_filters);
     VIR_FREE(data->log_outputs);
 
@@ -1053,9 +1065,20 @@ daemonConfigLoad(struct daemonConfig *data,
 
     GET_CONF_INT (conf, filename, prio_workers);
 
+    GET_CONF_INT (conf, filename, io_loops);
+
     GET_CONF_INT (conf, filename, max_requests);
     GET_CONF_INT (conf, filename, max_client_requests);
 
+    GET_CONF_STR (conf, filename, event_loop_backend);
+    if (data->event_loop_backend &&
+        virEventPollBackendTypeFromString(data->event_loop_backend) < 0) {
+        VIR_ERROR(_("remoteReadConfigFile: %s: event_loop_backend: "
+                    "unsupported backend %s"),
+                  filename, data->event_loop_backend);
+        goto error;
+    }
+
     GET_CONF_INT (conf, filename, audit_level);
     GET_CONF_INT (conf, filename, audit_logging);
 
@@ -1065,6 +1088,7 @@ daemonConfigLoad(struct daemonConfig *data,
     GET_CONF_STR (conf, filename, log_filters);
     GET_CONF_STR (conf, filename, log_outputs);
     GET_CONF_INT (conf, filename, log_buffer_size);
+    GET_CONF_INT (conf, filename, log_buffer_level);
 
     virConfFree (conf);
     return 0;
@@ -1450,6 +1474,14 @@ int main(int argc, char **argv) {
         goto cleanup;
     }
 
+    /* virNetServerNew sets up the event loop, so this has to come first */
+    if (config->event_loop_backend &&
+        virEventPollSetBackend(
+            virEventPollBackendTypeFromString(config->event_loop_backend)) < 0) {
+        ret = VIR_DAEMON_ERR_INIT;
+        goto cleanup;
+    }
+
     use_polkit_dbus = config->auth_unix_rw == REMOTE_AUTH_POLKIT ||
             config->auth_unix_ro == REMOTE_AUTH_POLKIT;
     if (!(srv = virNetServerNew(config->min_workers,
@@ -1541,6 +1573,12 @@ int main(int argc, char **argv) {
     virHookCall(VIR_HOOK_DRIVER_DAEMON, "-", VIR_HOOK_DAEMON_OP_START,
                 0, "start", NULL);
 
+    if (config->io_loops > 0 &&
+        virNetServerSetIOLoops(srv, config->io_loops) < 0) {
+        ret = VIR_DAEMON_ERR_INIT;
+        goto cleanup;
+    }
+
     if (daemonSetupNetworking(srv, config,
                               sock_file, sock_file_ro,
                               ipsock, privileged) < 0) {
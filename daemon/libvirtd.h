@@ -62,6 +62,12 @@ struct daemonClientPrivate {
     virConnectPtr conn;
 
     daemonClientStreamPtr streams;
+
+    /* Records of the virConnectGetAllDomainStats call the client is
+     * still reading in pages, and the cookie its replies carry */
+    virDomainStatsRecordPtr *domainStats;
+    unsigned int ndomainStats;
+    unsigned int domainStatsCookie;
 };
 
 # if HAVE_SASL
@@ -476,6 +476,10 @@ static void remoteClientFreeFunc(void *data)
 {
     struct daemonClientPrivate *priv = data;
 
+    /* The records hold references on the connection */
+    virDomainStatsRecordListFree(priv->domainStats);
+    priv->domainStats = NULL;
+
     /* Deregister event delivery callback */
     if (priv->conn) {
         int i;
@@ -934,6 +938,312 @@ cleanup:
     return rv;
 }
 
+/* Room left in a reply for the records, past the reply's own fields */
+#define REMOTE_DOMAIN_STATS_REPLY_ROOM (VIR_NET_MESSAGE_PAYLOAD_MAX - 64)
+
+/* Bytes taken by a string on the wire */
+static size_t
+remoteXDRStringSize(const char *str)
+{
+    return 4 + VIR_DIV_UP(strlen(str), 4) * 4;
+}
+
+/* Bytes taken by @record on the wire, once serialized */
+static size_t
+remoteDomainStatsRecordSize(virDomainStatsRecordPtr record)
+{
+    size_t size;
+    int i;
+
+    /* dom: name, uuid, id; then the length of params */
+    size = remoteXDRStringSize(record->dom->name) + VIR_UUID_BUFLEN + 4 + 4;
+
+    for (i = 0; i < record->nparams; i++) {
+        virTypedParameterPtr param = record->params + i;
+
+        size += remoteXDRStringSize(param->field) + 4;
+        switch (param->type) {
+        case VIR_TYPED_PARAM_LLONG:
+        case VIR_TYPED_PARAM_ULLONG:
+        case VIR_TYPED_PARAM_DOUBLE:
+            size += 8;
+            break;
+        default:
+            size += 4;
+            break;
+        }
+    }
+
+    return size;
+}
+
+static int
+remoteDispatchConnectGetAllDomainStats(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                       virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                       virNetMessageHeaderPtr hdr ATTRIBUTE_UNUSED,
+                                       virNetMessageErrorPtr rerr,
+                                       remote_connect_get_all_domain_stats_args *args,
+                                       remote_connect_get_all_domain_stats_ret *ret)
+{
+    virDomainStatsRecordPtr *retStats = NULL;
+    int nrecords = 0;
+    unsigned int count;
+    size_t size;
+    unsigned int i;
+    int rv = -1;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    /* Gather the records once, outside the lock, and hand them out
+     * over as many calls as it takes */
+    if (args->start == 0 &&
+        (nrecords = virConnectGetAllDomainStats(priv->conn, args->stats,
+                                                &retStats, args->flags)) < 0)
+        goto cleanup;
+
+    virMutexLock(&priv->lock);
+
+    if (args->start == 0) {
+        virDomainStatsRecordListFree(priv->domainStats);
+        priv->domainStats = retStats;
+        priv->ndomainStats = nrecords;
+        priv->domainStatsCookie++;
+        retStats = NULL;
+    } else if (!priv->domainStats ||
+               args->cookie != priv->domainStatsCookie ||
+               args->start >= priv->ndomainStats) {
+        virNetError(VIR_ERR_OPERATION_INVALID, "%s",
+                    _("domain stats records are no longer available"));
+        goto unlock;
+    }
+
+    /* As many records as fit in one message, but always at least one */
+    size = 0;
+    for (count = 0;
+         count < REMOTE_DOMAIN_STATS_RECORDS_MAX &&
+         args->start + count < priv->ndomainStats;
+         count++) {
+        size += remoteDomainStatsRecordSize(priv->domainStats[args->start + count]);
+        if (count > 0 && size > REMOTE_DOMAIN_STATS_REPLY_ROOM)
+            break;
+    }
+
+    if (count &&
+        VIR_ALLOC_N(ret->retStats.retStats_val, count) < 0) {
+        virReportOOMError();
+        goto unlock;
+    }
+    ret->retStats.retStats_len = count;
+
+    for (i = 0; i < count; i++) {
+        virDomainStatsRecordPtr record = priv->domainStats[args->start + i];
+        remote_domain_stats_record *dst = ret->retStats.retStats_val + i;
+
+        if (record->nparams > REMOTE_DOMAIN_STATS_PARAMS_MAX) {
+            virNetError(VIR_ERR_INTERNAL_ERROR,
+                        _("Too many stats '%d' for limit '%d'"),
+                        record->nparams, REMOTE_DOMAIN_STATS_PARAMS_MAX);
+            goto unlock;
+        }
+
+        make_nonnull_domain(&dst->dom, record->dom);
+        if (remoteSerializeTypedParameters(record->params,
+                                           record->nparams,
+                                           &dst->params.params_val,
+                                           &dst->params.params_len) < 0) {
+            dst->params.params_len = 0;
+            goto unlock;
+        }
+    }
+
+    ret->remaining = priv->ndomainStats - (args->start + count);
+    ret->cookie = priv->domainStatsCookie;
+
+    /* The last page is out, so nothing is left to keep */
+    if (ret->remaining == 0) {
+        virDomainStatsRecordListFree(priv->domainStats);
+        priv->domainStats = NULL;
+        priv->ndomainStats = 0;
+    }
+
+    rv = 0;
+
+unlock:
+    virMutexUnlock(&priv->lock);
+cleanup:
+    if (rv < 0) {
+        virNetMessageSaveError(rerr);
+        xdr_free((xdrproc_t)xdr_remote_connect_get_all_domain_stats_ret,
+                 (char *)ret);
+    }
+    virDomainStatsRecordListFree(retStats);
+    return rv;
+}
+
+static int
+remoteDispatchDomainGetStatsSamples(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                    virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                    virNetMessageHeaderPtr hdr ATTRIBUTE_UNUSED,
+                                    virNetMessageErrorPtr rerr,
+                                    remote_domain_get_stats_samples_args *args,
+                                    remote_domain_get_stats_samples_ret *ret)
+{
+    virDomainPtr dom = NULL;
+    virDomainStatsRecordPtr *retSamples = NULL;
+    int nrecords;
+    int i;
+    int rv = -1;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if (!(dom = get_nonnull_domain(priv->conn, args->dom)))
+        goto cleanup;
+
+    if ((nrecords = virDomainGetStatsSamples(dom, args->stats, args->nsamples,
+                                             &retSamples, args->flags)) < 0)
+        goto cleanup;
+
+    if (nrecords > REMOTE_DOMAIN_STATS_RECORDS_MAX) {
+        virNetError(VIR_ERR_INTERNAL_ERROR,
+                    _("Too many stats samples '%d' for limit '%d'"),
+                    nrecords, REMOTE_DOMAIN_STATS_RECORDS_MAX);
+        goto cleanup;
+    }
+
+    if (nrecords &&
+        VIR_ALLOC_N(ret->retSamples.retSamples_val, nrecords) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    ret->retSamples.retSamples_len = nrecords;
+
+    for (i = 0; i < nrecords; i++) {
+        remote_domain_stats_record *dst = ret->retSamples.retSamples_val + i;
+
+        if (retSamples[i]->nparams > REMOTE_DOMAIN_STATS_PARAMS_MAX) {
+            virNetError(VIR_ERR_INTERNAL_ERROR,
+                        _("Too many stats '%d' for limit '%d'"),
+                        retSamples[i]->nparams, REMOTE_DOMAIN_STATS_PARAMS_MAX);
+            goto cleanup;
+        }
+
+        make_nonnull_domain(&dst->dom, retSamples[i]->dom);
+        if (remoteSerializeTypedParameters(retSamples[i]->params,
+                                           retSamples[i]->nparams,
+                                           &dst->params.params_val,
+                                           &dst->params.params_len) < 0) {
+            dst->params.params_len = 0;
+            goto cleanup;
+        }
+    }
+
+    rv = 0;
+
+cleanup:
+    if (rv < 0) {
+        virNetMessageSaveError(rerr);
+        xdr_free((xdrproc_t)xdr_remote_domain_get_stats_samples_ret,
+                 (char *)ret);
+    }
+    virDomainStatsRecordListFree(retSamples);
+    if (dom)
+        virDomainFree(dom);
+    return rv;
+}
+
+static int
+remoteDispatchDomainGetMigrationTimeline(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                         virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                         virNetMessageHeaderPtr hdr ATTRIBUTE_UNUSED,
+                                         virNetMessageErrorPtr rerr,
+                                         remote_domain_get_migration_timeline_args *args,
+                                         remote_domain_get_migration_timeline_ret *ret)
+{
+    virDomainPtr dom = NULL;
+    virDomainStatsRecordPtr *retSamples = NULL;
+    unsigned int nsamples;
+    int nrecords;
+    int i;
+    int rv = -1;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if (!(dom = get_nonnull_domain(priv->conn, args->dom)))
+        goto cleanup;
+
+    /* The latest samples that fit in the reply, rather than failing
+     * on a long timeline, which is when it is wanted most */
+    nsamples = args->nsamples;
+    if (nsamples == 0 || nsamples > REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX)
+        nsamples = REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX;
+
+    if ((nrecords = virDomainGetMigrationTimeline(dom, nsamples,
+                                                  &retSamples, args->flags)) < 0)
+        goto cleanup;
+
+    if (nrecords > REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX) {
+        virNetError(VIR_ERR_INTERNAL_ERROR,
+                    _("Too many timeline samples '%d' for limit '%d'"),
+                    nrecords, REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX);
+        goto cleanup;
+    }
+
+    if (nrecords &&
+        VIR_ALLOC_N(ret->retSamples.retSamples_val, nrecords) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    ret->retSamples.retSamples_len = nrecords;
+
+    for (i = 0; i < nrecords; i++) {
+        remote_domain_stats_record *dst = ret->retSamples.retSamples_val + i;
+
+        if (retSamples[i]->nparams > REMOTE_DOMAIN_STATS_PARAMS_MAX) {
+            virNetError(VIR_ERR_INTERNAL_ERROR,
+                        _("Too many stats '%d' for limit '%d'"),
+                        retSamples[i]->nparams, REMOTE_DOMAIN_STATS_PARAMS_MAX);
+            goto cleanup;
+        }
+
+        make_nonnull_domain(&dst->dom, retSamples[i]->dom);
+        if (remoteSerializeTypedParameters(retSamples[i]->params,
+                                           retSamples[i]->nparams,
+                                           &dst->params.params_val,
+                                           &dst->params.params_len) < 0) {
+            dst->params.params_len = 0;
+            goto cleanup;
+        }
+    }
+
+    rv = 0;
+
+cleanup:
+    if (rv < 0) {
+        virNetMessageSaveError(rerr);
+        xdr_free((xdrproc_t)xdr_remote_domain_get_migration_timeline_ret,
+                 (char *)ret);
+    }
+    virDomainStatsRecordListFree(retSamples);
+    if (dom)
+        virDomainFree(dom);
+    return rv;
+}
+
 static int
 remoteDispatchDomainBlockPeek(virNetServerPtr server ATTRIBUTE_UNUSED,
                               virNetServerClientPtr client ATTRIBUTE_UNUSED,
@@ -51,7 +51,7 @@ struct daemonClientStream {
 
     int filterID;
 
-    virNetMessagePtr rx;
+    virNetMessageQueue rx;
     int tx;
 
     daemonClientStreamPtr next;
@@ -78,7 +78,7 @@ static void
 daemonStreamUpdateEvents(daemonClientStream *stream)
 {
     int newEvents = 0;
-    if (stream->rx)
+    if (stream->rx.head)
         newEvents |= VIR_STREAM_EVENT_WRITABLE;
     if (stream->tx && !stream->recvEOF)
         newEvents |= VIR_STREAM_EVENT_READABLE;
@@ -162,8 +162,8 @@ daemonStreamEvent(virStreamPtr st, int events, void *opaque)
     }
 
     /* If we have a completion/abort message, always process it */
-    if (stream->rx) {
-        virNetMessagePtr msg = stream->rx;
+    if (stream->rx.head) {
+        virNetMessagePtr msg = stream->rx.head;
         switch (msg->header.status) {
         case VIR_NET_CONTINUE:
             /* nada */
@@ -264,7 +264,7 @@ daemonStreamFilter(virNetServerClientPtr client ATTRIBUTE_UNUSED,
         goto cleanup;
 
     VIR_DEBUG("Incoming client=%p, rx=%p, serial=%d, proc=%d, status=%d",
-              client, stream->rx, msg->header.proc,
+              client, stream->rx.head, msg->header.proc,
               msg->header.serial, msg->header.status);
 
     virNetMessageQueuePush(&stream->rx, msg);
@@ -339,9 +339,7 @@ int daemonFreeClientStream(virNetServerClientPtr client,
 
     virNetServerProgramFree(stream->prog);
 
-    msg = stream->rx;
-    while (msg) {
-        virNetMessagePtr tmp = msg->next;
+    while ((msg = virNetMessageQueueServe(&stream->rx))) {
         if (client) {
             /* Send a dummy reply to free up 'msg' & unblock client rx */
             virNetMessageClear(msg);
@@ -354,7 +352,6 @@ int daemonFreeClientStream(virNetServerClientPtr client,
         } else {
             virNetMessageFree(msg);
         }
-        msg = tmp;
     }
 
     virStreamFree(stream->st);
@@ -617,8 +614,8 @@ daemonStreamHandleWrite(virNetServerClientPtr client,
 {
     VIR_DEBUG("client=%p, stream=%p", client, stream);
 
-    while (stream->rx && !stream->closed) {
-        virNetMessagePtr msg = stream->rx;
+    while (stream->rx.head && !stream->closed) {
+        virNetMessagePtr msg = stream->rx.head;
         int ret;
 
         switch (msg->header.status) {
@@ -442,6 +442,10 @@ skip_function = (
     'virConnectDomainEventDeregisterAny', # overridden in virConnect.py
     'virSaveLastError', # We have our own python error wrapper
     'virFreeError', # Only needed if we use virSaveLastError
+    'virConnectGetAllDomainStats', # Needs investigation...
+    'virDomainStatsRecordListFree', # Only needed with virConnectGetAllDomainStats
+    'virDomainGetStatsSamples', # Needs investigation...
+    'virDomainGetMigrationTimeline', # Needs investigation...
 
     'virStreamRecvAll', # Pure python libvirt-override-virStream.py
     'virStreamSendAll', # Pure python libvirt-override-virStream.py
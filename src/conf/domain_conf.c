@@ -49,6 +49,7 @@
 #include "virfile.h"
 #include "bitmap.h"
 #include "count-one-bits.h"
+#include "intprops.h"
 
 #define VIR_FROM_THIS VIR_FROM_DOMAIN
 
@@ -596,43 +597,179 @@ virDomainObjListDataFree(void *payload, const void *name ATTRIBUTE_UNUSED)
 
 int virDomainObjListInit(virDomainObjListPtr doms)
 {
+    if (virMutexInit(&doms->idLock) < 0) {
+        virDomainReportError(VIR_ERR_INTERNAL_ERROR,
+                             "%s", _("cannot initialize mutex"));
+        return -1;
+    }
+
     doms->objs = virHashCreate(50, virDomainObjListDataFree);
-    if (!doms->objs)
+    if (!doms->objs) {
+        virMutexDestroy(&doms->idLock);
         return -1;
+    }
+
+    /* The secondary indexes do not own a reference on
+     * the objects, so have no data free callback */
+    if (!(doms->objsName = virHashCreate(50, NULL)) ||
+        !(doms->objsID = virHashCreate(50, NULL))) {
+        virDomainObjListDeinit(doms);
+        return -1;
+    }
     return 0;
 }
 
 
 void virDomainObjListDeinit(virDomainObjListPtr doms)
 {
+    if (!doms->objs)
+        return;
+
+    virMutexDestroy(&doms->idLock);
+    virHashFree(doms->objsID);
+    virHashFree(doms->objsName);
     virHashFree(doms->objs);
+    doms->objsID = doms->objsName = doms->objs = NULL;
 }
 
 
-static int virDomainObjListSearchID(const void *payload,
-                                    const void *name ATTRIBUTE_UNUSED,
-                                    const void *data)
+#define VIR_DOMAIN_ID_KEY_BUFLEN INT_BUFSIZE_BOUND(int)
+
+static void virDomainObjListFormatID(char *key, int id)
 {
-    virDomainObjPtr obj = (virDomainObjPtr)payload;
-    const int *id = data;
-    int want = 0;
+    snprintf(key, VIR_DOMAIN_ID_KEY_BUFLEN, "%d", id);
+}
 
-    virDomainObjLock(obj);
-    if (virDomainObjIsActive(obj) &&
-        obj->def->id == *id)
-        want = 1;
-    virDomainObjUnlock(obj);
-    return want;
+/*
+ * Record the current ID of @obj in the ID index,
+ * if it is running. The caller must hold the lock
+ * on @obj.
+ */
+static int virDomainObjListIndexID(virDomainObjListPtr doms,
+                                   virDomainObjPtr obj)
+{
+    char key[VIR_DOMAIN_ID_KEY_BUFLEN];
+    int ret;
+
+    if (!virDomainObjIsActive(obj))
+        return 0;
+
+    virDomainObjListFormatID(key, obj->def->id);
+    virMutexLock(&doms->idLock);
+    ret = virHashUpdateEntry(doms->objsID, key, obj);
+    virMutexUnlock(&doms->idLock);
+    return ret;
+}
+
+/*
+ * Drop the ID index entry of @obj, if it is running
+ */
+static void virDomainObjListUnindexID(virDomainObjListPtr doms,
+                                      virDomainObjPtr obj)
+{
+    char key[VIR_DOMAIN_ID_KEY_BUFLEN];
+
+    if (!virDomainObjIsActive(obj))
+        return;
+
+    virDomainObjListFormatID(key, obj->def->id);
+    virMutexLock(&doms->idLock);
+    if (virHashLookup(doms->objsID, key) == obj)
+        virHashRemoveEntry(doms->objsID, key);
+    virMutexUnlock(&doms->idLock);
+}
+
+/*
+ * Drop every secondary index entry referring to @obj
+ */
+static void virDomainObjListUnindex(virDomainObjListPtr doms,
+                                    virDomainObjPtr obj)
+{
+    if (virHashLookup(doms->objsName, obj->def->name) == obj)
+        virHashRemoveEntry(doms->objsName, obj->def->name);
+    virDomainObjListUnindexID(doms, obj);
+}
+
+
+/**
+ * virDomainObjListAdd:
+ * @doms: the domain list
+ * @obj: locked domain object
+ *
+ * Insert @obj into the list, indexed by UUID, name and, if
+ * running, ID. The list takes over the caller's reference
+ * on @obj.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int virDomainObjListAdd(virDomainObjListPtr doms,
+                        virDomainObjPtr obj)
+{
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+    virUUIDFormat(obj->def->uuid, uuidstr);
+
+    if (virHashAddEntry(doms->objsName, obj->def->name, obj) < 0)
+        return -1;
+
+    if (virDomainObjListIndexID(doms, obj) < 0) {
+        virHashRemoveEntry(doms->objsName, obj->def->name);
+        return -1;
+    }
+
+    if (virHashAddEntry(doms->objs, uuidstr, obj) < 0) {
+        virDomainObjListUnindex(doms, obj);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * virDomainObjListSetID:
+ * @doms: the domain list holding @obj
+ * @obj: locked domain object
+ * @id: the new ID of @obj, or -1 once it is no longer running
+ *
+ * Drivers must set the ID of a listed domain through this, so
+ * that virDomainFindByID keeps finding it. Only the lock on @obj
+ * is needed.
+ */
+void virDomainObjListSetID(virDomainObjListPtr doms,
+                           virDomainObjPtr obj,
+                           int id)
+{
+    virDomainObjListUnindexID(doms, obj);
+    obj->def->id = id;
+    if (virDomainObjListIndexID(doms, obj) < 0)
+        VIR_WARN("Unable to index domain '%s' by ID %d",
+                 obj->def->name, id);
 }
 
+
 virDomainObjPtr virDomainFindByID(const virDomainObjListPtr doms,
                                   int id)
 {
+    char key[VIR_DOMAIN_ID_KEY_BUFLEN];
     virDomainObjPtr obj;
-    obj = virHashSearch(doms->objs, virDomainObjListSearchID, &id);
-    if (obj)
-        virDomainObjLock(obj);
-    return obj;
+
+    virDomainObjListFormatID(key, id);
+
+    virMutexLock(&doms->idLock);
+    obj = virHashLookup(doms->objsID, key);
+    virMutexUnlock(&doms->idLock);
+    if (!obj)
+        return NULL;
+
+    /* The driver lock keeps @obj in the list, but its ID may
+     * have changed before we got the domain lock */
+    virDomainObjLock(obj);
+    if (virDomainObjIsActive(obj) &&
+        obj->def->id == id)
+        return obj;
+    virDomainObjUnlock(obj);
+    return NULL;
 }
 
 
@@ -650,27 +787,19 @@ virDomainObjPtr virDomainFindByUUID(const virDomainObjListPtr doms,
     return obj;
 }
 
-static int virDomainObjListSearchName(const void *payload,
-                                      const void *name ATTRIBUTE_UNUSED,
-                                      const void *data)
-{
-    virDomainObjPtr obj = (virDomainObjPtr)payload;
-    int want = 0;
-
-    virDomainObjLock(obj);
-    if (STREQ(obj->def->name, (const char *)data))
-        want = 1;
-    virDomainObjUnlock(obj);
-    return want;
-}
-
+/*
+ * The name index is authoritative, since names can only
+ * change via virDomainAssignDef.
+ */
 virDomainObjPtr virDomainFindByName(const virDomainObjListPtr doms,
                                     const char *name)
 {
     virDomainObjPtr obj;
-    obj = virHashSearch(doms->objs, virDomainObjListSearchName, name);
-    if (obj)
-        virDomainObjLock(obj);
+
+    if (!(obj = virHashLookup(doms->objsName, name)))
+        return NULL;
+
+    virDomainObjLock(obj);
     return obj;
 }
 
@@ -1371,10 +1500,16 @@ virDomainObjPtr virDomainAssignDef(virCapsPtr caps,
                                    bool live)
 {
     virDomainObjPtr domain;
-    char uuidstr[VIR_UUID_STRING_BUFLEN];
 
     if ((domain = virDomainFindByUUID(doms, def->uuid))) {
+        virDomainObjListUnindex(doms, domain);
         virDomainObjAssignDef(domain, def, live);
+        /* Re-index under the, possibly changed, name and ID. A
+         * missing entry is only possible on OOM, so failure is
+         * not fatal here */
+        ignore_value(virHashUpdateEntry(doms->objsName,
+                                        domain->def->name, domain));
+        ignore_value(virDomainObjListIndexID(doms, domain));
         return domain;
     }
 
@@ -1382,8 +1517,7 @@ virDomainObjPtr virDomainAssignDef(virCapsPtr caps,
         return NULL;
     domain->def = def;
 
-    virUUIDFormat(def->uuid, uuidstr);
-    if (virHashAddEntry(doms->objs, uuidstr, domain) < 0) {
+    if (virDomainObjListAdd(doms, domain) < 0) {
         VIR_FREE(domain);
         return NULL;
     }
@@ -1467,6 +1601,8 @@ void virDomainRemoveInactive(virDomainObjListPtr doms,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
     virUUIDFormat(dom->def->uuid, uuidstr);
 
+    virDomainObjListUnindex(doms, dom);
+
     virDomainObjUnlock(dom);
 
     virHashRemoveEntry(doms->objs, uuidstr);
@@ -11261,7 +11397,7 @@ static virDomainObjPtr virDomainLoadStatus(virCapsPtr caps,
         goto error;
     }
 
-    if (virHashAddEntry(doms->objs, uuidstr, obj) < 0)
+    if (virDomainObjListAdd(doms, obj) < 0)
         goto error;
 
     if (notify)
@@ -1571,6 +1571,17 @@ struct _virDomainObjList {
     /* uuid string -> virDomainObj  mapping
      * for O(1), lockless lookup-by-uuid */
     virHashTable *objs;
+
+    /* name -> virDomainObj mapping
+     * for O(1), lockless lookup-by-name */
+    virHashTable *objsName;
+
+    /* id string -> virDomainObj mapping for O(1) lookup-by-id.
+     * Drivers change IDs with virDomainObjListSetID while holding
+     * just the domain lock, so this has a lock of its own, taken
+     * after any other */
+    virMutex idLock;
+    virHashTable *objsID;
 };
 
 static inline bool
@@ -1582,6 +1593,11 @@ virDomainObjIsActive(virDomainObjPtr dom)
 
 int virDomainObjListInit(virDomainObjListPtr objs);
 void virDomainObjListDeinit(virDomainObjListPtr objs);
+int virDomainObjListAdd(virDomainObjListPtr doms,
+                        virDomainObjPtr obj);
+void virDomainObjListSetID(virDomainObjListPtr doms,
+                           virDomainObjPtr obj,
+                           int id);
 
 virDomainObjPtr virDomainFindByID(const virDomainObjListPtr doms,
                                   int id);
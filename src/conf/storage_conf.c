@@ -44,6 +44,7 @@
 #include "util.h"
 #include "memory.h"
 #include "virfile.h"
+#include "ignore-value.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -1335,42 +1336,177 @@ virStoragePoolObjClearVols(virStoragePoolObjPtr pool)
 
     VIR_FREE(pool->volumes.objs);
     pool->volumes.count = 0;
+
+    virHashFree(pool->volumes.objsKey);
+    virHashFree(pool->volumes.objsPath);
+    virHashFree(pool->volumes.objsName);
+    pool->volumes.objsKey = NULL;
+    pool->volumes.objsPath = NULL;
+    pool->volumes.objsName = NULL;
+
+    if (pool->volumesPrivateFreeFunc)
+        (pool->volumesPrivateFreeFunc)(pool->volumesPrivate);
+    pool->volumesPrivate = NULL;
+    pool->volumesPrivateFreeFunc = NULL;
 }
 
-virStorageVolDefPtr
-virStorageVolDefFindByKey(virStoragePoolObjPtr pool,
-                          const char *key) {
+/*
+ * Like the linear scans the indexes replace, the volume
+ * added first wins should two of them share a key or path.
+ * Returns 1 if @vol was indexed, 0 if not, -1 on OOM
+ */
+static int
+virStorageVolDefListIndex(virHashTablePtr table,
+                          const char *name,
+                          virStorageVolDefPtr vol)
+{
+    if (name == NULL || virHashLookup(table, name))
+        return 0;
+    if (virHashAddEntry(table, name, vol) < 0)
+        return -1;
+    return 1;
+}
+
+/*
+ * Returns true if @vol was the one indexed under @name
+ */
+static bool
+virStorageVolDefListUnindex(virHashTablePtr table,
+                            const char *name,
+                            virStorageVolDefPtr vol)
+{
+    if (name == NULL || virHashLookup(table, name) != vol)
+        return false;
+    virHashRemoveEntry(table, name);
+    return true;
+}
+
+/**
+ * virStoragePoolObjAddVol:
+ * @pool: locked pool object
+ * @vol: volume to add
+ *
+ * Append @vol to the pool's volume list, and index it by its
+ * key, target path and name. Those must be filled in by now,
+ * and not change while @vol is in the list. The pool takes
+ * over ownership of @vol on success.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+virStoragePoolObjAddVol(virStoragePoolObjPtr pool,
+                        virStorageVolDefPtr vol)
+{
+    virStorageVolDefListPtr vols = &pool->volumes;
+    int key = 0, path = 0;
+
+    if (!vols->objsKey) {
+        if (!(vols->objsKey = virHashCreate(50, NULL)) ||
+            !(vols->objsPath = virHashCreate(50, NULL)) ||
+            !(vols->objsName = virHashCreate(50, NULL))) {
+            virHashFree(vols->objsKey);
+            virHashFree(vols->objsPath);
+            vols->objsKey = vols->objsPath = NULL;
+            return -1;
+        }
+    }
+
+    if (VIR_REALLOC_N(vols->objs, vols->count + 1) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    if ((key = virStorageVolDefListIndex(vols->objsKey, vol->key, vol)) < 0 ||
+        (path = virStorageVolDefListIndex(vols->objsPath,
+                                          vol->target.path, vol)) < 0 ||
+        virStorageVolDefListIndex(vols->objsName, vol->name, vol) < 0)
+        goto error;
+
+    vols->objs[vols->count++] = vol;
+    return 0;
+
+error:
+    if (key > 0)
+        virHashRemoveEntry(vols->objsKey, vol->key);
+    if (path > 0)
+        virHashRemoveEntry(vols->objsPath, vol->target.path);
+    return -1;
+}
+
+/**
+ * virStoragePoolObjRemoveVol:
+ * @pool: locked pool object
+ * @vol: volume to remove
+ *
+ * Drop @vol from the pool's volume list and indexes. Ownership
+ * of @vol goes back to the caller.
+ */
+void
+virStoragePoolObjRemoveVol(virStoragePoolObjPtr pool,
+                           virStorageVolDefPtr vol)
+{
+    virStorageVolDefListPtr vols = &pool->volumes;
+    bool key, path, name;
     unsigned int i;
 
-    for (i = 0 ; i < pool->volumes.count ; i++)
-        if (STREQ(pool->volumes.objs[i]->key, key))
-            return pool->volumes.objs[i];
+    for (i = 0 ; i < vols->count ; i++) {
+        if (vols->objs[i] == vol)
+            break;
+    }
+    if (i == vols->count)
+        return;
 
-    return NULL;
+    if (i < (vols->count - 1))
+        memmove(vols->objs + i, vols->objs + i + 1,
+                sizeof(*(vols->objs)) * (vols->count - (i + 1)));
+
+    if (VIR_REALLOC_N(vols->objs, vols->count - 1) < 0) {
+        ; /* Failure to reduce memory allocation isn't fatal */
+    }
+    vols->count--;
+
+    key = virStorageVolDefListUnindex(vols->objsKey, vol->key, vol);
+    path = virStorageVolDefListUnindex(vols->objsPath, vol->target.path, vol);
+    name = virStorageVolDefListUnindex(vols->objsName, vol->name, vol);
+
+    /* Hand the entries over to the next volume in line, if any
+     * shares them. On OOM that volume can only be found by a
+     * refresh of the pool, which rebuilds the indexes */
+    for (i = 0 ; i < vols->count && (key || path || name) ; i++) {
+        virStorageVolDefPtr other = vols->objs[i];
+
+        if (key && STREQ_NULLABLE(other->key, vol->key)) {
+            ignore_value(virHashAddEntry(vols->objsKey, other->key, other));
+            key = false;
+        }
+        if (path && STREQ_NULLABLE(other->target.path, vol->target.path)) {
+            ignore_value(virHashAddEntry(vols->objsPath,
+                                         other->target.path, other));
+            path = false;
+        }
+        if (name && STREQ_NULLABLE(other->name, vol->name)) {
+            ignore_value(virHashAddEntry(vols->objsName, other->name, other));
+            name = false;
+        }
+    }
+}
+
+virStorageVolDefPtr
+virStorageVolDefFindByKey(virStoragePoolObjPtr pool,
+                          const char *key) {
+    return virHashLookup(pool->volumes.objsKey, key);
 }
 
 virStorageVolDefPtr
 virStorageVolDefFindByPath(virStoragePoolObjPtr pool,
                            const char *path) {
-    unsigned int i;
-
-    for (i = 0 ; i < pool->volumes.count ; i++)
-        if (STREQ(pool->volumes.objs[i]->target.path, path))
-            return pool->volumes.objs[i];
-
-    return NULL;
+    return virHashLookup(pool->volumes.objsPath, path);
 }
 
 virStorageVolDefPtr
 virStorageVolDefFindByName(virStoragePoolObjPtr pool,
                            const char *name) {
-    unsigned int i;
-
-    for (i = 0 ; i < pool->volumes.count ; i++)
-        if (STREQ(pool->volumes.objs[i]->name, name))
-            return pool->volumes.objs[i];
-
-    return NULL;
+    return virHashLookup(pool->volumes.objsName, name);
 }
 
 virStoragePoolObjPtr
@@ -28,6 +28,7 @@
 # include "util.h"
 # include "storage_encryption_conf.h"
 # include "threads.h"
+# include "hash.h"
 
 # include <libxml/tree.h>
 
@@ -105,6 +106,12 @@ typedef virStorageVolDefList *virStorageVolDefListPtr;
 struct _virStorageVolDefList {
     unsigned int count;
     virStorageVolDefPtr *objs;
+
+    /* Lookup indexes over objs, which do not own the volumes.
+     * Only maintained by virStoragePoolObjAddVol/RemoveVol */
+    virHashTablePtr objsKey;
+    virHashTablePtr objsPath;
+    virHashTablePtr objsName;
 };
 
 
@@ -286,6 +293,12 @@ struct _virStoragePoolObj {
     virStoragePoolDefPtr newDef;
 
     virStorageVolDefList volumes;
+
+    /* Backend state describing the volumes listed, such as what
+     * an incremental refresh compares against. It goes away
+     * along with the volumes in virStoragePoolObjClearVols */
+    void *volumesPrivate;
+    void (*volumesPrivateFreeFunc)(void *);
 };
 
 typedef struct _virStoragePoolObjList virStoragePoolObjList;
@@ -346,6 +359,10 @@ virStorageVolDefPtr virStorageVolDefFindByName(virStoragePoolObjPtr pool,
                                                const char *name);
 
 void virStoragePoolObjClearVols(virStoragePoolObjPtr pool);
+int virStoragePoolObjAddVol(virStoragePoolObjPtr pool,
+                            virStorageVolDefPtr vol);
+void virStoragePoolObjRemoveVol(virStoragePoolObjPtr pool,
+                                virStorageVolDefPtr vol);
 
 virStoragePoolDefPtr virStoragePoolDefParseString(const char *xml);
 virStoragePoolDefPtr virStoragePoolDefParseFile(const char *filename);
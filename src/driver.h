@@ -735,6 +735,25 @@ typedef int
     (*virDrvDomainBlockPull)(virDomainPtr dom, const char *path,
                              unsigned long bandwidth, unsigned int flags);
 
+typedef int
+    (*virDrvConnectGetAllDomainStats)(virConnectPtr conn,
+                                      unsigned int stats,
+                                      virDomainStatsRecordPtr **retStats,
+                                      unsigned int flags);
+
+typedef int
+    (*virDrvDomainGetStatsSamples)(virDomainPtr dom,
+                                   unsigned int stats,
+                                   unsigned int nsamples,
+                                   virDomainStatsRecordPtr **retSamples,
+                                   unsigned int flags);
+
+typedef int
+    (*virDrvDomainGetMigrationTimeline)(virDomainPtr dom,
+                                        unsigned int nsamples,
+                                        virDomainStatsRecordPtr **retSamples,
+                                        unsigned int flags);
+
 
 /**
  * _virDriver:
@@ -893,6 +912,9 @@ struct _virDriver {
     virDrvDomainGetBlockJobInfo domainGetBlockJobInfo;
     virDrvDomainBlockJobSetSpeed domainBlockJobSetSpeed;
     virDrvDomainBlockPull domainBlockPull;
+    virDrvConnectGetAllDomainStats connectGetAllDomainStats;
+    virDrvDomainGetStatsSamples domainGetStatsSamples;
+    virDrvDomainGetMigrationTimeline domainGetMigrationTimeline;
 };
 
 typedef int
@@ -6710,6 +6710,264 @@ error:
     return -1;
 }
 
+/**
+ * virConnectGetAllDomainStats:
+ * @conn: pointer to the hypervisor connection
+ * @stats: bitwise-OR of virDomainStatsTypes, or 0 for all of them
+ * @retStats: pointer to an array of stats records (returned)
+ * @flags: unused, always pass 0
+ *
+ * Collects the requested groups of statistics for every running
+ * domain in a single call, rather than one call per domain and per
+ * device with virDomainGetInfo, virDomainBlockStats,
+ * virDomainInterfaceStats and virDomainMemoryStats.
+ *
+ * Each domain gets one virDomainStatsRecord, whose typed parameters
+ * hold the statistics the driver could gather for it. Groups the
+ * driver cannot gather for a domain at the moment, for instance
+ * because the domain is busy with a job that keeps its monitor to
+ * itself, are left out of that record rather than failing the call.
+ *
+ * VIR_DOMAIN_STATS_STATE:
+ *     "state.state" and "state.reason" as in virDomainGetState.
+ * VIR_DOMAIN_STATS_CPU_TOTAL:
+ *     "cpu.time", the CPU time used in nanoseconds.
+ * VIR_DOMAIN_STATS_BALLOON:
+ *     "balloon.current" and "balloon.maximum", in kilobytes.
+ * VIR_DOMAIN_STATS_INTERFACE:
+ *     "net.<ifname>.rx_bytes", "net.<ifname>.rx_packets" and so on
+ *     for every field of virDomainInterfaceStats.
+ * VIR_DOMAIN_STATS_BLOCK:
+ *     "block.<dev>.rd_bytes", "block.<dev>.rd_operations" and so on
+ *     for every VIR_DOMAIN_BLOCK_STATS_* field, named after the
+ *     target of the disk.
+ *
+ * Over a remote connection the records of all domains are gathered
+ * at once, and then read back as many as fit in one message at a
+ * time, so the size of the host is not bound by that of a message.
+ *
+ * The returned array is terminated by a NULL record, and must be
+ * released with virDomainStatsRecordListFree.
+ *
+ * Returns the number of records in @retStats, or -1 in case of error.
+ */
+int
+virConnectGetAllDomainStats(virConnectPtr conn,
+                            unsigned int stats,
+                            virDomainStatsRecordPtr **retStats,
+                            unsigned int flags)
+{
+    VIR_DEBUG("conn=%p, stats=%x, retStats=%p, flags=%x",
+              conn, stats, retStats, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECT(conn)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (!retStats) {
+        virLibConnError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+    *retStats = NULL;
+
+    if (conn->driver->connectGetAllDomainStats) {
+        int ret;
+        ret = conn->driver->connectGetAllDomainStats(conn, stats, retStats,
+                                                     flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
+/**
+ * virDomainGetStatsSamples:
+ * @dom: pointer to the domain object
+ * @stats: bitwise-OR of virDomainStatsTypes, or 0 for all of them
+ * @nsamples: how many of the latest samples to return, 0 for all
+ * @retSamples: pointer to an array of stats records (returned)
+ * @flags: bitwise-OR of virDomainStatsSamplesFlags
+ *
+ * Drivers which sample the statistics of their domains periodically
+ * keep a short history of them; this returns it, without reaching
+ * out to the hypervisor at all. How often samples are taken and how
+ * many are kept is up to the driver configuration.
+ *
+ * Each sample is a virDomainStatsRecord with the fields described
+ * in virConnectGetAllDomainStats for the groups in @stats, except
+ * VIR_DOMAIN_STATS_STATE which is not sampled, plus "timestamp",
+ * the time of the sample in milliseconds since the epoch.
+ *
+ * With VIR_DOMAIN_STATS_SAMPLES_RATES, each record rather describes
+ * the time since the sample before it, which it gives as "interval"
+ * in milliseconds. Counters are then turned into double values per
+ * second, "cpu.time" for instance into nanoseconds of CPU time used
+ * per second, while sizes such as "balloon.current" are left as
+ * they are. Counters which went back in the meantime are left out.
+ *
+ * The records come oldest first. The returned array is terminated
+ * by a NULL record, and must be released with
+ * virDomainStatsRecordListFree.
+ *
+ * Returns the number of records in @retSamples, or -1 in case of
+ * error, such as sampling not being enabled.
+ */
+int
+virDomainGetStatsSamples(virDomainPtr dom,
+                         unsigned int stats,
+                         unsigned int nsamples,
+                         virDomainStatsRecordPtr **retSamples,
+                         unsigned int flags)
+{
+    virConnectPtr conn;
+
+    VIR_DOMAIN_DEBUG(dom, "stats=%x, nsamples=%u, retSamples=%p, flags=%x",
+                     stats, nsamples, retSamples, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_DOMAIN(dom)) {
+        virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (!retSamples) {
+        virLibDomainError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+    *retSamples = NULL;
+
+    conn = dom->conn;
+    if (conn->driver->domainGetStatsSamples) {
+        int ret;
+        ret = conn->driver->domainGetStatsSamples(dom, stats, nsamples,
+                                                  retSamples, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+    virLibDomainError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(dom->conn);
+    return -1;
+}
+
+/**
+ * virDomainGetMigrationTimeline:
+ * @dom: pointer to the domain object
+ * @nsamples: how many of the latest samples to return, 0 for all
+ * @retSamples: pointer to an array of stats records (returned)
+ * @flags: unused, always pass 0
+ *
+ * Returns the progress of the latest migration, save or core dump of
+ * the domain, as the driver saw it each time it checked. This works
+ * both while the job is running and after it ended, until the next
+ * such job starts, so the timeline of a migration which never
+ * converged can be used to pick a better maximum downtime.
+ *
+ * Each sample is a virDomainStatsRecord with "timestamp", the time of
+ * the sample in milliseconds since the epoch, and the following
+ * VIR_TYPED_PARAM_ULLONG fields:
+ *
+ * "migration.elapsed" - milliseconds since the job started
+ * "migration.processed" - bytes of memory sent so far
+ * "migration.remaining" - bytes of memory left to send
+ * "migration.total" - bytes of memory in all
+ * "migration.rate" - bytes sent per second since the sample before
+ * "migration.dirty_rate" - bytes per second the guest dirtied again
+ *                          since the sample before, as an estimate
+ * "migration.next_poll" - milliseconds until the next sample
+ *
+ * The rates are 0 in the first sample. The records come oldest first.
+ * Only a bounded number of the latest samples is kept, and asking for
+ * all of them over a remote connection returns as many of the latest
+ * as fit in one reply.
+ * The returned array is terminated by a NULL record, and must be
+ * released with virDomainStatsRecordListFree.
+ *
+ * Returns the number of records in @retSamples, or -1 in case of
+ * error, such as the domain not having been migrated at all.
+ */
+int
+virDomainGetMigrationTimeline(virDomainPtr dom,
+                              unsigned int nsamples,
+                              virDomainStatsRecordPtr **retSamples,
+                              unsigned int flags)
+{
+    virConnectPtr conn;
+
+    VIR_DOMAIN_DEBUG(dom, "nsamples=%u, retSamples=%p, flags=%x",
+                     nsamples, retSamples, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_DOMAIN(dom)) {
+        virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (!retSamples) {
+        virLibDomainError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+    *retSamples = NULL;
+
+    conn = dom->conn;
+    if (conn->driver->domainGetMigrationTimeline) {
+        int ret;
+        ret = conn->driver->domainGetMigrationTimeline(dom, nsamples,
+                                                       retSamples, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+    virLibDomainError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(dom->conn);
+    return -1;
+}
+
+/**
+ * virDomainStatsRecordListFree:
+ * @stats: NULL terminated array of records to free
+ *
+ * Releases the records returned by virConnectGetAllDomainStats,
+ * virDomainGetStatsSamples or virDomainGetMigrationTimeline, along
+ * with the domain objects they
+ * reference. Unlike most other APIs this leaves the last error
+ * alone, so drivers can use it on their error paths too.
+ */
+void
+virDomainStatsRecordListFree(virDomainStatsRecordPtr *stats)
+{
+    virDomainStatsRecordPtr *next;
+
+    if (!stats)
+        return;
+
+    for (next = stats ; *next ; next++) {
+        if ((*next)->dom)
+            virUnrefDomain((*next)->dom);
+        VIR_FREE((*next)->params);
+        VIR_FREE(*next);
+    }
+
+    VIR_FREE(stats);
+}
+
 /**
  * virDomainBlockPeek:
  * @dom: pointer to the domain object
@@ -10960,12 +11218,17 @@ virStoragePoolRef(virStoragePoolPtr pool)
 /**
  * virStoragePoolRefresh:
  * @pool: pointer to storage pool
- * @flags: flags to control refresh behaviour (currently unused, use 0)
+ * @flags: bitwise-OR of virStoragePoolRefreshFlags
  *
  * Request that the pool refresh its list of volumes. This may
  * involve communicating with a remote server, and/or initializing
  * new devices at the OS layer
  *
+ * Where the pool supports it, only the volumes which changed since
+ * the last refresh are looked at again. Passing
+ * VIR_STORAGE_POOL_REFRESH_FULL rebuilds the whole volume list
+ * instead.
+ *
  * Returns 0 if the volume list was refreshed, -1 on failure
  */
 int
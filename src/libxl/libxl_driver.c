@@ -326,7 +326,7 @@ libxlVmCleanup(libxlDriverPrivatePtr driver,
     }
 
     if (vm->persistent) {
-        vm->def->id = -1;
+        virDomainObjListSetID(&driver->domains, vm, -1);
         virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, reason);
     }
 
@@ -706,7 +706,7 @@ libxlVmStart(libxlDriverPrivatePtr driver, virDomainObjPtr vm,
         goto error;
     }
 
-    vm->def->id = domid;
+    virDomainObjListSetID(&driver->domains, vm, domid);
     if ((dom_xml = virDomainDefFormat(vm->def, 0)) == NULL)
         goto error;
 
@@ -748,7 +748,7 @@ libxlVmStart(libxlDriverPrivatePtr driver, virDomainObjPtr vm,
 error:
     if (domid > 0) {
         libxl_domain_destroy(&priv->ctx, domid, 0);
-        vm->def->id = -1;
+        virDomainObjListSetID(&driver->domains, vm, -1);
         virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, VIR_DOMAIN_SHUTOFF_FAILED);
     }
     libxl_domain_config_destroy(&d_config);
@@ -796,7 +796,7 @@ libxlReconnectDomain(void *payload,
     }
 
     /* Update domid in case it changed (e.g. reboot) while we were gone? */
-    vm->def->id = d_info.domid;
+    virDomainObjListSetID(&driver->domains, vm, d_info.domid);
     virDomainObjSetState(vm, VIR_DOMAIN_RUNNING, VIR_DOMAIN_RUNNING_UNKNOWN);
 
     /* Recreate domain death et. al. events */
@@ -57,6 +57,7 @@
 #include "util.h"
 #include "virfile.h"
 #include "virpidfile.h"
+#include "virfdrelay.h"
 
 #define VIR_FROM_THIS VIR_FROM_LXC
 
@@ -436,46 +437,6 @@ error:
     return -1;
 }
 
-/**
- * lxcFdForward:
- * @readFd: file descriptor to read
- * @writeFd: file desriptor to write
- *
- * Reads 1 byte of data from readFd and writes to writeFd.
- *
- * Returns 0 on success, EAGAIN if returned on read, or -1 in case of error
- */
-static int lxcFdForward(int readFd, int writeFd)
-{
-    int rc = -1;
-    char buf[2];
-
-    if (1 != (saferead(readFd, buf, 1))) {
-        if (EAGAIN == errno) {
-            rc = EAGAIN;
-            goto cleanup;
-        }
-
-        virReportSystemError(errno,
-                             _("read of fd %d failed"),
-                             readFd);
-        goto cleanup;
-    }
-
-    if (1 != (safewrite(writeFd, buf, 1))) {
-        virReportSystemError(errno,
-                             _("write to fd %d failed"),
-                             writeFd);
-        goto cleanup;
-    }
-
-    rc = 0;
-
-cleanup:
-    return rc;
-}
-
-
 static int lxcControllerClearCapabilities(void)
 {
 #if HAVE_CAPNG
@@ -494,11 +455,6 @@ static int lxcControllerClearCapabilities(void)
     return 0;
 }
 
-typedef struct _lxcTtyForwardFd_t {
-    int fd;
-    int active;
-} lxcTtyForwardFd_t;
-
 /* Return true if it is ok to ignore an accept-after-epoll syscall
    that fails with the specified errno value.  Else false.  */
 static bool
@@ -533,6 +489,8 @@ lxcPidGone(pid_t container)
  * This process loops forever.
  * This uses epoll in edge triggered mode to avoid a hard loop on POLLHUP
  * events when the user disconnects the virsh console via ctrl-]
+ * Data is moved in chunks through a buffer in each direction, and
+ * reading stops while the other side is not keeping up.
  *
  * Returns 0 on success or -1 in case of error
  */
@@ -546,16 +504,8 @@ static int lxcControllerMain(int monitor,
     int epollFd;
     struct epoll_event epollEvent;
     int numEvents;
-    int numActive = 0;
-    lxcTtyForwardFd_t fdArray[2];
-    int timeout = -1;
-    int curFdOff = 0;
-    int writeFdOff = 0;
-
-    fdArray[0].fd = appPty;
-    fdArray[0].active = 0;
-    fdArray[1].fd = contPty;
-    fdArray[1].active = 0;
+    virFDRelayPtr relay = NULL;
+    int pending = 0;
 
     VIR_DEBUG("monitor=%d client=%d appPty=%d contPty=%d",
               monitor, client, appPty, contPty);
@@ -568,9 +518,13 @@ static int lxcControllerMain(int monitor,
         goto cleanup;
     }
 
+    if (!(relay = virFDRelayNew(appPty, contPty,
+                                VIR_FD_RELAY_DEFAULT_BUFSIZE)))
+        goto cleanup;
+
     /* add the file descriptors the epoll fd */
     memset(&epollEvent, 0x00, sizeof(epollEvent));
-    epollEvent.events = EPOLLIN|EPOLLET;    /* edge triggered */
+    epollEvent.events = EPOLLIN|EPOLLOUT|EPOLLET;    /* edge triggered */
     epollEvent.data.fd = appPty;
     if (0 > epoll_ctl(epollFd, EPOLL_CTL_ADD, appPty, &epollEvent)) {
         virReportSystemError(errno, "%s",
@@ -601,9 +555,8 @@ static int lxcControllerMain(int monitor,
     }
 
     while (1) {
-        /* if active fd's, return if no events, else wait forever */
-        timeout = (numActive > 0) ? 0 : -1;
-        numEvents = epoll_wait(epollFd, &epollEvent, 1, timeout);
+        /* if the relay has more to do, return if no events, else wait forever */
+        numEvents = epoll_wait(epollFd, &epollEvent, 1, pending ? 0 : -1);
         if (numEvents > 0) {
             if (epollEvent.data.fd == monitor) {
                 int fd = accept(monitor, NULL, 0);
@@ -639,38 +592,25 @@ static int lxcControllerMain(int monitor,
                 }
                 VIR_FORCE_CLOSE(client);
             } else {
-                if (epollEvent.events & EPOLLIN) {
-                    curFdOff = epollEvent.data.fd == appPty ? 0 : 1;
-                    if (!fdArray[curFdOff].active) {
-                        fdArray[curFdOff].active = 1;
-                        ++numActive;
-                    }
-                } else if (epollEvent.events & EPOLLHUP) {
+                int events = 0;
+
+                if (epollEvent.events & EPOLLIN)
+                    events |= VIR_EVENT_HANDLE_READABLE;
+                if (epollEvent.events & EPOLLOUT)
+                    events |= VIR_EVENT_HANDLE_WRITABLE;
+                if (epollEvent.events & EPOLLHUP) {
                     if (lxcPidGone(container))
                         goto cleanup;
-                    curFdOff = epollEvent.data.fd == appPty ? 0 : 1;
-                    if (fdArray[curFdOff].active) {
-                        fdArray[curFdOff].active = 0;
-                        --numActive;
-                    }
-                    continue;
-                } else {
+                    events |= VIR_EVENT_HANDLE_HANGUP;
+                }
+                if (!events) {
                     lxcError(VIR_ERR_INTERNAL_ERROR,
                              _("error event %d"), epollEvent.events);
                     goto cleanup;
                 }
+                virFDRelayNotify(relay, epollEvent.data.fd, events);
             }
-        } else if (0 == numEvents) {
-            if (2 == numActive) {
-                /* both fds active, toggle between the two */
-                curFdOff ^= 1;
-            } else {
-                /* only one active, if current is active, use it, else it */
-                /* must be the other one (ie. curFd just went inactive) */
-                curFdOff = fdArray[curFdOff].active ? curFdOff : curFdOff ^ 1;
-            }
-
-        } else  {
+        } else if (numEvents < 0) {
             if (EINTR == errno) {
                 continue;
             }
@@ -682,22 +622,13 @@ static int lxcControllerMain(int monitor,
 
         }
 
-        if (0 < numActive) {
-            writeFdOff = curFdOff ^ 1;
-            rc = lxcFdForward(fdArray[curFdOff].fd, fdArray[writeFdOff].fd);
-
-            if (EAGAIN == rc) {
-                /* this fd no longer has data, set it as inactive */
-                --numActive;
-                fdArray[curFdOff].active = 0;
-            } else if (-1 == rc) {
-                if (lxcPidGone(container))
-                    goto cleanup;
-                continue;
-            }
-
+        if ((pending = virFDRelayRun(relay)) < 0) {
+            if (lxcPidGone(container))
+                goto cleanup;
+            /* The failed end waits for its next event, but the
+             * other direction may still have work to do */
+            pending = 1;
         }
-
     }
 
     rc = 0;
@@ -706,6 +637,7 @@ cleanup:
     VIR_FORCE_CLOSE(appPty);
     VIR_FORCE_CLOSE(contPty);
     VIR_FORCE_CLOSE(epollFd);
+    virFDRelayFree(relay);
     return rc;
 }
 
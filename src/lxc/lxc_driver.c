@@ -1036,7 +1036,7 @@ static void lxcVmCleanup(lxc_driver_t *driver,
 
     virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, reason);
     vm->pid = -1;
-    vm->def->id = -1;
+    virDomainObjListSetID(&driver->domains, vm, -1);
     priv->monitor = -1;
     priv->monitorWatch = -1;
 
@@ -1641,7 +1641,7 @@ static int lxcVmStart(virConnectPtr conn,
         goto cleanup;
     }
 
-    vm->def->id = vm->pid;
+    virDomainObjListSetID(&driver->domains, vm, vm->pid);
     virDomainObjSetState(vm, VIR_DOMAIN_RUNNING, reason);
 
     if (lxcContainerWaitForContinue(handshakefds[0]) < 0) {
@@ -2107,7 +2107,7 @@ lxcReconnectVM(void *payload, const void *name ATTRIBUTE_UNUSED, void *opaque)
     priv = vm->privateData;
 
     if (vm->pid != 0) {
-        vm->def->id = vm->pid;
+        virDomainObjListSetID(&driver->domains, vm, vm->pid);
         virDomainObjSetState(vm, VIR_DOMAIN_RUNNING,
                              VIR_DOMAIN_RUNNING_UNKNOWN);
 
@@ -2121,7 +2121,7 @@ lxcReconnectVM(void *payload, const void *name ATTRIBUTE_UNUSED, void *opaque)
                  vm, NULL)) < 0)
             goto error;
     } else {
-        vm->def->id = -1;
+        virDomainObjListSetID(&driver->domains, vm, -1);
         VIR_FORCE_CLOSE(priv->monitor);
     }
 
@@ -614,7 +614,7 @@ openvzDomainShutdownFlags(virDomainPtr dom,
     if (virRun(prog, NULL) < 0)
         goto cleanup;
 
-    vm->def->id = -1;
+    virDomainObjListSetID(&driver->domains, vm, -1);
     virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, VIR_DOMAIN_SHUTOFF_SHUTDOWN);
     dom->id = -1;
     ret = 0;
@@ -1033,7 +1033,7 @@ openvzDomainCreateXML(virConnectPtr conn, const char *xml,
     }
 
     vm->pid = strtoI(vm->def->name);
-    vm->def->id = vm->pid;
+    virDomainObjListSetID(&driver->domains, vm, vm->pid);
     virDomainObjSetState(vm, VIR_DOMAIN_RUNNING, VIR_DOMAIN_RUNNING_BOOTED);
 
     if (vm->def->maxvcpus > 0) {
@@ -1092,7 +1092,7 @@ openvzDomainCreateWithFlags(virDomainPtr dom, unsigned int flags)
     }
 
     vm->pid = strtoI(vm->def->name);
-    vm->def->id = vm->pid;
+    virDomainObjListSetID(&driver->domains, vm, vm->pid);
     dom->id = vm->pid;
     virDomainObjSetState(vm, VIR_DOMAIN_RUNNING, VIR_DOMAIN_RUNNING_BOOTED);
     ret = 0;
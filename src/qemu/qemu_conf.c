@@ -80,6 +80,7 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     /* Setup critical defaults */
     driver->dynamicOwnership = 1;
     driver->clearEmulatorCapabilities = 1;
+    driver->statsSampleHistory = 60;
 
     if (!(driver->vncListen = strdup("127.0.0.1"))) {
         virReportOOMError();
@@ -462,6 +463,39 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     CHECK_TYPE("max_queued", VIR_CONF_LONG);
     if (p) driver->max_queued = p->l;
 
+    p = virConfGetValue(conf, "stats_sample_interval");
+    CHECK_TYPE("stats_sample_interval", VIR_CONF_LONG);
+    if (p) {
+        if (p->l < 0) {
+            VIR_ERROR(_("stats_sample_interval must not be negative"));
+            virConfFree(conf);
+            return -1;
+        }
+        driver->statsSampleInterval = p->l;
+    }
+
+    p = virConfGetValue(conf, "stats_sample_history");
+    CHECK_TYPE("stats_sample_history", VIR_CONF_LONG);
+    if (p) {
+        if (p->l <= 0) {
+            VIR_ERROR(_("stats_sample_history must be positive"));
+            virConfFree(conf);
+            return -1;
+        }
+        driver->statsSampleHistory = p->l;
+    }
+
+    p = virConfGetValue(conf, "migration_tunnel_chunk_size");
+    CHECK_TYPE("migration_tunnel_chunk_size", VIR_CONF_LONG);
+    if (p) {
+        if (p->l < 0) {
+            VIR_ERROR(_("migration_tunnel_chunk_size must not be negative"));
+            virConfFree(conf);
+            return -1;
+        }
+        driver->migrationTunnelChunkSize = p->l;
+    }
+
     virConfFree (conf);
     return 0;
 }
@@ -111,6 +111,12 @@ struct qemud_driver {
 
     int max_queued;
 
+    unsigned int statsSampleInterval;
+    unsigned int statsSampleHistory;
+    int statsTimer;
+
+    unsigned int migrationTunnelChunkSize;
+
     virCapsPtr caps;
 
     virDomainEventStatePtr domainEventState;
@@ -232,6 +232,10 @@ static void qemuDomainObjPrivateFree(void *data)
     VIR_FREE(priv->vcpupids);
     VIR_FREE(priv->lockState);
     VIR_FREE(priv->origname);
+    virHashFree(priv->blockStats);
+    qemuStatsPendingUnref(priv->statsPending);
+    qemuStatsRingFree(priv->statsRing);
+    qemuStatsRingFree(priv->migrationTimeline);
 
     /* This should never be non-NULL if we get here, but just in case... */
     if (priv->mon) {
@@ -1050,6 +1054,252 @@ void qemuDomainObjExitMonitorWithDriver(struct qemud_driver *driver,
     qemuDomainObjExitMonitorInternal(driver, true, obj);
 }
 
+/*
+ * obj must be locked before calling, qemud_driver does not matter
+ *
+ * Start a query job, for something which only reads the state of the
+ * domain. Query jobs never wait: they run alongside each other and
+ * alongside whatever sync or async job is active, and use the monitor
+ * through qemuDomainObjEnterMonitorQuery. Since that unlocks obj, a
+ * query must copy any part of obj->def it needs while in the monitor.
+ *
+ * Upon successful return, the object will have its ref count increased,
+ * successful calls must be followed by EndQuery eventually
+ */
+int qemuDomainObjBeginQuery(struct qemud_driver *driver ATTRIBUTE_UNUSED,
+                            virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    priv->job.queries++;
+    VIR_DEBUG("Starting query job (queries=%u job=%s async=%s)",
+              priv->job.queries,
+              qemuDomainJobTypeToString(priv->job.active),
+              qemuDomainAsyncJobTypeToString(priv->job.asyncJob));
+
+    virDomainObjRef(obj);
+    return 0;
+}
+
+/*
+ * obj must be locked before calling, qemud_driver does not matter
+ *
+ * Returns remaining refcount on 'obj', maybe 0 to indicated it
+ * was deleted
+ */
+int qemuDomainObjEndQuery(struct qemud_driver *driver ATTRIBUTE_UNUSED,
+                          virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    priv->job.queries--;
+    VIR_DEBUG("Stopping query job (queries=%u)", priv->job.queries);
+
+    return virDomainObjUnref(obj);
+}
+
+static qemuMonitorPtr
+qemuDomainObjEnterMonitorQueryInternal(struct qemud_driver *driver,
+                                       bool driver_locked,
+                                       virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+    qemuMonitorPtr mon = priv->mon;
+
+    if (!mon) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                        _("domain is not running"));
+        return NULL;
+    }
+
+    /* The monitor lock is let go of while waiting for a reply, so
+     * this only waits for other threads to queue their commands.
+     * priv->monStart is left alone, it tells how long the job has
+     * been waiting for QEMU. */
+    qemuMonitorLock(mon);
+    qemuMonitorRef(mon);
+    virDomainObjUnlock(obj);
+    if (driver_locked)
+        qemuDriverUnlock(driver);
+
+    return mon;
+}
+
+static void
+qemuDomainObjExitMonitorQueryInternal(struct qemud_driver *driver,
+                                      bool driver_locked,
+                                      virDomainObjPtr obj,
+                                      qemuMonitorPtr mon)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+    int refs;
+
+    refs = qemuMonitorUnref(mon);
+
+    if (refs > 0)
+        qemuMonitorUnlock(mon);
+
+    if (driver_locked)
+        qemuDriverLock(driver);
+    virDomainObjLock(obj);
+
+    /* The domain may have been stopped meanwhile, in which case
+     * priv->mon is no longer ours to clear */
+    if (refs == 0 && priv->mon == mon)
+        priv->mon = NULL;
+}
+
+/*
+ * obj must be locked before calling, qemud_driver must be unlocked
+ *
+ * To be called immediately before any QEMU monitor API call made
+ * within a query job, after checking that the VM is still active.
+ * The monitor to use is returned, rather than taken from priv->mon,
+ * which the job holding the domain may reset meanwhile.
+ *
+ * Returns the monitor, in which case this must be followed with
+ * qemuDomainObjExitMonitorQuery(); or NULL if there is no monitor.
+ */
+qemuMonitorPtr qemuDomainObjEnterMonitorQuery(struct qemud_driver *driver,
+                                              virDomainObjPtr obj)
+{
+    return qemuDomainObjEnterMonitorQueryInternal(driver, false, obj);
+}
+
+/*
+ * obj and qemud_driver must be locked before calling
+ *
+ * As qemuDomainObjEnterMonitorQuery, to be followed with
+ * qemuDomainObjExitMonitorQueryWithDriver()
+ */
+qemuMonitorPtr qemuDomainObjEnterMonitorQueryWithDriver(struct qemud_driver *driver,
+                                                        virDomainObjPtr obj)
+{
+    return qemuDomainObjEnterMonitorQueryInternal(driver, true, obj);
+}
+
+/* obj must NOT be locked before calling, qemud_driver must be unlocked
+ *
+ * Should be paired with an earlier qemuDomainObjEnterMonitorQuery() call
+ */
+void qemuDomainObjExitMonitorQuery(struct qemud_driver *driver,
+                                   virDomainObjPtr obj,
+                                   qemuMonitorPtr mon)
+{
+    qemuDomainObjExitMonitorQueryInternal(driver, false, obj, mon);
+}
+
+/* obj must NOT be locked before calling, qemud_driver must be unlocked,
+ * and will be locked after returning
+ *
+ * Should be paired with an earlier
+ * qemuDomainObjEnterMonitorQueryWithDriver() call
+ */
+void qemuDomainObjExitMonitorQueryWithDriver(struct qemud_driver *driver,
+                                             virDomainObjPtr obj,
+                                             qemuMonitorPtr mon)
+{
+    qemuDomainObjExitMonitorQueryInternal(driver, true, obj, mon);
+}
+
+
+/*
+ * obj must be locked before calling
+ *
+ * Whether a sync or async job holds the domain, and so possibly the
+ * monitor with a long running command. Queries had better answer
+ * from what earlier ones found, if they can.
+ */
+bool qemuDomainObjJobBusy(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    return priv->job.active != QEMU_JOB_NONE ||
+           priv->job.asyncJob != QEMU_ASYNC_JOB_NONE;
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Nothing is kept for a domain which stopped while being queried.
+ */
+void qemuDomainObjSetBalloon(virDomainObjPtr obj,
+                             unsigned long balloon)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    if (!virDomainObjIsActive(obj))
+        return;
+
+    obj->def->mem.cur_balloon = balloon;
+    ignore_value(virTimeMs(&priv->balloonTime));
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Keep @stats, a hash of qemuBlockStats by device alias as filled in
+ * by qemuMonitorGetAllBlockStatsInfo, in place of any earlier ones.
+ * NULL drops them, as when the domain stops; @stats is freed rather
+ * than kept if the domain stopped while being queried.
+ */
+void qemuDomainObjSetBlockStats(virDomainObjPtr obj,
+                                virHashTablePtr stats)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    if (stats && !virDomainObjIsActive(obj)) {
+        virHashFree(stats);
+        return;
+    }
+
+    virHashFree(priv->blockStats);
+    priv->blockStats = stats;
+    if (stats)
+        ignore_value(virTimeMs(&priv->blockStatsTime));
+    else
+        priv->blockStatsTime = 0;
+}
+
+/* How old the results of a query may get before readers have to
+ * query again, even if that means waiting on the monitor */
+#define QEMU_DOMAIN_QUERY_MAX_AGE (1000ull * 5)
+
+static bool
+qemuDomainQueryFresh(unsigned long long when)
+{
+    unsigned long long now;
+
+    if (!when || virTimeMs(&now) < 0)
+        return false;
+    return now - when <= QEMU_DOMAIN_QUERY_MAX_AGE;
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Whether cur_balloon was read recently enough to answer from it
+ */
+bool qemuDomainObjBalloonFresh(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    return qemuDomainQueryFresh(priv->balloonTime);
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Whether the kept block stats were read recently enough to answer
+ * from them
+ */
+bool qemuDomainObjBlockStatsFresh(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    return priv->blockStats && qemuDomainQueryFresh(priv->blockStatsTime);
+}
+
 void qemuDomainObjEnterRemoteWithDriver(struct qemud_driver *driver,
                                         virDomainObjPtr obj)
 {
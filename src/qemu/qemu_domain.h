@@ -28,6 +28,7 @@
 # include "domain_conf.h"
 # include "qemu_monitor.h"
 # include "qemu_conf.h"
+# include "qemu_stats.h"
 # include "bitmap.h"
 
 # define QEMU_EXPECTED_VIRT_TYPES      \
@@ -53,7 +54,8 @@
 
 /* Only 1 job is allowed at any time
  * A job includes *all* monitor commands, even those just querying
- * information, not merely actions */
+ * information, not merely actions; except for query jobs started
+ * with qemuDomainObjBeginQuery, which run alongside any other job */
 enum qemuDomainJob {
     QEMU_JOB_NONE = 0,  /* Always set to 0 for easy if (jobActive) conditions */
     QEMU_JOB_QUERY,         /* Doesn't change any state */
@@ -94,6 +96,7 @@ struct qemuDomainJobObj {
     unsigned long long mask;            /* Jobs allowed during async job */
     unsigned long long start;           /* When the async job started */
     virDomainJobInfo info;              /* Async job progress data */
+    unsigned int queries;               /* Query jobs currently running */
 };
 
 typedef struct _qemuDomainPCIAddressSet qemuDomainPCIAddressSet;
@@ -127,6 +130,19 @@ struct _qemuDomainObjPrivate {
 
     unsigned long migMaxBandwidth;
     char *origname;
+
+    /* Results of the latest queries, for readers that would rather
+     * not wait behind a job which is using the monitor */
+    unsigned long long balloonTime;     /* When cur_balloon was last read */
+    virHashTablePtr blockStats;         /* qemuBlockStats by device alias */
+    unsigned long long blockStatsTime;  /* When blockStats were read */
+
+    /* Kept by the stats sampler, if enabled */
+    qemuStatsRingPtr statsRing;
+    qemuStatsPendingPtr statsPending;
+
+    /* Progress of the latest migration, save or dump, as polled */
+    qemuStatsRingPtr migrationTimeline;
 };
 
 struct qemuDomainWatchdogEvent
@@ -198,6 +214,40 @@ int qemuDomainObjEnterMonitorAsync(struct qemud_driver *driver,
 void qemuDomainObjExitMonitorWithDriver(struct qemud_driver *driver,
                                         virDomainObjPtr obj)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+int qemuDomainObjBeginQuery(struct qemud_driver *driver,
+                            virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+int qemuDomainObjEndQuery(struct qemud_driver *driver,
+                          virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+qemuMonitorPtr qemuDomainObjEnterMonitorQuery(struct qemud_driver *driver,
+                                              virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+qemuMonitorPtr qemuDomainObjEnterMonitorQueryWithDriver(struct qemud_driver *driver,
+                                                        virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+void qemuDomainObjExitMonitorQuery(struct qemud_driver *driver,
+                                   virDomainObjPtr obj,
+                                   qemuMonitorPtr mon)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+void qemuDomainObjExitMonitorQueryWithDriver(struct qemud_driver *driver,
+                                             virDomainObjPtr obj,
+                                             qemuMonitorPtr mon)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+
+bool qemuDomainObjJobBusy(virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1);
+void qemuDomainObjSetBalloon(virDomainObjPtr obj,
+                             unsigned long balloon)
+    ATTRIBUTE_NONNULL(1);
+void qemuDomainObjSetBlockStats(virDomainObjPtr obj,
+                                virHashTablePtr stats)
+    ATTRIBUTE_NONNULL(1);
+bool qemuDomainObjBalloonFresh(virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1);
+bool qemuDomainObjBlockStatsFresh(virDomainObjPtr obj)
+    ATTRIBUTE_NONNULL(1);
+
 void qemuDomainObjEnterRemoteWithDriver(struct qemud_driver *driver,
                                         virDomainObjPtr obj)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
@@ -51,6 +51,7 @@
 #include "qemu_capabilities.h"
 #include "qemu_command.h"
 #include "qemu_cgroup.h"
+#include "qemu_stats.h"
 #include "qemu_hostdev.h"
 #include "qemu_hotplug.h"
 #include "qemu_monitor.h"
@@ -89,6 +90,8 @@
 #include "locking/lock_manager.h"
 #include "locking/domain_lock.h"
 #include "virkeycode.h"
+#include "virpzip.h"
+#include "virreadahead.h"
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
@@ -674,6 +677,9 @@ qemudStartup(int privileged) {
     if (!qemu_driver->workerPool)
         goto error;
 
+    if (qemuStatsSamplerStart(qemu_driver) < 0)
+        goto error;
+
     qemuDriverUnlock(qemu_driver);
 
     qemuAutostartDomains(qemu_driver);
@@ -770,6 +776,7 @@ qemudShutdown(void) {
         return -1;
 
     qemuDriverLock(qemu_driver);
+    qemuStatsSamplerStop(qemu_driver);
     pciDeviceListFree(qemu_driver->activePciHostdevs);
     virCapabilitiesFree(qemu_driver->caps);
 
@@ -2076,40 +2083,44 @@ static int qemudDomainGetInfo(virDomainPtr dom,
     info->maxMem = vm->def->mem.max_balloon;
 
     if (virDomainObjIsActive(vm)) {
-        qemuDomainObjPrivatePtr priv = vm->privateData;
-
         if ((vm->def->memballoon != NULL) &&
             (vm->def->memballoon->model == VIR_DOMAIN_MEMBALLOON_MODEL_NONE)) {
             info->memory = vm->def->mem.max_balloon;
-        } else if (qemuDomainJobAllowed(priv, QEMU_JOB_QUERY)) {
-            if (qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) < 0)
+        } else if (qemuDomainObjJobBusy(vm) &&
+                   qemuDomainObjBalloonFresh(vm)) {
+            /* Don't wait behind whatever the job is doing, the value
+             * found by a recent query will do */
+            info->memory = vm->def->mem.cur_balloon;
+        } else {
+            qemuMonitorPtr mon;
+
+            if (qemuDomainObjBeginQuery(driver, vm) < 0)
                 goto cleanup;
             if (!virDomainObjIsActive(vm))
                 err = 0;
+            else if (!(mon = qemuDomainObjEnterMonitorQuery(driver, vm)))
+                err = -1;
             else {
-                qemuDomainObjEnterMonitor(driver, vm);
-                err = qemuMonitorGetBalloonInfo(priv->mon, &balloon);
-                qemuDomainObjExitMonitor(driver, vm);
+                err = qemuMonitorGetBalloonInfo(mon, &balloon);
+                qemuDomainObjExitMonitorQuery(driver, vm, mon);
             }
-            if (qemuDomainObjEndJob(driver, vm) == 0) {
+            if (qemuDomainObjEndQuery(driver, vm) == 0) {
                 vm = NULL;
                 goto cleanup;
             }
 
             if (err < 0) {
                 /* We couldn't get current memory allocation but that's not
-                 * a show stopper; we wouldn't get it if there was a job
-                 * active either
+                 * a show stopper; the last known value will do
                  */
                 info->memory = vm->def->mem.cur_balloon;
             } else if (err == 0) {
                 /* Balloon not supported, so maxmem is always the allocation */
                 info->memory = vm->def->mem.max_balloon;
             } else {
+                qemuDomainObjSetBalloon(vm, balloon);
                 info->memory = balloon;
             }
-        } else {
-            info->memory = vm->def->mem.cur_balloon;
         }
     } else {
         info->memory = vm->def->mem.cur_balloon;
@@ -2234,6 +2245,8 @@ enum qemud_save_formats {
      */
     QEMUD_SAVE_FORMAT_XZ = 3,
     QEMUD_SAVE_FORMAT_LZOP = 4,
+    /* Built in, see virpzip.h */
+    QEMUD_SAVE_FORMAT_PZIP = 5,
     /* Note: add new members only at the end.
        These values are used in the on-disk format.
        Do not change or re-use numbers. */
@@ -2247,7 +2260,8 @@ VIR_ENUM_IMPL(qemudSaveCompression, QEMUD_SAVE_FORMAT_LAST,
               "gzip",
               "bzip2",
               "xz",
-              "lzop")
+              "lzop",
+              "pzip")
 
 struct qemud_save_header {
     char magic[sizeof(QEMUD_SAVE_MAGIC)-1];
@@ -2297,10 +2311,30 @@ endjob:
 static const char *
 qemuCompressProgramName(int compress)
 {
+    if (compress == QEMUD_SAVE_FORMAT_PZIP)
+        return LIBEXECDIR "/libvirt_iohelper";
     return (compress == QEMUD_SAVE_FORMAT_RAW ? NULL :
             qemudSaveCompressionTypeToString(compress));
 }
 
+/* The built in compressor keeps its writes aligned, so it can write
+ * to the file with O_DIRECT itself rather than going through the
+ * pipe and process of a virFileDirectFd.  @fd must already be at an
+ * aligned offset.  */
+static int
+qemuCompressDirectFd(int fd, const char *path)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+        fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) {
+        virReportSystemError(errno, _("unable to bypass cache for %s"),
+                             path);
+        return -1;
+    }
+    return 0;
+}
+
 /* Internal function to properly create or open existing files, with
  * ownership affected by qemu driver setup.  */
 static int
@@ -2434,6 +2468,8 @@ qemuDomainSaveInternal(struct qemud_driver *driver, virDomainPtr dom,
     int directFlag = 0;
     virFileDirectFdPtr directFd = NULL;
     bool bypass_cache = flags & VIR_DOMAIN_SAVE_BYPASS_CACHE;
+    bool direct_compress = (bypass_cache &&
+                            compressed == QEMUD_SAVE_FORMAT_PZIP);
 
     if (qemuProcessAutoDestroyActive(driver, vm)) {
         qemuReportError(VIR_ERR_OPERATION_INVALID,
@@ -2531,12 +2567,15 @@ qemuDomainSaveInternal(struct qemud_driver *driver, virDomainPtr dom,
                             _("bypass cache unsupported by this system"));
             goto cleanup;
         }
+        if (direct_compress)
+            directFlag = 0;
     }
     fd = qemuOpenFile(driver, path, O_WRONLY | O_TRUNC | O_CREAT | directFlag,
                       &needUnlink, &bypassSecurityDriver);
     if (fd < 0)
         goto endjob;
-    if (bypass_cache && (directFd = virFileDirectFdNew(&fd, path)) == NULL)
+    if (bypass_cache && !direct_compress &&
+        (directFd = virFileDirectFdNew(&fd, path)) == NULL)
         goto endjob;
 
     /* Write header to file, followed by XML */
@@ -2544,6 +2583,10 @@ qemuDomainSaveInternal(struct qemud_driver *driver, virDomainPtr dom,
         VIR_FORCE_CLOSE(fd);
         goto endjob;
     }
+    if (direct_compress && qemuCompressDirectFd(fd, path) < 0) {
+        VIR_FORCE_CLOSE(fd);
+        goto endjob;
+    }
 
     /* Perform the migration */
     if (qemuMigrationToFile(driver, vm, fd, offset, path,
@@ -2633,6 +2676,8 @@ static bool qemudCompressProgramAvailable(enum qemud_save_formats compress)
 
     if (compress == QEMUD_SAVE_FORMAT_RAW)
         return true;
+    if (compress == QEMUD_SAVE_FORMAT_PZIP)
+        return virPZipAvailable();
     prog = qemudSaveCompressionTypeToString(compress);
     c = virFindFileInPath(prog);
     if (!c)
@@ -2852,6 +2897,7 @@ doCoreDump(struct qemud_driver *driver,
     int ret = -1;
     virFileDirectFdPtr directFd = NULL;
     int directFlag = 0;
+    bool direct_compress = bypass_cache && compress == QEMUD_SAVE_FORMAT_PZIP;
 
     /* Create an empty file with appropriate ownership.  */
     if (bypass_cache) {
@@ -2861,6 +2907,8 @@ doCoreDump(struct qemud_driver *driver,
                             _("bypass cache unsupported by this system"));
             goto cleanup;
         }
+        if (direct_compress)
+            directFlag = 0;
     }
     /* Core dumps usually imply last-ditch analysis efforts are
      * desired, so we intentionally do not unlink even if a file was
@@ -2870,8 +2918,13 @@ doCoreDump(struct qemud_driver *driver,
                            NULL, NULL)) < 0)
         goto cleanup;
 
-    if (bypass_cache && (directFd = virFileDirectFdNew(&fd, path)) == NULL)
+    if (direct_compress) {
+        if (qemuCompressDirectFd(fd, path) < 0)
+            goto cleanup;
+    } else if (bypass_cache &&
+               (directFd = virFileDirectFdNew(&fd, path)) == NULL) {
         goto cleanup;
+    }
 
     if (qemuMigrationToFile(driver, vm, fd, 0, path,
                             qemuCompressProgramName(compress), false,
@@ -4069,6 +4122,7 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
     virDomainEventPtr event;
     int intermediatefd = -1;
     virCommandPtr cmd = NULL;
+    virReadAheadPtr readahead = NULL;
 
     if (header->version == 2) {
         const char *prog = qemudSaveCompressionTypeToString(header->compressed);
@@ -4080,6 +4134,7 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
         }
 
         if (header->compressed != QEMUD_SAVE_FORMAT_RAW) {
+            prog = qemuCompressProgramName(header->compressed);
             cmd = virCommandNewArgList(prog, "-dc", NULL);
             intermediatefd = *fd;
             *fd = -1;
@@ -4097,6 +4152,16 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
         }
     }
 
+    /* Whoever reads the image, QEMU or the decompressor, shares the
+     * offset of the file with us, so have the file read in ahead of
+     * it; not when bypassing the cache, then that is a pipe.  */
+    if (!(readahead = virReadAheadStart(intermediatefd != -1 ?
+                                        intermediatefd : *fd))) {
+        /* Slower without, but no reason not to restore */
+        VIR_DEBUG("Not reading ahead of restore from %s", path);
+        virResetLastError();
+    }
+
     /* Set the migration source and start it up. */
     ret = qemuProcessStart(conn, driver, vm, "stdio", true,
                            false, *fd, path, NULL, VIR_VM_OP_RESTORE);
@@ -4107,6 +4172,8 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
              * process will wait forever to write to stdout, so we
              * must manually kill it.
              */
+            virReadAheadStop(readahead);
+            readahead = NULL;
             VIR_FORCE_CLOSE(intermediatefd);
             VIR_FORCE_CLOSE(*fd);
         }
@@ -4114,6 +4181,7 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
         if (virCommandWait(cmd, NULL) < 0)
             ret = -1;
     }
+    virReadAheadStop(readahead);
     VIR_FORCE_CLOSE(intermediatefd);
 
     if (VIR_CLOSE(*fd) < 0) {
@@ -4425,11 +4493,12 @@ static char *qemuDomainGetXMLDesc(virDomainPtr dom,
     if ((vm->def->memballoon != NULL) &&
         (vm->def->memballoon->model != VIR_DOMAIN_MEMBALLOON_MODEL_NONE) &&
         (virDomainObjIsActive(vm))) {
-        qemuDomainObjPrivatePtr priv = vm->privateData;
-        /* Don't delay if someone's using the monitor, just use
-         * existing most recent data instead */
-        if (qemuDomainJobAllowed(priv, QEMU_JOB_QUERY)) {
-            if (qemuDomainObjBeginJobWithDriver(driver, vm, QEMU_JOB_QUERY) < 0)
+        /* Don't delay if a job is using the monitor and there is
+         * recent enough data to use instead */
+        if (!qemuDomainObjJobBusy(vm) || !qemuDomainObjBalloonFresh(vm)) {
+            qemuMonitorPtr mon;
+
+            if (qemuDomainObjBeginQuery(driver, vm) < 0)
                 goto cleanup;
 
             if (!virDomainObjIsActive(vm)) {
@@ -4438,19 +4507,22 @@ static char *qemuDomainGetXMLDesc(virDomainPtr dom,
                 goto endjob;
             }
 
-            qemuDomainObjEnterMonitorWithDriver(driver, vm);
-            err = qemuMonitorGetBalloonInfo(priv->mon, &balloon);
-            qemuDomainObjExitMonitorWithDriver(driver, vm);
+            if (!(mon = qemuDomainObjEnterMonitorQueryWithDriver(driver, vm))) {
+                err = -1;
+                goto endjob;
+            }
+            err = qemuMonitorGetBalloonInfo(mon, &balloon);
+            qemuDomainObjExitMonitorQueryWithDriver(driver, vm, mon);
 
 endjob:
-            if (qemuDomainObjEndJob(driver, vm) == 0) {
+            if (qemuDomainObjEndQuery(driver, vm) == 0) {
                 vm = NULL;
                 goto cleanup;
             }
             if (err < 0)
                 goto cleanup;
             if (err > 0)
-                vm->def->mem.cur_balloon = balloon;
+                qemuDomainObjSetBalloon(vm, balloon);
             /* err == 0 indicates no balloon support, so ignore it */
         }
     }
@@ -7048,6 +7120,9 @@ qemudDomainBlockStats (virDomainPtr dom,
     virDomainObjPtr vm;
     virDomainDiskDefPtr disk = NULL;
     qemuDomainObjPrivatePtr priv;
+    struct qemuBlockStats *cached;
+    qemuMonitorPtr mon;
+    char *alias = NULL;
 
     qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
@@ -7086,7 +7161,27 @@ qemudDomainBlockStats (virDomainPtr dom,
     }
 
     priv = vm->privateData;
-    if (qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) < 0)
+
+    /* Don't wait behind whatever the job is doing if stats
+     * sampled recently are at hand */
+    if (qemuDomainObjJobBusy(vm) && qemuDomainObjBlockStatsFresh(vm) &&
+        (cached = virHashLookup(priv->blockStats, disk->info.alias))) {
+        stats->rd_req = cached->rd_req;
+        stats->rd_bytes = cached->rd_bytes;
+        stats->wr_req = cached->wr_req;
+        stats->wr_bytes = cached->wr_bytes;
+        stats->errs = cached->errs;
+        ret = 0;
+        goto cleanup;
+    }
+
+    /* The disk may be unplugged while the query is in the monitor */
+    if (!(alias = strdup(disk->info.alias))) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (qemuDomainObjBeginQuery(driver, vm) < 0)
         goto cleanup;
 
     if (!virDomainObjIsActive(vm)) {
@@ -7095,9 +7190,10 @@ qemudDomainBlockStats (virDomainPtr dom,
         goto endjob;
     }
 
-    qemuDomainObjEnterMonitor(driver, vm);
-    ret = qemuMonitorGetBlockStatsInfo(priv->mon,
-                                       disk->info.alias,
+    if (!(mon = qemuDomainObjEnterMonitorQuery(driver, vm)))
+        goto endjob;
+    ret = qemuMonitorGetBlockStatsInfo(mon,
+                                       alias,
                                        &stats->rd_req,
                                        &stats->rd_bytes,
                                        NULL,
@@ -7107,13 +7203,14 @@ qemudDomainBlockStats (virDomainPtr dom,
                                        NULL,
                                        NULL,
                                        &stats->errs);
-    qemuDomainObjExitMonitor(driver, vm);
+    qemuDomainObjExitMonitorQuery(driver, vm, mon);
 
 endjob:
-    if (qemuDomainObjEndJob(driver, vm) == 0)
+    if (qemuDomainObjEndQuery(driver, vm) == 0)
         vm = NULL;
 
 cleanup:
+    VIR_FREE(alias);
     if (vm)
         virDomainObjUnlock(vm);
     return ret;
@@ -7130,7 +7227,8 @@ qemudDomainBlockStatsFlags (virDomainPtr dom,
     int i, tmp, ret = -1;
     virDomainObjPtr vm;
     virDomainDiskDefPtr disk = NULL;
-    qemuDomainObjPrivatePtr priv;
+    qemuMonitorPtr mon;
+    char *alias = NULL;
     long long rd_req, rd_bytes, wr_req, wr_bytes, rd_total_times;
     long long wr_total_times, flush_req, flush_total_times, errs;
 
@@ -7172,12 +7270,17 @@ qemudDomainBlockStatsFlags (virDomainPtr dom,
                              _("missing disk device alias name for %s"), disk->dst);
              goto cleanup;
         }
+
+        /* The disk may be unplugged while the query is in the monitor */
+        if (!(alias = strdup(disk->info.alias))) {
+            virReportOOMError();
+            goto cleanup;
+        }
     }
 
-    priv = vm->privateData;
-    VIR_DEBUG("priv=%p, params=%p, flags=%x", priv, params, flags);
+    VIR_DEBUG("vm=%p, params=%p, flags=%x", vm, params, flags);
 
-    if (qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) < 0)
+    if (qemuDomainObjBeginQuery(driver, vm) < 0)
         goto cleanup;
 
     if (!virDomainObjIsActive(vm)) {
@@ -7186,17 +7289,18 @@ qemudDomainBlockStatsFlags (virDomainPtr dom,
         goto endjob;
     }
 
-    qemuDomainObjEnterMonitor(driver, vm);
+    if (!(mon = qemuDomainObjEnterMonitorQuery(driver, vm)))
+        goto endjob;
     tmp = *nparams;
-    ret = qemuMonitorGetBlockStatsParamsNumber(priv->mon, nparams);
+    ret = qemuMonitorGetBlockStatsParamsNumber(mon, nparams);
 
     if (tmp == 0) {
-        qemuDomainObjExitMonitor(driver, vm);
+        qemuDomainObjExitMonitorQuery(driver, vm, mon);
         goto endjob;
     }
 
-    ret = qemuMonitorGetBlockStatsInfo(priv->mon,
-                                       disk->info.alias,
+    ret = qemuMonitorGetBlockStatsInfo(mon,
+                                       alias,
                                        &rd_req,
                                        &rd_bytes,
                                        &rd_total_times,
@@ -7207,7 +7311,7 @@ qemudDomainBlockStatsFlags (virDomainPtr dom,
                                        &flush_total_times,
                                        &errs);
 
-    qemuDomainObjExitMonitor(driver, vm);
+    qemuDomainObjExitMonitorQuery(driver, vm, mon);
 
     if (ret < 0)
         goto endjob;
@@ -7304,10 +7408,11 @@ qemudDomainBlockStatsFlags (virDomainPtr dom,
     }
 
 endjob:
-    if (qemuDomainObjEndJob(driver, vm) == 0)
+    if (qemuDomainObjEndQuery(driver, vm) == 0)
         vm = NULL;
 
 cleanup:
+    VIR_FREE(alias);
     if (vm)
         virDomainObjUnlock(vm);
     return ret;
@@ -7398,20 +7503,22 @@ qemudDomainMemoryStats (virDomainPtr dom,
         goto cleanup;
     }
 
-    if (qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) < 0)
+    if (qemuDomainObjBeginQuery(driver, vm) < 0)
         goto cleanup;
 
     if (virDomainObjIsActive(vm)) {
-        qemuDomainObjPrivatePtr priv = vm->privateData;
-        qemuDomainObjEnterMonitor(driver, vm);
-        ret = qemuMonitorGetMemoryStats(priv->mon, stats, nr_stats);
-        qemuDomainObjExitMonitor(driver, vm);
+        qemuMonitorPtr mon;
+
+        if ((mon = qemuDomainObjEnterMonitorQuery(driver, vm))) {
+            ret = qemuMonitorGetMemoryStats(mon, stats, nr_stats);
+            qemuDomainObjExitMonitorQuery(driver, vm, mon);
+        }
     } else {
         qemuReportError(VIR_ERR_OPERATION_INVALID,
                         "%s", _("domain is not running"));
     }
 
-    if (qemuDomainObjEndJob(driver, vm) == 0)
+    if (qemuDomainObjEndQuery(driver, vm) == 0)
         vm = NULL;
 
 cleanup:
@@ -7420,6 +7527,612 @@ cleanup:
     return ret;
 }
 
+/* Upper bound on the domains whose stats are gathered at once */
+#define QEMU_DOMAIN_STATS_WORKERS 16
+
+#define QEMU_DOMAIN_STATS_ALL                   \
+    (VIR_DOMAIN_STATS_STATE |                   \
+     VIR_DOMAIN_STATS_CPU_TOTAL |               \
+     VIR_DOMAIN_STATS_BALLOON |                 \
+     VIR_DOMAIN_STATS_INTERFACE |               \
+     VIR_DOMAIN_STATS_BLOCK)
+
+struct qemuDomainStatsState {
+    struct qemud_driver *driver;
+    virConnectPtr conn;
+    unsigned int stats;
+
+    virMutex lock;
+    virCond cond;
+    size_t pending;
+};
+
+/* One domain's share of a virConnectGetAllDomainStats call */
+struct qemuDomainStatsJob {
+    virDomainObjPtr vm;
+    virDomainStatsRecordPtr record;
+    size_t maxparams;
+    bool failed;
+};
+
+struct qemuDomainStatsList {
+    struct qemuDomainStatsJob *jobs;
+    size_t njobs;
+    size_t maxjobs;
+    bool failed;
+};
+
+/* Free a record which never made it into a list */
+static void
+qemuDomainStatsRecordFree(virDomainStatsRecordPtr record)
+{
+    if (!record)
+        return;
+
+    if (record->dom)
+        virUnrefDomain(record->dom);
+    VIR_FREE(record->params);
+    VIR_FREE(record);
+}
+
+static void
+qemuDomainStatsCollect(void *payload,
+                       const void *name ATTRIBUTE_UNUSED,
+                       void *opaque)
+{
+    virDomainObjPtr vm = payload;
+    struct qemuDomainStatsList *list = opaque;
+
+    virDomainObjLock(vm);
+    if (virDomainObjIsActive(vm)) {
+        if (VIR_RESIZE_N(list->jobs, list->maxjobs, list->njobs, 1) < 0) {
+            list->failed = true;
+        } else {
+            virDomainObjRef(vm);
+            list->jobs[list->njobs++].vm = vm;
+        }
+    }
+    virDomainObjUnlock(vm);
+}
+
+static virTypedParameterPtr
+qemuDomainStatsAdd(struct qemuDomainStatsJob *job,
+                   int type,
+                   const char *fmt, ...)
+    ATTRIBUTE_FMT_PRINTF(3, 4);
+
+static virTypedParameterPtr
+qemuDomainStatsAdd(struct qemuDomainStatsJob *job,
+                   int type,
+                   const char *fmt, ...)
+{
+    virDomainStatsRecordPtr record = job->record;
+    virTypedParameterPtr param;
+    va_list ap;
+    int len;
+
+    if (VIR_RESIZE_N(record->params, job->maxparams, record->nparams, 1) < 0) {
+        job->failed = true;
+        return NULL;
+    }
+
+    param = record->params + record->nparams;
+    va_start(ap, fmt);
+    len = vsnprintf(param->field, sizeof(param->field), fmt, ap);
+    va_end(ap);
+
+    /* A device with an absurdly long name only loses its own stats */
+    if (len < 0 || len >= sizeof(param->field)) {
+        VIR_DEBUG("Dropping stat with a name too long for '%s'", fmt);
+        return NULL;
+    }
+
+    param->type = type;
+    record->nparams++;
+    return param;
+}
+
+#define QEMU_DOMAIN_STATS_ADD(job, member, tp, val, ...)                \
+    do {                                                                \
+        virTypedParameterPtr param_;                                    \
+        if ((param_ = qemuDomainStatsAdd(job, tp, __VA_ARGS__)))        \
+            param_->value.member = val;                                 \
+    } while (0)
+
+#define QEMU_DOMAIN_STATS_ADD_LLONG(job, val, ...)                      \
+    do {                                                                \
+        if ((val) != -1)                                                \
+            QEMU_DOMAIN_STATS_ADD(job, l, VIR_TYPED_PARAM_LLONG, val,   \
+                                  __VA_ARGS__);                         \
+    } while (0)
+
+#ifdef __linux__
+static void
+qemuDomainStatsInterfaces(virDomainObjPtr vm,
+                          struct qemuDomainStatsJob *job)
+{
+    int i;
+
+    for (i = 0 ; i < vm->def->nnets ; i++) {
+        const char *ifname = vm->def->nets[i]->ifname;
+        struct _virDomainInterfaceStats stats;
+
+        if (!ifname)
+            continue;
+
+        if (linuxDomainInterfaceStats(ifname, &stats) < 0) {
+            VIR_DEBUG("No stats for interface %s of domain %s",
+                      ifname, vm->def->name);
+            continue;
+        }
+
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.rx_bytes,
+                                    "net.%s.rx_bytes", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.rx_packets,
+                                    "net.%s.rx_packets", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.rx_errs,
+                                    "net.%s.rx_errs", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.rx_drop,
+                                    "net.%s.rx_drop", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.tx_bytes,
+                                    "net.%s.tx_bytes", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.tx_packets,
+                                    "net.%s.tx_packets", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.tx_errs,
+                                    "net.%s.tx_errs", ifname);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats.tx_drop,
+                                    "net.%s.tx_drop", ifname);
+    }
+}
+#else
+static void
+qemuDomainStatsInterfaces(virDomainObjPtr vm ATTRIBUTE_UNUSED,
+                          struct qemuDomainStatsJob *job ATTRIBUTE_UNUSED)
+{
+}
+#endif
+
+static void
+qemuDomainStatsBlock(virDomainObjPtr vm,
+                     virHashTablePtr blockstats,
+                     struct qemuDomainStatsJob *job)
+{
+    int i;
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+        struct qemuBlockStats *stats;
+
+        if (!disk->info.alias ||
+            !(stats = virHashLookup(blockstats, disk->info.alias)))
+            continue;
+
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->rd_bytes, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_READ_BYTES);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->rd_req, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_READ_REQ);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->rd_total_times, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_READ_TOTAL_TIMES);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->wr_bytes, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_WRITE_BYTES);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->wr_req, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_WRITE_REQ);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->wr_total_times, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_WRITE_TOTAL_TIMES);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->flush_req, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_FLUSH_REQ);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->flush_total_times, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_FLUSH_TOTAL_TIMES);
+        QEMU_DOMAIN_STATS_ADD_LLONG(job, stats->errs, "block.%s.%s",
+                                    disk->dst, VIR_DOMAIN_BLOCK_STATS_ERRS);
+    }
+}
+
+/*
+ * Gather the stats of one domain. Whatever needs the monitor is
+ * fetched in a single query job, which runs alongside any other job.
+ * While a job holds the domain, a migration or a slow command could
+ * well be keeping QEMU busy too, and that must not hold up the whole
+ * host's stats: whatever the last query found is used instead, if
+ * anything.
+ */
+static void
+qemuDomainStatsGather(struct qemuDomainStatsState *state,
+                      struct qemuDomainStatsJob *job)
+{
+    struct qemud_driver *driver = state->driver;
+    virDomainObjPtr vm = job->vm;
+    qemuDomainObjPrivatePtr priv;
+    virHashTablePtr blockstats = NULL;
+    unsigned long balloon = 0;
+    int balloonret = -1;
+    bool useBalloon = false;
+    bool useBlock = false;
+    bool needMonitor = false;
+
+    virDomainObjLock(vm);
+    priv = vm->privateData;
+
+    if (!virDomainObjIsActive(vm))
+        goto cleanup;
+
+    if (VIR_ALLOC(job->record) < 0 ||
+        !(job->record->dom = virGetDomain(state->conn, vm->def->name,
+                                          vm->def->uuid))) {
+        job->failed = true;
+        goto cleanup;
+    }
+    job->record->dom->id = vm->def->id;
+
+    if (state->stats & VIR_DOMAIN_STATS_STATE) {
+        int reason;
+        int st = virDomainObjGetState(vm, &reason);
+
+        QEMU_DOMAIN_STATS_ADD(job, i, VIR_TYPED_PARAM_INT, st, "state.state");
+        QEMU_DOMAIN_STATS_ADD(job, i, VIR_TYPED_PARAM_INT, reason,
+                              "state.reason");
+    }
+
+    if (state->stats & VIR_DOMAIN_STATS_CPU_TOTAL) {
+        unsigned long long cpuTime;
+
+        if (qemudGetProcessInfo(&cpuTime, NULL, vm->pid, 0) < 0)
+            VIR_DEBUG("No cpu time for domain %s", vm->def->name);
+        else
+            QEMU_DOMAIN_STATS_ADD(job, ul, VIR_TYPED_PARAM_ULLONG, cpuTime,
+                                  "cpu.time");
+    }
+
+    if (state->stats & VIR_DOMAIN_STATS_BALLOON) {
+        useBalloon = !vm->def->memballoon ||
+            vm->def->memballoon->model != VIR_DOMAIN_MEMBALLOON_MODEL_NONE;
+        if (useBalloon &&
+            (!qemuDomainObjJobBusy(vm) || !qemuDomainObjBalloonFresh(vm)))
+            needMonitor = true;
+    }
+    if ((state->stats & VIR_DOMAIN_STATS_BLOCK) && vm->def->ndisks) {
+        useBlock = true;
+        if (!qemuDomainObjJobBusy(vm) || !qemuDomainObjBlockStatsFresh(vm))
+            needMonitor = true;
+    }
+
+    if (needMonitor) {
+        qemuMonitorPtr mon;
+
+        /* A query job only takes a reference, so vm is still there */
+        ignore_value(qemuDomainObjBeginQuery(driver, vm));
+        if (virDomainObjIsActive(vm) &&
+            (mon = qemuDomainObjEnterMonitorQuery(driver, vm))) {
+            if (useBalloon)
+                balloonret = qemuMonitorGetBalloonInfo(mon, &balloon);
+            if (useBlock &&
+                qemuMonitorGetAllBlockStatsInfo(mon, &blockstats) < 0)
+                VIR_DEBUG("No block stats for domain %s", vm->def->name);
+            qemuDomainObjExitMonitorQuery(driver, vm, mon);
+        }
+        virResetLastError();
+        ignore_value(qemuDomainObjEndQuery(driver, vm));
+
+        if (balloonret > 0)
+            qemuDomainObjSetBalloon(vm, balloon);
+        if (blockstats) {
+            qemuDomainObjSetBlockStats(vm, blockstats);
+            blockstats = NULL;
+        }
+    }
+
+    if (state->stats & VIR_DOMAIN_STATS_BALLOON) {
+        /* As in qemudDomainGetInfo */
+        if (!useBalloon || balloonret == 0)
+            balloon = vm->def->mem.max_balloon;
+        else if (balloonret < 0)
+            balloon = vm->def->mem.cur_balloon;
+
+        QEMU_DOMAIN_STATS_ADD(job, ul, VIR_TYPED_PARAM_ULLONG, balloon,
+                              "balloon.current");
+        QEMU_DOMAIN_STATS_ADD(job, ul, VIR_TYPED_PARAM_ULLONG,
+                              vm->def->mem.max_balloon, "balloon.maximum");
+    }
+
+    if (state->stats & VIR_DOMAIN_STATS_INTERFACE)
+        qemuDomainStatsInterfaces(vm, job);
+
+    /* Only if just read, or read recently enough; never stale ones
+     * left over from a failed query */
+    if (useBlock && qemuDomainObjBlockStatsFresh(vm))
+        qemuDomainStatsBlock(vm, priv->blockStats, job);
+
+cleanup:
+    virHashFree(blockstats);
+    if (virDomainObjUnref(vm) > 0)
+        virDomainObjUnlock(vm);
+    job->vm = NULL;
+}
+
+static void
+qemuDomainStatsWorker(void *jobdata, void *opaque)
+{
+    struct qemuDomainStatsState *state = opaque;
+
+    qemuDomainStatsGather(state, jobdata);
+
+    virMutexLock(&state->lock);
+    if (--state->pending == 0)
+        virCondSignal(&state->cond);
+    virMutexUnlock(&state->lock);
+}
+
+static int
+qemuConnectGetAllDomainStats(virConnectPtr conn,
+                             unsigned int stats,
+                             virDomainStatsRecordPtr **retStats,
+                             unsigned int flags)
+{
+    struct qemud_driver *driver = conn->privateData;
+    struct qemuDomainStatsState state;
+    struct qemuDomainStatsList list;
+    virThreadPoolPtr workers = NULL;
+    virDomainStatsRecordPtr *records = NULL;
+    bool threaded = false;
+    int nrecords = 0;
+    int ret = -1;
+    size_t i;
+
+    virCheckFlags(0, -1);
+
+    if (stats & ~QEMU_DOMAIN_STATS_ALL) {
+        qemuReportError(VIR_ERR_ARGUMENT_UNSUPPORTED,
+                        _("unsupported stats groups 0x%x"),
+                        stats & ~QEMU_DOMAIN_STATS_ALL);
+        return -1;
+    }
+    if (stats == 0)
+        stats = QEMU_DOMAIN_STATS_ALL;
+
+    memset(&state, 0, sizeof(state));
+    memset(&list, 0, sizeof(list));
+    state.driver = driver;
+    state.conn = conn;
+    state.stats = stats;
+
+    /* Take a reference on every running domain, so none of them can
+     * go away while the driver lock is not held */
+    qemuDriverLock(driver);
+    virHashForEach(driver->domains.objs, qemuDomainStatsCollect, &list);
+    qemuDriverUnlock(driver);
+
+    if (list.failed) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (list.njobs > 1 &&
+        virMutexInit(&state.lock) == 0) {
+        if (virCondInit(&state.cond) < 0) {
+            virMutexDestroy(&state.lock);
+        } else if (!(workers = virThreadPoolNew(0,
+                                                MIN(list.njobs,
+                                                    QEMU_DOMAIN_STATS_WORKERS),
+                                                0, qemuDomainStatsWorker,
+                                                &state))) {
+            ignore_value(virCondDestroy(&state.cond));
+            virMutexDestroy(&state.lock);
+            virResetLastError();
+        } else {
+            threaded = true;
+        }
+    }
+
+    for (i = 0 ; i < list.njobs ; i++) {
+        if (threaded) {
+            virMutexLock(&state.lock);
+            state.pending++;
+            virMutexUnlock(&state.lock);
+
+            if (virThreadPoolSendJob(workers, 0, &list.jobs[i]) == 0)
+                continue;
+
+            virMutexLock(&state.lock);
+            state.pending--;
+            virMutexUnlock(&state.lock);
+            virResetLastError();
+        }
+        qemuDomainStatsGather(&state, &list.jobs[i]);
+    }
+
+    if (threaded) {
+        virMutexLock(&state.lock);
+        while (state.pending > 0)
+            ignore_value(virCondWait(&state.cond, &state.lock));
+        virMutexUnlock(&state.lock);
+
+        virThreadPoolFree(workers);
+        ignore_value(virCondDestroy(&state.cond));
+        virMutexDestroy(&state.lock);
+    }
+
+    /* The list is NULL terminated */
+    if (VIR_ALLOC_N(records, list.njobs + 1) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < list.njobs ; i++) {
+        if (list.jobs[i].failed) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        /* Domains which stopped in the meantime have no record */
+        if (list.jobs[i].record) {
+            records[nrecords++] = list.jobs[i].record;
+            list.jobs[i].record = NULL;
+        }
+    }
+
+    *retStats = records;
+    records = NULL;
+    ret = nrecords;
+
+cleanup:
+    for (i = 0 ; i < list.njobs ; i++) {
+        /* Only left over if the domains were never handed out */
+        if (list.jobs[i].vm) {
+            virDomainObjLock(list.jobs[i].vm);
+            if (virDomainObjUnref(list.jobs[i].vm) > 0)
+                virDomainObjUnlock(list.jobs[i].vm);
+        }
+        qemuDomainStatsRecordFree(list.jobs[i].record);
+    }
+    VIR_FREE(list.jobs);
+    virDomainStatsRecordListFree(records);
+    return ret;
+}
+
+/* The groups which the stats sampler keeps a history of */
+#define QEMU_DOMAIN_STATS_SAMPLED               \
+    (VIR_DOMAIN_STATS_CPU_TOTAL |               \
+     VIR_DOMAIN_STATS_BALLOON |                 \
+     VIR_DOMAIN_STATS_INTERFACE |               \
+     VIR_DOMAIN_STATS_BLOCK)
+
+static int
+qemuDomainGetStatsSamples(virDomainPtr dom,
+                          unsigned int stats,
+                          unsigned int nsamples,
+                          virDomainStatsRecordPtr **retSamples,
+                          unsigned int flags)
+{
+    struct qemud_driver *driver = dom->conn->privateData;
+    virDomainObjPtr vm;
+    qemuDomainObjPrivatePtr priv;
+    virDomainStatsRecordPtr *records = NULL;
+    int nrecords = -1;
+    int ret = -1;
+    int i;
+
+    virCheckFlags(VIR_DOMAIN_STATS_SAMPLES_RATES, -1);
+
+    if (stats & ~QEMU_DOMAIN_STATS_SAMPLED) {
+        qemuReportError(VIR_ERR_ARGUMENT_UNSUPPORTED,
+                        _("unsupported stats groups 0x%x"),
+                        stats & ~QEMU_DOMAIN_STATS_SAMPLED);
+        return -1;
+    }
+    if (stats == 0)
+        stats = QEMU_DOMAIN_STATS_SAMPLED;
+
+    if (driver->statsSampleInterval == 0) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                        _("stats sampling is disabled in qemu.conf"));
+        return -1;
+    }
+
+    qemuDriverLock(driver);
+    vm = virDomainFindByUUID(&driver->domains, dom->uuid);
+    qemuDriverUnlock(driver);
+
+    if (!vm) {
+        char uuidstr[VIR_UUID_STRING_BUFLEN];
+        virUUIDFormat(dom->uuid, uuidstr);
+        qemuReportError(VIR_ERR_NO_DOMAIN,
+                        _("no domain with matching uuid '%s'"), uuidstr);
+        goto cleanup;
+    }
+
+    if (!virDomainObjIsActive(vm)) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID,
+                        "%s", _("domain is not running"));
+        goto cleanup;
+    }
+    priv = vm->privateData;
+
+    /* Replies which came in since the last round count too */
+    qemuStatsSamplerFlush(driver, vm);
+
+    if ((nrecords = qemuStatsRingGet(priv->statsRing, stats, nsamples,
+                                     !!(flags & VIR_DOMAIN_STATS_SAMPLES_RATES),
+                                     &records)) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < nrecords ; i++) {
+        if (!(records[i]->dom = virGetDomain(dom->conn, vm->def->name,
+                                             vm->def->uuid)))
+            goto cleanup;
+        records[i]->dom->id = vm->def->id;
+    }
+
+    *retSamples = records;
+    records = NULL;
+    ret = nrecords;
+
+cleanup:
+    if (vm)
+        virDomainObjUnlock(vm);
+    virDomainStatsRecordListFree(records);
+    return ret;
+}
+
+
+static int
+qemuDomainGetMigrationTimeline(virDomainPtr dom,
+                               unsigned int nsamples,
+                               virDomainStatsRecordPtr **retSamples,
+                               unsigned int flags)
+{
+    struct qemud_driver *driver = dom->conn->privateData;
+    virDomainObjPtr vm;
+    qemuDomainObjPrivatePtr priv;
+    virDomainStatsRecordPtr *records = NULL;
+    int nrecords = -1;
+    int ret = -1;
+    int i;
+
+    virCheckFlags(0, -1);
+
+    qemuDriverLock(driver);
+    vm = virDomainFindByUUID(&driver->domains, dom->uuid);
+    qemuDriverUnlock(driver);
+
+    if (!vm) {
+        char uuidstr[VIR_UUID_STRING_BUFLEN];
+        virUUIDFormat(dom->uuid, uuidstr);
+        qemuReportError(VIR_ERR_NO_DOMAIN,
+                        _("no domain with matching uuid '%s'"), uuidstr);
+        goto cleanup;
+    }
+    priv = vm->privateData;
+
+    /* The domain need not be running any more: the timeline of a
+     * finished migration, save or dump is kept until the next one */
+    if (!priv->migrationTimeline) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                        _("domain has not been migrated, saved or dumped"));
+        goto cleanup;
+    }
+
+    if ((nrecords = qemuStatsRingGet(priv->migrationTimeline,
+                                     QEMU_STATS_MIGRATION, nsamples,
+                                     false, &records)) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < nrecords ; i++) {
+        if (!(records[i]->dom = virGetDomain(dom->conn, vm->def->name,
+                                             vm->def->uuid)))
+            goto cleanup;
+        records[i]->dom->id = vm->def->id;
+    }
+
+    *retSamples = records;
+    records = NULL;
+    ret = nrecords;
+
+cleanup:
+    if (vm)
+        virDomainObjUnlock(vm);
+    virDomainStatsRecordListFree(records);
+    return ret;
+}
+
 static int
 qemudDomainBlockPeek (virDomainPtr dom,
                       const char *path,
@@ -10795,6 +11508,9 @@ static virDriver qemuDriver = {
     .domainGetBlockJobInfo = qemuDomainGetBlockJobInfo, /* 0.9.4 */
     .domainBlockJobSetSpeed = qemuDomainBlockJobSetSpeed, /* 0.9.4 */
     .domainBlockPull = qemuDomainBlockPull, /* 0.9.4 */
+    .connectGetAllDomainStats = qemuConnectGetAllDomainStats, /* 0.9.7 */
+    .domainGetStatsSamples = qemuDomainGetStatsSamples, /* 0.9.7 */
+    .domainGetMigrationTimeline = qemuDomainGetMigrationTimeline, /* 0.9.7 */
 };
 
 
@@ -32,6 +32,7 @@
 #include "qemu_process.h"
 #include "qemu_capabilities.h"
 #include "qemu_cgroup.h"
+#include "qemu_stats.h"
 
 #include "domain_audit.h"
 #include "logging.h"
@@ -44,6 +45,8 @@
 #include "uuid.h"
 #include "locking/domain_lock.h"
 #include "rpc/virnetsocket.h"
+#include "rpc/virnetprotocol.h"
+#include "ignore-value.h"
 
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
@@ -834,6 +837,12 @@ qemuMigrationSetOffline(struct qemud_driver *driver,
 }
 
 
+typedef struct _qemuMigrationIOThread qemuMigrationIOThread;
+typedef qemuMigrationIOThread *qemuMigrationIOThreadPtr;
+
+static void qemuMigrationTunnelJobInfo(qemuMigrationIOThreadPtr io,
+                                       virDomainJobInfoPtr info);
+
 static int
 qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
                              virDomainObjPtr vm,
@@ -906,12 +915,110 @@ qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
 }
 
 
+/* Polls kept in the timeline of a migration, the latest ones win.
+ * At about 350 bytes a record on the wire, a whole timeline still
+ * fits in one RPC reply with room to spare for long domain names */
+#define QEMU_MIGRATION_TIMELINE_MAX 512
+
+/*
+ * Work out from two polls @interval ms apart how fast data went out,
+ * and how fast the guest dirtied memory again: whatever was sent but
+ * did not bring down what remains was dirtied in the meantime. From
+ * that, guess how long until the migration converges, and poll again
+ * a fraction of that time later.
+ *
+ * Returns the number of ms to wait before the next poll
+ */
+unsigned long long
+qemuMigrationNextPoll(qemuMigrationProgressPtr prev,
+                      qemuMigrationProgressPtr cur,
+                      unsigned long long *rate,
+                      unsigned long long *dirtyRate)
+{
+    unsigned long long interval = cur->elapsed - prev->elapsed;
+    unsigned long long sent = 0;
+    unsigned long long dirtied = 0;
+    unsigned long long wait;
+
+    *rate = *dirtyRate = 0;
+    if (interval == 0)
+        return QEMU_MIGRATION_POLL_DEFAULT;
+
+    if (cur->processed > prev->processed)
+        sent = cur->processed - prev->processed;
+    if (cur->remaining + sent > prev->remaining)
+        dirtied = cur->remaining + sent - prev->remaining;
+
+    *rate = sent * 1000 / interval;
+    *dirtyRate = dirtied * 1000 / interval;
+
+    if (*rate == 0)
+        return QEMU_MIGRATION_POLL_DEFAULT;
+    if (*rate <= *dirtyRate)
+        return QEMU_MIGRATION_POLL_MAX;
+
+    wait = cur->remaining * 1000 / (*rate - *dirtyRate) / 4;
+    if (wait < QEMU_MIGRATION_POLL_MIN)
+        wait = QEMU_MIGRATION_POLL_MIN;
+    if (wait > QEMU_MIGRATION_POLL_MAX)
+        wait = QEMU_MIGRATION_POLL_MAX;
+    return wait;
+}
+
+/* Add a poll to the timeline of the migration, if there is one */
+static void
+qemuMigrationRecordProgress(qemuDomainObjPrivatePtr priv,
+                            qemuMigrationProgressPtr cur,
+                            unsigned long long rate,
+                            unsigned long long dirtyRate,
+                            unsigned long long wait)
+{
+    qemuStatsSamplePtr sample;
+    unsigned long long now;
+
+    if (!priv->migrationTimeline)
+        return;
+
+    if (virTimeMs(&now) < 0 ||
+        !(sample = qemuStatsSampleNew(now)))
+        goto error;
+
+    if (qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           cur->elapsed, "migration.elapsed") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, false,
+                           cur->processed, "migration.processed") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           cur->remaining, "migration.remaining") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           priv->job.info.memTotal, "migration.total") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           rate, "migration.rate") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           dirtyRate, "migration.dirty_rate") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           wait, "migration.next_poll") < 0) {
+        qemuStatsSampleFree(sample);
+        goto error;
+    }
+
+    qemuStatsRingPush(priv->migrationTimeline, sample);
+    return;
+
+error:
+    /* The migration is what matters, not its timeline */
+    virResetLastError();
+}
+
+/* @iothread is the tunnel the migration goes through, if any */
 static int
 qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
-                               enum qemuDomainAsyncJob asyncJob)
+                               enum qemuDomainAsyncJob asyncJob,
+                               qemuMigrationIOThreadPtr iothread)
 {
     qemuDomainObjPrivatePtr priv = vm->privateData;
     const char *job;
+    qemuMigrationProgress prev;
+    bool havePrev = false;
 
     switch (priv->job.asyncJob) {
     case QEMU_ASYNC_JOB_MIGRATION_OUT:
@@ -927,18 +1034,42 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
         job = _("job");
     }
 
+    qemuStatsRingFree(priv->migrationTimeline);
+    if (!(priv->migrationTimeline =
+          qemuStatsRingNew(QEMU_MIGRATION_TIMELINE_MAX)))
+        virResetLastError();
+
     priv->job.info.type = VIR_DOMAIN_JOB_UNBOUNDED;
 
     while (priv->job.info.type == VIR_DOMAIN_JOB_UNBOUNDED) {
-        /* Poll every 50ms for progress & to allow cancellation */
-        struct timespec ts = { .tv_sec = 0, .tv_nsec = 50 * 1000 * 1000ull };
+        qemuMigrationProgress cur;
+        unsigned long long wait = QEMU_MIGRATION_POLL_DEFAULT;
+        unsigned long long rate = 0;
+        unsigned long long dirtyRate = 0;
+        struct timespec ts;
 
         if (qemuMigrationUpdateJobStatus(driver, vm, job, asyncJob) < 0)
             goto cleanup;
 
+        if (priv->job.info.type == VIR_DOMAIN_JOB_UNBOUNDED) {
+            cur.elapsed = priv->job.info.timeElapsed;
+            cur.processed = priv->job.info.memProcessed;
+            cur.remaining = priv->job.info.memRemaining;
+            if (havePrev)
+                wait = qemuMigrationNextPoll(&prev, &cur, &rate, &dirtyRate);
+            qemuMigrationRecordProgress(priv, &cur, rate, dirtyRate, wait);
+            prev = cur;
+            havePrev = true;
+        }
+
+        if (iothread)
+            qemuMigrationTunnelJobInfo(iothread, &priv->job.info);
+
         virDomainObjUnlock(vm);
         qemuDriverUnlock(driver);
 
+        ts.tv_sec = wait / 1000;
+        ts.tv_nsec = (wait % 1000) * 1000 * 1000ull;
         nanosleep(&ts, NULL);
 
         qemuDriverLock(driver);
@@ -946,6 +1077,8 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
     }
 
 cleanup:
+    if (iothread)
+        qemuMigrationTunnelJobInfo(iothread, &priv->job.info);
     if (priv->job.info.type == VIR_DOMAIN_JOB_COMPLETED)
         return 0;
     else
@@ -1126,7 +1259,7 @@ qemuMigrationPrepareAny(struct qemud_driver *driver,
     qemuMigrationJobSetPhase(driver, vm, QEMU_MIGRATION_PHASE_PREPARE);
 
     /* Domain starts inactive, even if the domain XML had an id field. */
-    vm->def->id = -1;
+    virDomainObjListSetID(&driver->domains, vm, -1);
 
     if (tunnel &&
         (pipe(dataFD) < 0 || virSetCloseExec(dataFD[1]) < 0)) {
@@ -1404,66 +1537,145 @@ struct _qemuMigrationSpec {
     } fwd;
 };
 
-#define TUNNEL_SEND_BUF_SIZE 65536
+/* Chunks of the stream read from QEMU but not sent yet; reading one
+ * and sending another at the same time needs two, any more smooth
+ * out the bumps */
+#define TUNNEL_BUFFERS 4
 
-typedef struct _qemuMigrationIOThread qemuMigrationIOThread;
-typedef qemuMigrationIOThread *qemuMigrationIOThreadPtr;
 struct _qemuMigrationIOThread {
-    virThread thread;
+    virThread thread;           /* sends chunks to the stream */
+    virThread reader;           /* reads chunks from QEMU */
     virStreamPtr st;
     int sock;
     virError err;
+
+    virMutex lock;
+    virCond cond;
+
+    size_t chunk;
+    char *buffers[TUNNEL_BUFFERS];
+    size_t lens[TUNNEL_BUFFERS];
+    size_t head;                /* next buffer to send */
+    size_t count;               /* buffers waiting to be sent */
+    bool eof;                   /* reader is done */
+    int readErrno;              /* why, if not end of stream */
+    bool quit;                  /* sender is done, reader must stop */
+
+    unsigned long long start;
+    unsigned long long bytesRead;
+    unsigned long long bytesSent;
 };
 
-static void qemuMigrationIOFunc(void *arg)
+static void qemuMigrationIOReadFunc(void *arg)
 {
-    qemuMigrationIOThreadPtr data = arg;
-    char *buffer;
-    int nbytes = TUNNEL_SEND_BUF_SIZE;
-
-    if (VIR_ALLOC_N(buffer, TUNNEL_SEND_BUF_SIZE) < 0) {
-        virReportOOMError();
-        virStreamAbort(data->st);
-        goto error;
-    }
+    qemuMigrationIOThreadPtr io = arg;
 
+    virMutexLock(&io->lock);
     for (;;) {
-        nbytes = saferead(data->sock, buffer, TUNNEL_SEND_BUF_SIZE);
-        if (nbytes < 0) {
-            virReportSystemError(errno, "%s",
-                                 _("tunnelled migration failed to read from qemu"));
-            virStreamAbort(data->st);
-            VIR_FREE(buffer);
-            goto error;
+        size_t idx;
+        ssize_t nbytes;
+
+        while (io->count == TUNNEL_BUFFERS && !io->quit)
+            ignore_value(virCondWait(&io->cond, &io->lock));
+        if (io->quit)
+            break;
+
+        /* The sender only touches buffers already counted, so this
+         * one can be filled without the lock */
+        idx = (io->head + io->count) % TUNNEL_BUFFERS;
+        virMutexUnlock(&io->lock);
+
+        nbytes = saferead(io->sock, io->buffers[idx], io->chunk);
+
+        virMutexLock(&io->lock);
+        if (nbytes <= 0) {
+            if (nbytes < 0)
+                io->readErrno = errno;
+            break;
         }
-        else if (nbytes == 0)
-            /* EOF; get out of here */
+        io->lens[idx] = nbytes;
+        io->count++;
+        io->bytesRead += nbytes;
+        virCondSignal(&io->cond);
+    }
+    io->eof = true;
+    virCondSignal(&io->cond);
+    virMutexUnlock(&io->lock);
+}
+
+static void qemuMigrationIOFunc(void *arg)
+{
+    qemuMigrationIOThreadPtr io = arg;
+
+    for (;;) {
+        size_t idx;
+
+        virMutexLock(&io->lock);
+        while (io->count == 0 && !io->eof)
+            ignore_value(virCondWait(&io->cond, &io->lock));
+        if (io->count == 0) {
+            virMutexUnlock(&io->lock);
             break;
+        }
+        idx = io->head;
+        virMutexUnlock(&io->lock);
 
-        if (virStreamSend(data->st, buffer, nbytes) < 0) {
-            VIR_FREE(buffer);
+        if (virStreamSend(io->st, io->buffers[idx], io->lens[idx]) < 0)
             goto error;
-        }
+
+        virMutexLock(&io->lock);
+        io->head = (io->head + 1) % TUNNEL_BUFFERS;
+        io->count--;
+        io->bytesSent += io->lens[idx];
+        virCondSignal(&io->cond);
+        virMutexUnlock(&io->lock);
     }
 
-    VIR_FREE(buffer);
+    if (io->readErrno) {
+        virReportSystemError(io->readErrno, "%s",
+                             _("tunnelled migration failed to read from qemu"));
+        virStreamAbort(io->st);
+        goto error;
+    }
 
-    if (virStreamFinish(data->st) < 0)
+    if (virStreamFinish(io->st) < 0)
         goto error;
 
     return;
 
 error:
-    virCopyLastError(&data->err);
+    virMutexLock(&io->lock);
+    io->quit = true;
+    virCondSignal(&io->cond);
+    virMutexUnlock(&io->lock);
+
+    virCopyLastError(&io->err);
     virResetLastError();
 }
 
 
+static void
+qemuMigrationTunnelFree(qemuMigrationIOThreadPtr io)
+{
+    int i;
+
+    if (!io)
+        return;
+
+    for (i = 0 ; i < TUNNEL_BUFFERS ; i++)
+        VIR_FREE(io->buffers[i]);
+    ignore_value(virCondDestroy(&io->cond));
+    virMutexDestroy(&io->lock);
+    VIR_FREE(io);
+}
+
 static qemuMigrationIOThreadPtr
 qemuMigrationStartTunnel(virStreamPtr st,
-                         int sock)
+                         int sock,
+                         size_t chunk)
 {
     qemuMigrationIOThreadPtr io;
+    int i;
 
     if (VIR_ALLOC(io) < 0) {
         virReportOOMError();
@@ -1472,24 +1684,72 @@ qemuMigrationStartTunnel(virStreamPtr st,
 
     io->st = st;
     io->sock = sock;
+    io->chunk = (chunk && chunk < VIR_NET_MESSAGE_PAYLOAD_MAX ?
+                 chunk : VIR_NET_MESSAGE_PAYLOAD_MAX);
+
+    if (virMutexInit(&io->lock) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize mutex"));
+        VIR_FREE(io);
+        return NULL;
+    }
+    if (virCondInit(&io->cond) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize condition"));
+        virMutexDestroy(&io->lock);
+        VIR_FREE(io);
+        return NULL;
+    }
+
+    for (i = 0 ; i < TUNNEL_BUFFERS ; i++) {
+        if (VIR_ALLOC_N(io->buffers[i], io->chunk) < 0) {
+            virReportOOMError();
+            goto error;
+        }
+    }
+
+    if (virTimeMs(&io->start) < 0)
+        goto error;
+
+    if (virThreadCreate(&io->reader, true,
+                        qemuMigrationIOReadFunc,
+                        io) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create migration thread"));
+        goto error;
+    }
 
     if (virThreadCreate(&io->thread, true,
                         qemuMigrationIOFunc,
                         io) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to create migration thread"));
-        VIR_FREE(io);
-        return NULL;
+        virMutexLock(&io->lock);
+        io->quit = true;
+        virCondSignal(&io->cond);
+        virMutexUnlock(&io->lock);
+        virThreadJoin(&io->reader);
+        goto error;
     }
 
     return io;
+
+error:
+    qemuMigrationTunnelFree(io);
+    return NULL;
 }
 
 static int
 qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io)
 {
     int rv = -1;
+    unsigned long long now;
+
     virThreadJoin(&io->thread);
+    virThreadJoin(&io->reader);
+
+    if (virTimeMs(&now) == 0 && now > io->start)
+        VIR_DEBUG("Tunnelled %llu bytes in %llu ms, %llu KiB/s",
+                  io->bytesSent, now - io->start,
+                  io->bytesSent * 1000 / 1024 / (now - io->start));
 
     /* Forward error from the IO thread, to this thread */
     if (io->err.code != VIR_ERR_OK) {
@@ -1501,10 +1761,26 @@ qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io)
     rv = 0;
 
 cleanup:
-    VIR_FREE(io);
+    qemuMigrationTunnelFree(io);
     return rv;
 }
 
+/* For a tunnelled migration, the bytes which made it through the
+ * tunnel are a better measure of the job as a whole than QEMU's
+ * count of memory written, which includes what is still sitting in
+ * our buffers.  */
+static void
+qemuMigrationTunnelJobInfo(qemuMigrationIOThreadPtr io,
+                           virDomainJobInfoPtr info)
+{
+    virMutexLock(&io->lock);
+    info->dataProcessed = io->bytesSent;
+    info->dataRemaining = info->memRemaining +
+                          (io->bytesRead - io->bytesSent);
+    info->dataTotal = info->dataProcessed + info->dataRemaining;
+    virMutexUnlock(&io->lock);
+}
+
 static int
 qemuMigrationRun(struct qemud_driver *driver,
                  virDomainObjPtr vm,
@@ -1629,11 +1905,13 @@ qemuMigrationRun(struct qemud_driver *driver,
     }
 
     if (spec->fwdType != MIGRATION_FWD_DIRECT &&
-        !(iothread = qemuMigrationStartTunnel(spec->fwd.stream, fd)))
+        !(iothread = qemuMigrationStartTunnel(spec->fwd.stream, fd,
+                                              driver->migrationTunnelChunkSize)))
         goto cancel;
 
     if (qemuMigrationWaitForCompletion(driver, vm,
-                                       QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
+                                       QEMU_ASYNC_JOB_MIGRATION_OUT,
+                                       iothread) < 0)
         goto cleanup;
 
     /* When migration completed, QEMU will have paused the
@@ -2928,7 +3206,7 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
     if (rc < 0)
         goto cleanup;
 
-    rc = qemuMigrationWaitForCompletion(driver, vm, asyncJob);
+    rc = qemuMigrationWaitForCompletion(driver, vm, asyncJob, NULL);
 
     if (rc < 0)
         goto cleanup;
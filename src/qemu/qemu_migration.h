@@ -53,6 +53,28 @@ enum qemuMigrationJobPhase {
 };
 VIR_ENUM_DECL(qemuMigrationJobPhase)
 
+/* How often to poll QEMU for the progress of a migration: often when
+ * it looks close to completing, seldom while it is far off, and at
+ * the old fixed rate while there is nothing to go by yet */
+# define QEMU_MIGRATION_POLL_MIN 5
+# define QEMU_MIGRATION_POLL_MAX 500
+# define QEMU_MIGRATION_POLL_DEFAULT 50
+
+typedef struct _qemuMigrationProgress qemuMigrationProgress;
+typedef qemuMigrationProgress *qemuMigrationProgressPtr;
+struct _qemuMigrationProgress {
+    unsigned long long elapsed;         /* ms since the job started */
+    unsigned long long processed;
+    unsigned long long remaining;
+};
+
+unsigned long long qemuMigrationNextPoll(qemuMigrationProgressPtr prev,
+                                         qemuMigrationProgressPtr cur,
+                                         unsigned long long *rate,
+                                         unsigned long long *dirtyRate)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3)
+    ATTRIBUTE_NONNULL(4);
+
 int qemuMigrationJobStart(struct qemud_driver *driver,
                           virDomainObjPtr vm,
                           enum qemuDomainAsyncJob job)
@@ -42,6 +42,13 @@
 #define DEBUG_IO 0
 #define DEBUG_RAW_IO 0
 
+/* Room made for each read from the monitor, at the least */
+#define QEMU_MONITOR_READ_SIZE 1024
+
+/* Once drained, a receive buffer no bigger than this is kept for
+ * the next reply; one grown by a huge reply is given back */
+#define QEMU_MONITOR_BUFFER_KEEP (64 * 1024)
+
 struct _qemuMonitor {
     virMutex lock; /* also used to protect fd */
     virCond notify;
@@ -56,15 +63,20 @@ struct _qemuMonitor {
 
     qemuMonitorCallbacksPtr cb;
 
-    /* If there's a command being processed this will be
-     * non-NULL */
-    qemuMonitorMessagePtr msg;
+    /* Commands waiting to be sent or answered, oldest first.
+     * The text monitor has one of them in flight at a time, while
+     * QMP replies carry the id of their command so several can be */
+    qemuMonitorMessagePtr msgs;
+    /* Finished messages whose callback is still to be run */
+    qemuMonitorMessagePtr done;
 
     /* Buffer incoming data ready for Text/QMP monitor
      * code to process & find message boundaries */
     size_t bufferOffset;
     size_t bufferLength;
     char *buffer;
+    /* How far the buffer is known to hold no QMP line ending */
+    size_t bufferScanned;
 
     /* If anything went wrong, this will be fed back
      * the next monitor msg */
@@ -241,6 +253,108 @@ int qemuMonitorUnref(qemuMonitorPtr mon)
     return mon->refs;
 }
 
+/* Call these functions while holding the monitor lock. */
+static void
+qemuMonitorQueueMessage(qemuMonitorPtr mon, qemuMonitorMessagePtr msg)
+{
+    qemuMonitorMessagePtr *tail = &mon->msgs;
+
+    while (*tail)
+        tail = &(*tail)->next;
+    msg->next = NULL;
+    *tail = msg;
+}
+
+static void
+qemuMonitorUnqueueMessage(qemuMonitorPtr mon, qemuMonitorMessagePtr msg)
+{
+    qemuMonitorMessagePtr *tmp;
+
+    for (tmp = &mon->msgs ; *tmp ; tmp = &(*tmp)->next) {
+        if (*tmp == msg) {
+            *tmp = msg->next;
+            msg->next = NULL;
+            return;
+        }
+    }
+}
+
+/* The next message with data left to send, if it may be sent yet */
+static qemuMonitorMessagePtr
+qemuMonitorNextTx(qemuMonitorPtr mon)
+{
+    qemuMonitorMessagePtr msg;
+
+    for (msg = mon->msgs ; msg ; msg = msg->next) {
+        if (msg->txOffset < msg->txLength)
+            return msg;
+        /* Text replies can only be told apart by their order */
+        if (!mon->json)
+            return NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Take finished messages off the queue, or all of them when
+ * @fail is set, waking up their senders or setting them aside
+ * for their callbacks
+ */
+static void
+qemuMonitorReapMessages(qemuMonitorPtr mon, bool fail)
+{
+    qemuMonitorMessagePtr *tmp = &mon->msgs;
+    qemuMonitorMessagePtr *done = &mon->done;
+    bool wakeup = false;
+
+    while (*done)
+        done = &(*done)->next;
+
+    while (*tmp) {
+        qemuMonitorMessagePtr msg = *tmp;
+
+        if (fail)
+            msg->finished = 1;
+        if (!msg->finished) {
+            tmp = &msg->next;
+            continue;
+        }
+
+        *tmp = msg->next;
+        msg->next = NULL;
+        if (msg->callback) {
+            *done = msg;
+            done = &msg->next;
+        } else {
+            wakeup = true;
+        }
+    }
+
+    if (wakeup)
+        virCondBroadcast(&mon->notify);
+}
+
+/*
+ * Run the callbacks of finished asynchronous messages. The monitor
+ * is unlocked meanwhile, since they may well want other locks, so
+ * the caller must hold a reference on it.
+ */
+static void
+qemuMonitorRunCallbacks(qemuMonitorPtr mon)
+{
+    qemuMonitorMessagePtr msg;
+
+    while ((msg = mon->done)) {
+        mon->done = msg->next;
+        msg->next = NULL;
+
+        qemuMonitorUnlock(mon);
+        (msg->callback)(mon, msg, msg->callbackOpaque);
+        qemuMonitorLock(mon);
+    }
+}
+
 static void
 qemuMonitorUnwatch(void *monitor)
 {
@@ -331,15 +445,17 @@ qemuMonitorIOProcess(qemuMonitorPtr mon)
     qemuMonitorMessagePtr msg = NULL;
 
     /* See if there's a message & whether its ready for its reply
-     * ie whether its completed writing all its data */
-    if (mon->msg && mon->msg->txOffset == mon->msg->txLength)
-        msg = mon->msg;
+     * ie whether its completed writing all its data. QMP replies
+     * are matched to whichever of the queued messages they are for */
+    if (mon->msgs && (mon->json ||
+                      mon->msgs->txOffset == mon->msgs->txLength))
+        msg = mon->msgs;
 
 #if DEBUG_IO
 # if DEBUG_RAW_IO
     char *str1 = qemuMonitorEscapeNonPrintable(msg ? msg->txBuffer : "");
     char *str2 = qemuMonitorEscapeNonPrintable(mon->buffer);
-    VIR_ERROR(_("Process %d %p %p [[[[%s]]][[[%s]]]"), (int)mon->bufferOffset, mon->msg, msg, str1, str2);
+    VIR_ERROR(_("Process %d %p %p [[[[%s]]][[[%s]]]"), (int)mon->bufferOffset, mon->msgs, msg, str1, str2);
     VIR_FREE(str1);
     VIR_FREE(str2);
 # else
@@ -347,30 +463,50 @@ qemuMonitorIOProcess(qemuMonitorPtr mon)
 # endif
 #endif
 
-    if (mon->json)
-        len = qemuMonitorJSONIOProcess(mon,
-                                       mon->buffer, mon->bufferOffset,
-                                       msg);
-    else
+    if (mon->json) {
+        /* QMP sends one reply or event per line, so there is nothing
+         * to do until a line ending comes in. Look for one only in
+         * what arrived since the last time, rather than rescanning
+         * all of a long reply each time a bit more of it is read */
+        if (!memchr(mon->buffer + mon->bufferScanned, '\n',
+                    mon->bufferOffset - mon->bufferScanned)) {
+            mon->bufferScanned = mon->bufferOffset;
+            len = 0;
+        } else {
+            len = qemuMonitorJSONIOProcess(mon,
+                                           mon->buffer, mon->bufferOffset,
+                                           msg);
+        }
+    } else {
         len = qemuMonitorTextIOProcess(mon,
                                        mon->buffer, mon->bufferOffset,
                                        msg);
+    }
 
     if (len < 0)
         return -1;
 
     if (len < mon->bufferOffset) {
-        memmove(mon->buffer, mon->buffer + len, mon->bufferOffset - len);
-        mon->bufferOffset -= len;
-    } else {
+        if (len > 0) {
+            memmove(mon->buffer, mon->buffer + len, mon->bufferOffset - len);
+            mon->bufferOffset -= len;
+            mon->buffer[mon->bufferOffset] = '\0';
+        }
+        /* Every complete line was consumed, so whatever is left
+         * is the start of a line still to come */
+        mon->bufferScanned = mon->bufferOffset;
+    } else if (mon->bufferLength > QEMU_MONITOR_BUFFER_KEEP) {
         VIR_FREE(mon->buffer);
-        mon->bufferOffset = mon->bufferLength = 0;
+        mon->bufferOffset = mon->bufferLength = mon->bufferScanned = 0;
+    } else {
+        mon->bufferOffset = mon->bufferScanned = 0;
+        if (mon->buffer)
+            mon->buffer[0] = '\0';
     }
 #if DEBUG_IO
     VIR_DEBUG("Process done %d used %d", (int)mon->bufferOffset, len);
 #endif
-    if (msg && msg->finished)
-        virCondBroadcast(&mon->notify);
+    qemuMonitorReapMessages(mon, false);
     return len;
 }
 
@@ -423,27 +559,28 @@ qemuMonitorIOWriteWithFD(qemuMonitorPtr mon,
 static int
 qemuMonitorIOWrite(qemuMonitorPtr mon)
 {
+    qemuMonitorMessagePtr msg = qemuMonitorNextTx(mon);
     int done;
 
-    /* If no active message, or fully transmitted, the no-op */
-    if (!mon->msg || mon->msg->txOffset == mon->msg->txLength)
+    /* If no message is ready to go, the no-op */
+    if (!msg)
         return 0;
 
-    if (mon->msg->txFD != -1 && !mon->hasSendFD) {
+    if (msg->txFD != -1 && !mon->hasSendFD) {
         qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                         _("Monitor does not support sending of file descriptors"));
         return -1;
     }
 
-    if (mon->msg->txFD == -1)
+    if (msg->txFD == -1)
         done = write(mon->fd,
-                     mon->msg->txBuffer + mon->msg->txOffset,
-                     mon->msg->txLength - mon->msg->txOffset);
+                     msg->txBuffer + msg->txOffset,
+                     msg->txLength - msg->txOffset);
     else
         done = qemuMonitorIOWriteWithFD(mon,
-                                        mon->msg->txBuffer + mon->msg->txOffset,
-                                        mon->msg->txLength - mon->msg->txOffset,
-                                        mon->msg->txFD);
+                                        msg->txBuffer + msg->txOffset,
+                                        msg->txLength - msg->txOffset,
+                                        msg->txFD);
 
     if (done < 0) {
         if (errno == EAGAIN)
@@ -453,7 +590,7 @@ qemuMonitorIOWrite(qemuMonitorPtr mon)
                              _("Unable to write to monitor"));
         return -1;
     }
-    mon->msg->txOffset += done;
+    msg->txOffset += done;
     return done;
 }
 
@@ -469,14 +606,15 @@ qemuMonitorIORead(qemuMonitorPtr mon)
     size_t avail = mon->bufferLength - mon->bufferOffset;
     int ret = 0;
 
-    if (avail < 1024) {
-        if (VIR_REALLOC_N(mon->buffer,
-                          mon->bufferLength + 1024) < 0) {
+    /* Grow geometrically, so that taking in a reply of several
+     * megabytes does not cost a realloc and copy per kilobyte */
+    if (avail < QEMU_MONITOR_READ_SIZE) {
+        if (VIR_RESIZE_N(mon->buffer, mon->bufferLength,
+                         mon->bufferOffset, QEMU_MONITOR_READ_SIZE) < 0) {
             virReportOOMError();
             return -1;
         }
-        mon->bufferLength += 1024;
-        avail += 1024;
+        avail = mon->bufferLength - mon->bufferOffset;
     }
 
     /* Read as much as we can get into our buffer,
@@ -520,7 +658,7 @@ static void qemuMonitorUpdateWatch(qemuMonitorPtr mon)
     if (mon->lastError.code == VIR_ERR_OK) {
         events |= VIR_EVENT_HANDLE_READABLE;
 
-        if (mon->msg && mon->msg->txOffset < mon->msg->txLength)
+        if (qemuMonitorNextTx(mon))
             events |= VIR_EVENT_HANDLE_WRITABLE;
     }
 
@@ -614,14 +752,12 @@ qemuMonitorIO(int watch, int fd, int events, void *opaque) {
         }
 
         VIR_DEBUG("Error on monitor %s", NULLSTR(mon->lastError.message));
-        /* If IO process resulted in an error & we have a message,
-         * then wakeup that waiter */
-        if (mon->msg && !mon->msg->finished) {
-            mon->msg->finished = 1;
-            virCondSignal(&mon->notify);
-        }
+        /* If IO process resulted in an error, none of the queued
+         * messages is going to get a reply, so wakeup their waiters */
+        qemuMonitorReapMessages(mon, true);
     }
 
+    qemuMonitorRunCallbacks(mon);
     qemuMonitorUpdateWatch(mon);
 
     /* We have to unlock to avoid deadlock against command thread,
@@ -633,7 +769,7 @@ qemuMonitorIO(int watch, int fd, int events, void *opaque) {
         virDomainObjPtr vm = mon->vm;
 
         /* Make sure anyone waiting wakes up now */
-        virCondSignal(&mon->notify);
+        virCondBroadcast(&mon->notify);
         if (qemuMonitorUnref(mon) > 0)
             qemuMonitorUnlock(mon);
         VIR_DEBUG("Triggering EOF callback");
@@ -644,7 +780,7 @@ qemuMonitorIO(int watch, int fd, int events, void *opaque) {
         virDomainObjPtr vm = mon->vm;
 
         /* Make sure anyone waiting wakes up now */
-        virCondSignal(&mon->notify);
+        virCondBroadcast(&mon->notify);
         if (qemuMonitorUnref(mon) > 0)
             qemuMonitorUnlock(mon);
         VIR_DEBUG("Triggering error callback");
@@ -771,6 +907,18 @@ void qemuMonitorClose(qemuMonitorPtr mon)
         VIR_FORCE_CLOSE(mon->fd);
     }
 
+    /* Nothing still queued is going to be answered now */
+    if (mon->msgs) {
+        if (mon->lastError.code == VIR_ERR_OK) {
+            qemuReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                            _("monitor was closed"));
+            virCopyLastError(&mon->lastError);
+            virResetLastError();
+        }
+        qemuMonitorReapMessages(mon, true);
+        qemuMonitorRunCallbacks(mon);
+    }
+
     if (qemuMonitorUnref(mon) > 0)
         qemuMonitorUnlock(mon);
 }
@@ -801,10 +949,12 @@ int qemuMonitorSend(qemuMonitorPtr mon,
         return -1;
     }
 
-    mon->msg = msg;
+    /* Other threads may queue their own commands while this one
+     * waits for its reply */
+    qemuMonitorQueueMessage(mon, msg);
     qemuMonitorUpdateWatch(mon);
 
-    while (!mon->msg->finished) {
+    while (!msg->finished) {
         if (virCondWait(&mon->notify, &mon->lock) < 0) {
             qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                             _("Unable to wait on monitor condition"));
@@ -822,13 +972,49 @@ int qemuMonitorSend(qemuMonitorPtr mon,
     ret = 0;
 
 cleanup:
-    mon->msg = NULL;
+    qemuMonitorUnqueueMessage(mon, msg);
     qemuMonitorUpdateWatch(mon);
 
     return ret;
 }
 
 
+/**
+ * qemuMonitorSendAsync:
+ * @mon: the monitor, locked
+ * @msg: the message to send, with its callback set
+ *
+ * Queue @msg without waiting for its reply. Once the reply is in,
+ * or the monitor failed, the message is marked finished and its
+ * callback is run from the event loop, or from qemuMonitorClose.
+ * The callback gets the message back and must not block.
+ *
+ * Returns 0 if @msg was queued, in which case its callback will be
+ * run exactly once, or -1 on error
+ */
+int qemuMonitorSendAsync(qemuMonitorPtr mon,
+                         qemuMonitorMessagePtr msg)
+{
+    if (!msg->callback) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("asynchronous monitor message without a callback"));
+        return -1;
+    }
+
+    if (mon->lastError.code != VIR_ERR_OK) {
+        VIR_DEBUG("Attempt to send command while error is set %s",
+                  NULLSTR(mon->lastError.message));
+        virSetError(&mon->lastError);
+        return -1;
+    }
+
+    qemuMonitorQueueMessage(mon, msg);
+    qemuMonitorUpdateWatch(mon);
+
+    return 0;
+}
+
+
 int qemuMonitorHMPCommandWithFd(qemuMonitorPtr mon,
                                 const char *cmd,
                                 int scm_fd,
@@ -1203,6 +1389,35 @@ int qemuMonitorGetBalloonInfo(qemuMonitorPtr mon,
 }
 
 
+/*
+ * Queue query-balloon without waiting for its reply, which goes to
+ * @cb from the event loop. Only QMP can have commands in flight
+ * like this. @mon must be locked.
+ *
+ * Returns 0 if @cb is going to be called, -1 otherwise
+ */
+int qemuMonitorGetBalloonInfoAsync(qemuMonitorPtr mon,
+                                   qemuMonitorBalloonInfoCallback cb,
+                                   void *opaque)
+{
+    VIR_DEBUG("mon=%p", mon);
+
+    if (!mon) {
+        qemuReportError(VIR_ERR_INVALID_ARG, "%s",
+                        _("monitor must not be NULL"));
+        return -1;
+    }
+
+    if (!mon->json) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                        _("asynchronous queries need a JSON monitor"));
+        return -1;
+    }
+
+    return qemuMonitorJSONGetBalloonInfoAsync(mon, cb, opaque);
+}
+
+
 int qemuMonitorGetMemoryStats(qemuMonitorPtr mon,
                               virDomainMemoryStatPtr stats,
                               unsigned int nr_stats)
@@ -1308,6 +1523,79 @@ int qemuMonitorGetBlockStatsParamsNumber(qemuMonitorPtr mon,
     return ret;
 }
 
+static void
+qemuMonitorBlockStatsFree(void *payload,
+                          const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+/* Fetch the statistics of every block device with one command,
+ * instead of one per device. On success @ret_stats holds a
+ * struct qemuBlockStats for each device, keyed by the guest side
+ * device name, and must be freed with virHashFree.
+ */
+int qemuMonitorGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                    virHashTablePtr *ret_stats)
+{
+    int ret;
+    virHashTablePtr stats;
+    VIR_DEBUG("mon=%p ret_stats=%p", mon, ret_stats);
+
+    *ret_stats = NULL;
+
+    if (!mon) {
+        qemuReportError(VIR_ERR_INVALID_ARG, "%s",
+                        _("monitor must not be NULL"));
+        return -1;
+    }
+
+    if (!(stats = virHashCreate(10, qemuMonitorBlockStatsFree)))
+        return -1;
+
+    if (mon->json)
+        ret = qemuMonitorJSONGetAllBlockStatsInfo(mon, stats);
+    else
+        ret = qemuMonitorTextGetAllBlockStatsInfo(mon, stats);
+
+    if (ret < 0)
+        virHashFree(stats);
+    else
+        *ret_stats = stats;
+    return ret;
+}
+
+/*
+ * As qemuMonitorGetAllBlockStatsInfo, without waiting for the reply,
+ * which goes to @cb from the event loop. @mon must be locked.
+ *
+ * Returns 0 if @cb is going to be called, -1 otherwise
+ */
+int qemuMonitorGetAllBlockStatsInfoAsync(qemuMonitorPtr mon,
+                                         qemuMonitorBlockStatsCallback cb,
+                                         void *opaque)
+{
+    virHashTablePtr stats;
+    VIR_DEBUG("mon=%p", mon);
+
+    if (!mon) {
+        qemuReportError(VIR_ERR_INVALID_ARG, "%s",
+                        _("monitor must not be NULL"));
+        return -1;
+    }
+
+    if (!mon->json) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                        _("asynchronous queries need a JSON monitor"));
+        return -1;
+    }
+
+    if (!(stats = virHashCreate(10, qemuMonitorBlockStatsFree)))
+        return -1;
+
+    return qemuMonitorJSONGetAllBlockStatsInfoAsync(mon, stats, cb, opaque);
+}
+
 int qemuMonitorGetBlockExtent(qemuMonitorPtr mon,
                               const char *dev_name,
                               unsigned long long *extent)
@@ -43,6 +43,10 @@ typedef int (*qemuMonitorPasswordHandler)(qemuMonitorPtr mon,
                                           size_t len,
                                           void *opaque);
 
+typedef void (*qemuMonitorMessageCallback)(qemuMonitorPtr mon,
+                                           qemuMonitorMessagePtr msg,
+                                           void *opaque);
+
 struct _qemuMonitorMessage {
     int txFD;
 
@@ -63,6 +67,17 @@ struct _qemuMonitorMessage {
 
     qemuMonitorPasswordHandler passwordHandler;
     void *passwordOpaque;
+
+    /* The 'id' of a QMP command, which its reply will carry too */
+    const char *id;
+
+    /* For messages sent with qemuMonitorSendAsync, called once the
+     * message is finished, with the monitor unlocked */
+    qemuMonitorMessageCallback callback;
+    void *callbackOpaque;
+
+    /* Private to the monitor, for its queue of messages */
+    qemuMonitorMessagePtr next;
 };
 
 typedef struct _qemuMonitorCallbacks qemuMonitorCallbacks;
@@ -154,6 +169,8 @@ int qemuMonitorSetLink(qemuMonitorPtr mon,
 char *qemuMonitorNextCommandID(qemuMonitorPtr mon);
 int qemuMonitorSend(qemuMonitorPtr mon,
                     qemuMonitorMessagePtr msg);
+int qemuMonitorSendAsync(qemuMonitorPtr mon,
+                         qemuMonitorMessagePtr msg);
 int qemuMonitorHMPCommandWithFd(qemuMonitorPtr mon,
                                 const char *cmd,
                                 int scm_fd,
@@ -233,6 +250,16 @@ int qemuMonitorGetVirtType(qemuMonitorPtr mon,
                            int *virtType);
 int qemuMonitorGetBalloonInfo(qemuMonitorPtr mon,
                               unsigned long *currmem);
+
+/* Called with the monitor unlocked; @ret is as the return value of
+ * qemuMonitorGetBalloonInfo */
+typedef void (*qemuMonitorBalloonInfoCallback)(qemuMonitorPtr mon,
+                                               int ret,
+                                               unsigned long currmem,
+                                               void *opaque);
+int qemuMonitorGetBalloonInfoAsync(qemuMonitorPtr mon,
+                                   qemuMonitorBalloonInfoCallback cb,
+                                   void *opaque);
 int qemuMonitorGetMemoryStats(qemuMonitorPtr mon,
                               virDomainMemoryStatPtr stats,
                               unsigned int nr_stats);
@@ -253,6 +280,31 @@ int qemuMonitorGetBlockStatsInfo(qemuMonitorPtr mon,
 int qemuMonitorGetBlockStatsParamsNumber(qemuMonitorPtr mon,
                                          int *nparams);
 
+/* Statistics of one block device, -1 where QEMU does not report them */
+struct qemuBlockStats {
+    long long rd_req;
+    long long rd_bytes;
+    long long rd_total_times;
+    long long wr_req;
+    long long wr_bytes;
+    long long wr_total_times;
+    long long flush_req;
+    long long flush_total_times;
+    long long errs;
+};
+
+int qemuMonitorGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                    virHashTablePtr *ret_stats);
+
+/* Called with the monitor unlocked, and owning @stats, which is NULL
+ * if they could not be had */
+typedef void (*qemuMonitorBlockStatsCallback)(qemuMonitorPtr mon,
+                                              virHashTablePtr stats,
+                                              void *opaque);
+int qemuMonitorGetAllBlockStatsInfoAsync(qemuMonitorPtr mon,
+                                         qemuMonitorBlockStatsCallback cb,
+                                         void *opaque);
+
 int qemuMonitorGetBlockExtent(qemuMonitorPtr mon,
                               const char *dev_name,
                               unsigned long long *extent);
@@ -45,8 +45,6 @@
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
 
-#define LINE_ENDING "\r\n"
-
 static void qemuMonitorJSONHandleShutdown(qemuMonitorPtr mon, virJSONValuePtr data);
 static void qemuMonitorJSONHandleReset(qemuMonitorPtr mon, virJSONValuePtr data);
 static void qemuMonitorJSONHandlePowerdown(qemuMonitorPtr mon, virJSONValuePtr data);
@@ -104,22 +102,56 @@ qemuMonitorJSONIOProcessEvent(qemuMonitorPtr mon,
     return 0;
 }
 
+/*
+ * Find which of the queued messages starting at @msgs @reply is
+ * for: the one whose id it carries, else the oldest one sent that
+ * has no id of its own. QEMU leaves the id out of replies to
+ * commands it could not parse, and those come back in order.
+ */
+static qemuMonitorMessagePtr
+qemuMonitorJSONFindMessage(qemuMonitorMessagePtr msgs,
+                           virJSONValuePtr reply)
+{
+    const char *id = virJSONValueObjectGetString(reply, "id");
+    qemuMonitorMessagePtr msg;
+    qemuMonitorMessagePtr oldest = NULL;
+
+    for (msg = msgs ; msg ; msg = msg->next) {
+        /* Only messages sent in full can have been answered */
+        if (msg->finished || msg->txOffset < msg->txLength)
+            continue;
+
+        if (!id)
+            return msg;
+        if (msg->id && STREQ(msg->id, id))
+            return msg;
+        if (!msg->id && !oldest)
+            oldest = msg;
+    }
+
+    return oldest;
+}
+
+/* Replies and events are only ever read, so they are parsed into
+ * an arena, straight out of the monitor's receive buffer */
 static int
 qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
                              const char *line,
+                             size_t len,
                              qemuMonitorMessagePtr msg)
 {
     virJSONValuePtr obj = NULL;
     int ret = -1;
 
-    VIR_DEBUG("Line [%s]", line);
+    VIR_DEBUG("Line [%.*s]", (int)len, line);
 
-    if (!(obj = virJSONValueFromString(line)))
+    if (!(obj = virJSONValueFromBuffer(line, len, VIR_JSON_PARSE_ARENA)))
         goto cleanup;
 
     if (obj->type != VIR_JSON_TYPE_OBJECT) {
         qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                        _("Parsed JSON reply '%s' isn't an object"), line);
+                        _("Parsed JSON reply '%.*s' isn't an object"),
+                        (int)len, line);
         goto cleanup;
     }
 
@@ -129,18 +161,19 @@ qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
         ret = qemuMonitorJSONIOProcessEvent(mon, obj);
     } else if (virJSONValueObjectHasKey(obj, "error") == 1 ||
                virJSONValueObjectHasKey(obj, "return") == 1) {
-        if (msg) {
+        if ((msg = qemuMonitorJSONFindMessage(msg, obj))) {
             msg->rxObject = obj;
             msg->finished = 1;
             obj = NULL;
             ret = 0;
         } else {
             qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("Unexpected JSON reply '%s'"), line);
+                            _("Unexpected JSON reply '%.*s'"),
+                            (int)len, line);
         }
     } else {
         qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                        _("Unknown JSON reply '%s'"), line);
+                        _("Unknown JSON reply '%.*s'"), (int)len, line);
     }
 
 cleanup:
@@ -153,33 +186,32 @@ int qemuMonitorJSONIOProcess(qemuMonitorPtr mon,
                              size_t len,
                              qemuMonitorMessagePtr msg)
 {
-    int used = 0;
+    size_t used = 0;
+    size_t scan = 0;
     /*VIR_DEBUG("Data %d bytes [%s]", len, data);*/
 
-    while (used < len) {
-        char *nl = strstr(data + used, LINE_ENDING);
-
-        if (nl) {
-            int got = nl - (data + used);
-            char *line = strndup(data + used, got);
-            if (!line) {
-                virReportOOMError();
-                return -1;
-            }
-            used += got + strlen(LINE_ENDING);
-            line[got] = '\0'; /* kill \n */
-            if (qemuMonitorJSONIOProcessLine(mon, line, msg) < 0) {
-                VIR_FREE(line);
-                return -1;
-            }
+    /* Each byte is looked at once on its way to the end of a line,
+     * however large the reply it belongs to */
+    while (scan < len) {
+        const char *nl = memchr(data + scan, '\n', len - scan);
+        size_t got;
 
-            VIR_FREE(line);
-        } else {
+        if (!nl)
             break;
-        }
+
+        scan = nl - data + 1;
+
+        /* A newline on its own does not end the line */
+        if (nl == data || nl[-1] != '\r')
+            continue;
+
+        got = nl - 1 - (data + used);
+        if (qemuMonitorJSONIOProcessLine(mon, data + used, got, msg) < 0)
+            return -1;
+        used = scan;
     }
 
-    VIR_DEBUG("Total used %d bytes out of %zd available in buffer", used, len);
+    VIR_DEBUG("Total used %zu bytes out of %zu available in buffer", used, len);
     return used;
 }
 
@@ -220,6 +252,7 @@ qemuMonitorJSONCommandWithFd(qemuMonitorPtr mon,
     }
     msg.txLength = strlen(msg.txBuffer);
     msg.txFD = scm_fd;
+    msg.id = id;
 
     VIR_DEBUG("Send command '%s' for write with FD %d", cmdstr, scm_fd);
 
@@ -255,6 +288,109 @@ qemuMonitorJSONCommand(qemuMonitorPtr mon,
     return qemuMonitorJSONCommandWithFd(mon, cmd, -1, reply);
 }
 
+
+typedef struct _qemuMonitorJSONAsyncCommand qemuMonitorJSONAsyncCommand;
+typedef qemuMonitorJSONAsyncCommand *qemuMonitorJSONAsyncCommandPtr;
+struct _qemuMonitorJSONAsyncCommand {
+    qemuMonitorMessage msg;
+    char *id;
+    qemuMonitorJSONCommandCallback cb;
+    void *opaque;
+};
+
+static void
+qemuMonitorJSONAsyncCommandFree(qemuMonitorJSONAsyncCommandPtr cmd)
+{
+    if (!cmd)
+        return;
+
+    virJSONValueFree(cmd->msg.rxObject);
+    VIR_FREE(cmd->msg.txBuffer);
+    VIR_FREE(cmd->id);
+    VIR_FREE(cmd);
+}
+
+static void
+qemuMonitorJSONAsyncCommandDone(qemuMonitorPtr mon,
+                                qemuMonitorMessagePtr msg,
+                                void *opaque)
+{
+    qemuMonitorJSONAsyncCommandPtr cmd = opaque;
+    virJSONValuePtr reply = msg->rxObject;
+
+    VIR_DEBUG("Receive async command reply id=%s rxObject=%p",
+              NULLSTR(cmd->id), reply);
+
+    msg->rxObject = NULL;
+    (cmd->cb)(mon, reply, cmd->opaque);
+    qemuMonitorJSONAsyncCommandFree(cmd);
+}
+
+
+/**
+ * qemuMonitorJSONCommandAsync:
+ * @mon: the monitor, locked
+ * @cmd: the command to run
+ * @cb: called with the reply, or NULL if there is none
+ * @opaque: data for @cb
+ *
+ * Queue @cmd behind whatever the monitor is already busy with and
+ * return straight away. @cb owns the reply it gets, and is called
+ * from the event loop with the monitor unlocked, so it must not
+ * block.
+ *
+ * Returns 0 if @cmd was queued, in which case @cb will be called
+ * exactly once, or -1 on error
+ */
+int
+qemuMonitorJSONCommandAsync(qemuMonitorPtr mon,
+                            virJSONValuePtr cmd,
+                            qemuMonitorJSONCommandCallback cb,
+                            void *opaque)
+{
+    qemuMonitorJSONAsyncCommandPtr async = NULL;
+    char *cmdstr = NULL;
+
+    if (VIR_ALLOC(async) < 0) {
+        virReportOOMError();
+        goto error;
+    }
+
+    if (!(async->id = qemuMonitorNextCommandID(mon)))
+        goto error;
+    if (virJSONValueObjectAppendString(cmd, "id", async->id) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("Unable to append command 'id' string"));
+        goto error;
+    }
+
+    if (!(cmdstr = virJSONValueToString(cmd)) ||
+        virAsprintf(&async->msg.txBuffer, "%s\r\n", cmdstr) < 0) {
+        virReportOOMError();
+        goto error;
+    }
+    async->msg.txLength = strlen(async->msg.txBuffer);
+    async->msg.txFD = -1;
+    async->msg.id = async->id;
+    async->msg.callback = qemuMonitorJSONAsyncCommandDone;
+    async->msg.callbackOpaque = async;
+    async->cb = cb;
+    async->opaque = opaque;
+
+    VIR_DEBUG("Queue async command '%s'", cmdstr);
+
+    if (qemuMonitorSendAsync(mon, &async->msg) < 0)
+        goto error;
+
+    VIR_FREE(cmdstr);
+    return 0;
+
+error:
+    VIR_FREE(cmdstr);
+    qemuMonitorJSONAsyncCommandFree(async);
+    return -1;
+}
+
 /* Ignoring OOM in this method, since we're already reporting
  * a more important error
  *
@@ -1169,6 +1305,39 @@ cleanup:
  * Returns: 0 if balloon not supported, +1 if balloon query worked
  * or -1 on failure
  */
+static int
+qemuMonitorJSONParseBalloonInfo(virJSONValuePtr cmd,
+                                virJSONValuePtr reply,
+                                unsigned long *currmem)
+{
+    virJSONValuePtr data;
+    unsigned long long mem;
+
+    /* See if balloon soft-failed */
+    if (qemuMonitorJSONHasError(reply, "DeviceNotActive") ||
+        qemuMonitorJSONHasError(reply, "KVMMissingCap"))
+        return 0;
+
+    /* See if any other fatal error occurred */
+    if (qemuMonitorJSONCheckError(cmd, reply) < 0)
+        return -1;
+
+    if (!(data = virJSONValueObjectGet(reply, "return"))) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("info balloon reply was missing return data"));
+        return -1;
+    }
+
+    if (virJSONValueObjectGetNumberUlong(data, "actual", &mem) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("info balloon reply was missing balloon data"));
+        return -1;
+    }
+
+    *currmem = (mem/1024);
+    return 1;
+}
+
 int qemuMonitorJSONGetBalloonInfo(qemuMonitorPtr mon,
                                   unsigned long *currmem)
 {
@@ -1184,43 +1353,84 @@ int qemuMonitorJSONGetBalloonInfo(qemuMonitorPtr mon,
 
     ret = qemuMonitorJSONCommand(mon, cmd, &reply);
 
-    if (ret == 0) {
-        /* See if balloon soft-failed */
-        if (qemuMonitorJSONHasError(reply, "DeviceNotActive") ||
-            qemuMonitorJSONHasError(reply, "KVMMissingCap"))
-            goto cleanup;
+    if (ret == 0)
+        ret = qemuMonitorJSONParseBalloonInfo(cmd, reply, currmem);
 
-        /* See if any other fatal error occurred */
-        ret = qemuMonitorJSONCheckError(cmd, reply);
+    virJSONValueFree(cmd);
+    virJSONValueFree(reply);
+    return ret;
+}
 
-        /* Success */
-        if (ret == 0) {
-            virJSONValuePtr data;
-            unsigned long long mem;
 
-            if (!(data = virJSONValueObjectGet(reply, "return"))) {
-                qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                                _("info balloon reply was missing return data"));
-                ret = -1;
-                goto cleanup;
-            }
+/* What an asynchronous query needs to make sense of its reply */
+struct qemuMonitorJSONAsyncQuery {
+    virJSONValuePtr cmd;
+    virHashTablePtr stats;
+    qemuMonitorBalloonInfoCallback balloonCb;
+    qemuMonitorBlockStatsCallback blockStatsCb;
+    void *opaque;
+};
 
-            if (virJSONValueObjectGetNumberUlong(data, "actual", &mem) < 0) {
-                qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                                _("info balloon reply was missing balloon data"));
-                ret = -1;
-                goto cleanup;
-            }
+static void
+qemuMonitorJSONAsyncQueryFree(struct qemuMonitorJSONAsyncQuery *query)
+{
+    if (!query)
+        return;
 
-            *currmem = (mem/1024);
-            ret = 1;
-        }
+    virJSONValueFree(query->cmd);
+    virHashFree(query->stats);
+    VIR_FREE(query);
+}
+
+/* Queue @query, which is freed in any case */
+static int
+qemuMonitorJSONAsyncQueryRun(qemuMonitorPtr mon,
+                             struct qemuMonitorJSONAsyncQuery *query,
+                             qemuMonitorJSONCommandCallback done)
+{
+    if (!query->cmd ||
+        qemuMonitorJSONCommandAsync(mon, query->cmd, done, query) < 0) {
+        qemuMonitorJSONAsyncQueryFree(query);
+        return -1;
     }
 
-cleanup:
-    virJSONValueFree(cmd);
+    return 0;
+}
+
+static void
+qemuMonitorJSONGetBalloonInfoDone(qemuMonitorPtr mon,
+                                  virJSONValuePtr reply,
+                                  void *opaque)
+{
+    struct qemuMonitorJSONAsyncQuery *query = opaque;
+    unsigned long currmem = 0;
+    int ret = -1;
+
+    if (reply)
+        ret = qemuMonitorJSONParseBalloonInfo(query->cmd, reply, &currmem);
+
+    (query->balloonCb)(mon, ret, currmem, query->opaque);
+
     virJSONValueFree(reply);
-    return ret;
+    qemuMonitorJSONAsyncQueryFree(query);
+}
+
+int qemuMonitorJSONGetBalloonInfoAsync(qemuMonitorPtr mon,
+                                       qemuMonitorBalloonInfoCallback cb,
+                                       void *opaque)
+{
+    struct qemuMonitorJSONAsyncQuery *query;
+
+    if (VIR_ALLOC(query) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    query->cmd = qemuMonitorJSONMakeCommand("query-balloon", NULL);
+    query->balloonCb = cb;
+    query->opaque = opaque;
+
+    return qemuMonitorJSONAsyncQueryRun(mon, query,
+                                        qemuMonitorJSONGetBalloonInfoDone);
 }
 
 
@@ -1444,6 +1654,114 @@ cleanup:
 }
 
 
+/* Parse the "stats" object of one query-blockstats entry. Counters
+ * which only newer QEMU reports are left at -1 when missing */
+static int
+qemuMonitorJSONGetOneBlockStats(virJSONValuePtr stats,
+                                struct qemuBlockStats *bstats)
+{
+    bstats->rd_req = bstats->rd_bytes = bstats->rd_total_times = -1;
+    bstats->wr_req = bstats->wr_bytes = bstats->wr_total_times = -1;
+    bstats->flush_req = bstats->flush_total_times = -1;
+    bstats->errs = -1;
+
+    if (!stats || stats->type != VIR_JSON_TYPE_OBJECT) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("blockstats stats entry was not in expected format"));
+        return -1;
+    }
+
+#define GET_STAT(name, field, optional)                                 \
+    if ((!optional || virJSONValueObjectHasKey(stats, name)) &&         \
+        virJSONValueObjectGetNumberLong(stats, name, &bstats->field) < 0) { \
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,                         \
+                        _("cannot read %s statistic"), name);           \
+        return -1;                                                      \
+    }
+
+    GET_STAT("rd_bytes", rd_bytes, false);
+    GET_STAT("rd_operations", rd_req, false);
+    GET_STAT("rd_total_times_ns", rd_total_times, true);
+    GET_STAT("wr_bytes", wr_bytes, false);
+    GET_STAT("wr_operations", wr_req, false);
+    GET_STAT("wr_total_times_ns", wr_total_times, true);
+    GET_STAT("flush_operations", flush_req, true);
+    GET_STAT("flush_total_times_ns", flush_total_times, true);
+
+#undef GET_STAT
+
+    return 0;
+}
+
+
+/* The device list of a query-blockstats reply, which stays owned
+ * by @reply */
+static virJSONValuePtr
+qemuMonitorJSONBlockStatsDevices(virJSONValuePtr cmd,
+                                 virJSONValuePtr reply)
+{
+    virJSONValuePtr devices;
+
+    if (qemuMonitorJSONCheckError(cmd, reply) < 0)
+        return NULL;
+
+    devices = virJSONValueObjectGet(reply, "return");
+    if (!devices || devices->type != VIR_JSON_TYPE_ARRAY) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("blockstats reply was missing device list"));
+        return NULL;
+    }
+
+    return devices;
+}
+
+/* Run query-blockstats, and return the device list from its reply,
+ * which stays owned by @reply */
+static virJSONValuePtr
+qemuMonitorJSONQueryBlockStats(qemuMonitorPtr mon,
+                               virJSONValuePtr *reply)
+{
+    virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-blockstats",
+                                                     NULL);
+    virJSONValuePtr devices = NULL;
+
+    *reply = NULL;
+
+    if (!cmd)
+        return NULL;
+
+    if (qemuMonitorJSONCommand(mon, cmd, reply) == 0)
+        devices = qemuMonitorJSONBlockStatsDevices(cmd, *reply);
+
+    virJSONValueFree(cmd);
+    return devices;
+}
+
+
+/* Returns the guest side name of one query-blockstats entry */
+static const char *
+qemuMonitorJSONBlockStatsDevName(virJSONValuePtr dev)
+{
+    const char *thisdev;
+
+    if (!dev || dev->type != VIR_JSON_TYPE_OBJECT ||
+        (thisdev = virJSONValueObjectGetString(dev, "device")) == NULL) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("blockstats device entry was not in expected format"));
+        return NULL;
+    }
+
+    /* New QEMU has separate names for host & guest side of the disk
+     * and libvirt gives the host side a 'drive-' prefix. Callers
+     * want the guest side though
+     */
+    if (STRPREFIX(thisdev, QEMU_DRIVE_HOST_PREFIX))
+        thisdev += strlen(QEMU_DRIVE_HOST_PREFIX);
+
+    return thisdev;
+}
+
+
 int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
                                      const char *dev_name,
                                      long long *rd_req,
@@ -1456,13 +1774,12 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
                                      long long *flush_total_times,
                                      long long *errs)
 {
-    int ret;
+    int ret = -1;
     int i;
     int found = 0;
-    virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-blockstats",
-                                                     NULL);
     virJSONValuePtr reply = NULL;
     virJSONValuePtr devices;
+    struct qemuBlockStats bstats;
 
     *rd_req = *rd_bytes = -1;
     *wr_req = *wr_bytes = *errs = -1;
@@ -1476,118 +1793,36 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
     if (flush_total_times)
         *flush_total_times = -1;
 
-    if (!cmd)
-        return -1;
-
-    ret = qemuMonitorJSONCommand(mon, cmd, &reply);
-
-    if (ret == 0)
-        ret = qemuMonitorJSONCheckError(cmd, reply);
-    if (ret < 0)
+    if (!(devices = qemuMonitorJSONQueryBlockStats(mon, &reply)))
         goto cleanup;
-    ret = -1;
-
-    devices = virJSONValueObjectGet(reply, "return");
-    if (!devices || devices->type != VIR_JSON_TYPE_ARRAY) {
-        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                        _("blockstats reply was missing device list"));
-        goto cleanup;
-    }
 
     for (i = 0 ; i < virJSONValueArraySize(devices) ; i++) {
         virJSONValuePtr dev = virJSONValueArrayGet(devices, i);
-        virJSONValuePtr stats;
         const char *thisdev;
-        if (!dev || dev->type != VIR_JSON_TYPE_OBJECT) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats device entry was not in expected format"));
-            goto cleanup;
-        }
 
-        if ((thisdev = virJSONValueObjectGetString(dev, "device")) == NULL) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats device entry was not in expected format"));
+        if (!(thisdev = qemuMonitorJSONBlockStatsDevName(dev)))
             goto cleanup;
-        }
-
-        /* New QEMU has separate names for host & guest side of the disk
-         * and libvirt gives the host side a 'drive-' prefix. The passed
-         * in dev_name is the guest side though
-         */
-        if (STRPREFIX(thisdev, QEMU_DRIVE_HOST_PREFIX))
-            thisdev += strlen(QEMU_DRIVE_HOST_PREFIX);
 
         if (STRNEQ(thisdev, dev_name))
             continue;
 
         found = 1;
-        if ((stats = virJSONValueObjectGet(dev, "stats")) == NULL ||
-            stats->type != VIR_JSON_TYPE_OBJECT) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats stats entry was not in expected format"));
+        if (qemuMonitorJSONGetOneBlockStats(virJSONValueObjectGet(dev, "stats"),
+                                            &bstats) < 0)
             goto cleanup;
-        }
 
-        if (virJSONValueObjectGetNumberLong(stats, "rd_bytes", rd_bytes) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "rd_bytes");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "rd_operations", rd_req) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "rd_operations");
-            goto cleanup;
-        }
-        if (rd_total_times &&
-            virJSONValueObjectHasKey(stats, "rd_total_times_ns") &&
-            (virJSONValueObjectGetNumberLong(stats, "rd_total_times_ns",
-                                             rd_total_times) < 0)) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "rd_total_times_ns");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "wr_bytes", wr_bytes) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "wr_bytes");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "wr_operations", wr_req) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "wr_operations");
-            goto cleanup;
-        }
-        if (wr_total_times &&
-            virJSONValueObjectHasKey(stats, "wr_total_times_ns") &&
-            (virJSONValueObjectGetNumberLong(stats, "wr_total_times_ns",
-                                             wr_total_times) < 0)) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "wr_total_times_ns");
-            goto cleanup;
-        }
-        if (flush_req &&
-            virJSONValueObjectHasKey(stats, "flush_operations") &&
-            (virJSONValueObjectGetNumberLong(stats, "flush_operations",
-                                            flush_req) < 0)) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "flush_operations");
-            goto cleanup;
-        }
-        if (flush_total_times &&
-            virJSONValueObjectHasKey(stats, "flush_total_times_ns") &&
-            (virJSONValueObjectGetNumberLong(stats, "flush_total_times_ns",
-                                            flush_total_times) < 0)) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "flush_total_times_ns");
-            goto cleanup;
-        }
+        *rd_req = bstats.rd_req;
+        *rd_bytes = bstats.rd_bytes;
+        *wr_req = bstats.wr_req;
+        *wr_bytes = bstats.wr_bytes;
+        if (rd_total_times)
+            *rd_total_times = bstats.rd_total_times;
+        if (wr_total_times)
+            *wr_total_times = bstats.wr_total_times;
+        if (flush_req)
+            *flush_req = bstats.flush_req;
+        if (flush_total_times)
+            *flush_total_times = bstats.flush_total_times;
     }
 
     if (!found) {
@@ -1598,12 +1833,109 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
     ret = 0;
 
 cleanup:
-    virJSONValueFree(cmd);
     virJSONValueFree(reply);
     return ret;
 }
 
 
+/* Add a struct qemuBlockStats to @stats for each entry in @devices */
+static int
+qemuMonitorJSONFillAllBlockStats(virJSONValuePtr devices,
+                                 virHashTablePtr stats)
+{
+    int ret = -1;
+    int i;
+    struct qemuBlockStats *bstats = NULL;
+
+    for (i = 0 ; i < virJSONValueArraySize(devices) ; i++) {
+        virJSONValuePtr dev = virJSONValueArrayGet(devices, i);
+        const char *thisdev;
+
+        if (!(thisdev = qemuMonitorJSONBlockStatsDevName(dev)))
+            goto cleanup;
+
+        if (VIR_ALLOC(bstats) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+
+        if (qemuMonitorJSONGetOneBlockStats(virJSONValueObjectGet(dev, "stats"),
+                                            bstats) < 0)
+            goto cleanup;
+
+        if (virHashAddEntry(stats, thisdev, bstats) < 0)
+            goto cleanup;
+        bstats = NULL;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(bstats);
+    return ret;
+}
+
+
+int qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr stats)
+{
+    int ret = -1;
+    virJSONValuePtr reply = NULL;
+    virJSONValuePtr devices;
+
+    if ((devices = qemuMonitorJSONQueryBlockStats(mon, &reply)))
+        ret = qemuMonitorJSONFillAllBlockStats(devices, stats);
+
+    virJSONValueFree(reply);
+    return ret;
+}
+
+
+static void
+qemuMonitorJSONGetAllBlockStatsInfoDone(qemuMonitorPtr mon,
+                                        virJSONValuePtr reply,
+                                        void *opaque)
+{
+    struct qemuMonitorJSONAsyncQuery *query = opaque;
+    virHashTablePtr stats = NULL;
+    virJSONValuePtr devices;
+
+    if (reply &&
+        (devices = qemuMonitorJSONBlockStatsDevices(query->cmd, reply)) &&
+        qemuMonitorJSONFillAllBlockStats(devices, query->stats) == 0) {
+        stats = query->stats;
+        query->stats = NULL;
+    }
+
+    (query->blockStatsCb)(mon, stats, query->opaque);
+
+    virJSONValueFree(reply);
+    qemuMonitorJSONAsyncQueryFree(query);
+}
+
+/* @stats is filled in and handed to @cb on success, else freed */
+int qemuMonitorJSONGetAllBlockStatsInfoAsync(qemuMonitorPtr mon,
+                                             virHashTablePtr stats,
+                                             qemuMonitorBlockStatsCallback cb,
+                                             void *opaque)
+{
+    struct qemuMonitorJSONAsyncQuery *query;
+
+    if (VIR_ALLOC(query) < 0) {
+        virReportOOMError();
+        virHashFree(stats);
+        return -1;
+    }
+    query->cmd = qemuMonitorJSONMakeCommand("query-blockstats", NULL);
+    query->stats = stats;
+    query->blockStatsCb = cb;
+    query->opaque = opaque;
+
+    return qemuMonitorJSONAsyncQueryRun(mon, query,
+                                        qemuMonitorJSONGetAllBlockStatsInfoDone);
+}
+
+
 int qemuMonitorJSONGetBlockStatsParamsNumber(qemuMonitorPtr mon,
                                              int *nparams)
 {
@@ -28,12 +28,22 @@
 # include "internal.h"
 
 # include "qemu_monitor.h"
+# include "json.h"
 
 int qemuMonitorJSONIOProcess(qemuMonitorPtr mon,
                              const char *data,
                              size_t len,
                              qemuMonitorMessagePtr msg);
 
+typedef void (*qemuMonitorJSONCommandCallback)(qemuMonitorPtr mon,
+                                               virJSONValuePtr reply,
+                                               void *opaque);
+
+int qemuMonitorJSONCommandAsync(qemuMonitorPtr mon,
+                                virJSONValuePtr cmd,
+                                qemuMonitorJSONCommandCallback cb,
+                                void *opaque);
+
 int qemuMonitorJSONHumanCommandWithFd(qemuMonitorPtr mon,
                                       const char *cmd,
                                       int scm_fd,
@@ -59,6 +69,9 @@ int qemuMonitorJSONGetVirtType(qemuMonitorPtr mon,
                                int *virtType);
 int qemuMonitorJSONGetBalloonInfo(qemuMonitorPtr mon,
                                   unsigned long *currmem);
+int qemuMonitorJSONGetBalloonInfoAsync(qemuMonitorPtr mon,
+                                       qemuMonitorBalloonInfoCallback cb,
+                                       void *opaque);
 int qemuMonitorJSONGetMemoryStats(qemuMonitorPtr mon,
                                   virDomainMemoryStatPtr stats,
                                   unsigned int nr_stats);
@@ -78,6 +91,12 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
                                      long long *errs);
 int qemuMonitorJSONGetBlockStatsParamsNumber(qemuMonitorPtr mon,
                                              int *nparams);
+int qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr stats);
+int qemuMonitorJSONGetAllBlockStatsInfoAsync(qemuMonitorPtr mon,
+                                             virHashTablePtr stats,
+                                             qemuMonitorBlockStatsCallback cb,
+                                             void *opaque);
 int qemuMonitorJSONGetBlockExtent(qemuMonitorPtr mon,
                                   const char *dev_name,
                                   unsigned long long *extent);
@@ -995,6 +995,99 @@ int qemuMonitorTextGetBlockStatsInfo(qemuMonitorPtr mon,
     return ret;
 }
 
+int qemuMonitorTextGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr stats)
+{
+    char *info = NULL;
+    int ret = -1;
+    char *dummy;
+    char *dev_name = NULL;
+    struct qemuBlockStats *bstats = NULL;
+    const char *p, *eol, *colon;
+
+    if (qemuMonitorHMPCommand (mon, "info blockstats", &info) < 0) {
+        qemuReportError(VIR_ERR_OPERATION_FAILED,
+                        "%s", _("'info blockstats' command failed"));
+        goto cleanup;
+    }
+
+    /* See qemuMonitorTextGetBlockStatsInfo */
+    if (strstr(info, "\ninfo ")) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID,
+                        "%s",
+                        _("'info blockstats' not supported by this qemu"));
+        goto cleanup;
+    }
+
+    /* One line per block device, in the same format as parsed by
+     * qemuMonitorTextGetBlockStatsInfo */
+    for (p = info ; *p ; p = *eol ? eol + 1 : eol) {
+        eol = strchr(p, '\n');
+        if (!eol)
+            eol = p + strlen(p);
+
+        if (STRPREFIX(p, QEMU_DRIVE_HOST_PREFIX))
+            p += strlen(QEMU_DRIVE_HOST_PREFIX);
+
+        colon = strchr(p, ':');
+        if (!colon || colon >= eol || colon[1] != ' ')
+            continue;
+
+        if (!(dev_name = strndup(p, colon - p)) ||
+            VIR_ALLOC(bstats) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+
+        bstats->rd_req = bstats->rd_bytes = bstats->rd_total_times = -1;
+        bstats->wr_req = bstats->wr_bytes = bstats->wr_total_times = -1;
+        bstats->flush_req = bstats->flush_total_times = -1;
+        bstats->errs = -1;
+
+        p = colon + 2;
+        while (p < eol) {
+#define GET_STAT(name, field)                                           \
+            if (STRPREFIX(p, name "=")) {                               \
+                p += strlen(name "=");                                  \
+                if (virStrToLong_ll(p, &dummy, 10, &bstats->field) == -1) \
+                    VIR_DEBUG("error reading " name ": %s", p);         \
+            }
+
+            GET_STAT("rd_bytes", rd_bytes)
+            else GET_STAT("wr_bytes", wr_bytes)
+            else GET_STAT("rd_operations", rd_req)
+            else GET_STAT("wr_operations", wr_req)
+            else GET_STAT("rd_total_times_ns", rd_total_times)
+            else GET_STAT("wr_total_times_ns", wr_total_times)
+            else GET_STAT("flush_operations", flush_req)
+            else GET_STAT("flush_total_times_ns", flush_total_times)
+            else
+                VIR_DEBUG("unknown block stat near %s", p);
+
+#undef GET_STAT
+
+            /* Skip to next label. */
+            p = strchr(p, ' ');
+            if (!p || p >= eol)
+                break;
+            p++;
+        }
+
+        if (virHashAddEntry(stats, dev_name, bstats) < 0)
+            goto cleanup;
+        bstats = NULL;
+        VIR_FREE(dev_name);
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(bstats);
+    VIR_FREE(dev_name);
+    VIR_FREE(info);
+    return ret;
+}
+
 int qemuMonitorTextGetBlockStatsParamsNumber(qemuMonitorPtr mon,
                                              int *nparams)
 {
@@ -2848,7 +2848,7 @@ int qemuProcessStart(virConnectPtr conn,
     if (virDomainObjSetDefTransient(driver->caps, vm, true) < 0)
         goto cleanup;
 
-    vm->def->id = driver->nextvmid++;
+    virDomainObjListSetID(&driver->domains, vm, driver->nextvmid++);
     qemuDomainSetFakeReboot(driver, vm, false);
     virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, VIR_DOMAIN_SHUTOFF_UNKNOWN);
 
@@ -3450,13 +3450,19 @@ retry:
 
     vm->taint = 0;
     vm->pid = -1;
-    vm->def->id = -1;
+    virDomainObjListSetID(&driver->domains, vm, -1);
     virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, reason);
     VIR_FREE(priv->vcpupids);
     priv->nvcpupids = 0;
     qemuCapsFree(priv->qemuCaps);
     priv->qemuCaps = NULL;
     VIR_FREE(priv->pidfile);
+    priv->balloonTime = 0;
+    qemuDomainObjSetBlockStats(vm, NULL);
+    qemuStatsPendingUnref(priv->statsPending);
+    priv->statsPending = NULL;
+    qemuStatsRingFree(priv->statsRing);
+    priv->statsRing = NULL;
 
     /* The "release" hook cleans up additional resources */
     if (virHookPresent(VIR_HOOK_DRIVER_QEMU)) {
@@ -3514,7 +3520,7 @@ int qemuProcessAttach(virConnectPtr conn ATTRIBUTE_UNUSED,
     if (virDomainObjSetDefTransient(driver->caps, vm, true) < 0)
         goto cleanup;
 
-    vm->def->id = driver->nextvmid++;
+    virDomainObjListSetID(&driver->domains, vm, driver->nextvmid++);
 
     if (virFileMakePath(driver->logDir) < 0) {
         virReportSystemError(errno,
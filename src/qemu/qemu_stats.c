@@ -0,0 +1,898 @@
+/*
+ * qemu_stats.c: periodic sampling of QEMU domain statistics
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+
+#include "qemu_stats.h"
+#include "qemu_domain.h"
+#include "qemu_cgroup.h"
+#include "qemu_monitor.h"
+#include "stats_linux.h"
+#include "memory.h"
+#include "logging.h"
+#include "util.h"
+#include "event.h"
+#include "virterror_internal.h"
+
+#define VIR_FROM_THIS VIR_FROM_QEMU
+
+/*
+ * A domain keeps the same devices for long stretches, so the field
+ * names and types of its samples are kept once, and shared by all
+ * the consecutive samples which have the same ones. A sample itself
+ * is then little more than an array of numbers.
+ */
+typedef struct _qemuStatsField qemuStatsField;
+typedef qemuStatsField *qemuStatsFieldPtr;
+
+struct _qemuStatsField {
+    char *name;
+    int type;           /* VIR_TYPED_PARAM_ULLONG or _LLONG */
+    bool gauge;         /* A level rather than a running total */
+};
+
+typedef struct _qemuStatsLayout qemuStatsLayout;
+typedef qemuStatsLayout *qemuStatsLayoutPtr;
+
+struct _qemuStatsLayout {
+    int refs;
+    qemuStatsFieldPtr fields;
+    size_t nfields;
+    size_t maxfields;
+};
+
+struct _qemuStatsSample {
+    unsigned long long timestamp;       /* ms since the epoch */
+    qemuStatsLayoutPtr layout;
+    unsigned long long *values;         /* One per field of layout */
+    size_t maxvalues;
+};
+
+struct _qemuStatsRing {
+    qemuStatsSamplePtr *samples;
+    size_t size;
+    size_t first;       /* Index of the oldest sample */
+    size_t count;
+};
+
+struct _qemuStatsPending {
+    virMutex lock;
+    int refs;
+    size_t replies;     /* Monitor replies still to come */
+
+    qemuStatsSamplePtr sample;
+    int balloonRet;
+    unsigned long balloon;
+    virHashTablePtr blockStats;
+};
+
+
+static void
+qemuStatsLayoutUnref(qemuStatsLayoutPtr layout)
+{
+    size_t i;
+
+    if (!layout || --layout->refs > 0)
+        return;
+
+    for (i = 0 ; i < layout->nfields ; i++)
+        VIR_FREE(layout->fields[i].name);
+    VIR_FREE(layout->fields);
+    VIR_FREE(layout);
+}
+
+static bool
+qemuStatsLayoutEqual(qemuStatsLayoutPtr a,
+                     qemuStatsLayoutPtr b)
+{
+    size_t i;
+
+    if (a->nfields != b->nfields)
+        return false;
+
+    for (i = 0 ; i < a->nfields ; i++) {
+        if (a->fields[i].type != b->fields[i].type ||
+            a->fields[i].gauge != b->fields[i].gauge ||
+            STRNEQ(a->fields[i].name, b->fields[i].name))
+            return false;
+    }
+    return true;
+}
+
+
+qemuStatsSamplePtr
+qemuStatsSampleNew(unsigned long long timestamp)
+{
+    qemuStatsSamplePtr sample;
+
+    if (VIR_ALLOC(sample) < 0 ||
+        VIR_ALLOC(sample->layout) < 0) {
+        virReportOOMError();
+        VIR_FREE(sample);
+        return NULL;
+    }
+
+    sample->layout->refs = 1;
+    sample->timestamp = timestamp;
+    return sample;
+}
+
+void
+qemuStatsSampleFree(qemuStatsSamplePtr sample)
+{
+    if (!sample)
+        return;
+
+    qemuStatsLayoutUnref(sample->layout);
+    VIR_FREE(sample->values);
+    VIR_FREE(sample);
+}
+
+/*
+ * Append a field named after @fmt to a sample which has not been
+ * pushed to a ring yet. A field whose name does not fit in a typed
+ * parameter is left out.
+ *
+ * Returns 0 on success, -1 on OOM
+ */
+int
+qemuStatsSampleAdd(qemuStatsSamplePtr sample,
+                   int type,
+                   bool gauge,
+                   unsigned long long value,
+                   const char *fmt, ...)
+{
+    qemuStatsLayoutPtr layout = sample->layout;
+    qemuStatsFieldPtr field;
+    char *name;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = virVasprintf(&name, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        goto no_memory;
+
+    if (len >= VIR_TYPED_PARAM_FIELD_LENGTH) {
+        VIR_DEBUG("Dropping stat with a name too long for '%s'", fmt);
+        VIR_FREE(name);
+        return 0;
+    }
+
+    if (VIR_RESIZE_N(layout->fields, layout->maxfields,
+                     layout->nfields, 1) < 0 ||
+        VIR_RESIZE_N(sample->values, sample->maxvalues,
+                     layout->nfields, 1) < 0) {
+        VIR_FREE(name);
+        goto no_memory;
+    }
+
+    field = layout->fields + layout->nfields;
+    field->name = name;
+    field->type = type;
+    field->gauge = gauge;
+    sample->values[layout->nfields++] = value;
+    return 0;
+
+no_memory:
+    virReportOOMError();
+    return -1;
+}
+
+
+qemuStatsRingPtr
+qemuStatsRingNew(size_t size)
+{
+    qemuStatsRingPtr ring;
+
+    if (size == 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("stats history must hold at least one sample"));
+        return NULL;
+    }
+
+    if (VIR_ALLOC(ring) < 0 ||
+        VIR_ALLOC_N(ring->samples, size) < 0) {
+        virReportOOMError();
+        VIR_FREE(ring);
+        return NULL;
+    }
+
+    ring->size = size;
+    return ring;
+}
+
+void
+qemuStatsRingFree(qemuStatsRingPtr ring)
+{
+    size_t i;
+
+    if (!ring)
+        return;
+
+    for (i = 0 ; i < ring->size ; i++)
+        qemuStatsSampleFree(ring->samples[i]);
+    VIR_FREE(ring->samples);
+    VIR_FREE(ring);
+}
+
+/* The @n'th oldest sample in @ring */
+static qemuStatsSamplePtr
+qemuStatsRingAt(qemuStatsRingPtr ring, size_t n)
+{
+    return ring->samples[(ring->first + n) % ring->size];
+}
+
+/*
+ * Add @sample to @ring, which owns it from now on, dropping the
+ * oldest sample if @ring is full.
+ */
+void
+qemuStatsRingPush(qemuStatsRingPtr ring,
+                  qemuStatsSamplePtr sample)
+{
+    if (ring->count) {
+        qemuStatsSamplePtr last = qemuStatsRingAt(ring, ring->count - 1);
+
+        if (last->layout != sample->layout &&
+            qemuStatsLayoutEqual(last->layout, sample->layout)) {
+            qemuStatsLayoutUnref(sample->layout);
+            sample->layout = last->layout;
+            sample->layout->refs++;
+        }
+    }
+
+    if (ring->count == ring->size) {
+        qemuStatsSampleFree(ring->samples[ring->first]);
+        ring->samples[ring->first] = sample;
+        ring->first = (ring->first + 1) % ring->size;
+    } else {
+        ring->samples[(ring->first + ring->count) % ring->size] = sample;
+        ring->count++;
+    }
+}
+
+size_t
+qemuStatsRingCount(qemuStatsRingPtr ring)
+{
+    return ring ? ring->count : 0;
+}
+
+
+/* The VIR_DOMAIN_STATS_* group a field belongs to */
+static unsigned int
+qemuStatsFieldGroup(const char *name)
+{
+    if (STRPREFIX(name, "cpu."))
+        return VIR_DOMAIN_STATS_CPU_TOTAL;
+    if (STRPREFIX(name, "balloon."))
+        return VIR_DOMAIN_STATS_BALLOON;
+    if (STRPREFIX(name, "net."))
+        return VIR_DOMAIN_STATS_INTERFACE;
+    if (STRPREFIX(name, "block."))
+        return VIR_DOMAIN_STATS_BLOCK;
+    if (STRPREFIX(name, "migration."))
+        return QEMU_STATS_MIGRATION;
+    return 0;
+}
+
+/* Where field @i of @cur is in @prev, or -1 if nowhere */
+static int
+qemuStatsSampleFind(qemuStatsSamplePtr prev,
+                    qemuStatsSamplePtr cur,
+                    size_t i)
+{
+    size_t j;
+
+    if (prev->layout == cur->layout)
+        return i;
+
+    for (j = 0 ; j < prev->layout->nfields ; j++) {
+        if (prev->layout->fields[j].type == cur->layout->fields[i].type &&
+            STREQ(prev->layout->fields[j].name,
+                  cur->layout->fields[i].name))
+            return j;
+    }
+    return -1;
+}
+
+static int
+qemuStatsRecordAdd(virDomainStatsRecordPtr record,
+                   const char *name,
+                   int type)
+{
+    virTypedParameterPtr param = record->params + record->nparams;
+
+    if (!virStrcpyStatic(param->field, name)) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("stat name '%s' too long"), name);
+        return -1;
+    }
+    param->type = type;
+    record->nparams++;
+    return 0;
+}
+
+/*
+ * The fields of @cur which are in the groups of @stats, as they are
+ * or, if @prev is given, as the rate per second at which they grew
+ * since @prev. Gauges are never turned into rates, and counters which
+ * went back, as they do when a device is replaced, are left out.
+ */
+static virDomainStatsRecordPtr
+qemuStatsSampleRecord(qemuStatsSamplePtr cur,
+                      qemuStatsSamplePtr prev,
+                      unsigned int stats)
+{
+    qemuStatsLayoutPtr layout = cur->layout;
+    virDomainStatsRecordPtr record = NULL;
+    unsigned long long interval = 0;
+    size_t i;
+
+    if (VIR_ALLOC(record) < 0 ||
+        VIR_ALLOC_N(record->params, layout->nfields + 2) < 0)
+        goto no_memory;
+
+    if (qemuStatsRecordAdd(record, "timestamp", VIR_TYPED_PARAM_ULLONG) < 0)
+        goto error;
+    record->params[record->nparams - 1].value.ul = cur->timestamp;
+
+    if (prev) {
+        if (cur->timestamp > prev->timestamp)
+            interval = cur->timestamp - prev->timestamp;
+        if (qemuStatsRecordAdd(record, "interval",
+                               VIR_TYPED_PARAM_ULLONG) < 0)
+            goto error;
+        record->params[record->nparams - 1].value.ul = interval;
+    }
+
+    for (i = 0 ; i < layout->nfields ; i++) {
+        qemuStatsFieldPtr field = layout->fields + i;
+        unsigned long long value = cur->values[i];
+        unsigned long long old;
+        int j;
+
+        if (!(qemuStatsFieldGroup(field->name) & stats))
+            continue;
+
+        if (!prev || field->gauge) {
+            if (qemuStatsRecordAdd(record, field->name, field->type) < 0)
+                goto error;
+            if (field->type == VIR_TYPED_PARAM_LLONG)
+                record->params[record->nparams - 1].value.l = value;
+            else
+                record->params[record->nparams - 1].value.ul = value;
+            continue;
+        }
+
+        if (interval == 0 ||
+            (j = qemuStatsSampleFind(prev, cur, i)) < 0)
+            continue;
+        old = prev->values[j];
+
+        if (field->type == VIR_TYPED_PARAM_LLONG ?
+            (long long) value < (long long) old : value < old)
+            continue;
+
+        if (qemuStatsRecordAdd(record, field->name,
+                               VIR_TYPED_PARAM_DOUBLE) < 0)
+            goto error;
+        record->params[record->nparams - 1].value.d =
+            (value - old) * 1000.0 / interval;
+    }
+
+    return record;
+
+no_memory:
+    virReportOOMError();
+error:
+    if (record)
+        VIR_FREE(record->params);
+    VIR_FREE(record);
+    return NULL;
+}
+
+/*
+ * Turn the last @nsamples samples of @ring, or all of them if
+ * @nsamples is 0, into a NULL terminated list of records, oldest
+ * first, each with the fields of the groups in @stats and a
+ * "timestamp" in ms since the epoch. With @rates, each record is
+ * about the time since the sample before it instead, which it gives
+ * as "interval" in ms; the oldest sample only serves as a base.
+ * The records are not tied to any domain yet.
+ *
+ * Returns the number of records, or -1 on error
+ */
+int
+qemuStatsRingGet(qemuStatsRingPtr ring,
+                 unsigned int stats,
+                 unsigned int nsamples,
+                 bool rates,
+                 virDomainStatsRecordPtr **records)
+{
+    virDomainStatsRecordPtr *list = NULL;
+    size_t count = qemuStatsRingCount(ring);
+    size_t avail;
+    size_t first;
+    size_t i;
+
+    if (rates)
+        avail = count ? count - 1 : 0;
+    else
+        avail = count;
+    if (nsamples && nsamples < avail)
+        avail = nsamples;
+    first = count - avail;
+
+    if (VIR_ALLOC_N(list, avail + 1) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    for (i = 0 ; i < avail ; i++) {
+        qemuStatsSamplePtr prev = NULL;
+
+        if (rates)
+            prev = qemuStatsRingAt(ring, first + i - 1);
+        if (!(list[i] = qemuStatsSampleRecord(qemuStatsRingAt(ring, first + i),
+                                              prev, stats))) {
+            virDomainStatsRecordListFree(list);
+            return -1;
+        }
+    }
+
+    *records = list;
+    return avail;
+}
+
+
+void
+qemuStatsPendingUnref(qemuStatsPendingPtr pending)
+{
+    int refs;
+
+    if (!pending)
+        return;
+
+    virMutexLock(&pending->lock);
+    refs = --pending->refs;
+    virMutexUnlock(&pending->lock);
+
+    if (refs > 0)
+        return;
+
+    virMutexDestroy(&pending->lock);
+    qemuStatsSampleFree(pending->sample);
+    virHashFree(pending->blockStats);
+    VIR_FREE(pending);
+}
+
+static void
+qemuStatsBalloonDone(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
+                     int ret,
+                     unsigned long currmem,
+                     void *opaque)
+{
+    qemuStatsPendingPtr pending = opaque;
+
+    virMutexLock(&pending->lock);
+    pending->balloonRet = ret;
+    pending->balloon = currmem;
+    pending->replies--;
+    virMutexUnlock(&pending->lock);
+
+    qemuStatsPendingUnref(pending);
+}
+
+static void
+qemuStatsBlockDone(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
+                   virHashTablePtr stats,
+                   void *opaque)
+{
+    qemuStatsPendingPtr pending = opaque;
+
+    virMutexLock(&pending->lock);
+    pending->blockStats = stats;
+    pending->replies--;
+    virMutexUnlock(&pending->lock);
+
+    qemuStatsPendingUnref(pending);
+}
+
+
+#define QEMU_STATS_ADD_LLONG(sample, val, gauge, ...)                   \
+    do {                                                                \
+        if ((val) != -1 &&                                              \
+            qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_LLONG, gauge,    \
+                               val, __VA_ARGS__) < 0)                   \
+            return -1;                                                  \
+    } while (0)
+
+static int
+qemuStatsSampleCpu(struct qemud_driver *driver,
+                   virDomainObjPtr vm,
+                   qemuStatsSamplePtr sample)
+{
+    virCgroupPtr group = NULL;
+    unsigned long long usage;
+    int ret = 0;
+
+    if (!qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_CPUACCT) ||
+        virCgroupForDomain(driver->cgroup, vm->def->name, &group, 0) < 0)
+        return 0;
+
+    if (virCgroupGetCpuacctUsage(group, &usage) < 0)
+        VIR_DEBUG("No cpu time for domain %s", vm->def->name);
+    else
+        ret = qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, false,
+                                 usage, "cpu.time");
+
+    virCgroupFree(&group);
+    return ret;
+}
+
+#ifdef __linux__
+static int
+qemuStatsSampleInterfaces(virDomainObjPtr vm,
+                          qemuStatsSamplePtr sample)
+{
+    int i;
+
+    for (i = 0 ; i < vm->def->nnets ; i++) {
+        const char *ifname = vm->def->nets[i]->ifname;
+        struct _virDomainInterfaceStats stats;
+
+        if (!ifname)
+            continue;
+
+        if (linuxDomainInterfaceStats(ifname, &stats) < 0) {
+            VIR_DEBUG("No stats for interface %s of domain %s",
+                      ifname, vm->def->name);
+            continue;
+        }
+
+        QEMU_STATS_ADD_LLONG(sample, stats.rx_bytes, false,
+                             "net.%s.rx_bytes", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.rx_packets, false,
+                             "net.%s.rx_packets", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.rx_errs, false,
+                             "net.%s.rx_errs", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.rx_drop, false,
+                             "net.%s.rx_drop", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.tx_bytes, false,
+                             "net.%s.tx_bytes", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.tx_packets, false,
+                             "net.%s.tx_packets", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.tx_errs, false,
+                             "net.%s.tx_errs", ifname);
+        QEMU_STATS_ADD_LLONG(sample, stats.tx_drop, false,
+                             "net.%s.tx_drop", ifname);
+    }
+    return 0;
+}
+#else
+static int
+qemuStatsSampleInterfaces(virDomainObjPtr vm ATTRIBUTE_UNUSED,
+                          qemuStatsSamplePtr sample ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+#endif
+
+static int
+qemuStatsSampleBlock(virDomainObjPtr vm,
+                     virHashTablePtr blockstats,
+                     qemuStatsSamplePtr sample)
+{
+    int i;
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+        struct qemuBlockStats *stats;
+
+        if (!disk->info.alias ||
+            !(stats = virHashLookup(blockstats, disk->info.alias)))
+            continue;
+
+        QEMU_STATS_ADD_LLONG(sample, stats->rd_bytes, false, "block.%s.%s",
+                             disk->dst, VIR_DOMAIN_BLOCK_STATS_READ_BYTES);
+        QEMU_STATS_ADD_LLONG(sample, stats->rd_req, false, "block.%s.%s",
+                             disk->dst, VIR_DOMAIN_BLOCK_STATS_READ_REQ);
+        QEMU_STATS_ADD_LLONG(sample, stats->rd_total_times, false,
+                             "block.%s.%s", disk->dst,
+                             VIR_DOMAIN_BLOCK_STATS_READ_TOTAL_TIMES);
+        QEMU_STATS_ADD_LLONG(sample, stats->wr_bytes, false, "block.%s.%s",
+                             disk->dst, VIR_DOMAIN_BLOCK_STATS_WRITE_BYTES);
+        QEMU_STATS_ADD_LLONG(sample, stats->wr_req, false, "block.%s.%s",
+                             disk->dst, VIR_DOMAIN_BLOCK_STATS_WRITE_REQ);
+        QEMU_STATS_ADD_LLONG(sample, stats->wr_total_times, false,
+                             "block.%s.%s", disk->dst,
+                             VIR_DOMAIN_BLOCK_STATS_WRITE_TOTAL_TIMES);
+        QEMU_STATS_ADD_LLONG(sample, stats->flush_req, false, "block.%s.%s",
+                             disk->dst, VIR_DOMAIN_BLOCK_STATS_FLUSH_REQ);
+        QEMU_STATS_ADD_LLONG(sample, stats->flush_total_times, false,
+                             "block.%s.%s", disk->dst,
+                             VIR_DOMAIN_BLOCK_STATS_FLUSH_TOTAL_TIMES);
+        QEMU_STATS_ADD_LLONG(sample, stats->errs, false, "block.%s.%s",
+                             disk->dst, VIR_DOMAIN_BLOCK_STATS_ERRS);
+    }
+    return 0;
+}
+
+#undef QEMU_STATS_ADD_LLONG
+
+
+/*
+ * vm must be locked before calling
+ *
+ * Move the pending sample of @vm into its history once all the
+ * replies it waited for have come in. Whatever they brought also
+ * refreshes what GetInfo and friends fall back to while the domain
+ * is busy.
+ */
+void
+qemuStatsSamplerFlush(struct qemud_driver *driver ATTRIBUTE_UNUSED,
+                      virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuStatsPendingPtr pending = priv->statsPending;
+    qemuStatsSamplePtr sample;
+    unsigned long balloon;
+    size_t replies;
+
+    if (!pending)
+        return;
+
+    virMutexLock(&pending->lock);
+    replies = pending->replies;
+    virMutexUnlock(&pending->lock);
+    if (replies > 0)
+        return;
+
+    /* Nothing else refers to the sample now */
+    sample = pending->sample;
+
+    if (pending->balloonRet > 0)
+        qemuDomainObjSetBalloon(vm, pending->balloon);
+    /* As in qemudDomainGetInfo */
+    if (pending->balloonRet == 0)
+        balloon = vm->def->mem.max_balloon;
+    else
+        balloon = vm->def->mem.cur_balloon;
+
+    if (qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true, balloon,
+                           "balloon.current") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           vm->def->mem.max_balloon, "balloon.maximum") < 0)
+        goto cleanup;
+
+    if (pending->blockStats) {
+        if (qemuStatsSampleBlock(vm, pending->blockStats, sample) < 0)
+            goto cleanup;
+        qemuDomainObjSetBlockStats(vm, pending->blockStats);
+        pending->blockStats = NULL;
+    }
+
+    if (priv->statsRing) {
+        qemuStatsRingPush(priv->statsRing, sample);
+        pending->sample = NULL;
+    }
+
+cleanup:
+    priv->statsPending = NULL;
+    qemuStatsPendingUnref(pending);
+}
+
+
+/*
+ * vm must be locked before calling
+ *
+ * Take what can be had right away, and send off the monitor queries
+ * for the rest without waiting for them: QEMU answers while other
+ * domains are being sampled, and the next round or reader picks up
+ * the sample.
+ */
+static void
+qemuStatsSampleDomain(struct qemud_driver *driver,
+                      virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuStatsPendingPtr pending = NULL;
+    qemuStatsSamplePtr sample = NULL;
+    unsigned long long now;
+    bool useBalloon;
+
+    qemuStatsSamplerFlush(driver, vm);
+    if (priv->statsPending) {
+        VIR_DEBUG("Previous sample of domain %s still pending",
+                  vm->def->name);
+        return;
+    }
+
+    if (!priv->statsRing &&
+        !(priv->statsRing = qemuStatsRingNew(driver->statsSampleHistory)))
+        goto error;
+
+    if (virTimeMs(&now) < 0 ||
+        !(sample = qemuStatsSampleNew(now)) ||
+        qemuStatsSampleCpu(driver, vm, sample) < 0 ||
+        qemuStatsSampleInterfaces(vm, sample) < 0)
+        goto error;
+
+    if (VIR_ALLOC(pending) < 0) {
+        virReportOOMError();
+        goto error;
+    }
+    if (virMutexInit(&pending->lock) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("cannot initialize mutex"));
+        VIR_FREE(pending);
+        goto error;
+    }
+    pending->refs = 1;
+    pending->sample = sample;
+    pending->balloonRet = -1;
+    sample = NULL;
+
+    useBalloon = !vm->def->memballoon ||
+        vm->def->memballoon->model != VIR_DOMAIN_MEMBALLOON_MODEL_NONE;
+    if (!useBalloon)
+        pending->balloonRet = 0;
+
+    /* The replies may come in from another thread as soon as
+     * the monitor is unlocked */
+    if (priv->mon && priv->monJSON) {
+        qemuMonitorPtr mon = priv->mon;
+
+        qemuMonitorLock(mon);
+        virMutexLock(&pending->lock);
+
+        if (useBalloon) {
+            pending->refs++;
+            pending->replies++;
+            if (qemuMonitorGetBalloonInfoAsync(mon, qemuStatsBalloonDone,
+                                               pending) < 0) {
+                pending->refs--;
+                pending->replies--;
+                virResetLastError();
+            }
+        }
+        if (vm->def->ndisks) {
+            pending->refs++;
+            pending->replies++;
+            if (qemuMonitorGetAllBlockStatsInfoAsync(mon, qemuStatsBlockDone,
+                                                     pending) < 0) {
+                pending->refs--;
+                pending->replies--;
+                virResetLastError();
+            }
+        }
+
+        virMutexUnlock(&pending->lock);
+        qemuMonitorUnlock(mon);
+    }
+
+    priv->statsPending = pending;
+
+    /* Nothing to wait for, with the text monitor */
+    qemuStatsSamplerFlush(driver, vm);
+    return;
+
+error:
+    VIR_WARN("Unable to sample stats of domain %s", vm->def->name);
+    virResetLastError();
+    qemuStatsSampleFree(sample);
+}
+
+
+struct qemuStatsDomainList {
+    virDomainObjPtr *vms;
+    size_t nvms;
+    size_t maxvms;
+};
+
+static void
+qemuStatsSamplerCollect(void *payload,
+                        const void *name ATTRIBUTE_UNUSED,
+                        void *opaque)
+{
+    virDomainObjPtr vm = payload;
+    struct qemuStatsDomainList *list = opaque;
+
+    virDomainObjLock(vm);
+    if (virDomainObjIsActive(vm) &&
+        VIR_RESIZE_N(list->vms, list->maxvms, list->nvms, 1) == 0) {
+        virDomainObjRef(vm);
+        list->vms[list->nvms++] = vm;
+    }
+    virDomainObjUnlock(vm);
+}
+
+/*
+ * Sample all running domains in one go from the event loop, so the
+ * cost of watching a host does not grow with the number of clients
+ * watching it.
+ */
+static void
+qemuStatsSamplerTimer(int timer ATTRIBUTE_UNUSED,
+                      void *opaque)
+{
+    struct qemud_driver *driver = opaque;
+    struct qemuStatsDomainList list;
+    size_t i;
+
+    memset(&list, 0, sizeof(list));
+
+    /* Hold the driver lock only for long enough to reference the
+     * domains, not while reading their stats */
+    qemuDriverLock(driver);
+    virHashForEach(driver->domains.objs, qemuStatsSamplerCollect, &list);
+    qemuDriverUnlock(driver);
+
+    for (i = 0 ; i < list.nvms ; i++) {
+        virDomainObjPtr vm = list.vms[i];
+
+        virDomainObjLock(vm);
+        if (virDomainObjIsActive(vm))
+            qemuStatsSampleDomain(driver, vm);
+        if (virDomainObjUnref(vm) > 0)
+            virDomainObjUnlock(vm);
+    }
+
+    VIR_FREE(list.vms);
+}
+
+
+/*
+ * Start sampling all running domains every stats_sample_interval
+ * seconds, if it is set.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+qemuStatsSamplerStart(struct qemud_driver *driver)
+{
+    if (driver->statsSampleInterval == 0)
+        return 0;
+
+    if ((driver->statsTimer =
+         virEventAddTimeout(driver->statsSampleInterval * 1000,
+                            qemuStatsSamplerTimer, driver, NULL)) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("cannot add stats sampling timer"));
+        driver->statsTimer = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+qemuStatsSamplerStop(struct qemud_driver *driver)
+{
+    if (driver->statsTimer <= 0)
+        return;
+
+    virEventRemoveTimeout(driver->statsTimer);
+    driver->statsTimer = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * qemu_stats.h: periodic sampling of QEMU domain statistics
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __QEMU_STATS_H__
+# define __QEMU_STATS_H__
+
+# include "internal.h"
+# include "qemu_conf.h"
+
+/* One set of values taken at one point in time */
+typedef struct _qemuStatsSample qemuStatsSample;
+typedef qemuStatsSample *qemuStatsSamplePtr;
+
+/* The last few samples of one domain, oldest dropped first */
+typedef struct _qemuStatsRing qemuStatsRing;
+typedef qemuStatsRing *qemuStatsRingPtr;
+
+/* A sample still waiting for replies from the monitor */
+typedef struct _qemuStatsPending qemuStatsPending;
+typedef qemuStatsPending *qemuStatsPendingPtr;
+
+/* The group of "migration." fields, which only ever make it into the
+ * migration timeline, not into the public stats groups */
+# define QEMU_STATS_MIGRATION (1U << 31)
+
+qemuStatsSamplePtr qemuStatsSampleNew(unsigned long long timestamp);
+void qemuStatsSampleFree(qemuStatsSamplePtr sample);
+int qemuStatsSampleAdd(qemuStatsSamplePtr sample,
+                       int type,
+                       bool gauge,
+                       unsigned long long value,
+                       const char *fmt, ...)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_FMT_PRINTF(5, 6);
+
+qemuStatsRingPtr qemuStatsRingNew(size_t size);
+void qemuStatsRingFree(qemuStatsRingPtr ring);
+void qemuStatsRingPush(qemuStatsRingPtr ring,
+                       qemuStatsSamplePtr sample)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+size_t qemuStatsRingCount(qemuStatsRingPtr ring);
+int qemuStatsRingGet(qemuStatsRingPtr ring,
+                     unsigned int stats,
+                     unsigned int nsamples,
+                     bool rates,
+                     virDomainStatsRecordPtr **records)
+    ATTRIBUTE_NONNULL(5);
+
+void qemuStatsPendingUnref(qemuStatsPendingPtr pending);
+
+int qemuStatsSamplerStart(struct qemud_driver *driver);
+void qemuStatsSamplerStop(struct qemud_driver *driver);
+void qemuStatsSamplerFlush(struct qemud_driver *driver,
+                           virDomainObjPtr vm);
+
+#endif /* __QEMU_STATS_H__ */
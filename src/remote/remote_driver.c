@@ -361,6 +361,8 @@ doRemoteOpen (virConnectPtr conn,
     char *port = NULL, *authtype = NULL, *username = NULL;
     bool sanity = true, verify = true, tty = true;
     char *pkipath = NULL, *keyfile = NULL;
+    bool haveStreamQueueMax = false;
+    unsigned long long streamQueueMax = 0;
 
     /* Return code from this function, and the private data. */
     int retcode = VIR_DRV_OPEN_ERROR;
@@ -451,6 +453,17 @@ doRemoteOpen (virConnectPtr conn,
                 pkipath = strdup(var->value);
                 if (!pkipath) goto out_of_memory;
                 var->ignore = 1;
+            } else if (STRCASEEQ(var->name, "stream_queue_max")) {
+                if (virStrToLong_ull(var->value, NULL, 10,
+                                     &streamQueueMax) < 0 ||
+                    streamQueueMax > SIZE_MAX) {
+                    remoteError(VIR_ERR_INVALID_ARG,
+                                _("invalid stream_queue_max '%s'"),
+                                var->value);
+                    goto failed;
+                }
+                haveStreamQueueMax = true;
+                var->ignore = 1;
             } else {
                 VIR_DEBUG("passing through variable '%s' ('%s') to remote end",
                       var->name, var->value);
@@ -644,6 +657,12 @@ doRemoteOpen (virConnectPtr conn,
         virNetClientAddProgram(priv->client, priv->qemuProgram) < 0)
         goto failed;
 
+    /* Reading resumes once a full stream is down to a quarter */
+    if (haveStreamQueueMax &&
+        virNetClientSetStreamQueueLimits(priv->client, streamQueueMax,
+                                         streamQueueMax / 4) < 0)
+        goto failed;
+
     /* Try and authenticate with server */
     VIR_DEBUG("Trying authentication");
     if (remoteAuthenticate(conn, priv, auth, authtype) == -1)
@@ -1423,6 +1442,286 @@ done:
     return rv;
 }
 
+/* How often a listing of domain stats starts over, when another call
+ * on the same connection starts one in between its pages */
+#define REMOTE_DOMAIN_STATS_RESTARTS_MAX 3
+
+static int
+remoteConnectGetAllDomainStats(virConnectPtr conn,
+                               unsigned int stats,
+                               virDomainStatsRecordPtr **retStats,
+                               unsigned int flags)
+{
+    int rv = -1;
+    int i;
+    int restarts = 0;
+    size_t nstats = 0;
+    size_t nalloc = 0;
+    remote_connect_get_all_domain_stats_args args;
+    remote_connect_get_all_domain_stats_ret ret;
+    virDomainStatsRecordPtr *tmpstats = NULL;
+    struct private_data *priv = conn->privateData;
+
+    remoteDriverLock(priv);
+
+    args.stats = stats;
+    args.flags = flags;
+    args.start = 0;
+    args.cookie = 0;
+
+    memset (&ret, 0, sizeof ret);
+
+    /* The daemon hands the records out in pages, as many as fit in
+     * one reply, so keep asking until none remain */
+    for (;;) {
+        if (call (conn, priv, 0, REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS,
+                  (xdrproc_t) xdr_remote_connect_get_all_domain_stats_args, (char *) &args,
+                  (xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret, (char *) &ret) == -1) {
+            virErrorPtr verr = virGetLastError();
+
+            /* Another thread started a listing of its own in between
+             * our pages, which dropped ours: start over */
+            if (args.start != 0 &&
+                verr && verr->code == VIR_ERR_OPERATION_INVALID &&
+                restarts++ < REMOTE_DOMAIN_STATS_RESTARTS_MAX) {
+                virResetLastError();
+                virDomainStatsRecordListFree(tmpstats);
+                tmpstats = NULL;
+                nstats = nalloc = 0;
+                args.start = 0;
+                args.cookie = 0;
+                continue;
+            }
+            goto done;
+        }
+
+        /* Check the length of the returned list carefully. */
+        if (ret.retStats.retStats_len > REMOTE_DOMAIN_STATS_RECORDS_MAX ||
+            (ret.retStats.retStats_len == 0 && ret.remaining != 0) ||
+            (unsigned long long)nstats + ret.retStats.retStats_len +
+            ret.remaining > INT_MAX) {
+            remoteError(VIR_ERR_RPC, "%s",
+                        _("remoteConnectGetAllDomainStats: "
+                          "returned number of records exceeds limit"));
+            goto cleanup;
+        }
+
+        /* The list is NULL terminated */
+        if (VIR_RESIZE_N(tmpstats, nalloc, nstats,
+                         ret.retStats.retStats_len + 1) < 0)
+            goto no_memory;
+
+        for (i = 0; i < ret.retStats.retStats_len; i++) {
+            remote_domain_stats_record *rec = ret.retStats.retStats_val + i;
+            virDomainStatsRecordPtr elem;
+
+            if (VIR_ALLOC(elem) < 0)
+                goto no_memory;
+            tmpstats[nstats++] = elem;
+
+            if (!(elem->dom = get_nonnull_domain(conn, rec->dom)))
+                goto cleanup;
+
+            if (rec->params.params_len &&
+                VIR_ALLOC_N(elem->params, rec->params.params_len) < 0)
+                goto no_memory;
+            elem->nparams = rec->params.params_len;
+
+            if (remoteDeserializeTypedParameters(rec->params.params_val,
+                                                 rec->params.params_len,
+                                                 REMOTE_DOMAIN_STATS_PARAMS_MAX,
+                                                 elem->params,
+                                                 &elem->nparams) < 0)
+                goto cleanup;
+        }
+
+        if (ret.remaining == 0)
+            break;
+
+        args.start = nstats;
+        args.cookie = ret.cookie;
+        xdr_free ((xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret,
+                  (char *) &ret);
+        memset (&ret, 0, sizeof ret);
+    }
+
+    *retStats = tmpstats;
+    tmpstats = NULL;
+    rv = nstats;
+
+cleanup:
+    xdr_free ((xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret,
+              (char *) &ret);
+done:
+    virDomainStatsRecordListFree(tmpstats);
+    remoteDriverUnlock(priv);
+    return rv;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
+static int
+remoteDomainGetStatsSamples(virDomainPtr domain,
+                            unsigned int stats,
+                            unsigned int nsamples,
+                            virDomainStatsRecordPtr **retSamples,
+                            unsigned int flags)
+{
+    int rv = -1;
+    int i;
+    remote_domain_get_stats_samples_args args;
+    remote_domain_get_stats_samples_ret ret;
+    virDomainStatsRecordPtr *tmpsamples = NULL;
+    struct private_data *priv = domain->conn->privateData;
+
+    remoteDriverLock(priv);
+
+    make_nonnull_domain (&args.dom, domain);
+    args.stats = stats;
+    args.nsamples = nsamples;
+    args.flags = flags;
+
+    memset (&ret, 0, sizeof ret);
+    if (call (domain->conn, priv, 0, REMOTE_PROC_DOMAIN_GET_STATS_SAMPLES,
+              (xdrproc_t) xdr_remote_domain_get_stats_samples_args, (char *) &args,
+              (xdrproc_t) xdr_remote_domain_get_stats_samples_ret, (char *) &ret) == -1)
+        goto done;
+
+    /* Check the length of the returned list carefully. */
+    if (ret.retSamples.retSamples_len > REMOTE_DOMAIN_STATS_RECORDS_MAX) {
+        remoteError(VIR_ERR_RPC, "%s",
+                    _("remoteDomainGetStatsSamples: "
+                      "returned number of samples exceeds limit"));
+        goto cleanup;
+    }
+
+    /* The list is NULL terminated */
+    if (VIR_ALLOC_N(tmpsamples, ret.retSamples.retSamples_len + 1) < 0)
+        goto no_memory;
+
+    for (i = 0; i < ret.retSamples.retSamples_len; i++) {
+        remote_domain_stats_record *rec = ret.retSamples.retSamples_val + i;
+        virDomainStatsRecordPtr elem;
+
+        if (VIR_ALLOC(elem) < 0)
+            goto no_memory;
+        tmpsamples[i] = elem;
+
+        if (!(elem->dom = get_nonnull_domain(domain->conn, rec->dom)))
+            goto cleanup;
+
+        if (rec->params.params_len &&
+            VIR_ALLOC_N(elem->params, rec->params.params_len) < 0)
+            goto no_memory;
+        elem->nparams = rec->params.params_len;
+
+        if (remoteDeserializeTypedParameters(rec->params.params_val,
+                                             rec->params.params_len,
+                                             REMOTE_DOMAIN_STATS_PARAMS_MAX,
+                                             elem->params,
+                                             &elem->nparams) < 0)
+            goto cleanup;
+    }
+
+    *retSamples = tmpsamples;
+    tmpsamples = NULL;
+    rv = ret.retSamples.retSamples_len;
+
+cleanup:
+    virDomainStatsRecordListFree(tmpsamples);
+    xdr_free ((xdrproc_t) xdr_remote_domain_get_stats_samples_ret,
+              (char *) &ret);
+done:
+    remoteDriverUnlock(priv);
+    return rv;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
+static int
+remoteDomainGetMigrationTimeline(virDomainPtr domain,
+                                 unsigned int nsamples,
+                                 virDomainStatsRecordPtr **retSamples,
+                                 unsigned int flags)
+{
+    int rv = -1;
+    int i;
+    remote_domain_get_migration_timeline_args args;
+    remote_domain_get_migration_timeline_ret ret;
+    virDomainStatsRecordPtr *tmpsamples = NULL;
+    struct private_data *priv = domain->conn->privateData;
+
+    remoteDriverLock(priv);
+
+    make_nonnull_domain (&args.dom, domain);
+    args.nsamples = nsamples;
+    args.flags = flags;
+
+    memset (&ret, 0, sizeof ret);
+    if (call (domain->conn, priv, 0, REMOTE_PROC_DOMAIN_GET_MIGRATION_TIMELINE,
+              (xdrproc_t) xdr_remote_domain_get_migration_timeline_args,
+              (char *) &args,
+              (xdrproc_t) xdr_remote_domain_get_migration_timeline_ret,
+              (char *) &ret) == -1)
+        goto done;
+
+    /* Check the length of the returned list carefully. */
+    if (ret.retSamples.retSamples_len > REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX) {
+        remoteError(VIR_ERR_RPC, "%s",
+                    _("remoteDomainGetMigrationTimeline: "
+                      "returned number of samples exceeds limit"));
+        goto cleanup;
+    }
+
+    /* The list is NULL terminated */
+    if (VIR_ALLOC_N(tmpsamples, ret.retSamples.retSamples_len + 1) < 0)
+        goto no_memory;
+
+    for (i = 0; i < ret.retSamples.retSamples_len; i++) {
+        remote_domain_stats_record *rec = ret.retSamples.retSamples_val + i;
+        virDomainStatsRecordPtr elem;
+
+        if (VIR_ALLOC(elem) < 0)
+            goto no_memory;
+        tmpsamples[i] = elem;
+
+        if (!(elem->dom = get_nonnull_domain(domain->conn, rec->dom)))
+            goto cleanup;
+
+        if (rec->params.params_len &&
+            VIR_ALLOC_N(elem->params, rec->params.params_len) < 0)
+            goto no_memory;
+        elem->nparams = rec->params.params_len;
+
+        if (remoteDeserializeTypedParameters(rec->params.params_val,
+                                             rec->params.params_len,
+                                             REMOTE_DOMAIN_STATS_PARAMS_MAX,
+                                             elem->params,
+                                             &elem->nparams) < 0)
+            goto cleanup;
+    }
+
+    *retSamples = tmpsamples;
+    tmpsamples = NULL;
+    rv = ret.retSamples.retSamples_len;
+
+cleanup:
+    virDomainStatsRecordListFree(tmpsamples);
+    xdr_free ((xdrproc_t) xdr_remote_domain_get_migration_timeline_ret,
+              (char *) &ret);
+done:
+    remoteDriverUnlock(priv);
+    return rv;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
 static int
 remoteDomainGetMemoryParameters (virDomainPtr domain,
                                  virTypedParameterPtr params, int *nparams,
@@ -4433,6 +4732,9 @@ static virDriver remote_driver = {
     .domainGetBlockJobInfo = remoteDomainGetBlockJobInfo, /* 0.9.4 */
     .domainBlockJobSetSpeed = remoteDomainBlockJobSetSpeed, /* 0.9.4 */
     .domainBlockPull = remoteDomainBlockPull, /* 0.9.4 */
+    .connectGetAllDomainStats = remoteConnectGetAllDomainStats, /* 0.9.7 */
+    .domainGetStatsSamples = remoteDomainGetStatsSamples, /* 0.9.7 */
+    .domainGetMigrationTimeline = remoteDomainGetMigrationTimeline, /* 0.9.7 */
 };
 
 static virNetworkDriver network_driver = {
@@ -134,6 +134,19 @@ const REMOTE_NODE_MEMORY_STATS_MAX = 16;
 /* Upper limit on list of block stats. */
 const REMOTE_DOMAIN_BLOCK_STATS_PARAMETERS_MAX = 16;
 
+/* Upper limit on list of domain stats records in one reply.  The
+ * daemon also stops a reply short of this once the records it holds
+ * would no longer fit in one message, and the client asks for the
+ * rest in further calls. */
+const REMOTE_DOMAIN_STATS_RECORDS_MAX = 4096;
+
+/* Upper limit on list of stats in one domain stats record. */
+const REMOTE_DOMAIN_STATS_PARAMS_MAX = 2048;
+
+/* Upper limit on list of migration timeline samples, so that they
+ * fit in one message. */
+const REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX = 512;
+
 /* Upper limit on number of NUMA cells */
 const REMOTE_NODE_MAX_CELLS = 1024;
 
@@ -591,6 +604,48 @@ struct remote_domain_memory_stats_ret {
     remote_domain_memory_stat stats<REMOTE_DOMAIN_MEMORY_STATS_MAX>;
 };
 
+struct remote_domain_stats_record {
+    remote_nonnull_domain dom;
+    remote_typed_param params<REMOTE_DOMAIN_STATS_PARAMS_MAX>;
+};
+
+/* The records are gathered by the call with start == 0, and handed
+ * out from there as many as fit in each reply.  Calls with start != 0
+ * carry the cookie of that first reply and read on from start. */
+struct remote_connect_get_all_domain_stats_args {
+    unsigned int stats;
+    unsigned int flags;
+    unsigned int start;
+    unsigned int cookie;
+};
+
+struct remote_connect_get_all_domain_stats_ret {
+    remote_domain_stats_record retStats<REMOTE_DOMAIN_STATS_RECORDS_MAX>;
+    unsigned int remaining;
+    unsigned int cookie;
+};
+
+struct remote_domain_get_stats_samples_args {
+    remote_nonnull_domain dom;
+    unsigned int stats;
+    unsigned int nsamples;
+    unsigned int flags;
+};
+
+struct remote_domain_get_stats_samples_ret {
+    remote_domain_stats_record retSamples<REMOTE_DOMAIN_STATS_RECORDS_MAX>;
+};
+
+struct remote_domain_get_migration_timeline_args {
+    remote_nonnull_domain dom;
+    unsigned int nsamples;
+    unsigned int flags;
+};
+
+struct remote_domain_get_migration_timeline_ret {
+    remote_domain_stats_record retSamples<REMOTE_DOMAIN_MIGRATION_TIMELINE_MAX>;
+};
+
 struct remote_domain_block_peek_args {
     remote_nonnull_domain dom;
     remote_nonnull_string path;
@@ -2546,7 +2601,10 @@ enum remote_procedure {
     REMOTE_PROC_DOMAIN_SNAPSHOT_GET_PARENT = 244, /* autogen autogen priority:high */
     REMOTE_PROC_DOMAIN_RESET = 245, /* autogen autogen */
     REMOTE_PROC_DOMAIN_SNAPSHOT_NUM_CHILDREN = 246, /* autogen autogen priority:high */
-    REMOTE_PROC_DOMAIN_SNAPSHOT_LIST_CHILDREN_NAMES = 247 /* autogen autogen priority:high */
+    REMOTE_PROC_DOMAIN_SNAPSHOT_LIST_CHILDREN_NAMES = 247, /* autogen autogen priority:high */
+    REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS = 248, /* skipgen skipgen */
+    REMOTE_PROC_DOMAIN_GET_STATS_SAMPLES = 249, /* skipgen skipgen */
+    REMOTE_PROC_DOMAIN_GET_MIGRATION_TIMELINE = 250 /* skipgen skipgen */
 
     /*
      * Notice how the entries are grouped in sets of 10 ?
@@ -26,6 +26,7 @@
 #include <poll.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "virnetclient.h"
 #include "virnetsocket.h"
@@ -34,6 +35,7 @@
 #include "virfile.h"
 #include "logging.h"
 #include "util.h"
+#include "hash.h"
 #include "virterror_internal.h"
 
 #define VIR_FROM_THIS VIR_FROM_RPC
@@ -85,12 +87,19 @@ struct _virNetClient {
     /* Self-pipe to wakeup threads waiting in poll() */
     int wakeupSendFD;
     int wakeupReadFD;
+    /* Whether a wakeup is already in the pipe */
+    bool wakeupPending;
 
     /* List of threads currently waiting for dispatch */
     virNetClientCallPtr waitDispatch;
+    /* Those of them waiting for a reply to a call, by serial */
+    virHashTablePtr calls;
 
     size_t nstreams;
     virNetClientStreamPtr *streams;
+    /* Queue limits given to each stream added */
+    size_t streamQueueHigh;
+    size_t streamQueueLow;
 };
 
 
@@ -110,6 +119,80 @@ static void virNetClientIncomingEvent(virNetSocketPtr sock,
                                       int events,
                                       void *opaque);
 
+
+/* Most calls waiting to be sent that one write sends at once */
+#define VIR_NET_CLIENT_TX_IOV 64
+
+/*
+ * Calls waiting for a reply are keyed on the serial in the header
+ * of the message they sent, which lives as long as the call does
+ */
+static unsigned long virNetClientCallSerialCode(const void *name)
+{
+    return *(const unsigned int *)name;
+}
+static bool virNetClientCallSerialEqual(const void *namea, const void *nameb)
+{
+    return *(const unsigned int *)namea == *(const unsigned int *)nameb;
+}
+static void *virNetClientCallSerialCopy(const void *name)
+{
+    return (void *)name;
+}
+
+/*
+ * Reading off the socket stops while any stream is full, so a
+ * server sending stream data faster than the app reads it is
+ * held back by the socket filling up rather than by the client
+ * running out of memory. The only exception is a call waiting
+ * for its reply, which is always read, see virNetClientIOEventLoop
+ */
+static bool virNetClientStreamsFull(virNetClientPtr client)
+{
+    size_t i;
+
+    for (i = 0 ; i < client->nstreams ; i++) {
+        if (virNetClientStreamIsFull(client->streams[i]))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Force the thread polling the socket to wakeup and look at
+ * what changed. A single byte in the pipe is enough however
+ * many threads want it to
+ */
+static int virNetClientWakeup(virNetClientPtr client)
+{
+    char ignore = 1;
+
+    if (client->wakeupPending)
+        return 0;
+
+    if (safewrite(client->wakeupSendFD, &ignore, sizeof(ignore)) != sizeof(ignore))
+        return -1;
+
+    client->wakeupPending = true;
+    return 0;
+}
+
+static void virNetClientResumeReadLocked(virNetClientPtr client)
+{
+    if (!client->sock ||
+        virNetClientStreamsFull(client))
+        return;
+
+    /* If a thread is polling the socket, it has to be woken up to
+     * see it should read again, otherwise the event loop does */
+    if (client->waitDispatch) {
+        if (virNetClientWakeup(client) < 0)
+            VIR_WARN("Unable to wake up polling thread");
+    } else {
+        virNetSocketUpdateIOCallback(client->sock, VIR_EVENT_HANDLE_READABLE);
+    }
+}
+
 static void virNetClientEventFree(void *opaque)
 {
     virNetClientPtr client = opaque;
@@ -141,6 +224,16 @@ static virNetClientPtr virNetClientNew(virNetSocketPtr sock,
     client->wakeupReadFD = wakeupFD[0];
     client->wakeupSendFD = wakeupFD[1];
     wakeupFD[0] = wakeupFD[1] = -1;
+    client->streamQueueHigh = VIR_NET_CLIENT_STREAM_QUEUE_HIGH;
+    client->streamQueueLow = VIR_NET_CLIENT_STREAM_QUEUE_LOW;
+
+    if (!(client->calls = virHashCreateFull(VIR_NET_CLIENT_TX_IOV,
+                                            NULL,
+                                            virNetClientCallSerialCode,
+                                            virNetClientCallSerialEqual,
+                                            virNetClientCallSerialCopy,
+                                            NULL)))
+        goto error;
 
     if (hostname &&
         !(client->hostname = strdup(hostname)))
@@ -284,6 +377,9 @@ void virNetClientFree(virNetClientPtr client)
 
     VIR_FREE(client->hostname);
 
+    virNetMessageClear(&client->msg);
+    virHashFree(client->calls);
+
     if (client->sock)
         virNetSocketRemoveIOCallback(client->sock);
     virNetSocketFree(client->sock);
@@ -479,6 +575,9 @@ int virNetClientAddStream(virNetClientPtr client,
 
     client->streams[client->nstreams-1] = st;
     virNetClientStreamRef(st);
+    virNetClientStreamSetQueueLimits(st,
+                                     client->streamQueueHigh,
+                                     client->streamQueueLow);
 
     virNetClientUnlock(client);
     return 0;
@@ -514,11 +613,61 @@ void virNetClientRemoveStream(virNetClientPtr client,
     }
     virNetClientStreamFree(st);
 
+    /* Whatever was left queued for it no longer holds others up */
+    virNetClientResumeReadLocked(client);
+
 cleanup:
     virNetClientUnlock(client);
 }
 
 
+/**
+ * virNetClientSetStreamQueueLimits:
+ * @client: the client
+ * @high: bytes of received data at which a stream is full, or 0
+ * @low: bytes of received data at which it is no longer full
+ *
+ * Set the queue limits given to streams added to @client from
+ * now on, see virNetClientStreamSetQueueLimits. A @high of zero
+ * lets stream data queue up without limit.
+ *
+ * Returns 0 on success, -1 if @low is above @high
+ */
+int virNetClientSetStreamQueueLimits(virNetClientPtr client,
+                                     size_t high,
+                                     size_t low)
+{
+    if (high && low > high) {
+        virNetError(VIR_ERR_INVALID_ARG,
+                    _("stream queue low mark %zu is above high mark %zu"),
+                    low, high);
+        return -1;
+    }
+
+    virNetClientLock(client);
+    client->streamQueueHigh = high;
+    client->streamQueueLow = low;
+    virNetClientUnlock(client);
+    return 0;
+}
+
+
+/**
+ * virNetClientResumeRead:
+ * @client: the client
+ *
+ * Called when the app has read enough off a full stream that it
+ * is no longer full, to have the client read off the socket
+ * again if no other stream is still full
+ */
+void virNetClientResumeRead(virNetClientPtr client)
+{
+    virNetClientLock(client);
+    virNetClientResumeReadLocked(client);
+    virNetClientUnlock(client);
+}
+
+
 const char *virNetClientLocalAddrString(virNetClientPtr client)
 {
     return virNetSocketLocalAddrString(client->sock);
@@ -546,24 +695,23 @@ virNetClientCallDispatchReply(virNetClientPtr client)
 
     /* Ok, definitely got an RPC reply now find
        out who's been waiting for it */
-    thecall = client->waitDispatch;
-    while (thecall &&
-           !(thecall->msg->header.prog == client->msg.header.prog &&
-             thecall->msg->header.vers == client->msg.header.vers &&
-             thecall->msg->header.serial == client->msg.header.serial))
-        thecall = thecall->next;
+    thecall = virHashLookup(client->calls, &client->msg.header.serial);
 
-    if (!thecall) {
+    if (!thecall ||
+        thecall->mode != VIR_NET_CLIENT_MODE_WAIT_RX ||
+        thecall->msg->header.prog != client->msg.header.prog ||
+        thecall->msg->header.vers != client->msg.header.vers) {
         virNetError(VIR_ERR_RPC,
                     _("no call waiting for reply with prog %d vers %d serial %d"),
                     client->msg.header.prog, client->msg.header.vers, client->msg.header.serial);
         return -1;
     }
 
-    memcpy(thecall->msg->buffer, client->msg.buffer, sizeof(client->msg.buffer));
-    memcpy(&thecall->msg->header, &client->msg.header, sizeof(client->msg.header));
-    thecall->msg->bufferLength = client->msg.bufferLength;
-    thecall->msg->bufferOffset = client->msg.bufferOffset;
+    /* Hand the reply over to the call without copying it: the
+     * call takes the buffer it was read into, and the next message
+     * is read into the buffer the call was sent from */
+    virNetMessageSwapBuffers(thecall->msg, &client->msg);
+    thecall->msg->header = client->msg.header;
 
     thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
 
@@ -713,56 +861,63 @@ virNetClientCallDispatch(virNetClientPtr client)
 }
 
 
+/*
+ * Send as much of the calls waiting to be sent as fits in
+ * one write, in the order they were queued
+ */
 static ssize_t
-virNetClientIOWriteMessage(virNetClientPtr client,
-                           virNetClientCallPtr thecall)
+virNetClientIOHandleOutput(virNetClientPtr client)
 {
+    struct iovec iov[VIR_NET_CLIENT_TX_IOV];
+    virNetClientCallPtr thecall;
+    int niov = 0;
     ssize_t ret;
+    size_t done;
 
-    ret = virNetSocketWrite(client->sock,
-                            thecall->msg->buffer + thecall->msg->bufferOffset,
-                            thecall->msg->bufferLength - thecall->msg->bufferOffset);
-    if (ret <= 0)
-        return ret;
+    for (thecall = client->waitDispatch ;
+         thecall && niov < VIR_NET_CLIENT_TX_IOV ;
+         thecall = thecall->next) {
+        if (thecall->mode != VIR_NET_CLIENT_MODE_WAIT_TX)
+            continue;
 
-    thecall->msg->bufferOffset += ret;
-
-    if (thecall->msg->bufferOffset == thecall->msg->bufferLength) {
-        thecall->msg->bufferOffset = thecall->msg->bufferLength = 0;
-        if (thecall->expectReply)
-            thecall->mode = VIR_NET_CLIENT_MODE_WAIT_RX;
-        else
-            thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+        iov[niov].iov_base = thecall->msg->buffer + thecall->msg->bufferOffset;
+        iov[niov].iov_len = thecall->msg->bufferLength - thecall->msg->bufferOffset;
+        niov++;
     }
 
-    return ret;
-}
-
-
-static ssize_t
-virNetClientIOHandleOutput(virNetClientPtr client)
-{
-    virNetClientCallPtr thecall = client->waitDispatch;
-
-    while (thecall &&
-           thecall->mode != VIR_NET_CLIENT_MODE_WAIT_TX)
-        thecall = thecall->next;
-
-    if (!thecall)
+    if (!niov)
         return -1; /* Shouldn't happen, but you never know... */
 
-    while (thecall) {
-        ssize_t ret = virNetClientIOWriteMessage(client, thecall);
-        if (ret < 0)
-            return ret;
-
-        if (thecall->mode == VIR_NET_CLIENT_MODE_WAIT_TX)
-            return 0; /* Blocking write, to back to event loop */
-
-        thecall = thecall->next;
+    ret = virNetSocketWritev(client->sock, iov, niov);
+    if (ret <= 0)
+        return ret; /* -1 error, 0 blocking write, to back to event loop */
+
+    /* Spread what was written over the calls it came from */
+    done = ret;
+    for (thecall = client->waitDispatch ;
+         thecall && done ;
+         thecall = thecall->next) {
+        size_t len;
+
+        if (thecall->mode != VIR_NET_CLIENT_MODE_WAIT_TX)
+            continue;
+
+        len = thecall->msg->bufferLength - thecall->msg->bufferOffset;
+        if (len > done)
+            len = done;
+        thecall->msg->bufferOffset += len;
+        done -= len;
+
+        if (thecall->msg->bufferOffset == thecall->msg->bufferLength) {
+            thecall->msg->bufferOffset = thecall->msg->bufferLength = 0;
+            if (thecall->expectReply)
+                thecall->mode = VIR_NET_CLIENT_MODE_WAIT_RX;
+            else
+                thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+        }
     }
 
-    return 0; /* No more calls to send, all done */
+    return ret;
 }
 
 static ssize_t
@@ -775,6 +930,9 @@ virNetClientIOReadMessage(virNetClientPtr client)
     if (client->msg.bufferLength == 0)
         client->msg.bufferLength = 4;
 
+    if (virNetMessageGrowBuffer(&client->msg, client->msg.bufferLength) < 0)
+        return -1;
+
     wantData = client->msg.bufferLength - client->msg.bufferOffset;
 
     ret = virNetSocketRead(client->sock,
@@ -819,26 +977,31 @@ virNetClientIOHandleInput(virNetClientPtr client)
             } else {
                 ret = virNetClientCallDispatch(client);
                 client->msg.bufferOffset = client->msg.bufferLength = 0;
+                if (ret < 0)
+                    return -1;
                 /*
                  * We've completed one call, but we don't want to
                  * spin around the loop forever if there are many
-                 * incoming async events, or replies for other
-                 * thread's RPC calls. We want to get out & let
+                 * incoming async events. We want to get out & let
                  * any other thread take over as soon as we've
-                 * got our reply. When SASL is active though, we
-                 * may have read more data off the wire than we
-                 * initially wanted & cached it in memory. In this
-                 * case, poll() would not detect that there is more
-                 * ready todo.
+                 * got our reply. Until then, replies for other
+                 * thread's RPC calls are read one after the other
+                 * for as long as they keep arriving, rather than
+                 * going back to poll() for each of them. When SASL
+                 * is active, we may also have read more data off
+                 * the wire than we initially wanted & cached it in
+                 * memory. In this case, poll() would not detect
+                 * that there is more ready todo.
                  *
-                 * So if SASL is active *and* some SASL data is
-                 * already cached, then we'll process that now,
-                 * before returning.
+                 * So if the thread doing the I/O is still waiting,
+                 * or some SASL data is already cached, then we'll
+                 * process more now, before returning.
                  */
-                if (ret == 0 &&
+                if ((client->waitDispatch &&
+                     client->waitDispatch->mode != VIR_NET_CLIENT_MODE_COMPLETE) ||
                     virNetSocketHasCachedData(client->sock))
                     continue;
-                return ret;
+                return 0;
             }
         }
     }
@@ -888,9 +1051,11 @@ static int virNetClientIOEventLoop(virNetClientPtr client,
 
         /* We have to be prepared to receive stream data
          * regardless of whether any of the calls waiting
-         * for dispatch are for streams.
+         * for dispatch are for streams, unless they have
+         * as much queued as they can take.
          */
-        if (client->nstreams)
+        if (client->nstreams &&
+            !virNetClientStreamsFull(client))
             fds[0].events |= POLLIN;
 
         /* Release lock while poll'ing so other threads
@@ -934,6 +1099,7 @@ static int virNetClientIOEventLoop(virNetClientPtr client,
                                      _("read on wakeup fd failed"));
                 goto error;
             }
+            client->wakeupPending = false;
         }
 
         if (ret < 0) {
@@ -1070,7 +1236,6 @@ static int virNetClientIO(virNetClientPtr client,
     if (client->waitDispatch) {
         /* Stick ourselves on the end of the wait queue */
         virNetClientCallPtr tmp = client->waitDispatch;
-        char ignore = 1;
         while (tmp && tmp->next)
             tmp = tmp->next;
         if (tmp)
@@ -1079,7 +1244,7 @@ static int virNetClientIO(virNetClientPtr client,
             client->waitDispatch = thiscall;
 
         /* Force other thread to wakeup from poll */
-        if (safewrite(client->wakeupSendFD, &ignore, sizeof(ignore)) != sizeof(ignore)) {
+        if (virNetClientWakeup(client) < 0) {
             if (tmp)
                 tmp->next = NULL;
             else
@@ -1152,7 +1317,8 @@ static int virNetClientIO(virNetClientPtr client,
     virResetLastError();
     rv = virNetClientIOEventLoop(client, thiscall);
 
-    virNetSocketUpdateIOCallback(client->sock, VIR_EVENT_HANDLE_READABLE);
+    if (!virNetClientStreamsFull(client))
+        virNetSocketUpdateIOCallback(client->sock, VIR_EVENT_HANDLE_READABLE);
 
     if (rv == 0 &&
         virGetLastError())
@@ -1191,6 +1357,9 @@ void virNetClientIncomingEvent(virNetSocketPtr sock,
     if (virNetClientIOHandleInput(client) < 0) {
         VIR_WARN("Something went wrong during async message processing");
         virNetSocketRemoveIOCallback(sock);
+    } else if (virNetClientStreamsFull(client)) {
+        VIR_DEBUG("Stream queue full, stop reading");
+        virNetSocketUpdateIOCallback(sock, 0);
     }
 
 done:
@@ -1203,6 +1372,7 @@ int virNetClientSend(virNetClientPtr client,
                      bool expectReply)
 {
     virNetClientCallPtr call;
+    bool hashed = false;
     int ret = -1;
 
     PROBE(RPC_CLIENT_MSG_TX_QUEUE,
@@ -1239,8 +1409,24 @@ int virNetClientSend(virNetClientPtr client,
     call->msg = msg;
     call->expectReply = expectReply;
 
+    /* Stream packets share the serial of their stream, so only
+     * plain calls can be found by serial when their reply comes */
+    if (expectReply &&
+        msg->header.type == VIR_NET_CALL) {
+        if (virHashAddEntry(client->calls, &msg->header.serial, call) < 0) {
+            virNetError(VIR_ERR_INTERNAL_ERROR,
+                        _("a call with serial %u is already waiting"),
+                        msg->header.serial);
+            goto cleanup;
+        }
+        hashed = true;
+    }
+
     ret = virNetClientIO(client, call);
 
+    if (hashed)
+        virHashRemoveEntry(client->calls, &msg->header.serial);
+
 cleanup:
     ignore_value(virCondDestroy(&call->cond));
     VIR_FREE(call);
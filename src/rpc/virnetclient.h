@@ -64,6 +64,10 @@ int virNetClientAddStream(virNetClientPtr client,
 
 void virNetClientRemoveStream(virNetClientPtr client,
                               virNetClientStreamPtr st);
+int virNetClientSetStreamQueueLimits(virNetClientPtr client,
+                                     size_t high,
+                                     size_t low);
+void virNetClientResumeRead(virNetClientPtr client);
 
 int virNetClientSend(virNetClientPtr client,
                      virNetMessagePtr msg,
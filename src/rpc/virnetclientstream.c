@@ -45,16 +45,17 @@ struct _virNetClientStream {
 
     virError err;
 
-    /* XXX this buffer is unbounded if the client
-     * app has domain events registered, since packets
-     * may be read off wire, while app isn't ready to
-     * recv them. Figure out how to address this some
-     * time by stopping consuming any incoming data
-     * off the socket....
+    /* Packets received but not yet read by the app, which
+     * keep the buffers they were read into. Once rxLength
+     * bytes of data reach rxHigh the stream is full, and the
+     * client stops reading off the socket until the app has
+     * brought it down to rxLow
      */
-    char *incoming;
-    size_t incomingOffset;
-    size_t incomingLength;
+    virNetMessageQueue rx;
+    size_t rxLength;
+    size_t rxHigh;
+    size_t rxLow;
+    bool rxFull;
     bool incomingEOF;
 
     virNetClientStreamEventCallback cb;
@@ -72,9 +73,9 @@ virNetClientStreamEventTimerUpdate(virNetClientStreamPtr st)
     if (!st->cb)
         return;
 
-    VIR_DEBUG("Check timer offset=%zu %d", st->incomingOffset, st->cbEvents);
+    VIR_DEBUG("Check timer length=%zu %d", st->rxLength, st->cbEvents);
 
-    if (((st->incomingOffset || st->incomingEOF) &&
+    if (((st->rx.head || st->incomingEOF) &&
          (st->cbEvents & VIR_STREAM_EVENT_READABLE)) ||
         (st->cbEvents & VIR_STREAM_EVENT_WRITABLE)) {
         VIR_DEBUG("Enabling event timer");
@@ -97,13 +98,13 @@ virNetClientStreamEventTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
 
     if (st->cb &&
         (st->cbEvents & VIR_STREAM_EVENT_READABLE) &&
-        (st->incomingOffset || st->incomingEOF))
+        (st->rx.head || st->incomingEOF))
         events |= VIR_STREAM_EVENT_READABLE;
     if (st->cb &&
         (st->cbEvents & VIR_STREAM_EVENT_WRITABLE))
         events |= VIR_STREAM_EVENT_WRITABLE;
 
-    VIR_DEBUG("Got Timer dispatch %d %d offset=%zu", events, st->cbEvents, st->incomingOffset);
+    VIR_DEBUG("Got Timer dispatch %d %d length=%zu", events, st->cbEvents, st->rxLength);
     if (events) {
         virNetClientStreamEventCallback cb = st->cb;
         void *cbOpaque = st->cbOpaque;
@@ -145,6 +146,8 @@ virNetClientStreamPtr virNetClientStreamNew(virNetClientProgramPtr prog,
     st->prog = prog;
     st->proc = proc;
     st->serial = serial;
+    st->rxHigh = VIR_NET_CLIENT_STREAM_QUEUE_HIGH;
+    st->rxLow = VIR_NET_CLIENT_STREAM_QUEUE_LOW;
 
     if (virMutexInit(&st->lock) < 0) {
         virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
@@ -178,7 +181,8 @@ void virNetClientStreamFree(virNetClientStreamPtr st)
     virMutexUnlock(&st->lock);
 
     virResetError(&st->err);
-    VIR_FREE(st->incoming);
+    while (st->rx.head)
+        virNetMessageFree(virNetMessageQueueServe(&st->rx));
     virMutexDestroy(&st->lock);
     virNetClientProgramFree(st->prog);
     VIR_FREE(st);
@@ -198,6 +202,45 @@ bool virNetClientStreamMatches(virNetClientStreamPtr st,
 }
 
 
+/**
+ * virNetClientStreamSetQueueLimits:
+ * @st: the stream
+ * @high: bytes of received data at which the stream is full, or 0
+ * @low: bytes of received data at which it is no longer full
+ *
+ * Set how much data received for @st may be waiting for the app
+ * to read it before the client stops reading off the socket. A
+ * @high of zero lets the data queue up without limit.
+ */
+void virNetClientStreamSetQueueLimits(virNetClientStreamPtr st,
+                                      size_t high,
+                                      size_t low)
+{
+    virMutexLock(&st->lock);
+    st->rxHigh = high;
+    st->rxLow = low;
+    st->rxFull = high && st->rxLength >= high;
+    virMutexUnlock(&st->lock);
+}
+
+
+/**
+ * virNetClientStreamIsFull:
+ * @st: the stream
+ *
+ * Returns true if no more data should be read for @st until the
+ * app has read some of what is already queued
+ */
+bool virNetClientStreamIsFull(virNetClientStreamPtr st)
+{
+    bool ret;
+    virMutexLock(&st->lock);
+    ret = st->rxFull;
+    virMutexUnlock(&st->lock);
+    return ret;
+}
+
+
 bool virNetClientStreamRaiseError(virNetClientStreamPtr st)
 {
     virMutexLock(&st->lock);
@@ -289,28 +332,26 @@ int virNetClientStreamQueuePacket(virNetClientStreamPtr st,
     virMutexLock(&st->lock);
     need = msg->bufferLength - msg->bufferOffset;
     if (need) {
-        size_t avail = st->incomingLength - st->incomingOffset;
-        if (need > avail) {
-            size_t extra = need - avail;
-            if (VIR_REALLOC_N(st->incoming,
-                              st->incomingLength + extra) < 0) {
-                VIR_DEBUG("Out of memory handling stream data");
-                goto cleanup;
-            }
-            st->incomingLength += extra;
-        }
+        virNetMessagePtr tmp;
+
+        if (!(tmp = virNetMessageNew(false)))
+            goto cleanup;
+
+        /* Keep the buffer the packet was read into, leaving @msg
+         * an empty one to read the next packet into */
+        virNetMessageSwapBuffers(tmp, msg);
+        tmp->header = msg->header;
+        virNetMessageQueuePush(&st->rx, tmp);
 
-        memcpy(st->incoming + st->incomingOffset,
-               msg->buffer + msg->bufferOffset,
-               msg->bufferLength - msg->bufferOffset);
-        st->incomingOffset += (msg->bufferLength - msg->bufferOffset);
+        st->rxLength += need;
+        if (st->rxHigh && st->rxLength >= st->rxHigh)
+            st->rxFull = true;
     } else {
         st->incomingEOF = true;
     }
 
-    VIR_DEBUG("Stream incoming data offset %zu length %zu EOF %d",
-              st->incomingOffset, st->incomingLength,
-              st->incomingEOF);
+    VIR_DEBUG("Stream incoming data length %zu full %d EOF %d",
+              st->rxLength, st->rxFull, st->incomingEOF);
     virNetClientStreamEventTimerUpdate(st);
 
     ret = 0;
@@ -380,10 +421,12 @@ int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
                                  bool nonblock)
 {
     int rv = -1;
+    size_t got = 0;
+    bool resume = false;
     VIR_DEBUG("st=%p client=%p data=%p nbytes=%zu nonblock=%d",
               st, client, data, nbytes, nonblock);
     virMutexLock(&st->lock);
-    if (!st->incomingOffset && !st->incomingEOF) {
+    if (!st->rx.head && !st->incomingEOF) {
         virNetMessagePtr msg;
         int ret;
 
@@ -415,28 +458,35 @@ int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
             goto cleanup;
     }
 
-    VIR_DEBUG("After IO %zu", st->incomingOffset);
-    if (st->incomingOffset) {
-        int want = st->incomingOffset;
-        if (want > nbytes)
-            want = nbytes;
-        memcpy(data, st->incoming, want);
-        if (want < st->incomingOffset) {
-            memmove(st->incoming, st->incoming + want, st->incomingOffset - want);
-            st->incomingOffset -= want;
-        } else {
-            VIR_FREE(st->incoming);
-            st->incomingOffset = st->incomingLength = 0;
-        }
-        rv = want;
-    } else {
-        rv = 0;
+    VIR_DEBUG("After IO %zu", st->rxLength);
+    while (st->rx.head && got < nbytes) {
+        virNetMessagePtr msg = st->rx.head;
+        size_t want = msg->bufferLength - msg->bufferOffset;
+        if (want > nbytes - got)
+            want = nbytes - got;
+
+        memcpy(data + got, msg->buffer + msg->bufferOffset, want);
+        msg->bufferOffset += want;
+        got += want;
+        st->rxLength -= want;
+
+        if (msg->bufferOffset == msg->bufferLength)
+            virNetMessageFree(virNetMessageQueueServe(&st->rx));
+    }
+    rv = got;
+
+    if (st->rxFull && st->rxLength <= st->rxLow) {
+        VIR_DEBUG("Stream drained to %zu, resuming", st->rxLength);
+        st->rxFull = false;
+        resume = true;
     }
 
     virNetClientStreamEventTimerUpdate(st);
 
 cleanup:
     virMutexUnlock(&st->lock);
+    if (resume)
+        virNetClientResumeRead(client);
     return rv;
 }
 
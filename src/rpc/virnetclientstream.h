@@ -25,6 +25,12 @@
 
 # include "virnetclientprogram.h"
 
+/* How much received stream data may be waiting for the app
+ * before the client stops reading off the socket, and how much
+ * of it has to be read before the client starts again */
+# define VIR_NET_CLIENT_STREAM_QUEUE_HIGH (16 * VIR_NET_MESSAGE_PAYLOAD_MAX)
+# define VIR_NET_CLIENT_STREAM_QUEUE_LOW (4 * VIR_NET_MESSAGE_PAYLOAD_MAX)
+
 typedef struct _virNetClientStream virNetClientStream;
 typedef virNetClientStream *virNetClientStreamPtr;
 
@@ -47,6 +53,11 @@ int virNetClientStreamSetError(virNetClientStreamPtr st,
 bool virNetClientStreamMatches(virNetClientStreamPtr st,
                                virNetMessagePtr msg);
 
+void virNetClientStreamSetQueueLimits(virNetClientStreamPtr st,
+                                      size_t high,
+                                      size_t low);
+bool virNetClientStreamIsFull(virNetClientStreamPtr st);
+
 int virNetClientStreamQueuePacket(virNetClientStreamPtr st,
                                   virNetMessagePtr msg);
 
@@ -26,12 +26,240 @@
 #include "memory.h"
 #include "virterror_internal.h"
 #include "logging.h"
+#include "threads.h"
 
 #define VIR_FROM_THIS VIR_FROM_RPC
 #define virNetError(code, ...)                                    \
     virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,           \
                          __FUNCTION__, __LINE__, __VA_ARGS__)
 
+/*
+ * Message buffers come in two pooled sizes. Small buffers hold
+ * the common case of calls, replies and events, while large
+ * buffers hold anything up to the protocol limit, which is
+ * typically stream data. Buffers of any other size are only
+ * needed for the occasional mid-sized reply and are allocated
+ * exactly and freed directly.
+ */
+#define VIR_NET_MESSAGE_BUFFER_SMALL VIR_NET_MESSAGE_INITIAL
+#define VIR_NET_MESSAGE_BUFFER_LARGE (VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX)
+
+#define VIR_NET_MESSAGE_POOL_SMALL_MAX 256
+#define VIR_NET_MESSAGE_POOL_LARGE_MAX 16
+
+static virOnceControl virNetMessagePoolOnce = VIR_ONCE_CONTROL_INITIALIZER;
+static virMutex virNetMessagePoolMutex;
+static bool virNetMessagePoolReady = false;
+
+static char *virNetMessagePoolSmall[VIR_NET_MESSAGE_POOL_SMALL_MAX];
+static char *virNetMessagePoolLarge[VIR_NET_MESSAGE_POOL_LARGE_MAX];
+static virNetMessagePoolStats virNetMessagePoolCounters;
+
+static void virNetMessagePoolInitialize(void)
+{
+    if (virMutexInit(&virNetMessagePoolMutex) < 0)
+        return;
+    virNetMessagePoolReady = true;
+}
+
+static bool virNetMessagePoolLock(void)
+{
+    if (virOnce(&virNetMessagePoolOnce, virNetMessagePoolInitialize) < 0 ||
+        !virNetMessagePoolReady)
+        return false;
+
+    virMutexLock(&virNetMessagePoolMutex);
+    return true;
+}
+
+static void virNetMessagePoolUnlock(void)
+{
+    virMutexUnlock(&virNetMessagePoolMutex);
+}
+
+
+/*
+ * Round a requested buffer length up to the size that will
+ * actually be allocated
+ */
+static size_t virNetMessageBufferSize(size_t len)
+{
+    if (len <= VIR_NET_MESSAGE_BUFFER_SMALL)
+        return VIR_NET_MESSAGE_BUFFER_SMALL;
+    if (len > VIR_NET_MESSAGE_BUFFER_LARGE / 2)
+        return VIR_NET_MESSAGE_BUFFER_LARGE;
+    return len;
+}
+
+
+static char *virNetMessageBufferAlloc(size_t size)
+{
+    char *buf = NULL;
+
+    if (virNetMessagePoolLock()) {
+        if (size == VIR_NET_MESSAGE_BUFFER_SMALL) {
+            if (virNetMessagePoolCounters.smallFree) {
+                buf = virNetMessagePoolSmall[--virNetMessagePoolCounters.smallFree];
+                virNetMessagePoolCounters.smallHits++;
+            } else {
+                virNetMessagePoolCounters.smallMisses++;
+            }
+        } else if (size == VIR_NET_MESSAGE_BUFFER_LARGE) {
+            if (virNetMessagePoolCounters.largeFree) {
+                buf = virNetMessagePoolLarge[--virNetMessagePoolCounters.largeFree];
+                virNetMessagePoolCounters.largeHits++;
+            } else {
+                virNetMessagePoolCounters.largeMisses++;
+            }
+        }
+        virNetMessagePoolUnlock();
+    }
+
+    if (!buf &&
+        VIR_ALLOC_N(buf, size) < 0)
+        return NULL;
+
+    return buf;
+}
+
+
+static void virNetMessageBufferRelease(char *buf, size_t size)
+{
+    if (!buf)
+        return;
+
+    if (virNetMessagePoolLock()) {
+        if (size == VIR_NET_MESSAGE_BUFFER_SMALL &&
+            virNetMessagePoolCounters.smallFree < VIR_NET_MESSAGE_POOL_SMALL_MAX) {
+            virNetMessagePoolSmall[virNetMessagePoolCounters.smallFree++] = buf;
+            buf = NULL;
+        } else if (size == VIR_NET_MESSAGE_BUFFER_LARGE &&
+                   virNetMessagePoolCounters.largeFree < VIR_NET_MESSAGE_POOL_LARGE_MAX) {
+            virNetMessagePoolLarge[virNetMessagePoolCounters.largeFree++] = buf;
+            buf = NULL;
+        }
+        virNetMessagePoolUnlock();
+    }
+
+    VIR_FREE(buf);
+}
+
+
+/**
+ * virNetMessagePoolGetStats:
+ * @stats: filled with the current buffer pool counters
+ *
+ * Report how often message buffers were satisfied from the
+ * free lists rather than the heap, and how many buffers are
+ * currently held in the free lists.
+ */
+void virNetMessagePoolGetStats(virNetMessagePoolStatsPtr stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    if (!virNetMessagePoolLock())
+        return;
+    *stats = virNetMessagePoolCounters;
+    virNetMessagePoolUnlock();
+}
+
+
+/**
+ * virNetMessagePoolDrain:
+ *
+ * Release all buffers held in the free lists back to the heap
+ */
+void virNetMessagePoolDrain(void)
+{
+    size_t i;
+
+    if (!virNetMessagePoolLock())
+        return;
+
+    for (i = 0 ; i < virNetMessagePoolCounters.smallFree ; i++)
+        VIR_FREE(virNetMessagePoolSmall[i]);
+    for (i = 0 ; i < virNetMessagePoolCounters.largeFree ; i++)
+        VIR_FREE(virNetMessagePoolLarge[i]);
+    virNetMessagePoolCounters.smallFree = 0;
+    virNetMessagePoolCounters.largeFree = 0;
+
+    virNetMessagePoolUnlock();
+}
+
+
+/**
+ * virNetMessageGrowBuffer:
+ * @msg: the message
+ * @len: minimum number of bytes required
+ *
+ * Ensure that @msg has a buffer of at least @len bytes,
+ * preserving any data already present in it. This is a
+ * no-op if the buffer is already large enough.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int virNetMessageGrowBuffer(virNetMessagePtr msg, size_t len)
+{
+    char *newbuffer;
+    size_t newsize;
+
+    if (len <= msg->bufferSize)
+        return 0;
+
+    if (len > VIR_NET_MESSAGE_BUFFER_LARGE) {
+        virNetError(VIR_ERR_RPC,
+                    _("message buffer of %zu bytes exceeds limit of %d bytes"),
+                    len, VIR_NET_MESSAGE_BUFFER_LARGE);
+        return -1;
+    }
+
+    newsize = virNetMessageBufferSize(len);
+    if (!(newbuffer = virNetMessageBufferAlloc(newsize))) {
+        virReportOOMError();
+        return -1;
+    }
+
+    if (msg->buffer)
+        memcpy(newbuffer, msg->buffer, msg->bufferSize);
+    virNetMessageBufferRelease(msg->buffer, msg->bufferSize);
+
+    VIR_DEBUG("msg=%p grow buffer %zu -> %zu", msg, msg->bufferSize, newsize);
+
+    msg->buffer = newbuffer;
+    msg->bufferSize = newsize;
+
+    return 0;
+}
+
+
+/**
+ * virNetMessageSwapBuffers:
+ * @a: a message
+ * @b: another message
+ *
+ * Exchange the buffers of @a and @b, along with how much of
+ * each is filled and processed, so the data of one message is
+ * handed over to the other without being copied.
+ */
+void virNetMessageSwapBuffers(virNetMessagePtr a, virNetMessagePtr b)
+{
+    char *buffer = a->buffer;
+    size_t bufferSize = a->bufferSize;
+    size_t bufferLength = a->bufferLength;
+    size_t bufferOffset = a->bufferOffset;
+
+    a->buffer = b->buffer;
+    a->bufferSize = b->bufferSize;
+    a->bufferLength = b->bufferLength;
+    a->bufferOffset = b->bufferOffset;
+
+    b->buffer = buffer;
+    b->bufferSize = bufferSize;
+    b->bufferLength = bufferLength;
+    b->bufferOffset = bufferOffset;
+}
+
+
 virNetMessagePtr virNetMessageNew(bool tracked)
 {
     virNetMessagePtr msg;
@@ -51,6 +279,7 @@ virNetMessagePtr virNetMessageNew(bool tracked)
 void virNetMessageClear(virNetMessagePtr msg)
 {
     bool tracked = msg->tracked;
+    virNetMessageBufferRelease(msg->buffer, msg->bufferSize);
     memset(msg, 0, sizeof(*msg));
     msg->tracked = tracked;
 }
@@ -66,29 +295,30 @@ void virNetMessageFree(virNetMessagePtr msg)
 
     VIR_DEBUG("msg=%p", msg);
 
+    virNetMessageBufferRelease(msg->buffer, msg->bufferSize);
     VIR_FREE(msg);
 }
 
-void virNetMessageQueuePush(virNetMessagePtr *queue, virNetMessagePtr msg)
+void virNetMessageQueuePush(virNetMessageQueuePtr queue, virNetMessagePtr msg)
 {
-    virNetMessagePtr tmp = *queue;
+    msg->next = NULL;
 
-    if (tmp) {
-        while (tmp->next)
-            tmp = tmp->next;
-        tmp->next = msg;
-    } else {
-        *queue = msg;
-    }
+    if (queue->tail)
+        queue->tail->next = msg;
+    else
+        queue->head = msg;
+    queue->tail = msg;
 }
 
 
-virNetMessagePtr virNetMessageQueueServe(virNetMessagePtr *queue)
+virNetMessagePtr virNetMessageQueueServe(virNetMessageQueuePtr queue)
 {
-    virNetMessagePtr tmp = *queue;
+    virNetMessagePtr tmp = queue->head;
 
     if (tmp) {
-        *queue = tmp->next;
+        queue->head = tmp->next;
+        if (!queue->head)
+            queue->tail = NULL;
         tmp->next = NULL;
     }
 
@@ -129,6 +359,8 @@ int virNetMessageDecodeLength(virNetMessagePtr msg)
 
     /* Extend our declared buffer length and carry
        on reading the header + payload */
+    if (virNetMessageGrowBuffer(msg, msg->bufferLength + len) < 0)
+        goto cleanup;
     msg->bufferLength += len;
 
     VIR_DEBUG("Got length, now need %zu total (%u more)",
@@ -198,7 +430,10 @@ int virNetMessageEncodeHeader(virNetMessagePtr msg)
     int ret = -1;
     unsigned int len = 0;
 
-    msg->bufferLength = sizeof(msg->buffer);
+    if (virNetMessageGrowBuffer(msg, VIR_NET_MESSAGE_INITIAL) < 0)
+        return -1;
+
+    msg->bufferLength = msg->bufferSize;
     msg->bufferOffset = 0;
 
     /* Format the header. */
@@ -252,9 +487,26 @@ int virNetMessageEncodePayload(virNetMessagePtr msg,
     xdrmem_create(&xdr, msg->buffer + msg->bufferOffset,
                   msg->bufferLength - msg->bufferOffset, XDR_ENCODE);
 
-    if (!(*filter)(&xdr, data)) {
-        virNetError(VIR_ERR_RPC, "%s", _("Unable to encode message payload"));
-        goto error;
+    /* Try to encode the payload. If the buffer is too small
+     * double it and try again, until we hit the protocol limit */
+    while (!(*filter)(&xdr, data)) {
+        size_t newlen = msg->bufferSize * 2;
+
+        if (msg->bufferSize >= VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX) {
+            virNetError(VIR_ERR_RPC, "%s", _("Unable to encode message payload"));
+            goto error;
+        }
+        if (newlen > VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX)
+            newlen = VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX;
+
+        xdr_destroy(&xdr);
+
+        if (virNetMessageGrowBuffer(msg, newlen) < 0)
+            return -1;
+        msg->bufferLength = msg->bufferSize;
+
+        xdrmem_create(&xdr, msg->buffer + msg->bufferOffset,
+                      msg->bufferLength - msg->bufferOffset, XDR_ENCODE);
     }
 
     /* Get the length stored in buffer. */
@@ -317,10 +569,16 @@ int virNetMessageEncodePayloadRaw(virNetMessagePtr msg,
     unsigned int msglen;
 
     if ((msg->bufferLength - msg->bufferOffset) < len) {
-        virNetError(VIR_ERR_RPC,
-                    _("Stream data too long to send (%zu bytes needed, %zu bytes available)"),
-                    len, (msg->bufferLength - msg->bufferOffset));
-        return -1;
+        if ((VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX - msg->bufferOffset) < len) {
+            virNetError(VIR_ERR_RPC,
+                        _("Stream data too long to send (%zu bytes needed, %zu bytes available)"),
+                        len, (VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX - msg->bufferOffset));
+            return -1;
+        }
+
+        if (virNetMessageGrowBuffer(msg, msg->bufferOffset + len) < 0)
+            return -1;
+        msg->bufferLength = msg->bufferSize;
     }
 
     memcpy(msg->buffer + msg->bufferOffset, data, len);
@@ -31,13 +31,29 @@ typedef virNetMessage *virNetMessagePtr;
 
 typedef void (*virNetMessageFreeCallback)(virNetMessagePtr msg, void *opaque);
 
-/* Never allocate this (huge) buffer on the stack. Always
- * use virNetMessageNew() to allocate on the heap
+/* Small buffers are enough for the vast majority of RPC
+ * calls, replies and events. Anything bigger is grown on
+ * demand, up to VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX
  */
+# define VIR_NET_MESSAGE_INITIAL 4096
+
+typedef struct _virNetMessagePoolStats virNetMessagePoolStats;
+typedef virNetMessagePoolStats *virNetMessagePoolStatsPtr;
+
+struct _virNetMessagePoolStats {
+    unsigned long long smallHits;
+    unsigned long long smallMisses;
+    unsigned long long largeHits;
+    unsigned long long largeMisses;
+    size_t smallFree;
+    size_t largeFree;
+};
+
 struct _virNetMessage {
     bool tracked;
 
-    char buffer[VIR_NET_MESSAGE_MAX + VIR_NET_MESSAGE_LEN_MAX];
+    char *buffer; /* Allocated lazily, see virNetMessageGrowBuffer */
+    size_t bufferSize;
     size_t bufferLength;
     size_t bufferOffset;
 
@@ -49,6 +65,16 @@ struct _virNetMessage {
     virNetMessagePtr next;
 };
 
+/* A FIFO of messages linked through their 'next' field, which
+ * keeps track of its tail so pushing does not walk the list */
+typedef struct _virNetMessageQueue virNetMessageQueue;
+typedef virNetMessageQueue *virNetMessageQueuePtr;
+
+struct _virNetMessageQueue {
+    virNetMessagePtr head;
+    virNetMessagePtr tail;
+};
+
 
 virNetMessagePtr virNetMessageNew(bool tracked);
 
@@ -56,9 +82,18 @@ void virNetMessageClear(virNetMessagePtr);
 
 void virNetMessageFree(virNetMessagePtr msg);
 
-virNetMessagePtr virNetMessageQueueServe(virNetMessagePtr *queue)
+int virNetMessageGrowBuffer(virNetMessagePtr msg, size_t len)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
+void virNetMessageSwapBuffers(virNetMessagePtr a, virNetMessagePtr b)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
+void virNetMessagePoolGetStats(virNetMessagePoolStatsPtr stats)
+    ATTRIBUTE_NONNULL(1);
+void virNetMessagePoolDrain(void);
+
+virNetMessagePtr virNetMessageQueueServe(virNetMessageQueuePtr queue)
     ATTRIBUTE_NONNULL(1);
-void virNetMessageQueuePush(virNetMessagePtr *queue,
+void virNetMessageQueuePush(virNetMessageQueuePtr queue,
                             virNetMessagePtr msg)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
 
@@ -36,6 +36,7 @@
 #include "util.h"
 #include "virfile.h"
 #include "event.h"
+#include "event_poll.h"
 #if HAVE_AVAHI
 # include "virnetservermdns.h"
 #endif
@@ -48,6 +49,9 @@
     virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,           \
                          __FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* How often the message buffer pool counters are logged, in ms */
+#define VIR_NET_SERVER_POOL_STATS_INTERVAL (5 * 60 * 1000)
+
 typedef struct _virNetServerSignal virNetServerSignal;
 typedef virNetServerSignal *virNetServerSignalPtr;
 
@@ -67,6 +71,19 @@ struct _virNetServerJob {
     virNetServerProgramPtr prog;
 };
 
+typedef struct _virNetServerIOLoop virNetServerIOLoop;
+typedef virNetServerIOLoop *virNetServerIOLoopPtr;
+
+/* An event loop with a thread of its own, servicing the
+ * sockets of some of the clients */
+struct _virNetServerIOLoop {
+    virEventPollLoopPtr loop;
+    virThread thread;
+    /* Fired to have the thread finish */
+    int quitTimer;
+    bool quit;
+};
+
 struct _virNetServer {
     int refs;
 
@@ -95,6 +112,10 @@ struct _virNetServer {
     size_t nservices;
     virNetServerServicePtr *services;
 
+    /* Guards the programs and their refs on its own, since
+     * messages are dispatched with the client lock held, while
+     * the server lock is held to go over the clients */
+    virMutex programsLock;
     size_t nprograms;
     virNetServerProgramPtr *programs;
 
@@ -102,6 +123,12 @@ struct _virNetServer {
     size_t nclients_max;
     virNetServerClientPtr *clients;
 
+    /* Accepted clients are handed to these in turn */
+    size_t nioloops;
+    virNetServerIOLoopPtr ioloops;
+    size_t nextIOLoop;
+    int reapTimer;
+
     unsigned int quit :1;
 
     virNetTLSContextPtr tls;
@@ -162,9 +189,9 @@ static void virNetServerHandleJob(void *jobOpaque, void *opaque)
                                     job->msg) < 0)
         goto error;
 
-    virNetServerLock(srv);
+    virMutexLock(&srv->programsLock);
     virNetServerProgramFree(job->prog);
-    virNetServerUnlock(srv);
+    virMutexUnlock(&srv->programsLock);
 
 cleanup:
     virNetServerClientFree(job->client);
@@ -172,7 +199,9 @@ cleanup:
     return;
 
 error:
+    virMutexLock(&srv->programsLock);
     virNetServerProgramFree(job->prog);
+    virMutexUnlock(&srv->programsLock);
     virNetMessageFree(job->msg);
     virNetServerClientClose(job->client);
     virNetServerClientFree(job->client);
@@ -201,7 +230,7 @@ static int virNetServerDispatchNewMessage(virNetServerClientPtr client,
     job->client = client;
     job->msg = msg;
 
-    virNetServerLock(srv);
+    virMutexLock(&srv->programsLock);
     for (i = 0 ; i < srv->nprograms ; i++) {
         if (virNetServerProgramMatches(srv->programs[i], job->msg)) {
             prog = srv->programs[i];
@@ -214,19 +243,39 @@ static int virNetServerDispatchNewMessage(virNetServerClientPtr client,
         job->prog = prog;
         priority = virNetServerProgramGetPriority(prog, msg->header.proc);
     }
+    virMutexUnlock(&srv->programsLock);
 
+    /* The pool does its own locking, no need to hold up other
+     * users of the server while the job is queued */
     ret = virThreadPoolSendJob(srv->workers, priority, job);
 
     if (ret < 0) {
         VIR_FREE(job);
+        virMutexLock(&srv->programsLock);
         virNetServerProgramFree(prog);
+        virMutexUnlock(&srv->programsLock);
     }
-    virNetServerUnlock(srv);
 
     return ret;
 }
 
 
+/*
+ * Called from whichever thread finds @client wanting closing,
+ * so that virNetServerRun wakes up to reap it
+ */
+static void
+virNetServerNotifyClientWantClose(virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                  void *opaque)
+{
+    virNetServerPtr srv = opaque;
+
+    /* Only changes while no I/O loop is running */
+    if (srv->reapTimer > 0)
+        virEventUpdateTimeout(srv->reapTimer, 0);
+}
+
+
 static int virNetServerDispatchNewClient(virNetServerServicePtr svc ATTRIBUTE_UNUSED,
                                          virNetServerClientPtr client,
                                          void *opaque)
@@ -242,27 +291,41 @@ static int virNetServerDispatchNewClient(virNetServerServicePtr svc ATTRIBUTE_UN
         goto error;
     }
 
-    if (virNetServerClientInit(client) < 0)
-        goto error;
-
-    if (srv->clientInitHook &&
-        srv->clientInitHook(srv, client) < 0)
-        goto error;
-
     if (VIR_EXPAND_N(srv->clients, srv->nclients, 1) < 0) {
         virReportOOMError();
         goto error;
     }
-    srv->clients[srv->nclients-1] = client;
-    virNetServerClientRef(client);
+
+    /* With I/O loops, the client may be read from as soon as it
+     * is initialized, so everything it needs is set up first */
+    if (srv->clientInitHook &&
+        srv->clientInitHook(srv, client) < 0)
+        goto error_shrink;
 
     virNetServerClientSetDispatcher(client,
                                     virNetServerDispatchNewMessage,
                                     srv);
 
+    if (srv->nioloops) {
+        virNetServerClientSetEventLoop(client,
+                                       srv->ioloops[srv->nextIOLoop].loop);
+        virNetServerClientSetWantCloseHook(client,
+                                           virNetServerNotifyClientWantClose,
+                                           srv);
+        srv->nextIOLoop = (srv->nextIOLoop + 1) % srv->nioloops;
+    }
+
+    if (virNetServerClientInit(client) < 0)
+        goto error_shrink;
+
+    srv->clients[srv->nclients-1] = client;
+    virNetServerClientRef(client);
+
     virNetServerUnlock(srv);
     return 0;
 
+error_shrink:
+    VIR_SHRINK_N(srv->clients, srv->nclients, 1);
 error:
     virNetServerUnlock(srv);
     return -1;
@@ -321,6 +384,7 @@ virNetServerPtr virNetServerNew(size_t min_workers,
 
     srv->nclients_max = max_clients;
     srv->sigwrite = srv->sigread = -1;
+    srv->reapTimer = -1;
     srv->clientInitHook = clientInitHook;
     srv->privileged = geteuid() == 0 ? true : false;
 
@@ -358,7 +422,8 @@ virNetServerPtr virNetServerNew(size_t min_workers,
     }
 #endif
 
-    if (virMutexInit(&srv->lock) < 0) {
+    if (virMutexInit(&srv->lock) < 0 ||
+        virMutexInit(&srv->programsLock) < 0) {
         virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
                     _("cannot initialize mutex"));
         goto error;
@@ -618,7 +683,7 @@ error:
 int virNetServerAddProgram(virNetServerPtr srv,
                            virNetServerProgramPtr prog)
 {
-    virNetServerLock(srv);
+    virMutexLock(&srv->programsLock);
 
     if (VIR_EXPAND_N(srv->programs, srv->nprograms, 1) < 0)
         goto no_memory;
@@ -626,12 +691,12 @@ int virNetServerAddProgram(virNetServerPtr srv,
     srv->programs[srv->nprograms-1] = prog;
     virNetServerProgramRef(prog);
 
-    virNetServerUnlock(srv);
+    virMutexUnlock(&srv->programsLock);
     return 0;
 
 no_memory:
     virReportOOMError();
-    virNetServerUnlock(srv);
+    virMutexUnlock(&srv->programsLock);
     return -1;
 }
 
@@ -644,6 +709,149 @@ int virNetServerSetTLSContext(virNetServerPtr srv,
 }
 
 
+static void virNetServerIOLoopRun(void *opaque)
+{
+    virNetServerIOLoopPtr ioloop = opaque;
+
+    /* Set by the quit timer, so from within this thread */
+    while (!ioloop->quit) {
+        if (virEventPollLoopRunOnce(ioloop->loop) < 0) {
+            VIR_DEBUG("I/O loop iteration error, exiting");
+            break;
+        }
+    }
+}
+
+
+static void virNetServerIOLoopQuitTimer(int timerid ATTRIBUTE_UNUSED,
+                                        void *opaque)
+{
+    virNetServerIOLoopPtr ioloop = opaque;
+
+    ioloop->quit = true;
+}
+
+
+static void virNetServerReapTimer(int timerid,
+                                  void *opaque ATTRIBUTE_UNUSED)
+{
+    /* Only here to make virNetServerRun go round once more */
+    virEventUpdateTimeout(timerid, -1);
+}
+
+
+/*
+ * @srv: an unlocked server
+ *
+ * Tells the I/O loop threads to finish, waits for them, then
+ * frees their loops along with whatever is still registered
+ * with them.
+ */
+static void virNetServerStopIOLoops(virNetServerPtr srv)
+{
+    size_t i;
+
+    for (i = 0 ; i < srv->nioloops ; i++) {
+        virNetServerIOLoopPtr ioloop = &srv->ioloops[i];
+
+        virEventPollLoopUpdateTimeout(ioloop->loop, ioloop->quitTimer, 0);
+    }
+
+    for (i = 0 ; i < srv->nioloops ; i++) {
+        virThreadJoin(&srv->ioloops[i].thread);
+        virEventPollLoopFree(srv->ioloops[i].loop);
+    }
+
+    VIR_FREE(srv->ioloops);
+    srv->nioloops = 0;
+
+    if (srv->reapTimer > 0) {
+        virEventRemoveTimeout(srv->reapTimer);
+        srv->reapTimer = -1;
+    }
+}
+
+
+/*
+ * Starts @nloops threads, each running an event loop of its own,
+ * and hands the clients accepted from now on to them in turn, so
+ * their I/O no longer all goes through the default event loop.
+ * Listening sockets, signals and timers stay with the default
+ * loop. Passing 0 keeps all I/O in the default loop.
+ */
+int virNetServerSetIOLoops(virNetServerPtr srv,
+                           size_t nloops)
+{
+    size_t i;
+
+    virNetServerLock(srv);
+
+    if (srv->nioloops) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                    _("I/O event loops are already running"));
+        goto error;
+    }
+
+    if (nloops == 0) {
+        virNetServerUnlock(srv);
+        return 0;
+    }
+
+    if ((srv->reapTimer = virEventAddTimeout(-1,
+                                             virNetServerReapTimer,
+                                             NULL, NULL)) < 0) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                    _("Failed to register client reaping timeout"));
+        goto error;
+    }
+
+    if (VIR_ALLOC_N(srv->ioloops, nloops) < 0) {
+        virReportOOMError();
+        goto error_stop;
+    }
+
+    for (i = 0 ; i < nloops ; i++) {
+        virNetServerIOLoopPtr ioloop = &srv->ioloops[i];
+
+        if (!(ioloop->loop = virEventPollLoopNew()))
+            goto error_stop;
+
+        if ((ioloop->quitTimer =
+             virEventPollLoopAddTimeout(ioloop->loop, -1,
+                                        virNetServerIOLoopQuitTimer,
+                                        ioloop, NULL)) < 0) {
+            virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("Failed to register I/O event loop timeout"));
+            virEventPollLoopFree(ioloop->loop);
+            ioloop->loop = NULL;
+            goto error_stop;
+        }
+
+        if (virThreadCreate(&ioloop->thread, true,
+                            virNetServerIOLoopRun, ioloop) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to create I/O event loop thread"));
+            virEventPollLoopFree(ioloop->loop);
+            ioloop->loop = NULL;
+            goto error_stop;
+        }
+        srv->nioloops++;
+    }
+
+    virNetServerUnlock(srv);
+    return 0;
+
+error_stop:
+    virNetServerUnlock(srv);
+    virNetServerStopIOLoops(srv);
+    return -1;
+
+error:
+    virNetServerUnlock(srv);
+    return -1;
+}
+
+
 static void virNetServerAutoShutdownTimer(int timerid ATTRIBUTE_UNUSED,
                                           void *opaque) {
     virNetServerPtr srv = opaque;
@@ -659,6 +867,25 @@ static void virNetServerAutoShutdownTimer(int timerid ATTRIBUTE_UNUSED,
 }
 
 
+static void virNetServerLogMessagePool(void)
+{
+    virNetMessagePoolStats stats;
+
+    virNetMessagePoolGetStats(&stats);
+    VIR_INFO("Message buffer pool: small %llu hits %llu misses %zu free, "
+             "large %llu hits %llu misses %zu free",
+             stats.smallHits, stats.smallMisses, stats.smallFree,
+             stats.largeHits, stats.largeMisses, stats.largeFree);
+}
+
+
+static void virNetServerMessagePoolTimer(int timerid ATTRIBUTE_UNUSED,
+                                         void *opaque ATTRIBUTE_UNUSED)
+{
+    virNetServerLogMessagePool();
+}
+
+
 void virNetServerUpdateServices(virNetServerPtr srv,
                                 bool enabled)
 {
@@ -676,6 +903,7 @@ void virNetServerRun(virNetServerPtr srv)
 {
     int timerid = -1;
     int timerActive = 0;
+    int pooltimer;
     int i;
 
     virNetServerLock(srv);
@@ -695,6 +923,11 @@ void virNetServerRun(virNetServerPtr srv)
         goto cleanup;
     }
 
+    /* Not fatal, the counters are just not logged until shutdown */
+    pooltimer = virEventAddTimeout(VIR_NET_SERVER_POOL_STATS_INTERVAL,
+                                   virNetServerMessagePoolTimer,
+                                   NULL, NULL);
+
     VIR_DEBUG("srv=%p quit=%d", srv, srv->quit);
     while (!srv->quit) {
         /* A shutdown timeout is specified, so check
@@ -750,6 +983,10 @@ void virNetServerRun(virNetServerPtr srv)
         }
     }
 
+    if (pooltimer >= 0)
+        virEventRemoveTimeout(pooltimer);
+    virNetServerLogMessagePool();
+
 cleanup:
     virNetServerUnlock(srv);
 }
@@ -780,6 +1017,12 @@ void virNetServerFree(virNetServerPtr srv)
         return;
     }
 
+    /* No more client I/O from here on, so nothing is dispatched
+     * to the workers while they go away */
+    virNetServerUnlock(srv);
+    virNetServerStopIOLoops(srv);
+    virNetServerLock(srv);
+
     for (i = 0 ; i < srv->nservices ; i++)
         virNetServerServiceToggle(srv->services[i], false);
 
@@ -808,6 +1051,7 @@ void virNetServerFree(virNetServerPtr srv)
         virNetServerClientFree(srv->clients[i]);
     }
     VIR_FREE(srv->clients);
+    srv->nclients = 0;
 
     VIR_FREE(srv->mdnsGroupName);
 #if HAVE_AVAHI
@@ -820,6 +1064,8 @@ void virNetServerFree(virNetServerPtr srv)
 #endif
 
     virNetServerUnlock(srv);
+
+    virMutexDestroy(&srv->programsLock);
     virMutexDestroy(&srv->lock);
     VIR_FREE(srv);
 }
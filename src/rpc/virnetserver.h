@@ -80,6 +80,9 @@ int virNetServerSetTLSContext(virNetServerPtr srv,
 void virNetServerUpdateServices(virNetServerPtr srv,
                                 bool enabled);
 
+int virNetServerSetIOLoops(virNetServerPtr srv,
+                           size_t nloops);
+
 void virNetServerRun(virNetServerPtr srv);
 
 void virNetServerQuit(virNetServerPtr srv);
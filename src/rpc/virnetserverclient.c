@@ -85,7 +85,7 @@ struct _virNetServerClient
     virNetMessagePtr rx;
     /* Zero or many messages waiting for transmit
      * back to client, including async events */
-    virNetMessagePtr tx;
+    virNetMessageQueue tx;
 
     /* Filters to capture messages that would otherwise
      * end up on the 'dx' queue */
@@ -95,6 +95,9 @@ struct _virNetServerClient
     virNetServerClientDispatchFunc dispatchFunc;
     void *dispatchOpaque;
 
+    virNetServerClientWantCloseFunc wantCloseFunc;
+    void *wantCloseOpaque;
+
     void *privateData;
     virNetServerClientFreeFunc privateDataFreeFunc;
     virNetServerClientCloseFunc privateDataCloseFunc;
@@ -115,6 +118,18 @@ static void virNetServerClientUnlock(virNetServerClientPtr client)
 }
 
 
+/*
+ * @client: a locked client object
+ *
+ * Tell whoever reaps the client that it wants closing
+ */
+static void virNetServerClientNotifyWantClose(virNetServerClientPtr client)
+{
+    if (client->wantCloseFunc)
+        client->wantCloseFunc(client, client->wantCloseOpaque);
+}
+
+
 /*
  * @client: a locked client object
  */
@@ -127,7 +142,7 @@ virNetServerClientCalculateHandleMode(virNetServerClientPtr client) {
               client->tls,
               client->tls ? virNetTLSSessionGetHandshakeStatus(client->tls) : -1,
               client->rx,
-              client->tx);
+              client->tx.head);
     if (!client->sock || client->wantClose)
         return 0;
 
@@ -143,7 +158,7 @@ virNetServerClientCalculateHandleMode(virNetServerClientPtr client) {
         case VIR_NET_TLS_HANDSHAKE_COMPLETE:
             if (client->rx)
                 mode |= VIR_EVENT_HANDLE_READABLE;
-            if (client->tx)
+            if (client->tx.head)
                 mode |= VIR_EVENT_HANDLE_WRITABLE;
         }
     } else {
@@ -154,7 +169,7 @@ virNetServerClientCalculateHandleMode(virNetServerClientPtr client) {
 
         /* If there are one or more messages to send back to client,
            then monitor for writability on socket */
-        if (client->tx)
+        if (client->tx.head)
             mode |= VIR_EVENT_HANDLE_WRITABLE;
     }
     VIR_DEBUG("mode=%o", mode);
@@ -272,7 +287,7 @@ virNetServerClientCheckAccess(virNetServerClientPtr client)
     if (virNetTLSContextCheckCertificate(client->tlsCtxt, client->tls) < 0)
         return -1;
 
-    if (client->tx) {
+    if (client->tx.head) {
         VIR_DEBUG("client had unexpected data pending tx after access check");
         return -1;
     }
@@ -280,6 +295,11 @@ virNetServerClientCheckAccess(virNetServerClientPtr client)
     if (!(confirm = virNetMessageNew(false)))
         return -1;
 
+    if (virNetMessageGrowBuffer(confirm, 1) < 0) {
+        virNetMessageFree(confirm);
+        return -1;
+    }
+
     /* Checks have succeeded.  Write a '\1' byte back to the client to
      * indicate this (otherwise the socket is abruptly closed).
      * (NB. The '\1' byte is sent in an encrypted record).
@@ -288,7 +308,7 @@ virNetServerClientCheckAccess(virNetServerClientPtr client)
     confirm->bufferOffset = 0;
     confirm->buffer[0] = '\1';
 
-    client->tx = confirm;
+    virNetMessageQueuePush(&client->tx, confirm);
 
     return 0;
 }
@@ -517,6 +537,39 @@ void virNetServerClientSetDispatcher(virNetServerClientPtr client,
 }
 
 
+/*
+ * Have the client's socket serviced by @loop instead of the
+ * default event loop, so that all its I/O, and the dispatch
+ * of the messages it reads, happens in the thread running
+ * @loop. Must be called before virNetServerClientInit.
+ */
+void virNetServerClientSetEventLoop(virNetServerClientPtr client,
+                                    virEventPollLoopPtr loop)
+{
+    virNetServerClientLock(client);
+    if (client->sock)
+        virNetSocketSetEventLoop(client->sock, loop);
+    virNetServerClientUnlock(client);
+}
+
+
+/*
+ * Have @func called whenever the client comes to want closing,
+ * for when it is reaped by another thread than the one servicing
+ * its socket. It is called with the client locked, so it must not
+ * call back into the client.
+ */
+void virNetServerClientSetWantCloseHook(virNetServerClientPtr client,
+                                        virNetServerClientWantCloseFunc func,
+                                        void *opaque)
+{
+    virNetServerClientLock(client);
+    client->wantCloseFunc = func;
+    client->wantCloseOpaque = opaque;
+    virNetServerClientUnlock(client);
+}
+
+
 const char *virNetServerClientLocalAddrString(virNetServerClientPtr client)
 {
     if (!client->sock)
@@ -605,13 +658,11 @@ void virNetServerClientClose(virNetServerClientPtr client)
         client->tls = NULL;
     }
     client->wantClose = true;
+    virNetServerClientNotifyWantClose(client);
 
-    while (client->rx) {
-        virNetMessagePtr msg
-            = virNetMessageQueueServe(&client->rx);
-        virNetMessageFree(msg);
-    }
-    while (client->tx) {
+    virNetMessageFree(client->rx);
+    client->rx = NULL;
+    while (client->tx.head) {
         virNetMessagePtr msg
             = virNetMessageQueueServe(&client->tx);
         virNetMessageFree(msg);
@@ -646,6 +697,7 @@ void virNetServerClientImmediateClose(virNetServerClientPtr client)
 {
     virNetServerClientLock(client);
     client->wantClose = true;
+    virNetServerClientNotifyWantClose(client);
     virNetServerClientUnlock(client);
 }
 
@@ -727,6 +779,11 @@ static ssize_t virNetServerClientRead(virNetServerClientPtr client)
         return -1;
     }
 
+    if (virNetMessageGrowBuffer(client->rx, client->rx->bufferLength) < 0) {
+        client->wantClose = true;
+        return -1;
+    }
+
     ret = virNetSocketRead(client->sock,
                            client->rx->buffer + client->rx->bufferOffset,
                            client->rx->bufferLength - client->rx->bufferOffset);
@@ -768,9 +825,11 @@ readmore:
         goto readmore;
     } else {
         /* Grab the completed message */
-        virNetMessagePtr msg = virNetMessageQueueServe(&client->rx);
+        virNetMessagePtr msg = client->rx;
         virNetServerClientFilterPtr filter;
 
+        client->rx = NULL;
+
         /* Decode the header so we can use it for routing decisions */
         if (virNetMessageDecodeHeader(msg) < 0) {
             virNetMessageFree(msg);
@@ -829,8 +888,12 @@ readmore:
 }
 
 
+/* Most messages queued for a client that one write sends at once */
+#define VIR_NET_SERVER_CLIENT_TX_IOV 64
+
 /*
- * Send client->tx using no encoding
+ * Send as much of the client->tx queue as fits in one write,
+ * using no encoding
  *
  * Returns:
  *   -1 on error or EOF
@@ -839,27 +902,84 @@ readmore:
  */
 static ssize_t virNetServerClientWrite(virNetServerClientPtr client)
 {
-    ssize_t ret;
+    struct iovec iov[VIR_NET_SERVER_CLIENT_TX_IOV];
+    virNetMessagePtr msg;
+    int niov = 0;
+
+    for (msg = client->tx.head ;
+         msg && niov < VIR_NET_SERVER_CLIENT_TX_IOV ;
+         msg = msg->next) {
+        if (msg->bufferLength < msg->bufferOffset) {
+            virNetError(VIR_ERR_RPC,
+                        _("unexpected zero/negative length request %lld"),
+                        (long long int)(msg->bufferLength - msg->bufferOffset));
+            client->wantClose = true;
+            return -1;
+        }
 
-    if (client->tx->bufferLength < client->tx->bufferOffset) {
-        virNetError(VIR_ERR_RPC,
-                    _("unexpected zero/negative length request %lld"),
-                    (long long int)(client->tx->bufferLength - client->tx->bufferOffset));
-        client->wantClose = true;
-        return -1;
+        /* Nothing left of it to send, but it has to be
+         * completed before anything after it */
+        if (msg->bufferLength == msg->bufferOffset)
+            break;
+
+        iov[niov].iov_base = msg->buffer + msg->bufferOffset;
+        iov[niov].iov_len = msg->bufferLength - msg->bufferOffset;
+        niov++;
+
+#if HAVE_SASL
+        /* Whatever comes after the message completing SASL
+         * authentication is to be encoded by the SASL layer */
+        if (client->sasl)
+            break;
+#endif
     }
 
-    if (client->tx->bufferLength == client->tx->bufferOffset)
-        return 1;
+    return virNetSocketWritev(client->sock, iov, niov);
+}
 
-    ret = virNetSocketWrite(client->sock,
-                            client->tx->buffer + client->tx->bufferOffset,
-                            client->tx->bufferLength - client->tx->bufferOffset);
-    if (ret <= 0)
-        return ret; /* -1 error, 0 = egain */
 
-    client->tx->bufferOffset += ret;
-    return ret;
+/*
+ * Called once the head of the client->tx queue has been sent
+ * in full
+ */
+static void
+virNetServerClientCompleteWrite(virNetServerClientPtr client)
+{
+    virNetMessagePtr msg;
+#if HAVE_SASL
+    /* Completed this 'tx' operation, so now read for all
+     * future rx/tx to be under a SASL SSF layer
+     */
+    if (client->sasl) {
+        virNetSocketSetSASLSession(client->sock, client->sasl);
+        virNetSASLSessionFree(client->sasl);
+        client->sasl = NULL;
+    }
+#endif
+
+    /* Get finished msg from head of tx queue */
+    msg = virNetMessageQueueServe(&client->tx);
+
+    if (msg->tracked) {
+        client->nrequests--;
+        /* See if the recv queue is currently throttled */
+        if (!client->rx &&
+            client->nrequests < client->nrequests_max) {
+            /* Ready to recv more messages */
+            virNetMessageClear(msg);
+            client->rx = msg;
+            client->rx->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
+            msg = NULL;
+            client->nrequests++;
+        }
+    }
+
+    virNetMessageFree(msg);
+
+    virNetServerClientUpdateEvent(client);
+
+    if (client->delayedClose)
+        client->wantClose = true;
 }
 
 
@@ -870,9 +990,14 @@ static ssize_t virNetServerClientWrite(virNetServerClientPtr client)
 static void
 virNetServerClientDispatchWrite(virNetServerClientPtr client)
 {
-    while (client->tx) {
+    while (client->tx.head) {
         ssize_t ret;
 
+        if (client->tx.head->bufferOffset == client->tx.head->bufferLength) {
+            virNetServerClientCompleteWrite(client);
+            continue;
+        }
+
         ret = virNetServerClientWrite(client);
         if (ret < 0) {
             client->wantClose = true;
@@ -881,43 +1006,21 @@ virNetServerClientDispatchWrite(virNetServerClientPtr client)
         if (ret == 0)
             return; /* Would block on write EAGAIN */
 
-        if (client->tx->bufferOffset == client->tx->bufferLength) {
-            virNetMessagePtr msg;
-#if HAVE_SASL
-            /* Completed this 'tx' operation, so now read for all
-             * future rx/tx to be under a SASL SSF layer
-             */
-            if (client->sasl) {
-                virNetSocketSetSASLSession(client->sock, client->sasl);
-                virNetSASLSessionFree(client->sasl);
-                client->sasl = NULL;
-            }
-#endif
+        /* Spread what was written over the messages it came from,
+         * in order, completing those it covers in full */
+        while (ret > 0) {
+            virNetMessagePtr msg = client->tx.head;
+            size_t left = msg->bufferLength - msg->bufferOffset;
 
-            /* Get finished msg from head of tx queue */
-            msg = virNetMessageQueueServe(&client->tx);
-
-            if (msg->tracked) {
-                client->nrequests--;
-                /* See if the recv queue is currently throttled */
-                if (!client->rx &&
-                    client->nrequests < client->nrequests_max) {
-                    /* Ready to recv more messages */
-                    virNetMessageClear(msg);
-                    client->rx = msg;
-                    client->rx->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
-                    msg = NULL;
-                    client->nrequests++;
-                }
+            if ((size_t)ret < left) {
+                msg->bufferOffset += ret;
+                break;
             }
 
-            virNetMessageFree(msg);
-
-            virNetServerClientUpdateEvent(client);
-
-            if (client->delayedClose)
-                client->wantClose = true;
-         }
+            msg->bufferOffset = msg->bufferLength;
+            ret -= left;
+            virNetServerClientCompleteWrite(client);
+        }
     }
 }
 
@@ -977,6 +1080,15 @@ virNetServerClientDispatchEvent(virNetSocketPtr sock, int events, void *opaque)
                   VIR_EVENT_HANDLE_HANGUP))
         client->wantClose = true;
 
+    /* Stop watching the socket until the client is reaped, since
+     * that may be done by another thread than the one running
+     * this event loop, which would otherwise keep waking up for
+     * the same hangup */
+    if (client->wantClose) {
+        virNetServerClientUpdateEvent(client);
+        virNetServerClientNotifyWantClose(client);
+    }
+
     virNetServerClientUnlock(client);
 }
 
@@ -90,6 +90,15 @@ void virNetServerClientSetCloseHook(virNetServerClientPtr client,
 void virNetServerClientSetDispatcher(virNetServerClientPtr client,
                                      virNetServerClientDispatchFunc func,
                                      void *opaque);
+void virNetServerClientSetEventLoop(virNetServerClientPtr client,
+                                    virEventPollLoopPtr loop);
+
+typedef void (*virNetServerClientWantCloseFunc)(virNetServerClientPtr client,
+                                                void *opaque);
+
+void virNetServerClientSetWantCloseHook(virNetServerClientPtr client,
+                                        virNetServerClientWantCloseFunc func,
+                                        void *opaque);
 void virNetServerClientClose(virNetServerClientPtr client);
 bool virNetServerClientIsClosed(virNetServerClientPtr client);
 
@@ -25,6 +25,7 @@
 
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -49,6 +50,10 @@
     virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,           \
                          __FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* Largest payload of a TLS record: buffers smaller than this are
+ * copied together by virNetSocketWritev, to go out in one record */
+#define VIR_NET_SOCKET_TLS_RECORD_MAX 16384
+
 
 struct _virNetSocket {
     virMutex lock;
@@ -56,6 +61,7 @@ struct _virNetSocket {
 
     int fd;
     int watch;
+    virEventPollLoopPtr loop; /* NULL for the default event loop */
     pid_t pid;
     int errfd;
     bool client;
@@ -71,6 +77,7 @@ struct _virNetSocket {
     char *remoteAddrStr;
 
     virNetTLSSessionPtr tlsSession;
+    char *tlsCork; /* VIR_NET_SOCKET_TLS_RECORD_MAX bytes, allocated lazily */
 #if HAVE_SASL
     virNetSASLSessionPtr saslSession;
 
@@ -718,7 +725,10 @@ void virNetSocketFree(virNetSocketPtr sock)
 
     VIR_DEBUG("sock=%p fd=%d", sock, sock->fd);
     if (sock->watch > 0) {
-        virEventRemoveHandle(sock->watch);
+        if (sock->loop)
+            virEventPollLoopRemoveHandle(sock->loop, sock->watch);
+        else
+            virEventRemoveHandle(sock->watch);
         sock->watch = -1;
     }
 
@@ -734,6 +744,7 @@ void virNetSocketFree(virNetSocketPtr sock)
     if (sock->tlsSession)
         virNetTLSSessionSetIOCallbacks(sock->tlsSession, NULL, NULL, NULL);
     virNetTLSSessionFree(sock->tlsSession);
+    VIR_FREE(sock->tlsCork);
 #if HAVE_SASL
     virNetSASLSessionFree(sock->saslSession);
 #endif
@@ -1128,6 +1139,113 @@ ssize_t virNetSocketWrite(virNetSocketPtr sock, const char *buf, size_t len)
 }
 
 
+#ifndef WIN32
+static ssize_t virNetSocketWritevWire(virNetSocketPtr sock,
+                                      const struct iovec *iov,
+                                      int iovcnt)
+{
+    ssize_t ret;
+
+rewrite:
+    ret = writev(sock->fd, iov, iovcnt);
+
+    if (ret < 0) {
+        if (errno == EINTR)
+            goto rewrite;
+        if (errno == EAGAIN)
+            return 0;
+
+        virReportSystemError(errno, "%s",
+                             _("Cannot write data"));
+        return -1;
+    }
+    if (ret == 0) {
+        virReportSystemError(EIO, "%s",
+                             _("End of file while writing data"));
+        return -1;
+    }
+
+    return ret;
+}
+#else
+static ssize_t virNetSocketWritevWire(virNetSocketPtr sock,
+                                      const struct iovec *iov,
+                                      int iovcnt ATTRIBUTE_UNUSED)
+{
+    return virNetSocketWriteWire(sock, iov[0].iov_base, iov[0].iov_len);
+}
+#endif
+
+
+/*
+ * GNUTLS sends a record per write, so rather than have each small
+ * buffer go out in a record and a syscall of its own, copy as many
+ * as fit into one record. A write GNUTLS could not complete must
+ * be retried with the same data, which it is, since the caller
+ * retries from the same buffers, and these only ever get appended
+ * to in the meantime.
+ */
+static ssize_t virNetSocketWritevTLS(virNetSocketPtr sock,
+                                     const struct iovec *iov,
+                                     int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    if (iovcnt == 1 || iov[0].iov_len >= VIR_NET_SOCKET_TLS_RECORD_MAX)
+        return virNetSocketWriteWire(sock, iov[0].iov_base, iov[0].iov_len);
+
+    if (!sock->tlsCork &&
+        VIR_ALLOC_N(sock->tlsCork, VIR_NET_SOCKET_TLS_RECORD_MAX) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    for (i = 0 ; i < iovcnt && len < VIR_NET_SOCKET_TLS_RECORD_MAX ; i++) {
+        size_t n = iov[i].iov_len;
+
+        if (n > VIR_NET_SOCKET_TLS_RECORD_MAX - len)
+            n = VIR_NET_SOCKET_TLS_RECORD_MAX - len;
+        memcpy(sock->tlsCork + len, iov[i].iov_base, n);
+        len += n;
+    }
+
+    return virNetSocketWriteWire(sock, sock->tlsCork, len);
+}
+
+
+/*
+ * Write out as much of @iov as the socket takes without blocking,
+ * in as few syscalls as possible: a single writev for a plain
+ * socket, and with TLS a single record. With SASL, only the first
+ * buffer is written, since it is encoded one buffer at a time.
+ *
+ * Returns the number of bytes written, counted across the buffers
+ * in order, 0 if the socket would block, or -1 on error
+ */
+ssize_t virNetSocketWritev(virNetSocketPtr sock,
+                           const struct iovec *iov,
+                           int iovcnt)
+{
+    ssize_t ret;
+
+    virMutexLock(&sock->lock);
+#if HAVE_SASL
+    if (sock->saslSession)
+        ret = virNetSocketWriteSASL(sock, iov[0].iov_base, iov[0].iov_len);
+    else
+#endif
+    if (sock->tlsSession &&
+        virNetTLSSessionGetHandshakeStatus(sock->tlsSession) ==
+        VIR_NET_TLS_HANDSHAKE_COMPLETE)
+        ret = virNetSocketWritevTLS(sock, iov, iovcnt);
+    else
+        ret = virNetSocketWritevWire(sock, iov, iovcnt);
+    virMutexUnlock(&sock->lock);
+    return ret;
+}
+
+
 int virNetSocketListen(virNetSocketPtr sock, int backlog)
 {
     virMutexLock(&sock->lock);
@@ -1220,6 +1338,9 @@ static void virNetSocketEventFree(void *opaque)
     sock->func = NULL;
     sock->ff = NULL;
     sock->opaque = NULL;
+    /* The loop has purged the watch, and may be freed before
+     * the socket is, so don't touch it again */
+    sock->watch = -1;
     virMutexUnlock(&sock->lock);
 
     if (ff)
@@ -1228,6 +1349,22 @@ static void virNetSocketEventFree(void *opaque)
     virNetSocketFree(sock);
 }
 
+/*
+ * Have the IO callback of @sock run by @loop, rather than the
+ * default event loop. Must be called before the callback is
+ * added, and @loop must outlive the callback.
+ */
+void virNetSocketSetEventLoop(virNetSocketPtr sock,
+                              virEventPollLoopPtr loop)
+{
+    virMutexLock(&sock->lock);
+    if (sock->watch > 0)
+        VIR_WARN("Watch already registered on socket %p", sock);
+    else
+        sock->loop = loop;
+    virMutexUnlock(&sock->lock);
+}
+
 int virNetSocketAddIOCallback(virNetSocketPtr sock,
                               int events,
                               virNetSocketIOFunc func,
@@ -1243,11 +1380,20 @@ int virNetSocketAddIOCallback(virNetSocketPtr sock,
         goto cleanup;
     }
 
-    if ((sock->watch = virEventAddHandle(sock->fd,
-                                         events,
-                                         virNetSocketEventHandle,
-                                         sock,
-                                         virNetSocketEventFree)) < 0) {
+    if (sock->loop)
+        sock->watch = virEventPollLoopAddHandle(sock->loop,
+                                                sock->fd,
+                                                events,
+                                                virNetSocketEventHandle,
+                                                sock,
+                                                virNetSocketEventFree);
+    else
+        sock->watch = virEventAddHandle(sock->fd,
+                                        events,
+                                        virNetSocketEventHandle,
+                                        sock,
+                                        virNetSocketEventFree);
+    if (sock->watch < 0) {
         VIR_DEBUG("Failed to register watch on socket %p", sock);
         goto cleanup;
     }
@@ -1274,7 +1420,10 @@ void virNetSocketUpdateIOCallback(virNetSocketPtr sock,
         return;
     }
 
-    virEventUpdateHandle(sock->watch, events);
+    if (sock->loop)
+        virEventPollLoopUpdateHandle(sock->loop, sock->watch, events);
+    else
+        virEventUpdateHandle(sock->watch, events);
 
     virMutexUnlock(&sock->lock);
 }
@@ -1289,7 +1438,10 @@ void virNetSocketRemoveIOCallback(virNetSocketPtr sock)
         return;
     }
 
-    virEventRemoveHandle(sock->watch);
+    if (sock->loop)
+        virEventPollLoopRemoveHandle(sock->loop, sock->watch);
+    else
+        virEventRemoveHandle(sock->watch);
 
     virMutexUnlock(&sock->lock);
 }
@@ -33,6 +33,7 @@ typedef int (*virStorageBackendCheckPool)(virConnectPtr conn, virStoragePoolObjP
 typedef int (*virStorageBackendStartPool)(virConnectPtr conn, virStoragePoolObjPtr pool);
 typedef int (*virStorageBackendBuildPool)(virConnectPtr conn, virStoragePoolObjPtr pool, unsigned int flags);
 typedef int (*virStorageBackendRefreshPool)(virConnectPtr conn, virStoragePoolObjPtr pool);
+typedef int (*virStorageBackendUpdatePool)(virConnectPtr conn, virStoragePoolObjPtr pool);
 typedef int (*virStorageBackendStopPool)(virConnectPtr conn, virStoragePoolObjPtr pool);
 typedef int (*virStorageBackendDeletePool)(virConnectPtr conn, virStoragePoolObjPtr pool, unsigned int flags);
 
@@ -70,6 +71,9 @@ struct _virStorageBackend {
     virStorageBackendStartPool startPool;
     virStorageBackendBuildPool buildPool;
     virStorageBackendRefreshPool refreshPool;
+    /* Optional: refresh without clearing the volume list first,
+     * only looking at what changed since the last refresh */
+    virStorageBackendUpdatePool updatePool;
     virStorageBackendStopPool stopPool;
     virStorageBackendDeletePool deletePool;
 
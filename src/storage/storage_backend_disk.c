@@ -46,36 +46,26 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
                                  virStorageVolDefPtr vol)
 {
     char *tmp, *devpath;
+    virStorageVolDefPtr newvol = NULL;
 
     if (vol == NULL) {
-        if (VIR_ALLOC(vol) < 0) {
+        if (VIR_ALLOC(newvol) < 0) {
             virReportOOMError();
             return -1;
         }
-
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count+1) < 0) {
-            virReportOOMError();
-            virStorageVolDefFree(vol);
-            return -1;
-        }
-        pool->volumes.objs[pool->volumes.count++] = vol;
+        vol = newvol;
 
         /* Prepended path will be same for all partitions, so we can
          * strip the path to form a reasonable pool-unique name
          */
         tmp = strrchr(groups[0], '/');
-        if ((vol->name = strdup(tmp ? tmp + 1 : groups[0])) == NULL) {
-            virReportOOMError();
-            return -1;
-        }
+        if ((vol->name = strdup(tmp ? tmp + 1 : groups[0])) == NULL)
+            goto no_memory;
     }
 
     if (vol->target.path == NULL) {
-        if ((devpath = strdup(groups[0])) == NULL) {
-            virReportOOMError();
-            return -1;
-        }
+        if ((devpath = strdup(groups[0])) == NULL)
+            goto no_memory;
 
         /* Now figure out the stable path
          *
@@ -86,15 +76,21 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
         vol->target.path = virStorageBackendStablePath(pool, devpath);
         VIR_FREE(devpath);
         if (vol->target.path == NULL)
-            return -1;
+            goto error;
     }
 
     if (vol->key == NULL) {
         /* XXX base off a unique key of the underlying disk */
-        if ((vol->key = strdup(vol->target.path)) == NULL) {
-            virReportOOMError();
-            return -1;
-        }
+        if ((vol->key = strdup(vol->target.path)) == NULL)
+            goto no_memory;
+    }
+
+    /* The pool indexes volumes by key and path, so only
+     * add a new one once those are known */
+    if (newvol) {
+        if (virStoragePoolObjAddVol(pool, newvol) < 0)
+            goto error;
+        newvol = NULL;
     }
 
     if (vol->source.extents == NULL) {
@@ -152,6 +148,12 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
         pool->def->capacity = vol->source.extents[0].end;
 
     return 0;
+
+no_memory:
+    virReportOOMError();
+error:
+    virStorageVolDefFree(newvol);
+    return -1;
 }
 
 static int
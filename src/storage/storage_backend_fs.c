@@ -41,6 +41,10 @@
 # include <blkid/blkid.h>
 #endif
 
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
 #include "virterror_internal.h"
 #include "storage_backend_fs.h"
 #include "storage_conf.h"
@@ -806,103 +810,239 @@ error:
 }
 
 
-/**
- * Iterate over the pool's directory and enumerate all disk images
- * within it. This is non-recursive.
+/* What a file looked like when its volume was last probed. The
+ * volume is only probed again once one of these changes */
+typedef struct _virStorageBackendFileSystemStamp virStorageBackendFileSystemStamp;
+typedef virStorageBackendFileSystemStamp *virStorageBackendFileSystemStampPtr;
+struct _virStorageBackendFileSystemStamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    unsigned int pass;
+};
+
+/* Kept along with the volumes of a directory based pool, for
+ * the benefit of incremental refreshes */
+typedef struct _virStorageBackendFileSystemCache virStorageBackendFileSystemCache;
+typedef virStorageBackendFileSystemCache *virStorageBackendFileSystemCachePtr;
+struct _virStorageBackendFileSystemCache {
+    int watchfd;                /* inotify fd for the pool dir, or -1 */
+    unsigned int pass;          /* last pass over the whole dir */
+    virHashTablePtr stamps;     /* volume name -> stamp */
+};
+
+#if HAVE_SYS_INOTIFY_H
+# define VIR_STORAGE_FS_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVE |    \
+                                      IN_MODIFY | IN_ATTRIB |             \
+                                      IN_DELETE_SELF | IN_MOVE_SELF |     \
+                                      IN_ONLYDIR)
+#endif
+
+static void
+virStorageBackendFileSystemStampFree(void *payload,
+                                     const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+static void
+virStorageBackendFileSystemCacheFree(void *opaque)
+{
+    virStorageBackendFileSystemCachePtr cache = opaque;
+
+    if (!cache)
+        return;
+
+    VIR_FORCE_CLOSE(cache->watchfd);
+    virHashFree(cache->stamps);
+    VIR_FREE(cache);
+}
+
+static virStorageBackendFileSystemCachePtr
+virStorageBackendFileSystemCacheNew(virStoragePoolObjPtr pool ATTRIBUTE_UNUSED)
+{
+    virStorageBackendFileSystemCachePtr cache;
+
+    if (VIR_ALLOC(cache) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+    cache->watchfd = -1;
+
+    if (!(cache->stamps = virHashCreate(50,
+                                        virStorageBackendFileSystemStampFree))) {
+        virStorageBackendFileSystemCacheFree(cache);
+        return NULL;
+    }
+
+#if HAVE_SYS_INOTIFY_H
+    /* Changes made by other NFS clients never show up as inotify
+     * events, so network pools compare every file instead */
+    if (pool->def->type != VIR_STORAGE_POOL_NETFS) {
+        if ((cache->watchfd = inotify_init()) < 0 ||
+            virSetNonBlock(cache->watchfd) < 0 ||
+            virSetCloseExec(cache->watchfd) < 0 ||
+            inotify_add_watch(cache->watchfd, pool->def->target.path,
+                              VIR_STORAGE_FS_WATCH_EVENTS) < 0) {
+            char ebuf[1024];
+            VIR_WARN("cannot watch '%s' for changes: %s",
+                     pool->def->target.path,
+                     virStrerror(errno, ebuf, sizeof ebuf));
+            VIR_FORCE_CLOSE(cache->watchfd);
+        }
+    }
+#endif
+
+    return cache;
+}
+
+static int
+virStorageBackendFileSystemCacheStamp(virStorageBackendFileSystemCachePtr cache,
+                                      const char *name,
+                                      const struct stat *sb)
+{
+    virStorageBackendFileSystemStampPtr stamp;
+
+    if (VIR_ALLOC(stamp) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    stamp->dev = sb->st_dev;
+    stamp->ino = sb->st_ino;
+    stamp->size = sb->st_size;
+    stamp->mtime = sb->st_mtime;
+    stamp->ctime = sb->st_ctime;
+    stamp->pass = cache->pass;
+
+    if (virHashUpdateEntry(cache->stamps, name, stamp) < 0) {
+        VIR_FREE(stamp);
+        return -1;
+    }
+    return 0;
+}
+
+static bool
+virStorageBackendFileSystemStampMatches(virStorageBackendFileSystemStampPtr stamp,
+                                        const struct stat *sb)
+{
+    return stamp->dev == sb->st_dev &&
+        stamp->ino == sb->st_ino &&
+        stamp->size == sb->st_size &&
+        stamp->mtime == sb->st_mtime &&
+        stamp->ctime == sb->st_ctime;
+}
+
+
+/*
+ * Build the volume for the file @name in the pool's directory,
+ * and fill in @sb with what the file looked like beforehand.
+ * Returns 0 on success, -2 if the file is no volume, -1 on error
  */
 static int
-virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
-                                   virStoragePoolObjPtr pool)
+virStorageBackendFileSystemProbeVol(virStoragePoolObjPtr pool,
+                                    const char *name,
+                                    virStorageVolDefPtr *volret,
+                                    struct stat *sb)
 {
-    DIR *dir;
-    struct dirent *ent;
-    struct statvfs sb;
     virStorageVolDefPtr vol = NULL;
+    char *backingStore;
+    int backingStoreFormat;
+    int ret;
 
-    if (!(dir = opendir(pool->def->target.path))) {
-        virReportSystemError(errno,
-                             _("cannot open path '%s'"),
-                             pool->def->target.path);
+    if (VIR_ALLOC(vol) < 0)
+        goto no_memory;
+
+    if ((vol->name = strdup(name)) == NULL)
+        goto no_memory;
+
+    vol->type = VIR_STORAGE_VOL_FILE;
+    vol->target.format = VIR_STORAGE_FILE_RAW; /* Real value is filled in during probe */
+    if (virAsprintf(&vol->target.path, "%s/%s",
+                    pool->def->target.path,
+                    vol->name) == -1)
+        goto no_memory;
+
+    if ((vol->key = strdup(vol->target.path)) == NULL)
+        goto no_memory;
+
+    if (stat(vol->target.path, sb) < 0) {
+        /* Either a dangling symbolic link, or a file which went
+         * away since the directory was read */
+        if (errno == ENOENT || errno == ELOOP) {
+            ret = -2;
+        } else {
+            virReportSystemError(errno,
+                                 _("cannot stat file '%s'"),
+                                 vol->target.path);
+            ret = -1;
+        }
         goto cleanup;
     }
 
-    while ((ent = readdir(dir)) != NULL) {
-        int ret;
-        char *backingStore;
-        int backingStoreFormat;
-
-        if (VIR_ALLOC(vol) < 0)
-            goto no_memory;
-
-        if ((vol->name = strdup(ent->d_name)) == NULL)
-            goto no_memory;
-
-        vol->type = VIR_STORAGE_VOL_FILE;
-        vol->target.format = VIR_STORAGE_FILE_RAW; /* Real value is filled in during probe */
-        if (virAsprintf(&vol->target.path, "%s/%s",
-                        pool->def->target.path,
-                        vol->name) == -1)
-            goto no_memory;
-
-        if ((vol->key = strdup(vol->target.path)) == NULL)
-            goto no_memory;
-
-        if ((ret = virStorageBackendProbeTarget(&vol->target,
-                                                &backingStore,
-                                                &backingStoreFormat,
-                                                &vol->allocation,
-                                                &vol->capacity,
-                                                &vol->target.encryption)) < 0) {
-            if (ret == -2) {
-                /* Silently ignore non-regular files,
-                 * eg '.' '..', 'lost+found', dangling symbolic link */
-                virStorageVolDefFree(vol);
-                vol = NULL;
-                continue;
-            } else if (ret == -3) {
-                /* The backing file is currently unavailable, its format is not
-                 * explicitly specified, the probe to auto detect the format
-                 * failed: continue with faked RAW format, since AUTO will
-                 * break virStorageVolTargetDefFormat() generating the line
-                 * <format type='...'/>. */
-                backingStoreFormat = VIR_STORAGE_FILE_RAW;
-            } else
-                goto cleanup;
-        }
+    if ((ret = virStorageBackendProbeTarget(&vol->target,
+                                            &backingStore,
+                                            &backingStoreFormat,
+                                            &vol->allocation,
+                                            &vol->capacity,
+                                            &vol->target.encryption)) < 0) {
+        if (ret == -2) {
+            /* Silently ignore non-regular files,
+             * eg '.' '..', 'lost+found', dangling symbolic link */
+            goto cleanup;
+        } else if (ret == -3) {
+            /* The backing file is currently unavailable, its format is not
+             * explicitly specified, the probe to auto detect the format
+             * failed: continue with faked RAW format, since AUTO will
+             * break virStorageVolTargetDefFormat() generating the line
+             * <format type='...'/>. */
+            backingStoreFormat = VIR_STORAGE_FILE_RAW;
+        } else
+            goto cleanup;
+    }
 
-        /* directory based volume */
-        if (vol->target.format == VIR_STORAGE_FILE_DIR)
-            vol->type = VIR_STORAGE_VOL_DIR;
-
-        if (backingStore != NULL) {
-            vol->backingStore.path = backingStore;
-            vol->backingStore.format = backingStoreFormat;
-
-            if (virStorageBackendUpdateVolTargetInfo(&vol->backingStore,
-                                        NULL, NULL,
-                                        VIR_STORAGE_VOL_OPEN_DEFAULT) < 0) {
-                /* The backing file is currently unavailable, the capacity,
-                 * allocation, owner, group and mode are unknown. Just log the
-                 * error an continue.
-                 * Unfortunately virStorageBackendProbeTarget() might already
-                 * have logged a similar message for the same problem, but only
-                 * if AUTO format detection was used. */
-                virStorageReportError(VIR_ERR_INTERNAL_ERROR,
-                                      _("cannot probe backing volume info: %s"),
-                                      vol->backingStore.path);
-            }
+    /* directory based volume */
+    if (vol->target.format == VIR_STORAGE_FILE_DIR)
+        vol->type = VIR_STORAGE_VOL_DIR;
+
+    if (backingStore != NULL) {
+        vol->backingStore.path = backingStore;
+        vol->backingStore.format = backingStoreFormat;
+
+        if (virStorageBackendUpdateVolTargetInfo(&vol->backingStore,
+                                    NULL, NULL,
+                                    VIR_STORAGE_VOL_OPEN_DEFAULT) < 0) {
+            /* The backing file is currently unavailable, the capacity,
+             * allocation, owner, group and mode are unknown. Just log the
+             * error an continue.
+             * Unfortunately virStorageBackendProbeTarget() might already
+             * have logged a similar message for the same problem, but only
+             * if AUTO format detection was used. */
+            virStorageReportError(VIR_ERR_INTERNAL_ERROR,
+                                  _("cannot probe backing volume info: %s"),
+                                  vol->backingStore.path);
         }
+    }
 
+    *volret = vol;
+    return 0;
 
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count+1) < 0)
-            goto no_memory;
-        pool->volumes.objs[pool->volumes.count++] = vol;
-        vol = NULL;
-    }
-    closedir(dir);
+no_memory:
+    virReportOOMError();
+    ret = -1;
+cleanup:
+    virStorageVolDefFree(vol);
+    return ret;
+}
 
 
+static int
+virStorageBackendFileSystemRefreshSize(virStoragePoolObjPtr pool)
+{
+    struct statvfs sb;
+
     if (statvfs(pool->def->target.path, &sb) < 0) {
         virReportSystemError(errno,
                              _("cannot statvfs path '%s'"),
@@ -916,10 +1056,56 @@ virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
     pool->def->allocation = pool->def->capacity - pool->def->available;
 
     return 0;
+}
 
-no_memory:
-    virReportOOMError();
-    /* fallthrough */
+
+/**
+ * Iterate over the pool's directory and enumerate all disk images
+ * within it. This is non-recursive.
+ */
+static int
+virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
+                                   virStoragePoolObjPtr pool)
+{
+    DIR *dir = NULL;
+    struct dirent *ent;
+    struct stat sb;
+    virStorageVolDefPtr vol = NULL;
+    virStorageBackendFileSystemCachePtr cache;
+
+    /* Start watching before reading the directory, so the next
+     * incremental refresh can't miss anything changed meanwhile */
+    if (!(cache = virStorageBackendFileSystemCacheNew(pool)))
+        goto cleanup;
+    pool->volumesPrivate = cache;
+    pool->volumesPrivateFreeFunc = virStorageBackendFileSystemCacheFree;
+
+    if (!(dir = opendir(pool->def->target.path))) {
+        virReportSystemError(errno,
+                             _("cannot open path '%s'"),
+                             pool->def->target.path);
+        goto cleanup;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        int ret;
+
+        if ((ret = virStorageBackendFileSystemProbeVol(pool, ent->d_name,
+                                                       &vol, &sb)) == -2)
+            continue;
+        if (ret < 0)
+            goto cleanup;
+
+        if (virStoragePoolObjAddVol(pool, vol) < 0)
+            goto cleanup;
+        vol = NULL;
+
+        if (virStorageBackendFileSystemCacheStamp(cache, ent->d_name, &sb) < 0)
+            goto cleanup;
+    }
+    closedir(dir);
+
+    return virStorageBackendFileSystemRefreshSize(pool);
 
  cleanup:
     if (dir)
@@ -930,6 +1116,234 @@ no_memory:
 }
 
 
+/*
+ * Bring the volume for the file @name up to date, only probing
+ * the file if it changed since the volume was last built
+ */
+static int
+virStorageBackendFileSystemUpdateVol(virStoragePoolObjPtr pool,
+                                     virStorageBackendFileSystemCachePtr cache,
+                                     const char *name)
+{
+    virStorageVolDefPtr vol = virStorageVolDefFindByName(pool, name);
+    virStorageBackendFileSystemStampPtr stamp;
+    virStorageVolDefPtr newvol = NULL;
+    struct stat sb;
+    int ret;
+
+    if (vol && (stamp = virHashLookup(cache->stamps, name)) &&
+        stat(vol->target.path, &sb) == 0 &&
+        virStorageBackendFileSystemStampMatches(stamp, &sb)) {
+        stamp->pass = cache->pass;
+        return 0;
+    }
+
+    if ((ret = virStorageBackendFileSystemProbeVol(pool, name,
+                                                   &newvol, &sb)) == -1)
+        return -1;
+
+    if (vol) {
+        virStoragePoolObjRemoveVol(pool, vol);
+        virStorageVolDefFree(vol);
+    }
+    virHashRemoveEntry(cache->stamps, name);
+
+    if (ret == -2)
+        return 0;
+
+    if (virStoragePoolObjAddVol(pool, newvol) < 0) {
+        virStorageVolDefFree(newvol);
+        return -1;
+    }
+
+    return virStorageBackendFileSystemCacheStamp(cache, name, &sb);
+}
+
+/*
+ * Compare every file in the pool's directory with its stamp,
+ * and drop the volumes whose files have gone
+ */
+static int
+virStorageBackendFileSystemUpdateAll(virStoragePoolObjPtr pool,
+                                     virStorageBackendFileSystemCachePtr cache)
+{
+    DIR *dir;
+    struct dirent *ent;
+    unsigned int i;
+
+    if (!(dir = opendir(pool->def->target.path))) {
+        virReportSystemError(errno,
+                             _("cannot open path '%s'"),
+                             pool->def->target.path);
+        return -1;
+    }
+
+    cache->pass++;
+    while ((ent = readdir(dir)) != NULL) {
+        if (virStorageBackendFileSystemUpdateVol(pool, cache,
+                                                 ent->d_name) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+
+    i = 0;
+    while (i < pool->volumes.count) {
+        virStorageVolDefPtr vol = pool->volumes.objs[i];
+        virStorageBackendFileSystemStampPtr stamp =
+            virHashLookup(cache->stamps, vol->name);
+
+        if (stamp && stamp->pass == cache->pass) {
+            i++;
+            continue;
+        }
+
+        virHashRemoveEntry(cache->stamps, vol->name);
+        virStoragePoolObjRemoveVol(pool, vol);
+        virStorageVolDefFree(vol);
+    }
+
+    return 0;
+}
+
+#if HAVE_SYS_INOTIFY_H
+/*
+ * Collect the names of the files which changed since the last
+ * refresh into @names.
+ * Returns 0 on success, 1 if changes may have been missed, in
+ * which case every file needs comparing, or -1 on error
+ */
+static int
+virStorageBackendFileSystemReadChanges(virStorageBackendFileSystemCachePtr cache,
+                                       virHashTablePtr names)
+{
+    union {
+        struct inotify_event e;
+        char buf[16 * 1024];
+    } u;
+    bool lost = false;
+    bool gone = false;
+
+    for (;;) {
+        ssize_t n = read(cache->watchfd, u.buf, sizeof(u.buf));
+        char *tmp = u.buf;
+        size_t got;
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            virReportSystemError(errno, "%s",
+                                 _("cannot read inotify events"));
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got = n;
+
+        while (got >= sizeof(struct inotify_event)) {
+            struct inotify_event *e = (struct inotify_event *)tmp;
+            size_t len = sizeof(*e) + e->len;
+
+            if (len > got)
+                break;
+            tmp += len;
+            got -= len;
+
+            if (e->mask & IN_IGNORED)
+                gone = true;
+            if (e->mask & (IN_Q_OVERFLOW | IN_IGNORED |
+                           IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+                lost = true;
+            } else if (e->len && e->name[0] &&
+                       virHashUpdateEntry(names, e->name, cache) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    /* The watch is gone along with the directory, or its mount,
+     * so from now on only comparing every file will do */
+    if (gone)
+        VIR_FORCE_CLOSE(cache->watchfd);
+
+    return lost ? 1 : 0;
+}
+
+struct virStorageBackendFileSystemUpdateData {
+    virStoragePoolObjPtr pool;
+    virStorageBackendFileSystemCachePtr cache;
+    int ret;
+};
+
+static void
+virStorageBackendFileSystemUpdateIter(void *payload ATTRIBUTE_UNUSED,
+                                      const void *name,
+                                      void *opaque)
+{
+    struct virStorageBackendFileSystemUpdateData *data = opaque;
+
+    if (data->ret < 0)
+        return;
+
+    if (virStorageBackendFileSystemUpdateVol(data->pool, data->cache,
+                                             name) < 0)
+        data->ret = -1;
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/**
+ * Bring the pool's volumes up to date with the directory,
+ * probing only the files which changed since the last refresh.
+ * Where inotify is usable only the files it reported are looked
+ * at, else every file is compared with what it looked like then.
+ */
+static int
+virStorageBackendFileSystemUpdate(virConnectPtr conn,
+                                  virStoragePoolObjPtr pool)
+{
+    virStorageBackendFileSystemCachePtr cache = pool->volumesPrivate;
+    bool updated = false;
+
+    if (!cache) {
+        virStoragePoolObjClearVols(pool);
+        return virStorageBackendFileSystemRefresh(conn, pool);
+    }
+
+#if HAVE_SYS_INOTIFY_H
+    if (cache->watchfd != -1) {
+        struct virStorageBackendFileSystemUpdateData data = { pool, cache, 0 };
+        virHashTablePtr names;
+        int rc;
+
+        if (!(names = virHashCreate(50, NULL)))
+            return -1;
+
+        if ((rc = virStorageBackendFileSystemReadChanges(cache, names)) == 0) {
+            VIR_DEBUG("Updating %d changed files in pool '%s'",
+                      virHashSize(names), pool->def->name);
+            virHashForEach(names, virStorageBackendFileSystemUpdateIter, &data);
+            rc = data.ret;
+            updated = true;
+        } else if (rc > 0) {
+            VIR_DEBUG("Lost track of changes in pool '%s'", pool->def->name);
+        }
+        virHashFree(names);
+        if (rc < 0)
+            return -1;
+    }
+#endif
+
+    if (!updated &&
+        virStorageBackendFileSystemUpdateAll(pool, cache) < 0)
+        return -1;
+
+    return virStorageBackendFileSystemRefreshSize(pool);
+}
+
+
 /**
  * @conn connection to report errors against
  * @pool storage pool to start
@@ -1196,6 +1610,7 @@ virStorageBackend virStorageBackendDirectory = {
     .buildPool = virStorageBackendFileSystemBuild,
     .checkPool = virStorageBackendFileSystemCheck,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .updatePool = virStorageBackendFileSystemUpdate,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
     .buildVolFrom = virStorageBackendFileSystemVolBuildFrom,
@@ -1212,6 +1627,7 @@ virStorageBackend virStorageBackendFileSystem = {
     .checkPool = virStorageBackendFileSystemCheck,
     .startPool = virStorageBackendFileSystemStart,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .updatePool = virStorageBackendFileSystemUpdate,
     .stopPool = virStorageBackendFileSystemStop,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
@@ -1228,6 +1644,7 @@ virStorageBackend virStorageBackendNetFileSystem = {
     .startPool = virStorageBackendFileSystemStart,
     .findPoolSources = virStorageBackendFileSystemNetFindPoolSources,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .updatePool = virStorageBackendFileSystemUpdate,
     .stopPool = virStorageBackendFileSystemStop,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
@@ -104,13 +104,6 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
             virReportOOMError();
             goto cleanup;
         }
-
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count + 1)) {
-            virReportOOMError();
-            goto cleanup;
-        }
-        pool->volumes.objs[pool->volumes.count++] = vol;
     }
 
     if (vol->target.path == NULL) {
@@ -247,6 +240,10 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
         vol->source.nextent++;
     }
 
+    if (is_new_vol &&
+        virStoragePoolObjAddVol(pool, vol) < 0)
+        goto cleanup;
+
     ret = 0;
 
 cleanup:
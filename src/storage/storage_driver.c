@@ -48,6 +48,8 @@
 #include "virfile.h"
 #include "fdstream.h"
 #include "configmake.h"
+#include "threadpool.h"
+#include "ignore-value.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -64,62 +66,285 @@ static void storageDriverUnlock(virStorageDriverStatePtr driver)
     virMutexUnlock(&driver->lock);
 }
 
+/* Upper bound on the number of pools being started at once */
+#define STORAGE_AUTOSTART_WORKERS 8
+
+/*
+ * Pools are started in stages so that a pool comes up after the
+ * ones it may be built on: LUNs first, then multipath devices over
+ * them, partitions and volume groups over either, filesystems which
+ * may live on any of those, and finally plain directories, which
+ * may be inside a mounted filesystem.
+ */
+static unsigned int
+storagePoolAutostartStage(virStoragePoolObjPtr pool)
+{
+    switch (pool->def->type) {
+    case VIR_STORAGE_POOL_ISCSI:
+    case VIR_STORAGE_POOL_SCSI:
+        return 0;
+    case VIR_STORAGE_POOL_MPATH:
+        return 1;
+    case VIR_STORAGE_POOL_DISK:
+    case VIR_STORAGE_POOL_LOGICAL:
+        return 2;
+    case VIR_STORAGE_POOL_FS:
+    case VIR_STORAGE_POOL_NETFS:
+        return 3;
+    case VIR_STORAGE_POOL_DIR:
+    default:
+        return 4;
+    }
+}
+
+/* Whether @path lies strictly below the directory @parent */
+static bool
+storagePoolPathIsBelow(const char *path, const char *parent)
+{
+    size_t len;
+
+    if (!path || !parent)
+        return false;
+
+    len = strlen(parent);
+    while (len > 1 && parent[len - 1] == '/')
+        len--;
+
+    return STREQLEN(path, parent, len) &&
+        path[len] == '/' && path[len + 1] != '\0';
+}
+
+/*
+ * Whether the target of @def may be inside that of @parent, so that
+ * @parent has to be started first. Only a directory tree, mounted or
+ * not, can hold another pool's target: the targets of block device
+ * pools are merely where their device nodes turn up, and /dev says
+ * nothing about which pool provides which node.
+ */
+static bool
+storagePoolIsNestedIn(virStoragePoolDefPtr def,
+                      virStoragePoolDefPtr parent)
+{
+    switch (parent->type) {
+    case VIR_STORAGE_POOL_FS:
+    case VIR_STORAGE_POOL_NETFS:
+    case VIR_STORAGE_POOL_DIR:
+        break;
+    default:
+        return false;
+    }
+
+    if (STREQ_NULLABLE(def->target.path, "/dev") ||
+        storagePoolPathIsBelow(def->target.path, "/dev"))
+        return false;
+
+    return storagePoolPathIsBelow(def->target.path, parent->target.path);
+}
+
+/*
+ * Fill @stages, which has room for every pool in @pools, with the
+ * stage each pool is started in: that of its type, pushed past the
+ * stage of any pool its target is nested in.
+ */
+void
+storageDriverAutostartStages(virStoragePoolObjListPtr pools,
+                             unsigned int *stages)
+{
+    unsigned int count = pools->count;
+    unsigned int i, j;
+    bool changed;
+
+    for (i = 0 ; i < count ; i++)
+        stages[i] = storagePoolAutostartStage(pools->objs[i]);
+
+    /* Nesting is strict, so this settles within count passes */
+    for (j = 0, changed = true ; changed && j < count ; j++) {
+        changed = false;
+        for (i = 0 ; i < count ; i++) {
+            virStoragePoolDefPtr def = pools->objs[i]->def;
+            unsigned int k;
+
+            for (k = 0 ; k < count ; k++) {
+                virStoragePoolDefPtr other = pools->objs[k]->def;
+
+                if (stages[i] <= stages[k] &&
+                    storagePoolIsNestedIn(def, other)) {
+                    stages[i] = stages[k] + 1;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
 static void
-storageDriverAutostart(virStorageDriverStatePtr driver) {
-    unsigned int i;
+storagePoolAutostartOne(virStoragePoolObjPtr pool)
+{
+    virStorageBackendPtr backend;
+    bool started = false;
+    unsigned long long then = 0, now = 0;
 
-    for (i = 0 ; i < driver->pools.count ; i++) {
-        virStoragePoolObjPtr pool = driver->pools.objs[i];
-        virStorageBackendPtr backend;
-        bool started = false;
+    ignore_value(virTimeMs(&then));
 
-        virStoragePoolObjLock(pool);
-        if ((backend = virStorageBackendForType(pool->def->type)) == NULL) {
-            VIR_ERROR(_("Missing backend %d"), pool->def->type);
-            virStoragePoolObjUnlock(pool);
-            continue;
+    virStoragePoolObjLock(pool);
+    if ((backend = virStorageBackendForType(pool->def->type)) == NULL) {
+        VIR_ERROR(_("Missing backend %d"), pool->def->type);
+        goto cleanup;
+    }
+
+    if (backend->checkPool &&
+        backend->checkPool(NULL, pool, &started) < 0) {
+        virErrorPtr err = virGetLastError();
+        VIR_ERROR(_("Failed to initialize storage pool '%s': %s"),
+                  pool->def->name, err ? err->message :
+                  _("no error message found"));
+        goto cleanup;
+    }
+
+    if (!started &&
+        pool->autostart &&
+        !virStoragePoolObjIsActive(pool)) {
+        if (backend->startPool &&
+            backend->startPool(NULL, pool) < 0) {
+            virErrorPtr err = virGetLastError();
+            VIR_ERROR(_("Failed to autostart storage pool '%s': %s"),
+                      pool->def->name, err ? err->message :
+                      _("no error message found"));
+            goto cleanup;
         }
+        started = true;
+    }
 
-        if (backend->checkPool &&
-            backend->checkPool(NULL, pool, &started) < 0) {
+    if (started) {
+        if (backend->refreshPool(NULL, pool) < 0) {
             virErrorPtr err = virGetLastError();
-            VIR_ERROR(_("Failed to initialize storage pool '%s': %s"),
+            if (backend->stopPool)
+                backend->stopPool(NULL, pool);
+            VIR_ERROR(_("Failed to autostart storage pool '%s': %s"),
                       pool->def->name, err ? err->message :
                       _("no error message found"));
-            virStoragePoolObjUnlock(pool);
-            continue;
+            goto cleanup;
         }
+        pool->active = 1;
+    }
+
+cleanup:
+    ignore_value(virTimeMs(&now));
+    VIR_INFO("Storage pool '%s' %s after %llu ms", pool->def->name,
+             pool->active ? "active" : "inactive", now - then);
+    virStoragePoolObjUnlock(pool);
+}
+
+
+struct storageAutostartState {
+    virMutex lock;
+    virCond cond;
+    size_t pending;
+};
 
-        if (!started &&
-            pool->autostart &&
-            !virStoragePoolObjIsActive(pool)) {
-            if (backend->startPool &&
-                backend->startPool(NULL, pool) < 0) {
-                virErrorPtr err = virGetLastError();
-                VIR_ERROR(_("Failed to autostart storage pool '%s': %s"),
-                          pool->def->name, err ? err->message :
-                          _("no error message found"));
-                virStoragePoolObjUnlock(pool);
+static void
+storageDriverAutostartWorker(void *jobdata, void *opaque)
+{
+    struct storageAutostartState *state = opaque;
+
+    storagePoolAutostartOne(jobdata);
+
+    virMutexLock(&state->lock);
+    if (--state->pending == 0)
+        virCondSignal(&state->cond);
+    virMutexUnlock(&state->lock);
+}
+
+/*
+ * Check, start and refresh the pools of each stage concurrently,
+ * waiting for a stage to finish before moving on to the next one.
+ * Within a stage pools are handed out in the order they were
+ * loaded.
+ */
+static void
+storageDriverAutostart(virStorageDriverStatePtr driver) {
+    unsigned int count = driver->pools.count;
+    unsigned int *stages = NULL;
+    unsigned int i, stage, lastStage = 0;
+    struct storageAutostartState state;
+    virThreadPoolPtr workers = NULL;
+    unsigned long long then = 0, now = 0;
+
+    if (count == 0)
+        return;
+
+    ignore_value(virTimeMs(&then));
+
+    memset(&state, 0, sizeof(state));
+    if (VIR_ALLOC_N(stages, count) < 0) {
+        virReportOOMError();
+        goto serial;
+    }
+
+    storageDriverAutostartStages(&driver->pools, stages);
+
+    for (i = 0 ; i < count ; i++)
+        lastStage = MAX(lastStage, stages[i]);
+
+    if (virMutexInit(&state.lock) < 0)
+        goto serial;
+    if (virCondInit(&state.cond) < 0) {
+        virMutexDestroy(&state.lock);
+        goto serial;
+    }
+
+    if (!(workers = virThreadPoolNew(0, MIN(count, STORAGE_AUTOSTART_WORKERS),
+                                     0, storageDriverAutostartWorker,
+                                     &state))) {
+        ignore_value(virCondDestroy(&state.cond));
+        virMutexDestroy(&state.lock);
+        goto serial;
+    }
+
+    for (stage = 0 ; stage <= lastStage ; stage++) {
+        for (i = 0 ; i < count ; i++) {
+            if (stages[i] != stage)
                 continue;
+
+            virMutexLock(&state.lock);
+            state.pending++;
+            virMutexUnlock(&state.lock);
+
+            if (virThreadPoolSendJob(workers, 0,
+                                     driver->pools.objs[i]) < 0) {
+                virMutexLock(&state.lock);
+                state.pending--;
+                virMutexUnlock(&state.lock);
+                storagePoolAutostartOne(driver->pools.objs[i]);
             }
-            started = true;
         }
 
-        if (started) {
-            if (backend->refreshPool(NULL, pool) < 0) {
-                virErrorPtr err = virGetLastError();
-                if (backend->stopPool)
-                    backend->stopPool(NULL, pool);
-                VIR_ERROR(_("Failed to autostart storage pool '%s': %s"),
-                          pool->def->name, err ? err->message :
-                          _("no error message found"));
-                virStoragePoolObjUnlock(pool);
-                continue;
+        virMutexLock(&state.lock);
+        while (state.pending > 0) {
+            if (virCondWait(&state.cond, &state.lock) < 0) {
+                VIR_ERROR(_("Failed to wait for storage pools to start"));
+                break;
             }
-            pool->active = 1;
         }
-        virStoragePoolObjUnlock(pool);
+        virMutexUnlock(&state.lock);
     }
+
+    /* This waits for any pool still being worked on */
+    virThreadPoolFree(workers);
+    ignore_value(virCondDestroy(&state.cond));
+    virMutexDestroy(&state.lock);
+    goto done;
+
+serial:
+    /* Better slow than not at all */
+    for (i = 0 ; i < count ; i++)
+        storagePoolAutostartOne(driver->pools.objs[i]);
+
+done:
+    VIR_FREE(stages);
+
+    ignore_value(virTimeMs(&now));
+    VIR_INFO("Storage pools checked in %llu ms", now - then);
 }
 
 /**
@@ -871,9 +1096,10 @@ storagePoolRefresh(virStoragePoolPtr obj,
     virStorageDriverStatePtr driver = obj->conn->storagePrivateData;
     virStoragePoolObjPtr pool;
     virStorageBackendPtr backend;
+    int rc;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_POOL_REFRESH_FULL, -1);
 
     storageDriverLock(driver);
     pool = virStoragePoolObjFindByUUID(&driver->pools, obj->uuid);
@@ -900,8 +1126,14 @@ storagePoolRefresh(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    virStoragePoolObjClearVols(pool);
-    if (backend->refreshPool(obj->conn, pool) < 0) {
+    if (backend->updatePool && !(flags & VIR_STORAGE_POOL_REFRESH_FULL)) {
+        rc = backend->updatePool(obj->conn, pool);
+    } else {
+        virStoragePoolObjClearVols(pool);
+        rc = backend->refreshPool(obj->conn, pool);
+    }
+
+    if (rc < 0) {
         if (backend->stopPool)
             backend->stopPool(obj->conn, pool);
 
@@ -1245,21 +1477,28 @@ storageVolumeLookupByPath(virConnectPtr conn,
             virStorageVolDefPtr vol;
             const char *stable_path;
 
-            stable_path = virStorageBackendStablePath(driver->pools.objs[i],
-                                                      cleanpath);
-            if (stable_path == NULL) {
-                /* Don't break the whole lookup process if it fails on
-                 * getting the stable path for some of the pools.
-                 */
-                VIR_WARN("Failed to get stable path for pool '%s'",
-                         driver->pools.objs[i]->def->name);
-                virStoragePoolObjUnlock(driver->pools.objs[i]);
-                continue;
-            }
-
+            /* Paths are usually given the way the pool names them
+             * already, so try that before scanning the pool's
+             * target directory for a stable path */
             vol = virStorageVolDefFindByPath(driver->pools.objs[i],
-                                             stable_path);
-            VIR_FREE(stable_path);
+                                             cleanpath);
+            if (vol == NULL) {
+                stable_path = virStorageBackendStablePath(driver->pools.objs[i],
+                                                          cleanpath);
+                if (stable_path == NULL) {
+                    /* Don't break the whole lookup process if it fails on
+                     * getting the stable path for some of the pools.
+                     */
+                    VIR_WARN("Failed to get stable path for pool '%s'",
+                             driver->pools.objs[i]->def->name);
+                    virStoragePoolObjUnlock(driver->pools.objs[i]);
+                    continue;
+                }
+
+                vol = virStorageVolDefFindByPath(driver->pools.objs[i],
+                                                 stable_path);
+                VIR_FREE(stable_path);
+            }
 
             if (vol)
                 ret = virGetStorageVol(conn,
@@ -1323,12 +1562,6 @@ storageVolumeCreateXML(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    if (VIR_REALLOC_N(pool->volumes.objs,
-                      pool->volumes.count+1) < 0) {
-        virReportOOMError();
-        goto cleanup;
-    }
-
     if (!backend->createVol) {
         virStorageReportError(VIR_ERR_NO_SUPPORT,
                               "%s", _("storage pool does not support volume "
@@ -1340,11 +1573,12 @@ storageVolumeCreateXML(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    pool->volumes.objs[pool->volumes.count++] = voldef;
+    if (virStoragePoolObjAddVol(pool, voldef) < 0)
+        goto cleanup;
     volobj = virGetStorageVol(obj->conn, pool->def->name, voldef->name,
                               voldef->key);
     if (!volobj) {
-        pool->volumes.count--;
+        virStoragePoolObjRemoveVol(pool, voldef);
         goto cleanup;
     }
 
@@ -1501,18 +1735,13 @@ storageVolumeCreateXMLFrom(virStoragePoolPtr obj,
         backend->refreshVol(obj->conn, pool, origvol) < 0)
         goto cleanup;
 
-    if (VIR_REALLOC_N(pool->volumes.objs,
-                      pool->volumes.count+1) < 0) {
-        virReportOOMError();
-        goto cleanup;
-    }
-
     /* 'Define' the new volume so we get async progress reporting */
     if (backend->createVol(obj->conn, pool, newvol) < 0) {
         goto cleanup;
     }
 
-    pool->volumes.objs[pool->volumes.count++] = newvol;
+    if (virStoragePoolObjAddVol(pool, newvol) < 0)
+        goto cleanup;
     volobj = virGetStorageVol(obj->conn, pool->def->name, newvol->name,
                               newvol->key);
 
@@ -1917,7 +2146,6 @@ storageVolumeDelete(virStorageVolPtr obj,
     virStoragePoolObjPtr pool;
     virStorageBackendPtr backend;
     virStorageVolDefPtr vol = NULL;
-    unsigned int i;
     int ret = -1;
 
     storageDriverLock(driver);
@@ -1965,25 +2193,10 @@ storageVolumeDelete(virStorageVolPtr obj,
     if (backend->deleteVol(obj->conn, pool, vol, flags) < 0)
         goto cleanup;
 
-    for (i = 0 ; i < pool->volumes.count ; i++) {
-        if (pool->volumes.objs[i] == vol) {
-            VIR_INFO("Deleting volume '%s' from storage pool '%s'",
-                     vol->name, pool->def->name);
-            virStorageVolDefFree(vol);
-            vol = NULL;
-
-            if (i < (pool->volumes.count - 1))
-                memmove(pool->volumes.objs + i, pool->volumes.objs + i + 1,
-                        sizeof(*(pool->volumes.objs)) * (pool->volumes.count - (i + 1)));
-
-            if (VIR_REALLOC_N(pool->volumes.objs, pool->volumes.count - 1) < 0) {
-                ; /* Failure to reduce memory allocation isn't fatal */
-            }
-            pool->volumes.count--;
-
-            break;
-        }
-    }
+    VIR_INFO("Deleting volume '%s' from storage pool '%s'",
+             vol->name, pool->def->name);
+    virStoragePoolObjRemoveVol(pool, vol);
+    virStorageVolDefFree(vol);
     ret = 0;
 
 cleanup:
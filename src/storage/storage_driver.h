@@ -28,4 +28,7 @@
 
 int storageRegister(void);
 
+void storageDriverAutostartStages(virStoragePoolObjListPtr pools,
+                                  unsigned int *stages);
+
 #endif /* __VIR_STORAGE_DRIVER_H__ */
@@ -331,7 +331,7 @@ reread:
                 continue;
             }
 
-            dom->def->id = driver->nextvmid++;
+            virDomainObjListSetID(&driver->domains, dom, driver->nextvmid++);
             virDomainObjSetState(dom, VIR_DOMAIN_RUNNING,
                                  VIR_DOMAIN_RUNNING_BOOTED);
 
@@ -973,7 +973,7 @@ cleanup:
 }
 
 static void umlShutdownVMDaemon(virConnectPtr conn ATTRIBUTE_UNUSED,
-                                struct uml_driver *driver ATTRIBUTE_UNUSED,
+                                struct uml_driver *driver,
                                 virDomainObjPtr vm,
                                 virDomainShutoffReason reason)
 {
@@ -993,7 +993,7 @@ static void umlShutdownVMDaemon(virConnectPtr conn ATTRIBUTE_UNUSED,
     }
 
     vm->pid = -1;
-    vm->def->id = -1;
+    virDomainObjListSetID(&driver->domains, vm, -1);
     virDomainObjSetState(vm, VIR_DOMAIN_SHUTOFF, reason);
 
     virDomainConfVMNWFilterTeardown(vm);
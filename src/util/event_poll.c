@@ -30,6 +30,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 
 #include "threads.h"
 #include "logging.h"
@@ -48,7 +51,7 @@
     virReportErrorHelper(VIR_FROM_EVENT, code, __FILE__,            \
                          __FUNCTION__, __LINE__, __VA_ARGS__)
 
-static int virEventPollInterruptLocked(void);
+static int virEventPollInterruptLocked(virEventPollLoopPtr loop);
 
 /* State for a single file handle being monitored */
 struct virEventPollHandle {
@@ -59,6 +62,9 @@ struct virEventPollHandle {
     virFreeCallback ff;
     void *opaque;
     int deleted;
+    int efd;        /* fd registered with epoll, a dup of fd when shared */
+    int registered; /* efd is currently in the epoll set */
+    int unpollable; /* epoll refused efd, treat it as always ready */
 };
 
 /* State for a single timer being generated */
@@ -70,13 +76,22 @@ struct virEventPollTimeout {
     virFreeCallback ff;
     void *opaque;
     int deleted;
+    size_t heapIndex; /* position in the heap, or EVENT_TIMEOUT_UNARMED */
+    struct virEventPollTimeout *next; /* chains timers pending purge */
 };
 
+/* heapIndex of a timer which is disabled, deleted or being dispatched */
+#define EVENT_TIMEOUT_UNARMED ((size_t)-1)
+
 /* Allocate extra slots for virEventPollHandle/virEventPollTimeout
    records in this multiple */
 #define EVENT_ALLOC_EXTENT 10
 
-/* State for the main event loop */
+/* Max number of events collected by a single epoll_wait() */
+#define EVENT_EPOLL_MAX_EVENTS 128
+
+/* State for an event loop, the default one or one made by
+ * virEventPollLoopNew for a thread of its own */
 struct virEventPollLoop {
     virMutex lock;
     int running;
@@ -85,65 +100,305 @@ struct virEventPollLoop {
     size_t handlesCount;
     size_t handlesAlloc;
     struct virEventPollHandle *handles;
+    size_t handlesDeleted;
     size_t timeoutsCount;
     size_t timeoutsAlloc;
-    struct virEventPollTimeout *timeouts;
+    struct virEventPollTimeout **timeouts; /* sorted by timer id */
+    size_t timeoutsDeleted;
+    /* Binary min-heap of the armed timers, ordered by expiry */
+    size_t heapCount;
+    size_t heapAlloc;
+    struct virEventPollTimeout **heap;
+    /* Scratch space for the timers expiring in one iteration */
+    size_t expiredAlloc;
+    struct virEventPollTimeout **expired;
+    int backend;
+    int epollfd;
+    size_t unpollableCount;
+    /* Number of handles registered with epoll, indexed by efd */
+    size_t *efdUsers;
+    size_t efdUsersAlloc;
+    /* Unique ID for the next FD watch to be registered */
+    int nextWatch;
+    /* Unique ID for the next timer to be registered */
+    int nextTimer;
 };
 
-/* Only have one event loop */
+/* The loop behind the virEventPoll* functions */
 static struct virEventPollLoop eventLoop;
 
-/* Unique ID for the next FD watch to be registered */
-static int nextWatch = 1;
+VIR_ENUM_IMPL(virEventPollBackend, VIR_EVENT_POLL_BACKEND_LAST,
+              "poll",
+              "epoll")
+
+int virEventPollSetBackend(int backend)
+{
+    switch (backend) {
+    case VIR_EVENT_POLL_BACKEND_POLL:
+        break;
+
+    case VIR_EVENT_POLL_BACKEND_EPOLL:
+#if !HAVE_SYS_EPOLL_H
+        virEventError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                      _("epoll event loop is not supported on this platform"));
+        return -1;
+#endif
+        break;
+
+    default:
+        virEventError(VIR_ERR_INVALID_ARG,
+                      _("unknown event loop backend %d"), backend);
+        return -1;
+    }
+
+    eventLoop.backend = backend;
+    return 0;
+}
+
+/*
+ * Handles are only ever appended with increasing watch numbers
+ * and are compacted in place, so the array stays sorted by watch.
+ * returns: the index of the handle, or -1 if not found
+ */
+static int virEventPollFindHandle(virEventPollLoopPtr loop,
+                                  int watch)
+{
+    size_t lo = 0;
+    size_t hi = loop->handlesCount;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (loop->handles[mid].watch < watch)
+            lo = mid + 1;
+        else if (loop->handles[mid].watch > watch)
+            hi = mid;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+#if HAVE_SYS_EPOLL_H
+static int virEventEpollToEpollEvents(int events)
+{
+    int ret = 0;
+    if (events & POLLIN)
+        ret |= EPOLLIN;
+    if (events & POLLOUT)
+        ret |= EPOLLOUT;
+    if (events & POLLERR)
+        ret |= EPOLLERR;
+    if (events & POLLHUP)
+        ret |= EPOLLHUP;
+    return ret;
+}
+
+static int virEventEpollFromEpollEvents(int events)
+{
+    int ret = 0;
+    if (events & EPOLLIN)
+        ret |= POLLIN;
+    if (events & EPOLLOUT)
+        ret |= POLLOUT;
+    if (events & EPOLLERR)
+        ret |= POLLERR;
+    if (events & EPOLLHUP)
+        ret |= POLLHUP;
+    return ret;
+}
+
+/* Make room to count the users of @efd before registering it */
+static int virEventEpollReserveFD(virEventPollLoopPtr loop,
+                                  int efd)
+{
+    if (efd < loop->efdUsersAlloc)
+        return 0;
+
+    if (VIR_RESIZE_N(loop->efdUsers, loop->efdUsersAlloc,
+                     loop->efdUsersAlloc,
+                     efd + 1 - loop->efdUsersAlloc) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    return 0;
+}
+
+static int virEventEpollUnregister(virEventPollLoopPtr loop,
+                                   struct virEventPollHandle *handle)
+{
+    struct epoll_event ev;
+
+    if (!handle->registered)
+        return 0;
+    handle->registered = 0;
 
-/* Unique ID for the next timer to be registered */
-static int nextTimer = 1;
+    /* If efd was closed and the number reused by a newer handle,
+     * the kernel already dropped our registration and deleting
+     * it now would remove the newer one instead */
+    if (--loop->efdUsers[handle->efd] > 0)
+        return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, handle->efd, &ev) < 0 &&
+        errno != EBADF && errno != ENOENT) {
+        virReportSystemError(errno,
+                             _("Unable to remove fd %d from epoll set"),
+                             handle->efd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sync the epoll registration of a handle with its event set.
+ * epoll always reports errors and hangups, so handles which are
+ * not interested in any events are removed from the set.
+ */
+static int virEventEpollRegister(virEventPollLoopPtr loop,
+                                 struct virEventPollHandle *handle)
+{
+    struct epoll_event ev;
+
+    if (handle->unpollable)
+        return 0;
+
+    if (!handle->events)
+        return virEventEpollUnregister(loop, handle);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = virEventEpollToEpollEvents(handle->events);
+    ev.data.u32 = handle->watch;
+
+    if (handle->registered) {
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, handle->efd, &ev) < 0)
+            goto error;
+        return 0;
+    }
+
+    if (virEventEpollReserveFD(loop, handle->efd) < 0)
+        return -1;
+
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, handle->efd, &ev) == 0) {
+        handle->registered = 1;
+        loop->efdUsers[handle->efd]++;
+        return 0;
+    }
+
+    if (errno == EEXIST && handle->efd == handle->fd) {
+        /* Another handle is watching the same fd, and epoll only
+         * allows one registration per fd, so use a duplicate */
+        int efd;
+
+        if ((efd = dup(handle->fd)) < 0)
+            goto error;
+        if (virEventEpollReserveFD(loop, efd) < 0) {
+            VIR_FORCE_CLOSE(efd);
+            return -1;
+        }
+        if (virSetCloseExec(efd) < 0 ||
+            epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, efd, &ev) < 0) {
+            int save_errno = errno;
+            VIR_FORCE_CLOSE(efd);
+            errno = save_errno;
+            goto error;
+        }
+        handle->efd = efd;
+        handle->registered = 1;
+        loop->efdUsers[efd]++;
+        return 0;
+    }
+
+    if (errno == EPERM) {
+        /* Regular files and directories can't be used with epoll,
+         * poll() reports them as always ready so do the same */
+        EVENT_DEBUG("fd %d does not support epoll, always ready", handle->fd);
+        handle->unpollable = 1;
+        loop->unpollableCount++;
+        return 0;
+    }
+
+error:
+    virReportSystemError(errno,
+                         _("Unable to add fd %d to epoll set"),
+                         handle->fd);
+    return -1;
+}
+
+static int virEventEpollRemove(virEventPollLoopPtr loop,
+                               struct virEventPollHandle *handle)
+{
+    int ret = virEventEpollUnregister(loop, handle);
+
+    if (handle->unpollable) {
+        handle->unpollable = 0;
+        loop->unpollableCount--;
+    }
+    if (handle->efd != handle->fd)
+        VIR_FORCE_CLOSE(handle->efd);
+    handle->efd = handle->fd;
+    return ret;
+}
+#endif /* HAVE_SYS_EPOLL_H */
 
 /*
  * Register a callback for monitoring file handle events.
  * NB, it *must* be safe to call this from within a callback
  * For this reason we only ever append to existing list.
  */
-int virEventPollAddHandle(int fd, int events,
-                          virEventHandleCallback cb,
-                          void *opaque,
-                          virFreeCallback ff) {
+int virEventPollLoopAddHandle(virEventPollLoopPtr loop,
+                              int fd, int events,
+                              virEventHandleCallback cb,
+                              void *opaque,
+                              virFreeCallback ff) {
     int watch;
-    virMutexLock(&eventLoop.lock);
-    if (eventLoop.handlesCount == eventLoop.handlesAlloc) {
+    virMutexLock(&loop->lock);
+    if (loop->handlesCount == loop->handlesAlloc) {
         EVENT_DEBUG("Used %zu handle slots, adding at least %d more",
-                    eventLoop.handlesAlloc, EVENT_ALLOC_EXTENT);
-        if (VIR_RESIZE_N(eventLoop.handles, eventLoop.handlesAlloc,
-                         eventLoop.handlesCount, EVENT_ALLOC_EXTENT) < 0) {
-            virMutexUnlock(&eventLoop.lock);
+                    loop->handlesAlloc, EVENT_ALLOC_EXTENT);
+        if (VIR_RESIZE_N(loop->handles, loop->handlesAlloc,
+                         loop->handlesCount, EVENT_ALLOC_EXTENT) < 0) {
+            virMutexUnlock(&loop->lock);
             return -1;
         }
     }
 
-    watch = nextWatch++;
+    watch = loop->nextWatch++;
 
-    eventLoop.handles[eventLoop.handlesCount].watch = watch;
-    eventLoop.handles[eventLoop.handlesCount].fd = fd;
-    eventLoop.handles[eventLoop.handlesCount].events =
+    loop->handles[loop->handlesCount].watch = watch;
+    loop->handles[loop->handlesCount].fd = fd;
+    loop->handles[loop->handlesCount].events =
                                          virEventPollToNativeEvents(events);
-    eventLoop.handles[eventLoop.handlesCount].cb = cb;
-    eventLoop.handles[eventLoop.handlesCount].ff = ff;
-    eventLoop.handles[eventLoop.handlesCount].opaque = opaque;
-    eventLoop.handles[eventLoop.handlesCount].deleted = 0;
+    loop->handles[loop->handlesCount].cb = cb;
+    loop->handles[loop->handlesCount].ff = ff;
+    loop->handles[loop->handlesCount].opaque = opaque;
+    loop->handles[loop->handlesCount].deleted = 0;
+    loop->handles[loop->handlesCount].efd = fd;
+    loop->handles[loop->handlesCount].registered = 0;
+    loop->handles[loop->handlesCount].unpollable = 0;
+
+#if HAVE_SYS_EPOLL_H
+    if (loop->backend == VIR_EVENT_POLL_BACKEND_EPOLL &&
+        virEventEpollRegister(loop, &loop->handles[loop->handlesCount]) < 0) {
+        virMutexUnlock(&loop->lock);
+        return -1;
+    }
+#endif
 
-    eventLoop.handlesCount++;
+    loop->handlesCount++;
 
-    virEventPollInterruptLocked();
+    virEventPollInterruptLocked(loop);
 
     PROBE(EVENT_POLL_ADD_HANDLE,
           "watch=%d fd=%d events=%d cb=%p opaque=%p ff=%p",
           watch, fd, events, cb, opaque, ff);
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 
     return watch;
 }
 
-void virEventPollUpdateHandle(int watch, int events) {
+void virEventPollLoopUpdateHandle(virEventPollLoopPtr loop,
+                                  int watch, int events) {
     int i;
     PROBE(EVENT_POLL_UPDATE_HANDLE,
           "watch=%d events=%d",
@@ -154,16 +409,18 @@ void virEventPollUpdateHandle(int watch, int events) {
         return;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0 ; i < eventLoop.handlesCount ; i++) {
-        if (eventLoop.handles[i].watch == watch) {
-            eventLoop.handles[i].events =
-                    virEventPollToNativeEvents(events);
-            virEventPollInterruptLocked();
-            break;
-        }
+    virMutexLock(&loop->lock);
+    if ((i = virEventPollFindHandle(loop, watch)) >= 0 &&
+        !loop->handles[i].deleted) {
+        loop->handles[i].events =
+                virEventPollToNativeEvents(events);
+#if HAVE_SYS_EPOLL_H
+        if (loop->backend == VIR_EVENT_POLL_BACKEND_EPOLL)
+            ignore_value(virEventEpollRegister(loop, &loop->handles[i]));
+#endif
+        virEventPollInterruptLocked(loop);
     }
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 }
 
 /*
@@ -172,7 +429,8 @@ void virEventPollUpdateHandle(int watch, int events) {
  * For this reason we only ever set a flag in the existing list.
  * Actual deletion will be done out-of-band
  */
-int virEventPollRemoveHandle(int watch) {
+int virEventPollLoopRemoveHandle(virEventPollLoopPtr loop,
+                                 int watch) {
     int i;
     PROBE(EVENT_POLL_REMOVE_HANDLE,
           "watch=%d",
@@ -183,21 +441,148 @@ int virEventPollRemoveHandle(int watch) {
         return -1;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0 ; i < eventLoop.handlesCount ; i++) {
-        if (eventLoop.handles[i].deleted)
-            continue;
+    virMutexLock(&loop->lock);
+    if ((i = virEventPollFindHandle(loop, watch)) < 0 ||
+        loop->handles[i].deleted) {
+        virMutexUnlock(&loop->lock);
+        return -1;
+    }
 
-        if (eventLoop.handles[i].watch == watch) {
-            EVENT_DEBUG("mark delete %d %d", i, eventLoop.handles[i].fd);
-            eventLoop.handles[i].deleted = 1;
-            virEventPollInterruptLocked();
-            virMutexUnlock(&eventLoop.lock);
-            return 0;
-        }
+    EVENT_DEBUG("mark delete %d %d", i, loop->handles[i].fd);
+    loop->handles[i].deleted = 1;
+    loop->handlesDeleted++;
+#if HAVE_SYS_EPOLL_H
+    /* The caller is free to close the fd as soon as we return,
+     * so it has to leave the epoll set right now */
+    if (loop->backend == VIR_EVENT_POLL_BACKEND_EPOLL)
+        ignore_value(virEventEpollRemove(loop, &loop->handles[i]));
+#endif
+    virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
+    return 0;
+}
+
+
+/*
+ * Timers are only ever appended with increasing ids and are
+ * compacted in place, so the array stays sorted by id.
+ * returns: the timer, or NULL if not found
+ */
+static struct virEventPollTimeout *
+virEventPollFindTimeout(virEventPollLoopPtr loop, int timer)
+{
+    size_t lo = 0;
+    size_t hi = loop->timeoutsCount;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (loop->timeouts[mid]->timer < timer)
+            lo = mid + 1;
+        else if (loop->timeouts[mid]->timer > timer)
+            hi = mid;
+        else
+            return loop->timeouts[mid];
+    }
+    return NULL;
+}
+
+/* Timers expiring at the same time fire in the order
+ * they were registered */
+static bool virEventPollTimeoutBefore(struct virEventPollTimeout *a,
+                                      struct virEventPollTimeout *b)
+{
+    if (a->expiresAt != b->expiresAt)
+        return a->expiresAt < b->expiresAt;
+    return a->timer < b->timer;
+}
+
+static void virEventPollHeapSet(virEventPollLoopPtr loop,
+                                size_t i, struct virEventPollTimeout *t)
+{
+    loop->heap[i] = t;
+    t->heapIndex = i;
+}
+
+static void virEventPollHeapSiftUp(virEventPollLoopPtr loop,
+                                   size_t i)
+{
+    struct virEventPollTimeout *t = loop->heap[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!virEventPollTimeoutBefore(t, loop->heap[parent]))
+            break;
+        virEventPollHeapSet(loop, i, loop->heap[parent]);
+        i = parent;
+    }
+    virEventPollHeapSet(loop, i, t);
+}
+
+static void virEventPollHeapSiftDown(virEventPollLoopPtr loop,
+                                     size_t i)
+{
+    struct virEventPollTimeout *t = loop->heap[i];
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= loop->heapCount)
+            break;
+        if (child + 1 < loop->heapCount &&
+            virEventPollTimeoutBefore(loop->heap[child + 1],
+                                      loop->heap[child]))
+            child++;
+        if (!virEventPollTimeoutBefore(loop->heap[child], t))
+            break;
+        virEventPollHeapSet(loop, i, loop->heap[child]);
+        i = child;
+    }
+    virEventPollHeapSet(loop, i, t);
+}
+
+/* The heap is sized along with the timeouts array, so this
+ * can't fail */
+static void virEventPollHeapInsert(virEventPollLoopPtr loop,
+                                   struct virEventPollTimeout *t)
+{
+    virEventPollHeapSet(loop, loop->heapCount++, t);
+    virEventPollHeapSiftUp(loop, t->heapIndex);
+}
+
+static void virEventPollHeapRemove(virEventPollLoopPtr loop,
+                                   struct virEventPollTimeout *t)
+{
+    size_t i = t->heapIndex;
+
+    if (i == EVENT_TIMEOUT_UNARMED)
+        return;
+
+    t->heapIndex = EVENT_TIMEOUT_UNARMED;
+    if (i == --loop->heapCount)
+        return;
+
+    virEventPollHeapSet(loop, i, loop->heap[loop->heapCount]);
+    if (i > 0 &&
+        virEventPollTimeoutBefore(loop->heap[i],
+                                  loop->heap[(i - 1) / 2]))
+        virEventPollHeapSiftUp(loop, i);
+    else
+        virEventPollHeapSiftDown(loop, i);
+}
+
+/* Put a timer at its new place in the heap after its
+ * frequency or expiry time changed */
+static void virEventPollHeapUpdate(virEventPollLoopPtr loop,
+                                   struct virEventPollTimeout *t)
+{
+    if (t->frequency < 0) {
+        virEventPollHeapRemove(loop, t);
+    } else if (t->heapIndex == EVENT_TIMEOUT_UNARMED) {
+        virEventPollHeapInsert(loop, t);
+    } else {
+        virEventPollHeapSiftUp(loop, t->heapIndex);
+        virEventPollHeapSiftDown(loop, t->heapIndex);
     }
-    virMutexUnlock(&eventLoop.lock);
-    return -1;
 }
 
 
@@ -206,53 +591,72 @@ int virEventPollRemoveHandle(int watch) {
  * NB, it *must* be safe to call this from within a callback
  * For this reason we only ever append to existing list.
  */
-int virEventPollAddTimeout(int frequency,
-                           virEventTimeoutCallback cb,
-                           void *opaque,
-                           virFreeCallback ff)
+int virEventPollLoopAddTimeout(virEventPollLoopPtr loop,
+                               int frequency,
+                               virEventTimeoutCallback cb,
+                               void *opaque,
+                               virFreeCallback ff)
 {
     unsigned long long now;
+    struct virEventPollTimeout *t;
     int ret;
 
     if (virTimeMs(&now) < 0) {
         return -1;
     }
 
-    virMutexLock(&eventLoop.lock);
-    if (eventLoop.timeoutsCount == eventLoop.timeoutsAlloc) {
+    if (VIR_ALLOC(t) < 0)
+        return -1;
+
+    virMutexLock(&loop->lock);
+    if (loop->timeoutsCount == loop->timeoutsAlloc) {
         EVENT_DEBUG("Used %zu timeout slots, adding at least %d more",
-                    eventLoop.timeoutsAlloc, EVENT_ALLOC_EXTENT);
-        if (VIR_RESIZE_N(eventLoop.timeouts, eventLoop.timeoutsAlloc,
-                         eventLoop.timeoutsCount, EVENT_ALLOC_EXTENT) < 0) {
-            virMutexUnlock(&eventLoop.lock);
+                    loop->timeoutsAlloc, EVENT_ALLOC_EXTENT);
+        if (VIR_RESIZE_N(loop->timeouts, loop->timeoutsAlloc,
+                         loop->timeoutsCount, EVENT_ALLOC_EXTENT) < 0) {
+            virMutexUnlock(&loop->lock);
+            VIR_FREE(t);
             return -1;
         }
     }
+    /* Make sure every timer fits in the heap, and can expire at once */
+    if (VIR_RESIZE_N(loop->heap, loop->heapAlloc,
+                     loop->timeoutsCount, 1) < 0 ||
+        VIR_RESIZE_N(loop->expired, loop->expiredAlloc,
+                     loop->timeoutsCount, 1) < 0) {
+        virMutexUnlock(&loop->lock);
+        VIR_FREE(t);
+        return -1;
+    }
+
+    t->timer = loop->nextTimer++;
+    t->frequency = frequency;
+    t->cb = cb;
+    t->ff = ff;
+    t->opaque = opaque;
+    t->deleted = 0;
+    t->expiresAt = frequency >= 0 ? frequency + now : 0;
+    t->heapIndex = EVENT_TIMEOUT_UNARMED;
 
-    eventLoop.timeouts[eventLoop.timeoutsCount].timer = nextTimer++;
-    eventLoop.timeouts[eventLoop.timeoutsCount].frequency = frequency;
-    eventLoop.timeouts[eventLoop.timeoutsCount].cb = cb;
-    eventLoop.timeouts[eventLoop.timeoutsCount].ff = ff;
-    eventLoop.timeouts[eventLoop.timeoutsCount].opaque = opaque;
-    eventLoop.timeouts[eventLoop.timeoutsCount].deleted = 0;
-    eventLoop.timeouts[eventLoop.timeoutsCount].expiresAt =
-        frequency >= 0 ? frequency + now : 0;
+    loop->timeouts[loop->timeoutsCount++] = t;
+    if (frequency >= 0)
+        virEventPollHeapInsert(loop, t);
 
-    eventLoop.timeoutsCount++;
-    ret = nextTimer-1;
-    virEventPollInterruptLocked();
+    ret = t->timer;
+    virEventPollInterruptLocked(loop);
 
     PROBE(EVENT_POLL_ADD_TIMEOUT,
           "timer=%d frequency=%d cb=%p opaque=%p ff=%p",
           ret, frequency, cb, opaque, ff);
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
     return ret;
 }
 
-void virEventPollUpdateTimeout(int timer, int frequency)
+void virEventPollLoopUpdateTimeout(virEventPollLoopPtr loop,
+                                   int timer, int frequency)
 {
     unsigned long long now;
-    int i;
+    struct virEventPollTimeout *t;
     PROBE(EVENT_POLL_UPDATE_TIMEOUT,
           "timer=%d frequency=%d",
           timer, frequency);
@@ -266,17 +670,14 @@ void virEventPollUpdateTimeout(int timer, int frequency)
         return;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0 ; i < eventLoop.timeoutsCount ; i++) {
-        if (eventLoop.timeouts[i].timer == timer) {
-            eventLoop.timeouts[i].frequency = frequency;
-            eventLoop.timeouts[i].expiresAt =
-                frequency >= 0 ? frequency + now : 0;
-            virEventPollInterruptLocked();
-            break;
-        }
+    virMutexLock(&loop->lock);
+    if ((t = virEventPollFindTimeout(loop, timer)) && !t->deleted) {
+        t->frequency = frequency;
+        t->expiresAt = frequency >= 0 ? frequency + now : 0;
+        virEventPollHeapUpdate(loop, t);
+        virEventPollInterruptLocked(loop);
     }
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 }
 
 /*
@@ -285,8 +686,9 @@ void virEventPollUpdateTimeout(int timer, int frequency)
  * For this reason we only ever set a flag in the existing list.
  * Actual deletion will be done out-of-band
  */
-int virEventPollRemoveTimeout(int timer) {
-    int i;
+int virEventPollLoopRemoveTimeout(virEventPollLoopPtr loop,
+                                  int timer) {
+    struct virEventPollTimeout *t;
     PROBE(EVENT_POLL_REMOVE_TIMEOUT,
           "timer=%d",
           timer);
@@ -296,41 +698,34 @@ int virEventPollRemoveTimeout(int timer) {
         return -1;
     }
 
-    virMutexLock(&eventLoop.lock);
-    for (i = 0 ; i < eventLoop.timeoutsCount ; i++) {
-        if (eventLoop.timeouts[i].deleted)
-            continue;
-
-        if (eventLoop.timeouts[i].timer == timer) {
-            eventLoop.timeouts[i].deleted = 1;
-            virEventPollInterruptLocked();
-            virMutexUnlock(&eventLoop.lock);
-            return 0;
-        }
+    virMutexLock(&loop->lock);
+    if (!(t = virEventPollFindTimeout(loop, timer)) || t->deleted) {
+        virMutexUnlock(&loop->lock);
+        return -1;
     }
-    virMutexUnlock(&eventLoop.lock);
-    return -1;
+
+    t->deleted = 1;
+    loop->timeoutsDeleted++;
+    virEventPollHeapRemove(loop, t);
+    virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
+    return 0;
 }
 
-/* Iterates over all registered timeouts and determine which
- * will be the first to expire.
+/* Determine when the first armed timer expires, which is
+ * always at the top of the heap.
  * @timeout: filled with expiry time of soonest timer, or -1 if
  *           no timeout is pending
  * returns: 0 on success, -1 on error
  */
-static int virEventPollCalculateTimeout(int *timeout) {
+static int virEventPollCalculateTimeout(virEventPollLoopPtr loop,
+                                        int *timeout) {
     unsigned long long then = 0;
-    int i;
-    EVENT_DEBUG("Calculate expiry of %zu timers", eventLoop.timeoutsCount);
+    EVENT_DEBUG("Calculate expiry of %zu armed timers", loop->heapCount);
     /* Figure out if we need a timeout */
-    for (i = 0 ; i < eventLoop.timeoutsCount ; i++) {
-        if (eventLoop.timeouts[i].frequency < 0)
-            continue;
-
-        EVENT_DEBUG("Got a timeout scheduled for %llu", eventLoop.timeouts[i].expiresAt);
-        if (then == 0 ||
-            eventLoop.timeouts[i].expiresAt < then)
-            then = eventLoop.timeouts[i].expiresAt;
+    if (loop->heapCount > 0) {
+        then = loop->heap[0]->expiresAt;
+        EVENT_DEBUG("Got a timeout scheduled for %llu", then);
     }
 
     /* Calculate how long we should wait for a timeout if needed */
@@ -340,9 +735,7 @@ static int virEventPollCalculateTimeout(int *timeout) {
         if (virTimeMs(&now) < 0)
             return -1;
 
-        *timeout = then - now;
-        if (*timeout < 0)
-            *timeout = 0;
+        *timeout = then > now ? then - now : 0;
     } else {
         *timeout = -1;
     }
@@ -357,13 +750,14 @@ static int virEventPollCalculateTimeout(int *timeout) {
  * file handles. The caller must free the returned data struct
  * returns: the pollfd array, or NULL on error
  */
-static struct pollfd *virEventPollMakePollFDs(int *nfds) {
+static struct pollfd *virEventPollMakePollFDs(virEventPollLoopPtr loop,
+                                              int *nfds) {
     struct pollfd *fds;
     int i;
 
     *nfds = 0;
-    for (i = 0 ; i < eventLoop.handlesCount ; i++) {
-        if (eventLoop.handles[i].events && !eventLoop.handles[i].deleted)
+    for (i = 0 ; i < loop->handlesCount ; i++) {
+        if (loop->handles[i].events && !loop->handles[i].deleted)
             (*nfds)++;
     }
 
@@ -374,19 +768,19 @@ static struct pollfd *virEventPollMakePollFDs(int *nfds) {
     }
 
     *nfds = 0;
-    for (i = 0 ; i < eventLoop.handlesCount ; i++) {
+    for (i = 0 ; i < loop->handlesCount ; i++) {
         EVENT_DEBUG("Prepare n=%d w=%d, f=%d e=%d d=%d", i,
-                    eventLoop.handles[i].watch,
-                    eventLoop.handles[i].fd,
-                    eventLoop.handles[i].events,
-                    eventLoop.handles[i].deleted);
-        if (!eventLoop.handles[i].events || eventLoop.handles[i].deleted)
+                    loop->handles[i].watch,
+                    loop->handles[i].fd,
+                    loop->handles[i].events,
+                    loop->handles[i].deleted);
+        if (!loop->handles[i].events || loop->handles[i].deleted)
             continue;
-        fds[*nfds].fd = eventLoop.handles[i].fd;
-        fds[*nfds].events = eventLoop.handles[i].events;
+        fds[*nfds].fd = loop->handles[i].fd;
+        fds[*nfds].events = loop->handles[i].events;
         fds[*nfds].revents = 0;
         (*nfds)++;
-        //EVENT_DEBUG("Wait for %d %d", eventLoop.handles[i].fd, eventLoop.handles[i].events);
+        //EVENT_DEBUG("Wait for %d %d", loop->handles[i].fd, loop->handles[i].events);
     }
 
     return fds;
@@ -394,56 +788,88 @@ static struct pollfd *virEventPollMakePollFDs(int *nfds) {
 
 
 /*
- * Iterate over all timers and determine if any have expired.
- * Invoke the user supplied callback for each timer whose
- * expiry time is met, and schedule the next timeout. Does
- * not try to 'catch up' on time if the actual expiry time
- * was later than the requested time.
+ * Pop all the expired timers off the heap, then invoke the
+ * user supplied callback for each, and schedule the next
+ * timeout. Does not try to 'catch up' on time if the actual
+ * expiry time was later than the requested time.
  *
- * This method must cope with new timers being registered
- * by a callback, and must skip any timers marked as deleted.
+ * Taking the expired timers off the heap first means those
+ * re-armed or registered by a callback wait for the next
+ * iteration, rather than firing again straight away.
+ *
+ * This method must cope with timers being registered, updated
+ * and removed by a callback, and must skip any timers marked
+ * as deleted.
  *
  * Returns 0 upon success, -1 if an error occurred
  */
-static int virEventPollDispatchTimeouts(void)
+static int virEventPollDispatchTimeouts(virEventPollLoopPtr loop)
 {
     unsigned long long now;
-    int i;
-    /* Save this now - it may be changed during dispatch */
-    int ntimeouts = eventLoop.timeoutsCount;
-    VIR_DEBUG("Dispatch %d", ntimeouts);
+    size_t i, nexpired = 0;
 
     if (virTimeMs(&now) < 0)
         return -1;
 
-    for (i = 0 ; i < ntimeouts ; i++) {
-        if (eventLoop.timeouts[i].deleted || eventLoop.timeouts[i].frequency < 0)
+    /* Add 20ms fuzz so we don't pointlessly spin doing
+     * <10ms sleeps, particularly on kernels with low HZ
+     * it is fine that a timer expires 20ms earlier than
+     * requested
+     */
+    while (loop->heapCount > 0 &&
+           loop->heap[0]->expiresAt <= (now+20)) {
+        struct virEventPollTimeout *t = loop->heap[0];
+        virEventPollHeapRemove(loop, t);
+        loop->expired[nexpired++] = t;
+    }
+    VIR_DEBUG("Dispatch %zu", nexpired);
+
+    for (i = 0 ; i < nexpired ; i++) {
+        struct virEventPollTimeout *t = loop->expired[i];
+        virEventTimeoutCallback cb;
+        int timer;
+        void *opaque;
+
+        /* An earlier callback may have changed this timer */
+        if (t->deleted || t->frequency < 0 ||
+            t->expiresAt > (now+20))
             continue;
 
-        /* Add 20ms fuzz so we don't pointlessly spin doing
-         * <10ms sleeps, particularly on kernels with low HZ
-         * it is fine that a timer expires 20ms earlier than
-         * requested
-         */
-        if (eventLoop.timeouts[i].expiresAt <= (now+20)) {
-            virEventTimeoutCallback cb = eventLoop.timeouts[i].cb;
-            int timer = eventLoop.timeouts[i].timer;
-            void *opaque = eventLoop.timeouts[i].opaque;
-            eventLoop.timeouts[i].expiresAt =
-                now + eventLoop.timeouts[i].frequency;
-
-            PROBE(EVENT_POLL_DISPATCH_TIMEOUT,
-                  "timer=%d",
-                  timer);
-            virMutexUnlock(&eventLoop.lock);
-            (cb)(timer, opaque);
-            virMutexLock(&eventLoop.lock);
-        }
+        cb = t->cb;
+        timer = t->timer;
+        opaque = t->opaque;
+        t->expiresAt = now + t->frequency;
+        virEventPollHeapUpdate(loop, t);
+
+        PROBE(EVENT_POLL_DISPATCH_TIMEOUT,
+              "timer=%d",
+              timer);
+        virMutexUnlock(&loop->lock);
+        (cb)(timer, opaque);
+        virMutexLock(&loop->lock);
     }
     return 0;
 }
 
 
+/* Invoke the user supplied callback for the handle at index @i,
+ * dropping the lock while it runs */
+static void virEventPollDispatchHandle(virEventPollLoopPtr loop,
+                                       int i, int revents)
+{
+    virEventHandleCallback cb = loop->handles[i].cb;
+    int watch = loop->handles[i].watch;
+    int fd = loop->handles[i].fd;
+    void *opaque = loop->handles[i].opaque;
+    int hEvents = virEventPollFromNativeEvents(revents);
+    PROBE(EVENT_POLL_DISPATCH_HANDLE,
+          "watch=%d events=%d",
+          watch, hEvents);
+    virMutexUnlock(&loop->lock);
+    (cb)(watch, fd, hEvents, opaque);
+    virMutexLock(&loop->lock);
+}
+
 /* Iterate over all file handles and dispatch any which
  * have pending events listed in the poll() data. Invoke
  * the user supplied callback for each handle which has
@@ -454,92 +880,156 @@ static int virEventPollDispatchTimeouts(void)
  *
  * Returns 0 upon success, -1 if an error occurred
  */
-static int virEventPollDispatchHandles(int nfds, struct pollfd *fds) {
+static int virEventPollDispatchHandles(virEventPollLoopPtr loop,
+                                       int nfds, struct pollfd *fds) {
     int i, n;
     VIR_DEBUG("Dispatch %d", nfds);
 
-    /* NB, use nfds not eventLoop.handlesCount, because new
+    /* NB, use nfds not loop->handlesCount, because new
      * fds might be added on end of list, and they're not
      * in the fds array we've got */
-    for (i = 0, n = 0 ; n < nfds && i < eventLoop.handlesCount ; n++) {
-        while ((eventLoop.handles[i].fd != fds[n].fd ||
-                eventLoop.handles[i].events == 0) &&
-               i < eventLoop.handlesCount) {
+    for (i = 0, n = 0 ; n < nfds && i < loop->handlesCount ; n++) {
+        while (i < loop->handlesCount &&
+               (loop->handles[i].fd != fds[n].fd ||
+                loop->handles[i].events == 0)) {
             i++;
         }
-        if (i == eventLoop.handlesCount)
+        if (i == loop->handlesCount)
             break;
 
-        VIR_DEBUG("i=%d w=%d", i, eventLoop.handles[i].watch);
-        if (eventLoop.handles[i].deleted) {
+        VIR_DEBUG("i=%d w=%d", i, loop->handles[i].watch);
+        if (loop->handles[i].deleted) {
             EVENT_DEBUG("Skip deleted n=%d w=%d f=%d", i,
-                        eventLoop.handles[i].watch, eventLoop.handles[i].fd);
+                        loop->handles[i].watch, loop->handles[i].fd);
+            continue;
+        }
+
+        if (fds[n].revents)
+            virEventPollDispatchHandle(loop, i, fds[n].revents);
+    }
+
+    return 0;
+}
+
+
+#if HAVE_SYS_EPOLL_H
+/* Dispatch the handles reported by epoll_wait(). Watches are
+ * looked up rather than matched positionally, since the set
+ * of handles is not rebuilt for each iteration. Handles which
+ * could not be added to the epoll set are always dispatched.
+ *
+ * This method must cope with new handles being registered
+ * by a callback, and must skip any handles marked as deleted.
+ *
+ * Returns 0 upon success, -1 if an error occurred
+ */
+static int virEventEpollDispatchHandles(virEventPollLoopPtr loop,
+                                        int nevents,
+                                        struct epoll_event *events)
+{
+    int i, n;
+    VIR_DEBUG("Dispatch %d", nevents);
+
+    for (n = 0 ; n < nevents ; n++) {
+        if ((i = virEventPollFindHandle(loop, events[n].data.u32)) < 0)
+            continue;
+
+        VIR_DEBUG("i=%d w=%d", i, loop->handles[i].watch);
+        if (loop->handles[i].deleted ||
+            loop->handles[i].events == 0) {
+            EVENT_DEBUG("Skip n=%d w=%d f=%d", i,
+                        loop->handles[i].watch, loop->handles[i].fd);
             continue;
         }
 
-        if (fds[n].revents) {
-            virEventHandleCallback cb = eventLoop.handles[i].cb;
-            int watch = eventLoop.handles[i].watch;
-            void *opaque = eventLoop.handles[i].opaque;
-            int hEvents = virEventPollFromNativeEvents(fds[n].revents);
-            PROBE(EVENT_POLL_DISPATCH_HANDLE,
-                  "watch=%d events=%d",
-                  watch, hEvents);
-            virMutexUnlock(&eventLoop.lock);
-            (cb)(watch, fds[n].fd, hEvents, opaque);
-            virMutexLock(&eventLoop.lock);
+        virEventPollDispatchHandle(loop, i,
+                                   virEventEpollFromEpollEvents(events[n].events));
+    }
+
+    if (loop->unpollableCount) {
+        /* Save this now - it may be changed during dispatch */
+        int nhandles = loop->handlesCount;
+
+        for (i = 0 ; i < nhandles ; i++) {
+            if (!loop->handles[i].unpollable ||
+                loop->handles[i].deleted ||
+                loop->handles[i].events == 0)
+                continue;
+
+            virEventPollDispatchHandle(loop, i, loop->handles[i].events &
+                                                (POLLIN | POLLOUT));
         }
     }
 
     return 0;
 }
+#endif /* HAVE_SYS_EPOLL_H */
 
 
 /* Used post dispatch to actually remove any timers that
  * were previously marked as deleted. This asynchronous
  * cleanup is needed to make dispatch re-entrant safe.
  */
-static void virEventPollCleanupTimeouts(void) {
-    int i;
+static void virEventPollCleanupTimeouts(virEventPollLoopPtr loop) {
+    struct virEventPollTimeout *purge = NULL;
+    struct virEventPollTimeout **tail = &purge;
+    size_t i, j;
     size_t gap;
-    VIR_DEBUG("Cleanup %zu", eventLoop.timeoutsCount);
+
+    if (loop->timeoutsDeleted == 0)
+        return;
+
+    VIR_DEBUG("Cleanup %zu of %zu", loop->timeoutsDeleted,
+              loop->timeoutsCount);
 
     /* Remove deleted entries, shuffling down remaining
-     * entries as needed to form contiguous series
+     * entries as needed to form contiguous series. The
+     * lock is held throughout so the array is never seen
+     * half compacted.
      */
-    for (i = 0 ; i < eventLoop.timeoutsCount ; ) {
-        if (!eventLoop.timeouts[i].deleted) {
-            i++;
+    for (i = 0, j = 0 ; i < loop->timeoutsCount ; i++) {
+        struct virEventPollTimeout *t = loop->timeouts[i];
+
+        if (t->deleted) {
+            t->next = NULL;
+            *tail = t;
+            tail = &t->next;
             continue;
         }
+        loop->timeouts[j++] = t;
+    }
+    loop->timeoutsCount = j;
+    loop->timeoutsDeleted = 0;
+
+    /* Release some memory if we've got a big chunk free */
+    gap = loop->timeoutsAlloc - loop->timeoutsCount;
+    if (loop->timeoutsCount == 0 ||
+        (gap > loop->timeoutsCount && gap > EVENT_ALLOC_EXTENT)) {
+        EVENT_DEBUG("Found %zu out of %zu timeout slots used, releasing %zu",
+                    loop->timeoutsCount, loop->timeoutsAlloc, gap);
+        VIR_SHRINK_N(loop->timeouts, loop->timeoutsAlloc, gap);
+        VIR_SHRINK_N(loop->heap, loop->heapAlloc,
+                     loop->heapAlloc - loop->timeoutsCount);
+        VIR_SHRINK_N(loop->expired, loop->expiredAlloc,
+                     loop->expiredAlloc - loop->timeoutsCount);
+    }
+
+    /* Now the free callbacks can be run without the lock */
+    while (purge) {
+        struct virEventPollTimeout *t = purge;
+        purge = t->next;
 
         PROBE(EVENT_POLL_PURGE_TIMEOUT,
               "timer=%d",
-              eventLoop.timeouts[i].timer);
-        if (eventLoop.timeouts[i].ff) {
-            virFreeCallback ff = eventLoop.timeouts[i].ff;
-            void *opaque = eventLoop.timeouts[i].opaque;
-            virMutexUnlock(&eventLoop.lock);
+              t->timer);
+        if (t->ff) {
+            virFreeCallback ff = t->ff;
+            void *opaque = t->opaque;
+            virMutexUnlock(&loop->lock);
             ff(opaque);
-            virMutexLock(&eventLoop.lock);
+            virMutexLock(&loop->lock);
         }
-
-        if ((i+1) < eventLoop.timeoutsCount) {
-            memmove(eventLoop.timeouts+i,
-                    eventLoop.timeouts+i+1,
-                    sizeof(struct virEventPollTimeout)*(eventLoop.timeoutsCount
-                                                    -(i+1)));
-        }
-        eventLoop.timeoutsCount--;
-    }
-
-    /* Release some memory if we've got a big chunk free */
-    gap = eventLoop.timeoutsAlloc - eventLoop.timeoutsCount;
-    if (eventLoop.timeoutsCount == 0 ||
-        (gap > eventLoop.timeoutsCount && gap > EVENT_ALLOC_EXTENT)) {
-        EVENT_DEBUG("Found %zu out of %zu timeout slots used, releasing %zu",
-                    eventLoop.timeoutsCount, eventLoop.timeoutsAlloc, gap);
-        VIR_SHRINK_N(eventLoop.timeouts, eventLoop.timeoutsAlloc, gap);
+        VIR_FREE(t);
     }
 }
 
@@ -547,70 +1037,150 @@ static void virEventPollCleanupTimeouts(void) {
  * were previously marked as deleted. This asynchronous
  * cleanup is needed to make dispatch re-entrant safe.
  */
-static void virEventPollCleanupHandles(void) {
+static void virEventPollCleanupHandles(virEventPollLoopPtr loop) {
     int i;
     size_t gap;
-    VIR_DEBUG("Cleanup %zu", eventLoop.handlesCount);
+
+    if (loop->handlesDeleted == 0)
+        return;
+
+    VIR_DEBUG("Cleanup %zu of %zu", loop->handlesDeleted,
+              loop->handlesCount);
 
     /* Remove deleted entries, shuffling down remaining
      * entries as needed to form contiguous series
      */
-    for (i = 0 ; i < eventLoop.handlesCount ; ) {
-        if (!eventLoop.handles[i].deleted) {
+    for (i = 0 ; i < loop->handlesCount ; ) {
+        if (!loop->handles[i].deleted) {
             i++;
             continue;
         }
 
         PROBE(EVENT_POLL_PURGE_HANDLE,
               "watch=%d",
-              eventLoop.handles[i].watch);
-        if (eventLoop.handles[i].ff) {
-            virFreeCallback ff = eventLoop.handles[i].ff;
-            void *opaque = eventLoop.handles[i].opaque;
-            virMutexUnlock(&eventLoop.lock);
+              loop->handles[i].watch);
+        if (loop->handles[i].ff) {
+            virFreeCallback ff = loop->handles[i].ff;
+            void *opaque = loop->handles[i].opaque;
+            virMutexUnlock(&loop->lock);
             ff(opaque);
-            virMutexLock(&eventLoop.lock);
+            virMutexLock(&loop->lock);
         }
 
-        if ((i+1) < eventLoop.handlesCount) {
-            memmove(eventLoop.handles+i,
-                    eventLoop.handles+i+1,
-                    sizeof(struct virEventPollHandle)*(eventLoop.handlesCount
+        if ((i+1) < loop->handlesCount) {
+            memmove(loop->handles+i,
+                    loop->handles+i+1,
+                    sizeof(struct virEventPollHandle)*(loop->handlesCount
                                                    -(i+1)));
         }
-        eventLoop.handlesCount--;
+        loop->handlesCount--;
+        /* Counted down one at a time, as handles before i may be
+         * deleted while the lock is dropped for ff */
+        loop->handlesDeleted--;
     }
 
     /* Release some memory if we've got a big chunk free */
-    gap = eventLoop.handlesAlloc - eventLoop.handlesCount;
-    if (eventLoop.handlesCount == 0 ||
-        (gap > eventLoop.handlesCount && gap > EVENT_ALLOC_EXTENT)) {
+    gap = loop->handlesAlloc - loop->handlesCount;
+    if (loop->handlesCount == 0 ||
+        (gap > loop->handlesCount && gap > EVENT_ALLOC_EXTENT)) {
         EVENT_DEBUG("Found %zu out of %zu handles slots used, releasing %zu",
-                    eventLoop.handlesCount, eventLoop.handlesAlloc, gap);
-        VIR_SHRINK_N(eventLoop.handles, eventLoop.handlesAlloc, gap);
+                    loop->handlesCount, loop->handlesAlloc, gap);
+        VIR_SHRINK_N(loop->handles, loop->handlesAlloc, gap);
     }
 }
 
+#if HAVE_SYS_EPOLL_H
+/*
+ * Run a single iteration of the event loop using epoll. The
+ * file handles are registered with the kernel as they are
+ * added and updated, so only the timers need to be looked at
+ * before waiting.
+ */
+static int virEventEpollRunOnce(virEventPollLoopPtr loop)
+{
+    struct epoll_event events[EVENT_EPOLL_MAX_EVENTS];
+    int ret, timeout;
+
+    virMutexLock(&loop->lock);
+    loop->running = 1;
+    virThreadSelf(&loop->leader);
+
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
+
+    if (virEventPollCalculateTimeout(loop, &timeout) < 0)
+        goto error;
+
+    /* Don't block if there are handles which are always ready */
+    if (loop->unpollableCount)
+        timeout = 0;
+
+    EVENT_DEBUG("Wait on %zu handles, %zu always ready",
+                loop->handlesCount, loop->unpollableCount);
+    PROBE(EVENT_POLL_RUN,
+          "nhandles=%d imeout=%d",
+          (int)loop->handlesCount, timeout);
+    virMutexUnlock(&loop->lock);
+
+ retry:
+    ret = epoll_wait(loop->epollfd, events,
+                     ARRAY_CARDINALITY(events), timeout);
+    if (ret < 0) {
+        EVENT_DEBUG("Poll got error event %d", errno);
+        if (errno == EINTR) {
+            goto retry;
+        }
+        virReportSystemError(errno, "%s",
+                             _("Unable to poll on file handles"));
+        return -1;
+    }
+    EVENT_DEBUG("Poll got %d event(s)", ret);
+
+    virMutexLock(&loop->lock);
+    if (virEventPollDispatchTimeouts(loop) < 0)
+        goto error;
+
+    if (virEventEpollDispatchHandles(loop, ret, events) < 0)
+        goto error;
+
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
+
+    loop->running = 0;
+    virMutexUnlock(&loop->lock);
+    return 0;
+
+error:
+    virMutexUnlock(&loop->lock);
+    return -1;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 /*
  * Run a single iteration of the event loop, blocking until
  * at least one file handle has an event, or a timer expires
  */
-int virEventPollRunOnce(void) {
+int virEventPollLoopRunOnce(virEventPollLoopPtr loop) {
     struct pollfd *fds = NULL;
     int ret, timeout, nfds;
 
-    virMutexLock(&eventLoop.lock);
-    eventLoop.running = 1;
-    virThreadSelf(&eventLoop.leader);
+#if HAVE_SYS_EPOLL_H
+    if (loop->backend == VIR_EVENT_POLL_BACKEND_EPOLL)
+        return virEventEpollRunOnce(loop);
+#endif
+
+    virMutexLock(&loop->lock);
+    loop->running = 1;
+    virThreadSelf(&loop->leader);
 
-    virEventPollCleanupTimeouts();
-    virEventPollCleanupHandles();
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
 
-    if (!(fds = virEventPollMakePollFDs(&nfds)) ||
-        virEventPollCalculateTimeout(&timeout) < 0)
+    if (!(fds = virEventPollMakePollFDs(loop, &nfds)) ||
+        virEventPollCalculateTimeout(loop, &timeout) < 0)
         goto error;
 
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 
  retry:
     PROBE(EVENT_POLL_RUN,
@@ -628,24 +1198,24 @@ int virEventPollRunOnce(void) {
     }
     EVENT_DEBUG("Poll got %d event(s)", ret);
 
-    virMutexLock(&eventLoop.lock);
-    if (virEventPollDispatchTimeouts() < 0)
+    virMutexLock(&loop->lock);
+    if (virEventPollDispatchTimeouts(loop) < 0)
         goto error;
 
     if (ret > 0 &&
-        virEventPollDispatchHandles(nfds, fds) < 0)
+        virEventPollDispatchHandles(loop, nfds, fds) < 0)
         goto error;
 
-    virEventPollCleanupTimeouts();
-    virEventPollCleanupHandles();
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
 
-    eventLoop.running = 0;
-    virMutexUnlock(&eventLoop.lock);
+    loop->running = 0;
+    virMutexUnlock(&loop->lock);
     VIR_FREE(fds);
     return 0;
 
 error:
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 error_unlocked:
     VIR_FREE(fds);
     return -1;
@@ -655,68 +1225,209 @@ error_unlocked:
 static void virEventPollHandleWakeup(int watch ATTRIBUTE_UNUSED,
                                      int fd,
                                      int events ATTRIBUTE_UNUSED,
-                                     void *opaque ATTRIBUTE_UNUSED)
+                                     void *opaque)
 {
+    virEventPollLoopPtr loop = opaque;
     char c;
-    virMutexLock(&eventLoop.lock);
+    virMutexLock(&loop->lock);
     ignore_value(saferead(fd, &c, sizeof(c)));
-    virMutexUnlock(&eventLoop.lock);
+    virMutexUnlock(&loop->lock);
 }
 
-int virEventPollInit(void)
+static int virEventPollLoopInit(virEventPollLoopPtr loop)
 {
-    if (virMutexInit(&eventLoop.lock) < 0) {
+    loop->nextWatch = 1;
+    loop->nextTimer = 1;
+    loop->epollfd = -1;
+    loop->wakeupfd[0] = loop->wakeupfd[1] = -1;
+
+    if (virMutexInit(&loop->lock) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to initialize mutex"));
         return -1;
     }
 
-    if (pipe2(eventLoop.wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
+#if HAVE_SYS_EPOLL_H
+    if (loop->backend == VIR_EVENT_POLL_BACKEND_EPOLL) {
+        if ((loop->epollfd = epoll_create(EVENT_EPOLL_MAX_EVENTS)) < 0 ||
+            virSetCloseExec(loop->epollfd) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to create epoll set"));
+            goto error;
+        }
+    }
+#endif
+
+    if (pipe2(loop->wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to setup wakeup pipe"));
-        return -1;
+        goto error;
     }
 
-    if (virEventPollAddHandle(eventLoop.wakeupfd[0],
-                              VIR_EVENT_HANDLE_READABLE,
-                              virEventPollHandleWakeup, NULL, NULL) < 0) {
+    if (virEventPollLoopAddHandle(loop, loop->wakeupfd[0],
+                                  VIR_EVENT_HANDLE_READABLE,
+                                  virEventPollHandleWakeup, loop, NULL) < 0) {
         virEventError(VIR_ERR_INTERNAL_ERROR,
                       _("Unable to add handle %d to event loop"),
-                      eventLoop.wakeupfd[0]);
-        VIR_FORCE_CLOSE(eventLoop.wakeupfd[0]);
-        VIR_FORCE_CLOSE(eventLoop.wakeupfd[1]);
-        return -1;
+                      loop->wakeupfd[0]);
+        goto error;
     }
 
     return 0;
+
+error:
+    VIR_FORCE_CLOSE(loop->wakeupfd[0]);
+    VIR_FORCE_CLOSE(loop->wakeupfd[1]);
+    VIR_FORCE_CLOSE(loop->epollfd);
+    VIR_FREE(loop->handles);
+    loop->handlesCount = loop->handlesAlloc = 0;
+    VIR_FREE(loop->efdUsers);
+    loop->efdUsersAlloc = 0;
+    virMutexDestroy(&loop->lock);
+    return -1;
 }
 
-static int virEventPollInterruptLocked(void)
+int virEventPollInit(void)
+{
+    return virEventPollLoopInit(&eventLoop);
+}
+
+virEventPollLoopPtr virEventPollLoopNew(void)
+{
+    virEventPollLoopPtr loop;
+
+    if (VIR_ALLOC(loop) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    loop->backend = eventLoop.backend;
+    if (virEventPollLoopInit(loop) < 0) {
+        VIR_FREE(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+/*
+ * Free a loop made by virEventPollLoopNew. No thread may be
+ * running it any more. The free callbacks of any handles and
+ * timers still registered are invoked.
+ */
+void virEventPollLoopFree(virEventPollLoopPtr loop)
+{
+    size_t i;
+
+    if (!loop)
+        return;
+
+    virMutexLock(&loop->lock);
+    for (i = 0 ; i < loop->handlesCount ; i++) {
+        if (loop->handles[i].deleted)
+            continue;
+        loop->handles[i].deleted = 1;
+        loop->handlesDeleted++;
+#if HAVE_SYS_EPOLL_H
+        if (loop->backend == VIR_EVENT_POLL_BACKEND_EPOLL)
+            ignore_value(virEventEpollRemove(loop, &loop->handles[i]));
+#endif
+    }
+    for (i = 0 ; i < loop->timeoutsCount ; i++) {
+        if (loop->timeouts[i]->deleted)
+            continue;
+        loop->timeouts[i]->deleted = 1;
+        loop->timeoutsDeleted++;
+    }
+    virEventPollCleanupTimeouts(loop);
+    virEventPollCleanupHandles(loop);
+    virMutexUnlock(&loop->lock);
+
+    VIR_FORCE_CLOSE(loop->wakeupfd[0]);
+    VIR_FORCE_CLOSE(loop->wakeupfd[1]);
+    VIR_FORCE_CLOSE(loop->epollfd);
+    VIR_FREE(loop->handles);
+    VIR_FREE(loop->efdUsers);
+    VIR_FREE(loop->timeouts);
+    VIR_FREE(loop->heap);
+    VIR_FREE(loop->expired);
+    virMutexDestroy(&loop->lock);
+    VIR_FREE(loop);
+}
+
+static int virEventPollInterruptLocked(virEventPollLoopPtr loop)
 {
     char c = '\0';
 
-    if (!eventLoop.running ||
-        virThreadIsSelf(&eventLoop.leader)) {
-        VIR_DEBUG("Skip interrupt, %d %d", eventLoop.running,
-                  virThreadID(&eventLoop.leader));
+    if (!loop->running ||
+        virThreadIsSelf(&loop->leader)) {
+        VIR_DEBUG("Skip interrupt, %d %d", loop->running,
+                  virThreadID(&loop->leader));
         return 0;
     }
 
     VIR_DEBUG("Interrupting");
-    if (safewrite(eventLoop.wakeupfd[1], &c, sizeof(c)) != sizeof(c))
+    if (safewrite(loop->wakeupfd[1], &c, sizeof(c)) != sizeof(c))
         return -1;
     return 0;
 }
 
-int virEventPollInterrupt(void)
+int virEventPollLoopInterrupt(virEventPollLoopPtr loop)
 {
     int ret;
-    virMutexLock(&eventLoop.lock);
-    ret = virEventPollInterruptLocked();
-    virMutexUnlock(&eventLoop.lock);
+    virMutexLock(&loop->lock);
+    ret = virEventPollInterruptLocked(loop);
+    virMutexUnlock(&loop->lock);
     return ret;
 }
 
+
+int virEventPollAddHandle(int fd, int events,
+                          virEventHandleCallback cb,
+                          void *opaque,
+                          virFreeCallback ff)
+{
+    return virEventPollLoopAddHandle(&eventLoop, fd, events, cb, opaque, ff);
+}
+
+void virEventPollUpdateHandle(int watch, int events)
+{
+    virEventPollLoopUpdateHandle(&eventLoop, watch, events);
+}
+
+int virEventPollRemoveHandle(int watch)
+{
+    return virEventPollLoopRemoveHandle(&eventLoop, watch);
+}
+
+int virEventPollAddTimeout(int frequency,
+                           virEventTimeoutCallback cb,
+                           void *opaque,
+                           virFreeCallback ff)
+{
+    return virEventPollLoopAddTimeout(&eventLoop, frequency, cb, opaque, ff);
+}
+
+void virEventPollUpdateTimeout(int timer, int frequency)
+{
+    virEventPollLoopUpdateTimeout(&eventLoop, timer, frequency);
+}
+
+int virEventPollRemoveTimeout(int timer)
+{
+    return virEventPollLoopRemoveTimeout(&eventLoop, timer);
+}
+
+int virEventPollRunOnce(void)
+{
+    return virEventPollLoopRunOnce(&eventLoop);
+}
+
+int virEventPollInterrupt(void)
+{
+    return virEventPollLoopInterrupt(&eventLoop);
+}
+
 int
 virEventPollToNativeEvents(int events)
 {
@@ -25,6 +25,29 @@
 # define __VIR_EVENT_POLL_H__
 
 # include "internal.h"
+# include "util.h"
+
+enum {
+    VIR_EVENT_POLL_BACKEND_POLL,  /* poll(), rebuilding the fd set each iteration */
+    VIR_EVENT_POLL_BACKEND_EPOLL, /* epoll, with persistent fd registrations */
+
+    VIR_EVENT_POLL_BACKEND_LAST
+};
+
+VIR_ENUM_DECL(virEventPollBackend)
+
+/**
+ * virEventPollSetBackend: choose the file handle monitoring backend
+ *
+ * @backend: one of the VIR_EVENT_POLL_BACKEND_* constants
+ *
+ * Must be called before virEventPollInit. Timers are handled
+ * the same way regardless of the backend.
+ *
+ * returns -1 if the backend is not supported on this platform,
+ * 0 upon success
+ */
+int virEventPollSetBackend(int backend);
 
 /**
  * virEventPollAddHandle: register a callback for monitoring file handle events
@@ -129,4 +152,41 @@ int virEventPollToNativeEvents(int events);
 int virEventPollInterrupt(void);
 
 
+/*
+ * Further event loops, each to be run by a thread of its own,
+ * have the same API as the default one above, with the loop as
+ * an extra first argument. They use the backend chosen for the
+ * default loop. Watch and timer ids are only unique within the
+ * loop which returned them.
+ */
+typedef struct virEventPollLoop virEventPollLoop;
+typedef virEventPollLoop *virEventPollLoopPtr;
+
+virEventPollLoopPtr virEventPollLoopNew(void);
+void virEventPollLoopFree(virEventPollLoopPtr loop);
+
+int virEventPollLoopAddHandle(virEventPollLoopPtr loop,
+                              int fd, int events,
+                              virEventHandleCallback cb,
+                              void *opaque,
+                              virFreeCallback ff);
+void virEventPollLoopUpdateHandle(virEventPollLoopPtr loop,
+                                  int watch, int events);
+int virEventPollLoopRemoveHandle(virEventPollLoopPtr loop,
+                                 int watch);
+
+int virEventPollLoopAddTimeout(virEventPollLoopPtr loop,
+                               int frequency,
+                               virEventTimeoutCallback cb,
+                               void *opaque,
+                               virFreeCallback ff);
+void virEventPollLoopUpdateTimeout(virEventPollLoopPtr loop,
+                                   int timer, int frequency);
+int virEventPollLoopRemoveTimeout(virEventPollLoopPtr loop,
+                                  int timer);
+
+int virEventPollLoopRunOnce(virEventPollLoopPtr loop);
+int virEventPollLoopInterrupt(virEventPollLoopPtr loop);
+
+
 #endif /* __VIRTD_EVENT_H__ */
@@ -23,6 +23,7 @@
  *   - Read existing file
  *   - Write existing file
  *   - Create & write new file
+ *   - Compress & decompress stdin to stdout
  */
 
 #include <config.h>
@@ -36,6 +37,7 @@
 #include "util.h"
 #include "threads.h"
 #include "virfile.h"
+#include "virpzip.h"
 #include "memory.h"
 #include "virterror_internal.h"
 #include "configmake.h"
@@ -71,6 +73,45 @@ cleanup:
     return fd;
 }
 
+#ifdef SPLICE_F_MOVE
+/* Move data straight from @fdin to @fdout in the kernel, for as
+ * long as it lets us; it only can if one of them is a pipe. Sets
+ * @done once the end of the data is reached, and otherwise leaves
+ * the rest to be copied by hand.  */
+static int
+runSplice(int fdin, const char *fdinname,
+          int fdout, const char *fdoutname,
+          unsigned long long length, size_t buflen,
+          unsigned long long *total, bool *done)
+{
+    while (!length || *total < length) {
+        size_t want = buflen;
+        ssize_t got;
+
+        if (length && (length - *total) < want)
+            want = length - *total;
+
+        got = splice(fdin, NULL, fdout, NULL, want,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS)
+                return 0;
+            virReportSystemError(errno, _("Unable to move data from %s to %s"),
+                                 fdinname, fdoutname);
+            return -1;
+        }
+        if (got == 0)
+            break;
+        *total += got;
+    }
+
+    *done = true;
+    return 0;
+}
+#endif
+
 static int
 runIO(const char *path, int fd, int oflags, unsigned long long length)
 {
@@ -137,6 +178,20 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
         goto cleanup;
     }
 
+#ifdef SPLICE_F_MOVE
+    if (!direct) {
+        bool done = false;
+
+        if (runSplice(fdin, fdinname, fdout, fdoutname,
+                      length, buflen, &total, &done) < 0)
+            goto cleanup;
+        if (done) {
+            ret = 0;
+            goto cleanup;
+        }
+    }
+#endif
+
     while (1) {
         ssize_t got;
 
@@ -200,8 +255,9 @@ usage(int status)
         fprintf(stderr, _("%s: try --help for more details"), program_name);
     } else {
         printf(_("Usage: %s FILENAME OFLAGS MODE OFFSET LENGTH DELETE\n"
-                 "   or: %s FILENAME LENGTH FD\n"),
-               program_name, program_name);
+                 "   or: %s FILENAME LENGTH FD\n"
+                 "   or: %s -c|-dc [THREADS]\n"),
+               program_name, program_name, program_name);
     }
     exit(status);
 }
@@ -239,6 +295,26 @@ main(int argc, char **argv)
 
     if (argc > 1 && STREQ(argv[1], "--help"))
         usage(EXIT_SUCCESS);
+    if (argc > 1 && (STREQ(argv[1], "-c") || STREQ(argv[1], "-dc"))) {
+        /* -c|-dc [THREADS], like gzip, stdin to stdout */
+        unsigned int nthreads = 0;
+        int rc;
+
+        if (argc > 3 ||
+            (argc == 3 && virStrToLong_ui(argv[2], NULL, 10, &nthreads) < 0))
+            usage(EXIT_FAILURE);
+
+        path = "stdin";
+        if (STREQ(argv[1], "-c"))
+            rc = virPZipCompress(STDIN_FILENO, "stdin",
+                                 STDOUT_FILENO, "stdout", nthreads);
+        else
+            rc = virPZipDecompress(STDIN_FILENO, "stdin",
+                                   STDOUT_FILENO, "stdout", nthreads);
+        if (rc < 0)
+            goto error;
+        return 0;
+    }
     if (argc == 7) { /* FILENAME OFLAGS MODE OFFSET LENGTH DELETE */
         lengthIndex = 5;
         if (virStrToLong_i(argv[2], NULL, 10, &oflags) < 0) {
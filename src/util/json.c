@@ -48,28 +48,85 @@
                          __FUNCTION__, __LINE__, __VA_ARGS__)
 
 
+/* Objects with at least this many members get a hash index */
+#define VIR_JSON_OBJECT_INDEX_MIN 8
+
+/* Arena blocks grow from the size of the document being parsed
+ * up to this, after which they stay the same size */
+#define VIR_JSON_ARENA_BLOCK_MIN 4096
+#define VIR_JSON_ARENA_BLOCK_MAX (1024 * 1024)
+#define VIR_JSON_ARENA_ALIGN sizeof(void *)
+
+typedef struct _virJSONArenaBlock virJSONArenaBlock;
+typedef virJSONArenaBlock *virJSONArenaBlockPtr;
+struct _virJSONArenaBlock {
+    virJSONArenaBlockPtr next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct _virJSONArena {
+    virJSONValuePtr root;
+    virJSONArenaBlockPtr blocks;
+    size_t nblocks;
+    size_t blocksize;
+};
+
 typedef struct _virJSONParserState virJSONParserState;
 typedef virJSONParserState *virJSONParserStatePtr;
 struct _virJSONParserState {
     virJSONValuePtr value;
     char *key;
+    /* Where the members of this container start in the pending list */
+    size_t first;
 };
 
 typedef struct _virJSONParser virJSONParser;
 typedef virJSONParser *virJSONParserPtr;
 struct _virJSONParser {
+    virJSONArenaPtr arena;
     virJSONValuePtr head;
     virJSONParserStatePtr state;
-    unsigned int nstate;
+    size_t nstate;
+    size_t nstate_max;
+    /* Members of all open containers, innermost last. They are only
+     * moved into their container, in an array of the right size,
+     * once it is closed */
+    virJSONObjectPairPtr pending;
+    size_t npending;
+    size_t npending_max;
 };
 
 
+static void virJSONArenaFree(virJSONArenaPtr arena)
+{
+    virJSONArenaBlockPtr block;
+
+    if (!arena)
+        return;
+
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        VIR_FREE(block);
+    }
+    VIR_FREE(arena);
+}
+
+
 void virJSONValueFree(virJSONValuePtr value)
 {
     int i;
     if (!value)
         return;
 
+    /* Values in an arena go away all at once, with their root */
+    if (value->arena) {
+        if (value->arena->root == value)
+            virJSONArenaFree(value->arena);
+        return;
+    }
+
     switch (value->type) {
     case VIR_JSON_TYPE_OBJECT:
         for (i = 0 ; i < value->data.object.npairs; i++) {
@@ -77,6 +134,7 @@ void virJSONValueFree(virJSONValuePtr value)
             virJSONValueFree(value->data.object.pairs[i].value);
         }
         VIR_FREE(value->data.object.pairs);
+        VIR_FREE(value->data.object.index);
         break;
     case VIR_JSON_TYPE_ARRAY:
         for (i = 0 ; i < value->data.array.nvalues ; i++)
@@ -95,6 +153,46 @@ void virJSONValueFree(virJSONValuePtr value)
 }
 
 
+/**
+ * virJSONValueCountAllocs:
+ * @value: the value
+ *
+ * Returns the number of memory allocations @value is made of, or
+ * for a value in an arena, the whole arena is. Only meant for the
+ * tests, which link the library statically, so it is not exported.
+ */
+size_t virJSONValueCountAllocs(virJSONValuePtr value)
+{
+    size_t count = 1;
+    int i;
+
+    if (!value)
+        return 0;
+
+    if (value->arena)
+        return value->arena->nblocks + 1;
+
+    switch (value->type) {
+    case VIR_JSON_TYPE_OBJECT:
+        for (i = 0 ; i < value->data.object.npairs; i++)
+            count += 1 + virJSONValueCountAllocs(value->data.object.pairs[i].value);
+        count += !!value->data.object.pairs + !!value->data.object.index;
+        break;
+    case VIR_JSON_TYPE_ARRAY:
+        for (i = 0 ; i < value->data.array.nvalues ; i++)
+            count += virJSONValueCountAllocs(value->data.array.values[i]);
+        count += !!value->data.array.values;
+        break;
+    case VIR_JSON_TYPE_STRING:
+    case VIR_JSON_TYPE_NUMBER:
+        count++;
+        break;
+    }
+
+    return count;
+}
+
+
 virJSONValuePtr virJSONValueNewString(const char *data)
 {
     virJSONValuePtr val;
@@ -262,7 +360,7 @@ int virJSONValueObjectAppend(virJSONValuePtr object, const char *key, virJSONVal
 {
     char *newkey;
 
-    if (object->type != VIR_JSON_TYPE_OBJECT)
+    if (object->type != VIR_JSON_TYPE_OBJECT || object->arena)
         return -1;
 
     if (virJSONValueObjectHasKey(object, key))
@@ -271,6 +369,10 @@ int virJSONValueObjectAppend(virJSONValuePtr object, const char *key, virJSONVal
     if (!(newkey = strdup(key)))
         return -1;
 
+    /* Not worth keeping up to date, lookups can do without */
+    VIR_FREE(object->data.object.index);
+    object->data.object.nindex = 0;
+
     if (VIR_REALLOC_N(object->data.object.pairs,
                       object->data.object.npairs + 1) < 0) {
         VIR_FREE(newkey);
@@ -385,7 +487,7 @@ int virJSONValueObjectAppendNull(virJSONValuePtr object, const char *key)
 
 int virJSONValueArrayAppend(virJSONValuePtr array, virJSONValuePtr value)
 {
-    if (array->type != VIR_JSON_TYPE_ARRAY)
+    if (array->type != VIR_JSON_TYPE_ARRAY || array->arena)
         return -1;
 
     if (VIR_REALLOC_N(array->data.array.values,
@@ -398,34 +500,62 @@ int virJSONValueArrayAppend(virJSONValuePtr array, virJSONValuePtr value)
     return 0;
 }
 
-int virJSONValueObjectHasKey(virJSONValuePtr object, const char *key)
+/* FNV-1a */
+static unsigned int virJSONKeyHash(const char *key)
 {
-    int i;
+    unsigned int hash = 2166136261U;
 
-    if (object->type != VIR_JSON_TYPE_OBJECT)
-        return -1;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static virJSONObjectPairPtr virJSONObjectFind(virJSONObjectPtr object,
+                                              const char *key)
+{
+    unsigned int i;
 
-    for (i = 0 ; i < object->data.object.npairs ; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key))
-            return 1;
+    if (object->nindex) {
+        unsigned int mask = object->nindex - 1;
+
+        for (i = virJSONKeyHash(key) & mask ;
+             object->index[i] ;
+             i = (i + 1) & mask) {
+            if (STREQ(object->pairs[object->index[i] - 1].key, key))
+                return &object->pairs[object->index[i] - 1];
+        }
+        return NULL;
     }
 
-    return 0;
+    for (i = 0 ; i < object->npairs ; i++) {
+        if (STREQ(object->pairs[i].key, key))
+            return &object->pairs[i];
+    }
+
+    return NULL;
+}
+
+int virJSONValueObjectHasKey(virJSONValuePtr object, const char *key)
+{
+    if (object->type != VIR_JSON_TYPE_OBJECT)
+        return -1;
+
+    return virJSONObjectFind(&object->data.object, key) != NULL;
 }
 
 virJSONValuePtr virJSONValueObjectGet(virJSONValuePtr object, const char *key)
 {
-    int i;
+    virJSONObjectPairPtr pair;
 
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return NULL;
 
-    for (i = 0 ; i < object->data.object.npairs ; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key))
-            return object->data.object.pairs[i].value;
-    }
+    if (!(pair = virJSONObjectFind(&object->data.object, key)))
+        return NULL;
 
-    return NULL;
+    return pair->value;
 }
 
 int virJSONValueArraySize(virJSONValuePtr array)
@@ -630,6 +760,106 @@ int virJSONValueObjectIsNull(virJSONValuePtr object, const char *key)
 
 
 #if HAVE_YAJL
+static virJSONArenaPtr virJSONArenaNew(size_t hint)
+{
+    virJSONArenaPtr arena;
+
+    if (VIR_ALLOC(arena) < 0)
+        return NULL;
+
+    arena->blocksize = MAX(VIR_JSON_ARENA_BLOCK_MIN,
+                           MIN(hint, VIR_JSON_ARENA_BLOCK_MAX));
+    return arena;
+}
+
+/* Returns zeroed memory which lives as long as @arena */
+static void *virJSONArenaAlloc(virJSONArenaPtr arena, size_t size)
+{
+    virJSONArenaBlockPtr block = arena->blocks;
+    void *ret;
+
+    size = VIR_DIV_UP(size, VIR_JSON_ARENA_ALIGN) * VIR_JSON_ARENA_ALIGN;
+
+    if (!block || block->size - block->used < size) {
+        size_t want = arena->blocksize;
+
+        if (arena->nblocks && want < VIR_JSON_ARENA_BLOCK_MAX)
+            want = MIN(want * 2, VIR_JSON_ARENA_BLOCK_MAX);
+        arena->blocksize = want;
+        want = MAX(want, size);
+
+        if (VIR_ALLOC_VAR(block, char, want) < 0)
+            return NULL;
+        block->size = want;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->nblocks++;
+    }
+
+    ret = block->data + block->used;
+    block->used += size;
+    return ret;
+}
+
+
+static virJSONValuePtr virJSONParserNewValue(virJSONParserPtr parser,
+                                             int type)
+{
+    virJSONValuePtr value;
+
+    if (parser->arena) {
+        if (!(value = virJSONArenaAlloc(parser->arena, sizeof(*value))))
+            return NULL;
+        value->arena = parser->arena;
+    } else {
+        if (VIR_ALLOC(value) < 0)
+            return NULL;
+    }
+
+    value->type = type;
+    return value;
+}
+
+static char *virJSONParserStrndup(virJSONParserPtr parser,
+                                  const char *str,
+                                  size_t len)
+{
+    char *ret;
+
+    if (!parser->arena)
+        return strndup(str, len);
+
+    if (!(ret = virJSONArenaAlloc(parser->arena, len + 1)))
+        return NULL;
+    memcpy(ret, str, len);
+    return ret;
+}
+
+static void *virJSONParserAllocN(virJSONParserPtr parser,
+                                 size_t size,
+                                 size_t count)
+{
+    void *ret;
+
+    if (parser->arena) {
+        if (xalloc_oversized(count, size))
+            return NULL;
+        return virJSONArenaAlloc(parser->arena, size * count);
+    }
+
+    if (virAllocN(&ret, size, count) < 0)
+        return NULL;
+    return ret;
+}
+
+static void virJSONParserFreeString(virJSONParserPtr parser,
+                                    char **str)
+{
+    if (!parser->arena)
+        VIR_FREE(*str);
+    *str = NULL;
+}
+
 static int virJSONParserInsertValue(virJSONParserPtr parser,
                                     virJSONValuePtr value)
 {
@@ -650,13 +880,6 @@ static int virJSONParserInsertValue(virJSONParserPtr parser,
                 VIR_DEBUG("missing key when inserting object value");
                 return -1;
             }
-
-            if (virJSONValueObjectAppend(state->value,
-                                         state->key,
-                                         value) < 0)
-                return -1;
-
-            VIR_FREE(state->key);
         }   break;
 
         case VIR_JSON_TYPE_ARRAY: {
@@ -664,25 +887,143 @@ static int virJSONParserInsertValue(virJSONParserPtr parser,
                 VIR_DEBUG("unexpected key when inserting array value");
                 return -1;
             }
-
-            if (virJSONValueArrayAppend(state->value,
-                                        value) < 0)
-                return -1;
         }   break;
 
         default:
             VIR_DEBUG("unexpected value type, not a container");
             return -1;
         }
+
+        if (VIR_RESIZE_N(parser->pending, parser->npending_max,
+                         parser->npending, 1) < 0)
+            return -1;
+
+        parser->pending[parser->npending].key = state->key;
+        parser->pending[parser->npending].value = value;
+        parser->npending++;
+        state->key = NULL;
+    }
+
+    return 0;
+}
+
+/* Index the members of a large object by key, and check there
+ * are no duplicates, which would be refused when appending */
+static int virJSONParserIndexObject(virJSONParserPtr parser,
+                                    virJSONObjectPtr object)
+{
+    unsigned int *index;
+    unsigned int nindex = 1;
+    unsigned int i, j;
+
+    if (object->npairs < VIR_JSON_OBJECT_INDEX_MIN) {
+        for (i = 1 ; i < object->npairs ; i++) {
+            for (j = 0 ; j < i ; j++) {
+                if (STREQ(object->pairs[i].key, object->pairs[j].key))
+                    goto duplicate;
+            }
+        }
+        return 0;
+    }
+
+    /* Keep the table at most half full */
+    while (nindex < object->npairs * 2)
+        nindex *= 2;
+
+    if (!(index = virJSONParserAllocN(parser, sizeof(*index), nindex)))
+        return -1;
+    object->index = index;
+    object->nindex = nindex;
+
+    for (i = 0 ; i < object->npairs ; i++) {
+        for (j = virJSONKeyHash(object->pairs[i].key) & (nindex - 1) ;
+             index[j] ;
+             j = (j + 1) & (nindex - 1)) {
+            if (STREQ(object->pairs[index[j] - 1].key, object->pairs[i].key))
+                goto duplicate;
+        }
+        index[j] = i + 1;
+    }
+
+    return 0;
+
+duplicate:
+    VIR_DEBUG("duplicate key %s in object", object->pairs[i].key);
+    return -1;
+}
+
+/* Move the members of the innermost container into it */
+static int virJSONParserPopContainer(virJSONParserPtr parser)
+{
+    virJSONParserStatePtr state = &parser->state[parser->nstate-1];
+    virJSONObjectPairPtr members = parser->pending + state->first;
+    size_t nmembers = parser->npending - state->first;
+    size_t i;
+
+    if (state->key) {
+        virJSONParserFreeString(parser, &state->key);
+        return -1;
+    }
+
+    if (state->value->type == VIR_JSON_TYPE_OBJECT) {
+        virJSONObjectPtr object = &state->value->data.object;
+
+        if (nmembers) {
+            if (!(object->pairs = virJSONParserAllocN(parser, sizeof(*members),
+                                                      nmembers)))
+                return -1;
+            memcpy(object->pairs, members, nmembers * sizeof(*members));
+        }
+        object->npairs = nmembers;
+        parser->npending = state->first;
+        parser->nstate--;
+
+        if (virJSONParserIndexObject(parser, object) < 0)
+            return -1;
+    } else {
+        virJSONArrayPtr array = &state->value->data.array;
+
+        if (nmembers &&
+            !(array->values = virJSONParserAllocN(parser,
+                                                  sizeof(*array->values),
+                                                  nmembers)))
+            return -1;
+
+        for (i = 0 ; i < nmembers ; i++)
+            array->values[i] = members[i].value;
+        array->nvalues = nmembers;
+        parser->npending = state->first;
+        parser->nstate--;
     }
 
     return 0;
 }
 
+static int virJSONParserPushContainer(virJSONParserPtr parser,
+                                      virJSONValuePtr value)
+{
+    if (virJSONParserInsertValue(parser, value) < 0) {
+        virJSONValueFree(value);
+        return -1;
+    }
+
+    /* From here on the value is the parser's to free on failure */
+    if (VIR_RESIZE_N(parser->state, parser->nstate_max,
+                     parser->nstate, 1) < 0)
+        return -1;
+
+    parser->state[parser->nstate].value = value;
+    parser->state[parser->nstate].key = NULL;
+    parser->state[parser->nstate].first = parser->npending;
+    parser->nstate++;
+
+    return 0;
+}
+
 static int virJSONParserHandleNull(void *ctx)
 {
     virJSONParserPtr parser = ctx;
-    virJSONValuePtr value = virJSONValueNewNull();
+    virJSONValuePtr value = virJSONParserNewValue(parser, VIR_JSON_TYPE_NULL);
 
     VIR_DEBUG("parser=%p", parser);
 
@@ -700,12 +1041,14 @@ static int virJSONParserHandleNull(void *ctx)
 static int virJSONParserHandleBoolean(void *ctx, int boolean_)
 {
     virJSONParserPtr parser = ctx;
-    virJSONValuePtr value = virJSONValueNewBoolean(boolean_);
+    virJSONValuePtr value = virJSONParserNewValue(parser,
+                                                  VIR_JSON_TYPE_BOOLEAN);
 
     VIR_DEBUG("parser=%p boolean=%d", parser, boolean_);
 
     if (!value)
         return 0;
+    value->data.boolean = boolean_;
 
     if (virJSONParserInsertValue(parser, value) < 0) {
         virJSONValueFree(value);
@@ -720,20 +1063,16 @@ static int virJSONParserHandleNumber(void *ctx,
                                      yajl_size_t l)
 {
     virJSONParserPtr parser = ctx;
-    char *str = strndup(s, l);
-    virJSONValuePtr value;
+    virJSONValuePtr value = virJSONParserNewValue(parser,
+                                                  VIR_JSON_TYPE_NUMBER);
 
-    if (!str)
-        return -1;
-    value = virJSONValueNewNumber(str);
-    VIR_FREE(str);
-
-    VIR_DEBUG("parser=%p str=%s", parser, str);
+    VIR_DEBUG("parser=%p str=%.*s", parser, (int)l, s);
 
     if (!value)
         return 0;
 
-    if (virJSONParserInsertValue(parser, value) < 0) {
+    if (!(value->data.number = virJSONParserStrndup(parser, s, l)) ||
+        virJSONParserInsertValue(parser, value) < 0) {
         virJSONValueFree(value);
         return 0;
     }
@@ -746,15 +1085,18 @@ static int virJSONParserHandleString(void *ctx,
                                      yajl_size_t stringLen)
 {
     virJSONParserPtr parser = ctx;
-    virJSONValuePtr value = virJSONValueNewStringLen((const char *)stringVal,
-                                                     stringLen);
+    virJSONValuePtr value = virJSONParserNewValue(parser,
+                                                  VIR_JSON_TYPE_STRING);
 
     VIR_DEBUG("parser=%p str=%p", parser, (const char *)stringVal);
 
     if (!value)
         return 0;
 
-    if (virJSONParserInsertValue(parser, value) < 0) {
+    if (!(value->data.string = virJSONParserStrndup(parser,
+                                                    (const char *)stringVal,
+                                                    stringLen)) ||
+        virJSONParserInsertValue(parser, value) < 0) {
         virJSONValueFree(value);
         return 0;
     }
@@ -777,7 +1119,8 @@ static int virJSONParserHandleMapKey(void *ctx,
     state = &parser->state[parser->nstate-1];
     if (state->key)
         return 0;
-    state->key = strndup((const char *)stringVal, stringLen);
+    state->key = virJSONParserStrndup(parser, (const char *)stringVal,
+                                      stringLen);
     if (!state->key)
         return 0;
     return 1;
@@ -786,27 +1129,16 @@ static int virJSONParserHandleMapKey(void *ctx,
 static int virJSONParserHandleStartMap(void *ctx)
 {
     virJSONParserPtr parser = ctx;
-    virJSONValuePtr value = virJSONValueNewObject();
+    virJSONValuePtr value = virJSONParserNewValue(parser,
+                                                  VIR_JSON_TYPE_OBJECT);
 
     VIR_DEBUG("parser=%p", parser);
 
     if (!value)
         return 0;
 
-    if (virJSONParserInsertValue(parser, value) < 0) {
-        virJSONValueFree(value);
-        return 0;
-    }
-
-    if (VIR_REALLOC_N(parser->state,
-                      parser->nstate + 1) < 0) {
-        virJSONValueFree(value);
+    if (virJSONParserPushContainer(parser, value) < 0)
         return 0;
-    }
-
-    parser->state[parser->nstate].value = value;
-    parser->state[parser->nstate].key = NULL;
-    parser->nstate++;
 
     return 1;
 }
@@ -815,23 +1147,15 @@ static int virJSONParserHandleStartMap(void *ctx)
 static int virJSONParserHandleEndMap(void *ctx)
 {
     virJSONParserPtr parser = ctx;
-    virJSONParserStatePtr state;
 
     VIR_DEBUG("parser=%p", parser);
 
-    if (!parser->nstate)
+    if (!parser->nstate ||
+        parser->state[parser->nstate-1].value->type != VIR_JSON_TYPE_OBJECT)
         return 0;
 
-    state = &(parser->state[parser->nstate-1]);
-    if (state->key) {
-        VIR_FREE(state->key);
+    if (virJSONParserPopContainer(parser) < 0)
         return 0;
-    }
-
-    if (VIR_REALLOC_N(parser->state,
-                      parser->nstate - 1) < 0)
-        return 0;
-    parser->nstate--;
 
     return 1;
 }
@@ -839,49 +1163,32 @@ static int virJSONParserHandleEndMap(void *ctx)
 static int virJSONParserHandleStartArray(void *ctx)
 {
     virJSONParserPtr parser = ctx;
-    virJSONValuePtr value = virJSONValueNewArray();
+    virJSONValuePtr value = virJSONParserNewValue(parser,
+                                                  VIR_JSON_TYPE_ARRAY);
 
     VIR_DEBUG("parser=%p", parser);
 
     if (!value)
         return 0;
 
-    if (virJSONParserInsertValue(parser, value) < 0) {
-        virJSONValueFree(value);
-        return 0;
-    }
-
-    if (VIR_REALLOC_N(parser->state,
-                      parser->nstate + 1) < 0)
+    if (virJSONParserPushContainer(parser, value) < 0)
         return 0;
 
-    parser->state[parser->nstate].value = value;
-    parser->state[parser->nstate].key = NULL;
-    parser->nstate++;
-
     return 1;
 }
 
 static int virJSONParserHandleEndArray(void *ctx)
 {
     virJSONParserPtr parser = ctx;
-    virJSONParserStatePtr state;
 
     VIR_DEBUG("parser=%p", parser);
 
-    if (!parser->nstate)
+    if (!parser->nstate ||
+        parser->state[parser->nstate-1].value->type != VIR_JSON_TYPE_ARRAY)
         return 0;
 
-    state = &(parser->state[parser->nstate-1]);
-    if (state->key) {
-        VIR_FREE(state->key);
+    if (virJSONParserPopContainer(parser) < 0)
         return 0;
-    }
-
-    if (VIR_REALLOC_N(parser->state,
-                      parser->nstate - 1) < 0)
-        return 0;
-    parser->nstate--;
 
     return 1;
 }
@@ -901,17 +1208,71 @@ static const yajl_callbacks parserCallbacks = {
 };
 
 
-/* XXX add an incremental streaming parser - yajl trivially supports it */
+/* Free whatever a failed parse left behind */
+static void virJSONParserCleanup(virJSONParserPtr parser)
+{
+    size_t i;
+
+    if (parser->arena) {
+        virJSONArenaFree(parser->arena);
+    } else {
+        for (i = 0 ; i < parser->npending ; i++) {
+            VIR_FREE(parser->pending[i].key);
+            virJSONValueFree(parser->pending[i].value);
+        }
+        for (i = 0 ; i < parser->nstate ; i++)
+            VIR_FREE(parser->state[i].key);
+        virJSONValueFree(parser->head);
+    }
+
+    parser->arena = NULL;
+    parser->head = NULL;
+    parser->npending = parser->nstate = 0;
+}
+
+
 virJSONValuePtr virJSONValueFromString(const char *jsonstring)
+{
+    return virJSONValueFromBuffer(jsonstring, strlen(jsonstring), 0);
+}
+
+
+/**
+ * virJSONValueFromBuffer:
+ * @data: the JSON document, which need not be NUL terminated
+ * @len: the length of @data
+ * @flags: bitwise-OR of virJSONParseFlags
+ *
+ * Parse the document in @data straight out of the caller's buffer.
+ * With VIR_JSON_PARSE_ARENA, all of the resulting tree is carved
+ * out of a few large blocks, which is much cheaper to build and to
+ * free for a big document, but the tree can't be modified and no
+ * part of it outlives its root.
+ *
+ * Returns the parsed value, or NULL on error
+ */
+virJSONValuePtr virJSONValueFromBuffer(const char *data, size_t len,
+                                       unsigned int flags)
 {
     yajl_handle hand;
-    virJSONParser parser = { NULL, NULL, 0 };
+    virJSONParser parser;
     virJSONValuePtr ret = NULL;
+    yajl_status rc;
 # ifndef HAVE_YAJL2
     yajl_parser_config cfg = { 1, 1 };
 # endif
 
-    VIR_DEBUG("string=%s", jsonstring);
+    virCheckFlags(VIR_JSON_PARSE_ARENA, NULL);
+
+    VIR_DEBUG("string=%.*s", (int)len, data);
+
+    memset(&parser, 0, sizeof(parser));
+
+    if ((flags & VIR_JSON_PARSE_ARENA) &&
+        !(parser.arena = virJSONArenaNew(len * 2))) {
+        virReportOOMError();
+        return NULL;
+    }
 
 # ifdef HAVE_YAJL2
     hand = yajl_alloc(&parserCallbacks, NULL, &parser);
@@ -928,34 +1289,39 @@ virJSONValuePtr virJSONValueFromString(const char *jsonstring)
         goto cleanup;
     }
 
-    if (yajl_parse(hand,
-                   (const unsigned char *)jsonstring,
-                   strlen(jsonstring)) != yajl_status_ok) {
+    rc = yajl_parse(hand, (const unsigned char *)data, len);
+# ifdef HAVE_YAJL2
+    if (rc == yajl_status_ok)
+        rc = yajl_complete_parse(hand);
+# endif
+
+    if (rc != yajl_status_ok || parser.nstate || !parser.head) {
         unsigned char *errstr = yajl_get_error(hand, 1,
-                                               (const unsigned char*)jsonstring,
-                                               strlen(jsonstring));
+                                               (const unsigned char*)data,
+                                               len);
 
         virJSONError(VIR_ERR_INTERNAL_ERROR,
-                     _("cannot parse json %s: %s"),
-                     jsonstring, (const char*) errstr);
+                     _("cannot parse json %.*s: %s"),
+                     (int)len, data, (const char*) errstr);
         VIR_FREE(errstr);
-        virJSONValueFree(parser.head);
         goto cleanup;
     }
 
     ret = parser.head;
+    if (parser.arena) {
+        parser.arena->root = ret;
+        parser.arena = NULL;
+    }
+    parser.head = NULL;
 
 cleanup:
-    yajl_free(hand);
+    if (hand)
+        yajl_free(hand);
+    virJSONParserCleanup(&parser);
+    VIR_FREE(parser.pending);
+    VIR_FREE(parser.state);
 
-    if (parser.nstate) {
-        int i;
-        for (i = 0 ; i < parser.nstate ; i++) {
-            VIR_FREE(parser.state[i].key);
-        }
-    }
-
-    VIR_DEBUG("result=%p", parser.head);
+    VIR_DEBUG("result=%p", ret);
 
     return ret;
 }
@@ -1081,6 +1447,14 @@ virJSONValuePtr virJSONValueFromString(const char *jsonstring ATTRIBUTE_UNUSED)
                  _("No JSON parser implementation is available"));
     return NULL;
 }
+virJSONValuePtr virJSONValueFromBuffer(const char *data ATTRIBUTE_UNUSED,
+                                       size_t len ATTRIBUTE_UNUSED,
+                                       unsigned int flags ATTRIBUTE_UNUSED)
+{
+    virJSONError(VIR_ERR_INTERNAL_ERROR, "%s",
+                 _("No JSON parser implementation is available"));
+    return NULL;
+}
 char *virJSONValueToString(virJSONValuePtr object ATTRIBUTE_UNUSED)
 {
     virJSONError(VIR_ERR_INTERNAL_ERROR, "%s",
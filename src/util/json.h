@@ -48,6 +48,9 @@ typedef virJSONObjectPair *virJSONObjectPairPtr;
 typedef struct _virJSONArray virJSONArray;
 typedef virJSONArray *virJSONArrayPtr;
 
+typedef struct _virJSONArena virJSONArena;
+typedef virJSONArena *virJSONArenaPtr;
+
 
 struct _virJSONObjectPair {
     char *key;
@@ -57,6 +60,9 @@ struct _virJSONObjectPair {
 struct _virJSONObject {
     unsigned int npairs;
     virJSONObjectPairPtr pairs;
+    /* Hash index into pairs, kept for large parsed objects only */
+    unsigned int nindex;
+    unsigned int *index;
 };
 
 struct _virJSONArray {
@@ -66,6 +72,9 @@ struct _virJSONArray {
 
 struct _virJSONValue {
     int type;
+    /* Set on values parsed with VIR_JSON_PARSE_ARENA, which live
+     * as long as the root of their tree and cannot be modified */
+    virJSONArenaPtr arena;
 
     union {
         virJSONObject object;
@@ -77,6 +86,7 @@ struct _virJSONValue {
 };
 
 void virJSONValueFree(virJSONValuePtr value);
+size_t virJSONValueCountAllocs(virJSONValuePtr value);
 
 virJSONValuePtr virJSONValueNewString(const char *data);
 virJSONValuePtr virJSONValueNewStringLen(const char *data, size_t length);
@@ -126,7 +136,14 @@ int virJSONValueObjectAppendNumberDouble(virJSONValuePtr object, const char *key
 int virJSONValueObjectAppendBoolean(virJSONValuePtr object, const char *key, int boolean);
 int virJSONValueObjectAppendNull(virJSONValuePtr object, const char *key);
 
+typedef enum {
+    /* Allocate the whole tree from one arena, freed at once with its root */
+    VIR_JSON_PARSE_ARENA = (1 << 0),
+} virJSONParseFlags;
+
 virJSONValuePtr virJSONValueFromString(const char *jsonstring);
+virJSONValuePtr virJSONValueFromBuffer(const char *data, size_t len,
+                                       unsigned int flags);
 char *virJSONValueToString(virJSONValuePtr object);
 
 #endif /* __VIR_JSON_H_ */
@@ -47,14 +47,33 @@
 #define VIR_FROM_THIS VIR_FROM_NONE
 
 /*
- * A logging buffer to keep some history over logs
+ * A logging buffer to keep some history over logs. Writers reserve
+ * room for a message by moving pos on, then copy it in without
+ * holding any lock. Positions count every byte ever reserved, so
+ * the buffer size is rounded up to a power of two to keep them
+ * consistent when they wrap.
  */
+typedef struct _virLogRing virLogRing;
+typedef virLogRing *virLogRingPtr;
+
+struct _virLogRing {
+    char *data;
+    unsigned long size;
+    unsigned long pos;      /* end of the last reserved message */
+    unsigned long start;    /* nothing before this is dumped */
+
+    virLogRingPtr retired;
+};
 
 static int virLogSize = 64 * 1024;
-static char *virLogBuffer = NULL;
-static int virLogLen = 0;
-static int virLogStart = 0;
-static int virLogEnd = 0;
+static virLogRingPtr virLogBuffer = NULL;
+/* Replaced buffers are kept until shutdown, as some thread may
+ * still be writing to them */
+static virLogRingPtr virLogBufferRetired = NULL;
+static int virLogBufferPriority = VIR_LOG_DEBUG;
+#if !HAVE_SYNC_FETCH_AND_ADD
+static virMutex virLogBufferMutex;
+#endif
 
 /*
  * Filters are used to refine the rules on what to keep or drop
@@ -94,6 +113,22 @@ static int virLogNbOutputs = 0;
  */
 static virLogPriority virLogDefaultPriority = VIR_LOG_DEFAULT;
 
+/*
+ * Bumped whenever something deciding which messages are wanted
+ * changes, so that call sites check again. It stays within the
+ * bits a call site has for it and never goes back to 0, which is
+ * what a call site starts with.
+ */
+unsigned int virLogFiltersSerial = 1;
+
+static void virLogFiltersChanged(void)
+{
+    virLogFiltersSerial++;
+    virLogFiltersSerial &= UINT_MAX >> VIR_LOG_SITE_SHIFT;
+    if (virLogFiltersSerial == 0)
+        virLogFiltersSerial = 1;
+}
+
 static int virLogResetFilters(void);
 static int virLogResetOutputs(void);
 static int virLogOutputToFd(const char *category, int priority,
@@ -141,6 +176,41 @@ static const char *virLogPriorityString(virLogPriority lvl) {
     return "unknown";
 }
 
+static virLogRingPtr virLogRingNew(int size)
+{
+    virLogRingPtr ring;
+
+    if (VIR_ALLOC(ring) < 0)
+        return NULL;
+
+    for (ring->size = 1 ; ring->size < (unsigned long) size ; ring->size <<= 1)
+        ;
+
+    if (VIR_ALLOC_N(ring->data, ring->size) < 0) {
+        VIR_FREE(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+static void virLogRingFree(virLogRingPtr ring)
+{
+    while (ring) {
+        virLogRingPtr retired = ring->retired;
+
+        VIR_FREE(ring->data);
+        VIR_FREE(ring);
+        ring = retired;
+    }
+}
+
+static void virLogRingReset(virLogRingPtr ring)
+{
+    if (ring)
+        ring->start = ring->pos;
+}
+
 static int virLogInitialized = 0;
 
 /**
@@ -158,27 +228,33 @@ int virLogStartup(void) {
 
     if (virMutexInit(&virLogMutex) < 0)
         return -1;
+#if !HAVE_SYNC_FETCH_AND_ADD
+    if (virMutexInit(&virLogBufferMutex) < 0) {
+        virMutexDestroy(&virLogMutex);
+        return -1;
+    }
+#endif
 
     virLogInitialized = 1;
     virLogLock();
-    if (VIR_ALLOC_N(virLogBuffer, virLogSize + 1) < 0) {
+    if (virLogSize > 0 &&
+        !(virLogBuffer = virLogRingNew(virLogSize))) {
         /*
          * The debug buffer is not a critical component, allow startup
          * even in case of failure to allocate it in case of a
          * configuration mistake.
          */
         virLogSize = 64 * 1024;
-        if (VIR_ALLOC_N(virLogBuffer, virLogSize + 1) < 0) {
+        if (!(virLogBuffer = virLogRingNew(virLogSize))) {
             pbm = "Failed to allocate debug buffer: deactivating debug log\n";
             virLogSize = 0;
         } else {
             pbm = "Failed to allocate debug buffer: reduced to 64 kB\n";
         }
     }
-    virLogLen = 0;
-    virLogStart = 0;
-    virLogEnd = 0;
     virLogDefaultPriority = VIR_LOG_DEFAULT;
+    virLogBufferPriority = VIR_LOG_DEBUG;
+    virLogFiltersChanged();
     virLogUnlock();
     if (pbm)
         VIR_WARN("%s", pbm);
@@ -198,8 +274,7 @@ int virLogStartup(void) {
 extern int
 virLogSetBufferSize(int size) {
     int ret = 0;
-    int oldsize;
-    char *oldLogBuffer;
+    virLogRingPtr ring = NULL;
     const char *pbm = NULL;
 
     if (size < 0)
@@ -210,27 +285,25 @@ virLogSetBufferSize(int size) {
 
     virLogLock();
 
-    oldsize = virLogSize;
-    oldLogBuffer = virLogBuffer;
-
     if (INT_MAX / 1024 <= size) {
         pbm = "Requested log size of %d kB too large\n";
         ret = -1;
         goto error;
     }
 
-    virLogSize = size * 1024;
-    if (VIR_ALLOC_N(virLogBuffer, virLogSize + 1) < 0) {
+    if (size > 0 && !(ring = virLogRingNew(size * 1024))) {
         pbm = "Failed to allocate debug buffer of %d kB\n";
-        virLogBuffer = oldLogBuffer;
-        virLogSize = oldsize;
         ret = -1;
         goto error;
     }
-    VIR_FREE(oldLogBuffer);
-    virLogLen = 0;
-    virLogStart = 0;
-    virLogEnd = 0;
+
+    if (virLogBuffer) {
+        virLogBuffer->retired = virLogBufferRetired;
+        virLogBufferRetired = virLogBuffer;
+    }
+    virLogBuffer = ring;
+    virLogSize = size * 1024;
+    virLogFiltersChanged();
 
 error:
     virLogUnlock();
@@ -253,10 +326,10 @@ int virLogReset(void) {
     virLogLock();
     virLogResetFilters();
     virLogResetOutputs();
-    virLogLen = 0;
-    virLogStart = 0;
-    virLogEnd = 0;
+    virLogRingReset(virLogBuffer);
     virLogDefaultPriority = VIR_LOG_DEFAULT;
+    virLogBufferPriority = VIR_LOG_DEBUG;
+    virLogFiltersChanged();
     virLogUnlock();
     return 0;
 }
@@ -271,53 +344,73 @@ void virLogShutdown(void) {
     virLogLock();
     virLogResetFilters();
     virLogResetOutputs();
-    virLogLen = 0;
-    virLogStart = 0;
-    virLogEnd = 0;
-    VIR_FREE(virLogBuffer);
+    virLogRingFree(virLogBuffer);
+    virLogRingFree(virLogBufferRetired);
+    virLogBuffer = virLogBufferRetired = NULL;
+    virLogFiltersChanged();
     virLogUnlock();
     virMutexDestroy(&virLogMutex);
+#if !HAVE_SYNC_FETCH_AND_ADD
+    virMutexDestroy(&virLogBufferMutex);
+#endif
     virLogInitialized = 0;
 }
 
 /*
- * Store a string in the ring buffer
+ * Reserve @len bytes at the end of @ring, returning their position
  */
-static void virLogStr(const char *str)
+static unsigned long virLogRingReserve(virLogRingPtr ring, unsigned long len)
 {
-    int tmp;
-    int len;
+#if HAVE_SYNC_FETCH_AND_ADD
+    return __sync_fetch_and_add(&ring->pos, len);
+#else
+    unsigned long pos;
 
-    if ((str == NULL) || (virLogBuffer == NULL) || (virLogSize <= 0))
-        return;
-    len = strlen(str);
-    if (len >= virLogSize)
-        return;
+    virMutexLock(&virLogBufferMutex);
+    pos = ring->pos;
+    ring->pos += len;
+    virMutexUnlock(&virLogBufferMutex);
+    return pos;
+#endif
+}
 
-    /*
-     * copy the data and reset the end, we cycle over the end of the buffer
-     */
-    if (virLogEnd + len >= virLogSize) {
-        tmp = virLogSize - virLogEnd;
-        memcpy(&virLogBuffer[virLogEnd], str, tmp);
-        memcpy(&virLogBuffer[0], &str[tmp], len - tmp);
-        virLogEnd = len - tmp;
+static unsigned long virLogRingCopy(virLogRingPtr ring, unsigned long pos,
+                                    const char *str, unsigned long len)
+{
+    unsigned long off = pos & (ring->size - 1);
+    unsigned long tmp = ring->size - off;
+
+    if (len > tmp) {
+        memcpy(&ring->data[off], str, tmp);
+        memcpy(&ring->data[0], &str[tmp], len - tmp);
     } else {
-        memcpy(&virLogBuffer[virLogEnd], str, len);
-        virLogEnd += len;
-    }
-    virLogBuffer[virLogEnd] = 0;
-    /*
-     * Update the log length, and if full move the start index
-     */
-    virLogLen += len;
-    if (virLogLen > virLogSize) {
-        tmp = virLogLen - virLogSize;
-        virLogLen = virLogSize;
-        virLogStart += tmp;
-        if (virLogStart >= virLogSize)
-            virLogStart -= virLogSize;
+        memcpy(&ring->data[off], str, len);
     }
+    return pos + len;
+}
+
+/*
+ * Store a message and its timestamp in the ring buffer, overwriting
+ * the oldest messages if needed
+ */
+static void virLogStr(const char *timestamp, const char *msg)
+{
+    virLogRingPtr ring = virLogBuffer;
+    unsigned long tlen, mlen;
+    unsigned long pos;
+
+    if (ring == NULL)
+        return;
+
+    tlen = strlen(timestamp);
+    mlen = strlen(msg);
+    if (tlen + 2 + mlen >= ring->size)
+        return;
+
+    pos = virLogRingReserve(ring, tlen + 2 + mlen);
+    pos = virLogRingCopy(ring, pos, timestamp, tlen);
+    pos = virLogRingCopy(ring, pos, ": ", 2);
+    virLogRingCopy(ring, pos, msg, mlen);
 }
 
 static void virLogDumpAllFD(const char *msg, int len) {
@@ -351,8 +444,8 @@ static void virLogDumpAllFD(const char *msg, int len) {
  */
 void
 virLogEmergencyDumpAll(int signum) {
-    int len;
-    int oldLogStart, oldLogLen;
+    virLogRingPtr ring = virLogBuffer;
+    unsigned long pos, end, len;
 
     switch (signum) {
 #ifdef SIGFPE
@@ -389,7 +482,7 @@ virLogEmergencyDumpAll(int signum) {
             virLogDumpAllFD( "Caught unexpected signal", -1);
             break;
     }
-    if ((virLogBuffer == NULL) || (virLogSize <= 0)) {
+    if (ring == NULL) {
         virLogDumpAllFD(" internal log buffer deactivated\n", -1);
         return;
     }
@@ -401,30 +494,20 @@ virLogEmergencyDumpAll(int signum) {
      * Since we can't lock the buffer safely from a signal handler
      * we mark it as empty in case of concurrent access, and proceed
      * with the data, at worse we will output something a bit weird
-     * if another thread start logging messages at the same time.
-     * Note that virLogStr() uses virLogEnd for the computations and
-     * writes to the buffer and only then updates virLogLen and virLogStart
-     * so it's best to reset it first.
+     * if another thread start logging messages at the same time, or
+     * was still copying its message in when the signal came.
      */
-    oldLogStart = virLogStart;
-    oldLogLen = virLogLen;
-    virLogEnd = 0;
-    virLogLen = 0;
-    virLogStart = 0;
-
-    while (oldLogLen > 0) {
-        if (oldLogStart + oldLogLen < virLogSize) {
-            virLogBuffer[oldLogStart + oldLogLen] = 0;
-            virLogDumpAllFD(&virLogBuffer[oldLogStart], oldLogLen);
-            oldLogStart += oldLogLen;
-            oldLogLen = 0;
-        } else {
-            len = virLogSize - oldLogStart;
-            virLogBuffer[virLogSize] = 0;
-            virLogDumpAllFD(&virLogBuffer[oldLogStart], len);
-            oldLogLen -= len;
-            oldLogStart = 0;
-        }
+    end = ring->pos;
+    len = end - ring->start;
+    if (len > ring->size)
+        len = ring->size;
+    ring->start = end;
+
+    for (pos = end - len ; pos != end ; pos += len) {
+        unsigned long off = pos & (ring->size - 1);
+
+        len = MIN(end - pos, ring->size - off);
+        virLogDumpAllFD(&ring->data[off], len);
     }
     virLogDumpAllFD("\n\n     ====== end of log =====\n\n", -1);
 }
@@ -446,7 +529,35 @@ int virLogSetDefaultPriority(int priority) {
     }
     if (!virLogInitialized)
         virLogStartup();
+    virLogLock();
     virLogDefaultPriority = priority;
+    virLogFiltersChanged();
+    virLogUnlock();
+    return 0;
+}
+
+/**
+ * virLogSetBufferPriority:
+ * @priority: the lowest priority kept in the debug buffer
+ *
+ * Only keep messages of this priority or above in the debug buffer.
+ * The buffer normally keeps every message, including those which no
+ * output wants, which means formatting all of them. Raising this
+ * allows messages nobody wants to be skipped right away.
+ *
+ * Returns 0 if successful, -1 in case of error.
+ */
+int virLogSetBufferPriority(int priority) {
+    if ((priority < VIR_LOG_DEBUG) || (priority > VIR_LOG_ERROR)) {
+        VIR_WARN("Ignoring invalid log buffer level setting.");
+        return -1;
+    }
+    if (!virLogInitialized)
+        virLogStartup();
+    virLogLock();
+    virLogBufferPriority = priority;
+    virLogFiltersChanged();
+    virLogUnlock();
     return 0;
 }
 
@@ -515,6 +626,8 @@ int virLogDefineFilter(const char *match, int priority,
     virLogFilters[i].priority = priority;
     virLogNbFilters++;
 cleanup:
+    if (i >= 0)
+        virLogFiltersChanged();
     virLogUnlock();
     return i;
 }
@@ -529,21 +642,58 @@ cleanup:
  *
  * Returns 0 if not matched or the new priority if found.
  */
-static int virLogFiltersCheck(const char *input) {
+static int virLogFiltersCheckLocked(const char *input) {
     int ret = 0;
     int i;
 
-    virLogLock();
     for (i = 0;i < virLogNbFilters;i++) {
         if (strstr(input, virLogFilters[i].match)) {
             ret = virLogFilters[i].priority;
             break;
         }
     }
+    return ret;
+}
+
+static int virLogFiltersCheck(const char *input) {
+    int ret;
+
+    virLogLock();
+    ret = virLogFiltersCheckLocked(input);
     virLogUnlock();
     return ret;
 }
 
+/**
+ * virLogSiteUpdate:
+ * @site: the cached decision of a call site
+ * @category: the category of the messages from that call site
+ *
+ * Work out the lowest priority a message of @category is wanted at,
+ * either by an output or by the debug buffer, and remember it in
+ * @site until virLogFiltersSerial changes.
+ *
+ * Returns that priority
+ */
+int virLogSiteUpdate(unsigned int *site, const char *category) {
+    int priority;
+
+    /* virLogMessage will sort it out */
+    if (!virLogInitialized)
+        return VIR_LOG_DEBUG;
+
+    virLogLock();
+    priority = virLogFiltersCheckLocked(category);
+    if (priority == 0)
+        priority = virLogDefaultPriority;
+    if (virLogBuffer && virLogBufferPriority < priority)
+        priority = virLogBufferPriority;
+    *site = (virLogFiltersSerial << VIR_LOG_SITE_SHIFT) | priority;
+    virLogUnlock();
+
+    return priority;
+}
+
 /**
  * virLogResetOutputs:
  *
@@ -708,6 +858,7 @@ void virLogMessage(const char *category, int priority, const char *funcname,
     int fprio, i, ret;
     int saved_errno = errno;
     int emit = 1;
+    bool store = true;
     va_list ap;
 
     if (!virLogInitialized)
@@ -727,7 +878,10 @@ void virLogMessage(const char *category, int priority, const char *funcname,
         emit = 0;
     }
 
-    if ((emit == 0) && ((virLogBuffer == NULL) || (virLogSize <= 0)))
+    if (priority < virLogBufferPriority)
+        store = false;
+
+    if ((emit == 0) && ((virLogBuffer == NULL) || !store))
         goto cleanup;
 
     /*
@@ -756,10 +910,8 @@ void virLogMessage(const char *category, int priority, const char *funcname,
      *       threads, but avoid intermixing. Maybe set up locks per output
      *       to improve paralellism.
      */
-    virLogLock();
-    virLogStr(timestamp);
-    virLogStr(msg);
-    virLogUnlock();
+    if (store)
+        virLogStr(timestamp, msg);
     if (emit == 0)
         goto cleanup;
 
@@ -25,6 +25,29 @@
 # include "internal.h"
 # include "buf.h"
 
+/*
+ * Each use of VIR_DEBUG, VIR_INFO, VIR_WARN or VIR_ERROR remembers
+ * the lowest priority its category is wanted at, along with the
+ * value of virLogFiltersSerial at the time. Until the priorities,
+ * filters or debug buffer settings change, a message nobody wants
+ * costs no more than a comparison. The category of a given call
+ * site must therefore be the same every time.
+ */
+# define VIR_LOG_SITE_SHIFT 3
+# define VIR_LOG_SITE_MASK ((1 << VIR_LOG_SITE_SHIFT) - 1)
+
+# define VIR_LOG_SITE_ENABLED(site, category, priority)                  \
+    ((priority) >= ((site) >> VIR_LOG_SITE_SHIFT == virLogFiltersSerial ? \
+                    (int) ((site) & VIR_LOG_SITE_MASK) :                 \
+                    virLogSiteUpdate(&(site), category)))
+
+# define VIR_LOG_SITE(category, priority, f, l, ...)                     \
+    do {                                                                 \
+        static unsigned int virLogSite;                                  \
+        if (VIR_LOG_SITE_ENABLED(virLogSite, category, priority))        \
+            virLogMessage(category, priority, f, l, 0, __VA_ARGS__);     \
+    } while (0)
+
 /*
  * If configured with --enable-debug=yes then library calls
  * are printed to stderr for debugging or to an appropriate channel
@@ -33,9 +56,13 @@
 # ifdef ENABLE_DEBUG
 #  define VIR_DEBUG_INT(category, f, l, ...)                            \
     virLogMessage(category, VIR_LOG_DEBUG, f, l, 0, __VA_ARGS__)
+#  define VIR_DEBUG_SITE(category, f, l, ...)                           \
+    VIR_LOG_SITE(category, VIR_LOG_DEBUG, f, l, __VA_ARGS__)
 # else
 #  define VIR_DEBUG_INT(category, f, l, ...)    \
     do { } while (0)
+#  define VIR_DEBUG_SITE(category, f, l, ...)   \
+    do { } while (0)
 # endif /* !ENABLE_DEBUG */
 
 # define VIR_INFO_INT(category, f, l, ...)                              \
@@ -46,13 +73,16 @@
     virLogMessage(category, VIR_LOG_ERROR, f, l, 0, __VA_ARGS__)
 
 # define VIR_DEBUG(...)                                                 \
-        VIR_DEBUG_INT("file." __FILE__, __func__, __LINE__, __VA_ARGS__)
+        VIR_DEBUG_SITE("file." __FILE__, __func__, __LINE__, __VA_ARGS__)
 # define VIR_INFO(...)                                                  \
-        VIR_INFO_INT("file." __FILE__, __func__, __LINE__, __VA_ARGS__)
+        VIR_LOG_SITE("file." __FILE__, VIR_LOG_INFO,                    \
+                     __func__, __LINE__, __VA_ARGS__)
 # define VIR_WARN(...)                                                  \
-        VIR_WARN_INT("file." __FILE__, __func__, __LINE__, __VA_ARGS__)
+        VIR_LOG_SITE("file." __FILE__, VIR_LOG_WARN,                    \
+                     __func__, __LINE__, __VA_ARGS__)
 # define VIR_ERROR(...)                                                 \
-        VIR_ERROR_INT("file." __FILE__, __func__, __LINE__, __VA_ARGS__)
+        VIR_LOG_SITE("file." __FILE__, VIR_LOG_ERROR,                   \
+                     __func__, __LINE__, __VA_ARGS__)
 
 /*
  * To be made public
@@ -129,5 +159,8 @@ extern void virLogMessage(const char *category, int priority,
                           unsigned int flags,
                           const char *fmt, ...) ATTRIBUTE_FMT_PRINTF(6, 7);
 extern int virLogSetBufferSize(int size);
+extern int virLogSetBufferPriority(int priority);
+extern int virLogSiteUpdate(unsigned int *site, const char *category);
+extern unsigned int virLogFiltersSerial;
 extern void virLogEmergencyDumpAll(int signum);
 #endif
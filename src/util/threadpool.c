@@ -25,6 +25,8 @@
 
 #include <config.h>
 
+#include <sys/time.h>
+
 #include "threadpool.h"
 #include "memory.h"
 #include "threads.h"
@@ -33,13 +35,17 @@
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
+#define virThreadPoolError(code, ...)                               \
+    virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,             \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
 typedef struct _virThreadPoolJob virThreadPoolJob;
 typedef virThreadPoolJob *virThreadPoolJobPtr;
 
 struct _virThreadPoolJob {
-    virThreadPoolJobPtr prev;
     virThreadPoolJobPtr next;
     unsigned int priority;
+    unsigned long long queuedAt; /* microseconds */
 
     void *data;
 };
@@ -50,110 +56,476 @@ typedef virThreadPoolJobList *virThreadPoolJobListPtr;
 struct _virThreadPoolJobList {
     virThreadPoolJobPtr head;
     virThreadPoolJobPtr tail;
-    virThreadPoolJobPtr firstPrio;
+    size_t depth;
 };
 
+typedef struct _virThreadPoolJobStats virThreadPoolJobStats;
+typedef virThreadPoolJobStats *virThreadPoolJobStatsPtr;
 
-struct _virThreadPool {
+struct _virThreadPoolJobStats {
+    unsigned long long jobsDone;
+    unsigned long long jobsStolen;
+    unsigned long long waitTime[VIR_THREAD_POOL_HIST_BUCKETS];
+    unsigned long long runTime[VIR_THREAD_POOL_HIST_BUCKETS];
+};
+
+typedef struct _virThreadPoolWorker virThreadPoolWorker;
+typedef virThreadPoolWorker *virThreadPoolWorkerPtr;
+
+/*
+ * Each normal worker has its own queue and lock. Jobs are handed
+ * to an idle worker if there is one, or else queued to the workers
+ * in turn. A worker which runs out of work of its own takes
+ * priority jobs, then steals from the other queues.
+ */
+struct _virThreadPoolWorker {
+    virThreadPoolPtr pool;
+    virThread thread;
+
+    virMutex lock;
+    virCond cond;
+    virThreadPoolJobList jobs;
+    bool idle;      /* looking for work, or waiting for some */
+    bool wakeup;    /* work was queued since it last looked */
+    bool spinning;  /* woken to look for work in other queues */
     bool quit;
+    bool onIdleList; /* protected by the pool's idleLock */
 
+    virThreadPoolJobStats stats;
+};
+
+struct _virThreadPool {
     virThreadPoolJobFunc jobFunc;
     void *jobOpaque;
-    virThreadPoolJobList jobList;
-    size_t jobQueueDepth;
 
+    /* Serializes starting workers and protects the worker counts.
+     * Submitters only take it to start a worker, as nWorkers only
+     * grows and is read atomically, and nextWorker is just a hint.
+     * Workers themselves only take it when exiting. */
     virMutex mutex;
-    virCond cond;
     virCond quit_cond;
+    bool quit;
+    size_t nLive;
 
     size_t maxWorkers;
-    size_t freeWorkers;
     size_t nWorkers;
-    virThreadPtr workers;
-
+    size_t nextWorker;
+    size_t nSlots;
+    virThreadPoolWorkerPtr workers;
+
+    /* Workers which went idle, most recent last. Entries may be
+     * stale, so the worker's own flags are checked when popping.
+     * Only one worker at a time is woken to look for work, and it
+     * wakes the next one if it finds some, so a burst of jobs does
+     * not wake every idle worker at once. */
+    virMutex idleLock;
+    size_t nIdle;
+    virThreadPoolWorkerPtr *idleWorkers;
+    size_t nSpinning;
+
+    /* Priority jobs are served by the priority workers, and
+     * by any normal worker which has nothing else to do */
+    virMutex prioLock;
+    virCond prioCond;
+    virThreadPoolJobList prioJobs;
+    bool prioQuit;
+    size_t freePrioWorkers;
     size_t nPrioWorkers;
     virThreadPtr prioWorkers;
-    virCond prioCond;
+    virThreadPoolJobStats prioStats;
 };
 
-struct virThreadPoolWorkerData {
-    virThreadPoolPtr pool;
-    virCondPtr cond;
-    bool priority;
-};
 
-static void virThreadPoolWorker(void *opaque)
+static unsigned long long virThreadPoolNowUs(void)
 {
-    struct virThreadPoolWorkerData *data = opaque;
-    virThreadPoolPtr pool = data->pool;
-    virCondPtr cond = data->cond;
-    bool priority = data->priority;
-    virThreadPoolJobPtr job = NULL;
+    struct timeval now;
 
-    VIR_FREE(data);
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+    return now.tv_sec * 1000000ull + now.tv_usec;
+}
 
-    virMutexLock(&pool->mutex);
+static void virThreadPoolJobListPush(virThreadPoolJobListPtr list,
+                                     virThreadPoolJobPtr job)
+{
+    job->next = NULL;
+    if (list->tail)
+        list->tail->next = job;
+    else
+        list->head = job;
+    list->tail = job;
+    list->depth++;
+}
 
-    while (1) {
-        while (!pool->quit &&
-               ((!priority && !pool->jobList.head) ||
-                (priority && !pool->jobList.firstPrio))) {
-            if (!priority)
-                pool->freeWorkers++;
-            if (virCondWait(cond, &pool->mutex) < 0) {
-                if (!priority)
-                    pool->freeWorkers--;
-                goto out;
-            }
-            if (!priority)
-                pool->freeWorkers--;
-        }
+static virThreadPoolJobPtr virThreadPoolJobListPop(virThreadPoolJobListPtr list)
+{
+    virThreadPoolJobPtr job = list->head;
 
-        if (pool->quit)
-            break;
+    if (!job)
+        return NULL;
+
+    list->head = job->next;
+    if (!list->head)
+        list->tail = NULL;
+    list->depth--;
+    return job;
+}
+
+/* Move the @n oldest jobs of @from to the end of @to */
+static void virThreadPoolJobListMove(virThreadPoolJobListPtr from,
+                                     virThreadPoolJobListPtr to,
+                                     size_t n)
+{
+    virThreadPoolJobPtr last;
+    size_t i;
+
+    if (n == 0)
+        return;
+
+    last = from->head;
+    for (i = 1 ; i < n ; i++)
+        last = last->next;
+
+    if (to->tail)
+        to->tail->next = from->head;
+    else
+        to->head = from->head;
+    to->tail = last;
+    to->depth += n;
+
+    from->head = last->next;
+    if (!from->head)
+        from->tail = NULL;
+    from->depth -= n;
+    last->next = NULL;
+}
+
+static void virThreadPoolJobListClear(virThreadPoolJobListPtr list)
+{
+    virThreadPoolJobPtr job;
+
+    while ((job = virThreadPoolJobListPop(list)))
+        VIR_FREE(job);
+}
+
+static void virThreadPoolHistAdd(unsigned long long *hist,
+                                 unsigned long long start,
+                                 unsigned long long end)
+{
+    unsigned long long us = end > start ? end - start : 0;
+    size_t bucket = 0;
+
+    while (us && bucket < VIR_THREAD_POOL_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    hist[bucket]++;
+}
+
+static void virThreadPoolRunJob(virThreadPoolPtr pool,
+                                virThreadPoolJobPtr job,
+                                unsigned long long *start,
+                                unsigned long long *end)
+{
+    *start = virThreadPoolNowUs();
+    (pool->jobFunc)(job->data, pool->jobOpaque);
+    *end = virThreadPoolNowUs();
+}
 
-        if (priority) {
-            job = pool->jobList.firstPrio;
-        } else {
-            job = pool->jobList.head;
+static void virThreadPoolJobStatsAdd(virThreadPoolJobStatsPtr stats,
+                                     virThreadPoolJobPtr job,
+                                     unsigned long long start,
+                                     unsigned long long end)
+{
+    stats->jobsDone++;
+    virThreadPoolHistAdd(stats->waitTime, job->queuedAt, start);
+    virThreadPoolHistAdd(stats->runTime, start, end);
+}
+
+
+/* Must be called with the worker's lock held.
+ * Returns true if the worker was idle and will now look for work */
+static bool virThreadPoolWorkerWake(virThreadPoolWorkerPtr worker)
+{
+    if (!worker->idle || worker->wakeup || worker->quit)
+        return false;
+
+    worker->wakeup = true;
+    virCondSignal(&worker->cond);
+    return true;
+}
+
+/* Must be called with the worker's lock held */
+static void virThreadPoolWorkerSetIdle(virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolPtr pool = worker->pool;
+
+    worker->idle = true;
+
+    virMutexLock(&pool->idleLock);
+    if (!worker->onIdleList) {
+        pool->idleWorkers[pool->nIdle++] = worker;
+        worker->onIdleList = true;
+    }
+    virMutexUnlock(&pool->idleLock);
+}
+
+/*
+ * Make sure some worker looks for work which was just queued.
+ * Nobody is woken if a worker is looking already, since that one
+ * will wake another if it finds anything.
+ * Must be called without any worker lock held.
+ * Returns false if all workers are busy
+ */
+static bool virThreadPoolWakeIdle(virThreadPoolPtr pool)
+{
+    virThreadPoolWorkerPtr worker;
+    bool woken;
+
+    for (;;) {
+        virMutexLock(&pool->idleLock);
+        if (pool->nSpinning || pool->nIdle == 0) {
+            woken = pool->nSpinning > 0;
+            virMutexUnlock(&pool->idleLock);
+            return woken;
         }
+        worker = pool->idleWorkers[--pool->nIdle];
+        worker->onIdleList = false;
+        pool->nSpinning++;
+        virMutexUnlock(&pool->idleLock);
+
+        virMutexLock(&worker->lock);
+        if ((woken = virThreadPoolWorkerWake(worker)))
+            worker->spinning = true;
+        virMutexUnlock(&worker->lock);
+        if (woken)
+            return true;
+
+        /* It found some work meanwhile */
+        virMutexLock(&pool->idleLock);
+        pool->nSpinning--;
+        virMutexUnlock(&pool->idleLock);
+    }
+}
+
+/* Returns true if no other worker is still looking for work */
+static bool virThreadPoolStopSpinning(virThreadPoolPtr pool)
+{
+    bool last;
+
+    virMutexLock(&pool->idleLock);
+    last = --pool->nSpinning == 0;
+    virMutexUnlock(&pool->idleLock);
+    return last;
+}
+
+/*
+ * Look for work queued anywhere but the worker's own queue,
+ * priority jobs first. Half of the first non-empty queue found is
+ * taken at once, so a busy pool doesn't keep everyone scanning.
+ * Called without any lock held.
+ */
+static void virThreadPoolSteal(virThreadPoolWorkerPtr self,
+                               virThreadPoolJobListPtr jobs)
+{
+    virThreadPoolPtr pool = self->pool;
+    size_t first = self - pool->workers;
+    size_t i;
 
-        if (job == pool->jobList.firstPrio) {
-            virThreadPoolJobPtr tmp = job->next;
-            while (tmp) {
-                if (tmp->priority) {
+    virMutexLock(&pool->prioLock);
+    virThreadPoolJobListMove(&pool->prioJobs, jobs,
+                             pool->prioJobs.head ? 1 : 0);
+    virMutexUnlock(&pool->prioLock);
+    if (jobs->head)
+        return;
+
+    for (i = 1 ; i < pool->nSlots ; i++) {
+        virThreadPoolWorkerPtr victim = &pool->workers[(first + i) % pool->nSlots];
+
+        /* Peeking without the lock is only a hint, but anyone who
+         * queued work without finding us idle took idleLock after
+         * queuing it, and before we did, so that work shows here */
+        if (!victim->jobs.head)
+            continue;
+
+        virMutexLock(&victim->lock);
+        virThreadPoolJobListMove(&victim->jobs, jobs,
+                                 (victim->jobs.depth + 1) / 2);
+        virMutexUnlock(&victim->lock);
+        if (jobs->head)
+            return;
+    }
+}
+
+static void virThreadPoolWorkerExit(virThreadPoolPtr pool)
+{
+    virMutexLock(&pool->mutex);
+    if (--pool->nLive == 0)
+        virCondSignal(&pool->quit_cond);
+    virMutexUnlock(&pool->mutex);
+}
+
+static void virThreadPoolWorkerMain(void *opaque)
+{
+    virThreadPoolWorkerPtr worker = opaque;
+    virThreadPoolPtr pool = worker->pool;
+    virThreadPoolJobPtr job;
+    virThreadPoolJobList stolen;
+    unsigned long long start, end;
+    bool spinning;
+
+    virMutexLock(&worker->lock);
+
+    while (!worker->quit) {
+        if (!(job = virThreadPoolJobListPop(&worker->jobs))) {
+            /* Advertise that we're idle before looking at the other
+             * queues, so anyone queuing work after we've looked
+             * there will wake us up */
+            virThreadPoolWorkerSetIdle(worker);
+            virMutexUnlock(&worker->lock);
+            memset(&stolen, 0, sizeof(stolen));
+            virThreadPoolSteal(worker, &stolen);
+            virMutexLock(&worker->lock);
+
+            if (!stolen.head) {
+                if (worker->spinning) {
+                    /* Submitters don't wake anyone while we're
+                     * spinning, so have one more look afterwards */
+                    worker->spinning = false;
+                    virMutexUnlock(&worker->lock);
+                    virThreadPoolStopSpinning(pool);
+                    virMutexLock(&worker->lock);
+                    continue;
+                }
+                if (!worker->wakeup && !worker->quit && !worker->jobs.head &&
+                    virCondWait(&worker->cond, &worker->lock) < 0) {
+                    /* Leave our queue to the other workers */
+                    worker->quit = true;
                     break;
                 }
-                tmp = tmp->next;
+                worker->wakeup = false;
+                continue;
             }
-            pool->jobList.firstPrio = tmp;
+            worker->stats.jobsStolen += stolen.depth;
+            virThreadPoolJobListMove(&stolen, &worker->jobs, stolen.depth);
+            job = virThreadPoolJobListPop(&worker->jobs);
         }
+        worker->idle = false;
+        worker->wakeup = false;
+        spinning = worker->spinning;
+        worker->spinning = false;
+
+        virMutexUnlock(&worker->lock);
+        /* There may be more where that came from */
+        if (spinning && virThreadPoolStopSpinning(pool))
+            virThreadPoolWakeIdle(pool);
+        virThreadPoolRunJob(pool, job, &start, &end);
+        virMutexLock(&worker->lock);
+
+        virThreadPoolJobStatsAdd(&worker->stats, job, start, end);
+        VIR_FREE(job);
+    }
 
-        if (job->prev)
-            job->prev->next = job->next;
-        else
-            pool->jobList.head = job->next;
-        if (job->next)
-            job->next->prev = job->prev;
-        else
-            pool->jobList.tail = job->prev;
+    worker->idle = false;
+    spinning = worker->spinning;
+    worker->spinning = false;
+    virMutexUnlock(&worker->lock);
+
+    if (spinning)
+        virThreadPoolStopSpinning(pool);
+    virThreadPoolWorkerExit(pool);
+}
+
+static void virThreadPoolPrioWorkerMain(void *opaque)
+{
+    virThreadPoolPtr pool = opaque;
+    virThreadPoolJobPtr job;
+    unsigned long long start, end;
 
-        pool->jobQueueDepth--;
+    virMutexLock(&pool->prioLock);
 
-        virMutexUnlock(&pool->mutex);
-        (pool->jobFunc)(job->data, pool->jobOpaque);
+    while (!pool->prioQuit) {
+        if (!(job = virThreadPoolJobListPop(&pool->prioJobs))) {
+            int rc;
+
+            pool->freePrioWorkers++;
+            rc = virCondWait(&pool->prioCond, &pool->prioLock);
+            pool->freePrioWorkers--;
+            if (rc < 0)
+                break;
+            continue;
+        }
+
+        virMutexUnlock(&pool->prioLock);
+        virThreadPoolRunJob(pool, job, &start, &end);
+        virMutexLock(&pool->prioLock);
+
+        virThreadPoolJobStatsAdd(&pool->prioStats, job, start, end);
         VIR_FREE(job);
-        virMutexLock(&pool->mutex);
     }
 
-out:
-    if (priority)
-        pool->nPrioWorkers--;
-    else
-        pool->nWorkers--;
-    if (pool->nWorkers == 0 && pool->nPrioWorkers==0)
-        virCondSignal(&pool->quit_cond);
+    virMutexUnlock(&pool->prioLock);
+
+    virThreadPoolWorkerExit(pool);
+}
+
+/* Must be called with the pool mutex held */
+static int virThreadPoolSpawnWorker(virThreadPoolPtr pool)
+{
+    virThreadPoolWorkerPtr worker;
+
+    if (pool->nWorkers >= pool->maxWorkers) {
+        virThreadPoolError(VIR_ERR_INTERNAL_ERROR,
+                           _("Thread pool already has %zu workers"),
+                           pool->maxWorkers);
+        return -1;
+    }
+
+    worker = &pool->workers[pool->nWorkers];
+    if (virThreadCreate(&worker->thread,
+                        true,
+                        virThreadPoolWorkerMain,
+                        worker) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create worker thread"));
+        return -1;
+    }
+
+    /* The new slot is set up before submitters can see it */
+#if HAVE_SYNC_FETCH_AND_ADD
+    __sync_fetch_and_add(&pool->nWorkers, 1);
+#else
+    pool->nWorkers++;
+#endif
+    pool->nLive++;
+    return 0;
+}
+
+/*
+ * Pick the worker to queue the next job to, in turn, setting
+ * @nWorkers to the number of workers there are. Called without
+ * the pool mutex held.
+ */
+static virThreadPoolWorkerPtr virThreadPoolNextWorker(virThreadPoolPtr pool,
+                                                      size_t *nWorkers)
+{
+    size_t next;
+
+#if HAVE_SYNC_FETCH_AND_ADD
+    *nWorkers = __sync_fetch_and_add(&pool->nWorkers, 0);
+    if (*nWorkers == 0)
+        return NULL;
+    next = __sync_fetch_and_add(&pool->nextWorker, 1);
+#else
+    virMutexLock(&pool->mutex);
+    *nWorkers = pool->nWorkers;
+    next = pool->nextWorker++;
     virMutexUnlock(&pool->mutex);
+    if (*nWorkers == 0)
+        return NULL;
+#endif
+
+    return &pool->workers[next % *nWorkers];
 }
 
 virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
@@ -164,7 +536,12 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
 {
     virThreadPoolPtr pool;
     size_t i;
-    struct virThreadPoolWorkerData *data = NULL;
+
+    if (maxWorkers == 0) {
+        virThreadPoolError(VIR_ERR_INVALID_ARG, "%s",
+                           _("Thread pool needs at least one worker"));
+        return NULL;
+    }
 
     if (minWorkers > maxWorkers)
         minWorkers = maxWorkers;
@@ -174,68 +551,74 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
         return NULL;
     }
 
-    pool->jobList.tail = pool->jobList.head = NULL;
-
     pool->jobFunc = func;
     pool->jobOpaque = opaque;
 
     if (virMutexInit(&pool->mutex) < 0)
         goto error;
-    if (virCondInit(&pool->cond) < 0)
-        goto error;
     if (virCondInit(&pool->quit_cond) < 0)
         goto error;
+    if (virMutexInit(&pool->prioLock) < 0)
+        goto error;
+    if (virCondInit(&pool->prioCond) < 0)
+        goto error;
+    if (virMutexInit(&pool->idleLock) < 0)
+        goto error;
 
-    if (VIR_ALLOC_N(pool->workers, minWorkers) < 0)
+    /* Every slot is set up front, so that stealing workers can
+     * look at all of them without taking the pool mutex */
+    if (VIR_ALLOC_N(pool->workers, maxWorkers) < 0 ||
+        VIR_ALLOC_N(pool->idleWorkers, maxWorkers) < 0) {
+        virReportOOMError();
         goto error;
+    }
 
     pool->maxWorkers = maxWorkers;
-    for (i = 0; i < minWorkers; i++) {
-        if (VIR_ALLOC(data) < 0) {
-            virReportOOMError();
+    for (i = 0; i < maxWorkers; i++) {
+        pool->workers[i].pool = pool;
+        if (virMutexInit(&pool->workers[i].lock) < 0)
+            goto error;
+        if (virCondInit(&pool->workers[i].cond) < 0) {
+            virMutexDestroy(&pool->workers[i].lock);
             goto error;
         }
-        data->pool = pool;
-        data->cond = &pool->cond;
+        pool->nSlots++;
+    }
 
-        if (virThreadCreate(&pool->workers[i],
-                            true,
-                            virThreadPoolWorker,
-                            data) < 0) {
+    virMutexLock(&pool->mutex);
+    for (i = 0; i < minWorkers; i++) {
+        if (virThreadPoolSpawnWorker(pool) < 0) {
+            virMutexUnlock(&pool->mutex);
             goto error;
         }
-        pool->nWorkers++;
     }
 
     if (prioWorkers) {
-        if (virCondInit(&pool->prioCond) < 0)
-            goto error;
-        if (VIR_ALLOC_N(pool->prioWorkers, prioWorkers) < 0)
+        if (VIR_ALLOC_N(pool->prioWorkers, prioWorkers) < 0) {
+            virReportOOMError();
+            virMutexUnlock(&pool->mutex);
             goto error;
+        }
 
         for (i = 0; i < prioWorkers; i++) {
-            if (VIR_ALLOC(data) < 0) {
-                virReportOOMError();
-                goto error;
-            }
-            data->pool = pool;
-            data->cond = &pool->prioCond;
-            data->priority = true;
-
             if (virThreadCreate(&pool->prioWorkers[i],
                                 true,
-                                virThreadPoolWorker,
-                                data) < 0) {
+                                virThreadPoolPrioWorkerMain,
+                                pool) < 0) {
+                virReportSystemError(errno, "%s",
+                                     _("Unable to create priority worker thread"));
+                virMutexUnlock(&pool->mutex);
                 goto error;
             }
             pool->nPrioWorkers++;
+            pool->nLive++;
         }
     }
+    virMutexUnlock(&pool->mutex);
 
     return pool;
 
 error:
-    VIR_FREE(data);
     virThreadPoolFree(pool);
     return NULL;
 
@@ -243,40 +626,128 @@ error:
 
 void virThreadPoolFree(virThreadPoolPtr pool)
 {
-    virThreadPoolJobPtr job;
-    bool priority = false;
+    size_t i;
 
     if (!pool)
         return;
 
     virMutexLock(&pool->mutex);
     pool->quit = true;
-    if (pool->nWorkers > 0)
-        virCondBroadcast(&pool->cond);
-    if (pool->nPrioWorkers > 0) {
-        priority = true;
-        virCondBroadcast(&pool->prioCond);
+    for (i = 0; i < pool->nWorkers; i++) {
+        virMutexLock(&pool->workers[i].lock);
+        pool->workers[i].quit = true;
+        virCondSignal(&pool->workers[i].cond);
+        virMutexUnlock(&pool->workers[i].lock);
     }
 
-    ignore_value(virCondWait(&pool->quit_cond, &pool->mutex));
+    virMutexLock(&pool->prioLock);
+    pool->prioQuit = true;
+    virCondBroadcast(&pool->prioCond);
+    virMutexUnlock(&pool->prioLock);
 
-    while ((job = pool->jobList.head)) {
-        pool->jobList.head = pool->jobList.head->next;
-        VIR_FREE(job);
+    while (pool->nLive > 0) {
+        if (virCondWait(&pool->quit_cond, &pool->mutex) < 0)
+            break;
     }
+    virMutexUnlock(&pool->mutex);
+
+    for (i = 0; i < pool->nSlots; i++) {
+        virThreadPoolJobListClear(&pool->workers[i].jobs);
+        virMutexDestroy(&pool->workers[i].lock);
+        ignore_value(virCondDestroy(&pool->workers[i].cond));
+    }
+    virThreadPoolJobListClear(&pool->prioJobs);
 
     VIR_FREE(pool->workers);
-    virMutexUnlock(&pool->mutex);
+    VIR_FREE(pool->idleWorkers);
+    VIR_FREE(pool->prioWorkers);
     virMutexDestroy(&pool->mutex);
     ignore_value(virCondDestroy(&pool->quit_cond));
-    ignore_value(virCondDestroy(&pool->cond));
-    if (priority) {
-        VIR_FREE(pool->prioWorkers);
-        ignore_value(virCondDestroy(&pool->prioCond));
-    }
+    virMutexDestroy(&pool->prioLock);
+    ignore_value(virCondDestroy(&pool->prioCond));
+    virMutexDestroy(&pool->idleLock);
     VIR_FREE(pool);
 }
 
+/*
+ * Start another worker if there is room, for when nobody is idle.
+ * If @job is not NULL, it is queued to the new worker.
+ * Returns -1 if @job could not be queued.
+ */
+static int virThreadPoolGrow(virThreadPoolPtr pool,
+                             virThreadPoolJobPtr job)
+{
+    virThreadPoolWorkerPtr worker;
+    int ret = -1;
+
+    virMutexLock(&pool->mutex);
+    if (pool->quit) {
+        virThreadPoolError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("Thread pool is shutting down"));
+        goto cleanup;
+    }
+
+    /* Someone else may have filled the pool meanwhile */
+    if (pool->nWorkers < pool->maxWorkers &&
+        virThreadPoolSpawnWorker(pool) < 0)
+        goto cleanup;
+
+    if (job) {
+        worker = &pool->workers[pool->nWorkers - 1];
+        virMutexLock(&worker->lock);
+        virThreadPoolJobListPush(&worker->jobs, job);
+        virMutexUnlock(&worker->lock);
+        virThreadPoolWakeIdle(pool);
+    }
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&pool->mutex);
+    return ret;
+}
+
+/*
+ * Queue a job to the next worker in turn, starting a new worker
+ * if there is room and nobody is idle. Only starting a worker
+ * takes the pool mutex.
+ */
+static int virThreadPoolQueueJob(virThreadPoolPtr pool,
+                                 virThreadPoolJobPtr job)
+{
+    virThreadPoolWorkerPtr worker = NULL;
+    size_t nWorkers = 0;
+    size_t i = 0;
+
+    do {
+        if (!(worker = virThreadPoolNextWorker(pool, &nWorkers)))
+            break;
+        virMutexLock(&worker->lock);
+        if (!worker->quit)
+            break;
+        virMutexUnlock(&worker->lock);
+        worker = NULL;
+    } while (++i < nWorkers);
+
+    if (worker) {
+        virThreadPoolJobListPush(&worker->jobs, job);
+        virMutexUnlock(&worker->lock);
+
+        /* Checked after queuing, to catch workers which went idle
+         * after looking at this queue */
+        if (virThreadPoolWakeIdle(pool) ||
+            nWorkers == pool->maxWorkers)
+            return 0;
+
+        /* The job is queued already, so it will get done eventually
+         * even if we can't start another worker */
+        if (virThreadPoolGrow(pool, NULL) < 0)
+            virResetLastError();
+        return 0;
+    }
+
+    return virThreadPoolGrow(pool, job);
+}
+
 /*
  * @priority - job priority
  * Return: 0 on success, -1 otherwise
@@ -286,67 +757,88 @@ int virThreadPoolSendJob(virThreadPoolPtr pool,
                          void *jobData)
 {
     virThreadPoolJobPtr job;
-    struct virThreadPoolWorkerData *data = NULL;
-
-    virMutexLock(&pool->mutex);
-    if (pool->quit)
-        goto error;
 
-    if (pool->freeWorkers - pool->jobQueueDepth <= 0 &&
-        pool->nWorkers < pool->maxWorkers) {
-        if (VIR_EXPAND_N(pool->workers, pool->nWorkers, 1) < 0) {
-            virReportOOMError();
-            goto error;
-        }
+    if (VIR_ALLOC(job) < 0) {
+        virReportOOMError();
+        return -1;
+    }
 
-        if (VIR_ALLOC(data) < 0) {
-            pool->nWorkers--;
-            virReportOOMError();
-            goto error;
-        }
+    job->data = jobData;
+    job->priority = priority;
+    job->queuedAt = virThreadPoolNowUs();
 
-        data->pool = pool;
-        data->cond = &pool->cond;
+    if (priority && pool->nPrioWorkers) {
+        bool woken;
 
-        if (virThreadCreate(&pool->workers[pool->nWorkers - 1],
-                            true,
-                            virThreadPoolWorker,
-                            data) < 0) {
-            VIR_FREE(data);
-            pool->nWorkers--;
+        virMutexLock(&pool->prioLock);
+        if (pool->prioQuit) {
+            virMutexUnlock(&pool->prioLock);
+            virThreadPoolError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("Thread pool is shutting down"));
             goto error;
         }
+        virThreadPoolJobListPush(&pool->prioJobs, job);
+        woken = pool->freePrioWorkers > 0;
+        if (woken)
+            virCondSignal(&pool->prioCond);
+        virMutexUnlock(&pool->prioLock);
+
+        /* A priority worker will get to it anyway */
+        if (!virThreadPoolWakeIdle(pool) && !woken &&
+            virThreadPoolGrow(pool, NULL) < 0)
+            virResetLastError();
+        return 0;
     }
 
-    if (VIR_ALLOC(job) < 0) {
-        virReportOOMError();
+    if (virThreadPoolQueueJob(pool, job) < 0)
         goto error;
-    }
-
-    job->data = jobData;
-    job->priority = priority;
+    return 0;
 
-    job->prev = pool->jobList.tail;
-    if (pool->jobList.tail)
-        pool->jobList.tail->next = job;
-    pool->jobList.tail = job;
+error:
+    VIR_FREE(job);
+    return -1;
+}
 
-    if (!pool->jobList.head)
-        pool->jobList.head = job;
+static void virThreadPoolStatsAdd(virThreadPoolStatsPtr stats,
+                                  virThreadPoolJobStatsPtr jobStats)
+{
+    size_t i;
 
-    if (priority && !pool->jobList.firstPrio)
-        pool->jobList.firstPrio = job;
+    stats->jobsDone += jobStats->jobsDone;
+    stats->jobsStolen += jobStats->jobsStolen;
+    for (i = 0; i < VIR_THREAD_POOL_HIST_BUCKETS; i++) {
+        stats->waitTime[i] += jobStats->waitTime[i];
+        stats->runTime[i] += jobStats->runTime[i];
+    }
+}
 
-    pool->jobQueueDepth++;
+void virThreadPoolGetStats(virThreadPoolPtr pool,
+                           virThreadPoolStatsPtr stats)
+{
+    size_t i;
 
-    virCondSignal(&pool->cond);
-    if (priority)
-        virCondSignal(&pool->prioCond);
+    memset(stats, 0, sizeof(*stats));
 
-    virMutexUnlock(&pool->mutex);
-    return 0;
+    virMutexLock(&pool->mutex);
+    stats->maxWorkers = pool->maxWorkers;
+    stats->nWorkers = pool->nWorkers;
+    stats->nPrioWorkers = pool->nPrioWorkers;
+
+    for (i = 0; i < pool->nSlots; i++) {
+        virThreadPoolWorkerPtr worker = &pool->workers[i];
+
+        virMutexLock(&worker->lock);
+        if (worker->idle)
+            stats->freeWorkers++;
+        stats->jobQueueDepth += worker->jobs.depth;
+        virThreadPoolStatsAdd(stats, &worker->stats);
+        virMutexUnlock(&worker->lock);
+    }
 
-error:
+    virMutexLock(&pool->prioLock);
+    stats->freePrioWorkers = pool->freePrioWorkers;
+    stats->prioJobQueueDepth = pool->prioJobs.depth;
+    virThreadPoolStatsAdd(stats, &pool->prioStats);
+    virMutexUnlock(&pool->prioLock);
     virMutexUnlock(&pool->mutex);
-    return -1;
 }
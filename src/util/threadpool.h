@@ -33,6 +33,32 @@ typedef virThreadPool *virThreadPoolPtr;
 
 typedef void (*virThreadPoolJobFunc)(void *jobdata, void *opaque);
 
+# define VIR_THREAD_POOL_HIST_BUCKETS 24
+
+typedef struct _virThreadPoolStats virThreadPoolStats;
+typedef virThreadPoolStats *virThreadPoolStatsPtr;
+
+/*
+ * Wait and run times are histograms in microseconds: bucket 0
+ * counts jobs taking under 1us, bucket N those taking between
+ * 2^(N-1) and 2^N us, and the last bucket everything longer.
+ */
+struct _virThreadPoolStats {
+    size_t maxWorkers;
+    size_t nWorkers;
+    size_t freeWorkers;
+    size_t nPrioWorkers;
+    size_t freePrioWorkers;
+
+    size_t jobQueueDepth;
+    size_t prioJobQueueDepth;
+
+    unsigned long long jobsDone;
+    unsigned long long jobsStolen;  /* run by a worker they weren't queued to */
+    unsigned long long waitTime[VIR_THREAD_POOL_HIST_BUCKETS];
+    unsigned long long runTime[VIR_THREAD_POOL_HIST_BUCKETS];
+};
+
 virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
                                   size_t maxWorkers,
                                   size_t prioWorkers,
@@ -46,4 +72,8 @@ int virThreadPoolSendJob(virThreadPoolPtr pool,
                          void *jobdata) ATTRIBUTE_NONNULL(1)
                                         ATTRIBUTE_RETURN_CHECK;
 
+void virThreadPoolGetStats(virThreadPoolPtr pool,
+                           virThreadPoolStatsPtr stats) ATTRIBUTE_NONNULL(1)
+                                                       ATTRIBUTE_NONNULL(2);
+
 #endif
@@ -0,0 +1,273 @@
+/*
+ * virfdrelay.c: buffered forwarding of data between two file descriptors
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include "virfdrelay.h"
+#include "memory.h"
+#include "logging.h"
+#include "virterror_internal.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define virFDRelayError(code, ...)                                  \
+    virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,             \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
+/* Upper bound on the rounds of reads and writes done by one call
+ * to virFDRelayRun, so a chatty peer cannot starve the caller's
+ * event loop */
+#define VIR_FD_RELAY_MAX_PASSES 16
+
+typedef struct _virFDRelayEnd virFDRelayEnd;
+typedef virFDRelayEnd *virFDRelayEndPtr;
+
+struct _virFDRelayEnd {
+    int fd;
+    bool readable;
+    bool writable;
+    bool hangup;
+
+    /* Data read from this end, waiting to be written to the other */
+    char *buf;
+    size_t off;
+    size_t len;
+};
+
+struct _virFDRelay {
+    size_t bufsize;
+    virFDRelayEnd ends[2];
+};
+
+
+virFDRelayPtr virFDRelayNew(int fdA, int fdB, size_t bufsize)
+{
+    virFDRelayPtr relay;
+    size_t i;
+
+    if (bufsize == 0) {
+        virFDRelayError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("relay buffer size must not be zero"));
+        return NULL;
+    }
+
+    if (VIR_ALLOC(relay) < 0)
+        goto no_memory;
+
+    relay->bufsize = bufsize;
+    relay->ends[0].fd = fdA;
+    relay->ends[1].fd = fdB;
+    for (i = 0 ; i < 2 ; i++) {
+        if (VIR_ALLOC_N(relay->ends[i].buf, bufsize) < 0)
+            goto no_memory;
+    }
+
+    return relay;
+
+no_memory:
+    virReportOOMError();
+    virFDRelayFree(relay);
+    return NULL;
+}
+
+
+void virFDRelayFree(virFDRelayPtr relay)
+{
+    if (!relay)
+        return;
+
+    VIR_FREE(relay->ends[0].buf);
+    VIR_FREE(relay->ends[1].buf);
+    VIR_FREE(relay);
+}
+
+
+static virFDRelayEndPtr virFDRelayFindEnd(virFDRelayPtr relay, int fd)
+{
+    if (relay->ends[0].fd == fd)
+        return &relay->ends[0];
+    if (relay->ends[1].fd == fd)
+        return &relay->ends[1];
+    return NULL;
+}
+
+
+/**
+ * virFDRelayNotify:
+ * @relay: the relay
+ * @fd: one of the relay's file descriptors
+ * @events: VIR_EVENT_HANDLE_* flags reported for @fd
+ *
+ * Record that @fd may be readable or writable now. A hangup with
+ * nothing left to read stops the relay reading from @fd until it
+ * is reported readable again. Until @fd is reported ready without
+ * a hangup, data for it is dropped rather than held back when it
+ * would block, since nobody is there to take it.
+ */
+void virFDRelayNotify(virFDRelayPtr relay, int fd, int events)
+{
+    virFDRelayEndPtr end = virFDRelayFindEnd(relay, fd);
+
+    if (!end)
+        return;
+
+    if (events & VIR_EVENT_HANDLE_READABLE)
+        end->readable = true;
+    else if (events & VIR_EVENT_HANDLE_HANGUP)
+        end->readable = false;
+
+    if (events & VIR_EVENT_HANDLE_WRITABLE)
+        end->writable = true;
+
+    end->hangup = !!(events & VIR_EVENT_HANDLE_HANGUP);
+}
+
+
+/**
+ * virFDRelayGetEvents:
+ * @relay: the relay
+ * @fd: one of the relay's file descriptors
+ *
+ * For level triggered event loops: returns the VIR_EVENT_HANDLE_*
+ * flags worth waiting for on @fd. Nothing is asked for while a
+ * buffer is full, which is what pushes back on a fast writer.
+ */
+int virFDRelayGetEvents(virFDRelayPtr relay, int fd)
+{
+    virFDRelayEndPtr end = virFDRelayFindEnd(relay, fd);
+    virFDRelayEndPtr other;
+    int events = 0;
+
+    if (!end)
+        return 0;
+    other = end == &relay->ends[0] ? &relay->ends[1] : &relay->ends[0];
+
+    if (!end->readable && end->len < relay->bufsize)
+        events |= VIR_EVENT_HANDLE_READABLE;
+    if (!end->writable && other->len)
+        events |= VIR_EVENT_HANDLE_WRITABLE;
+
+    return events;
+}
+
+
+/*
+ * Move one chunk from @src into its buffer, and as much of the
+ * buffer as possible on to @dst.
+ * Returns -1 on error, else whether anything was moved
+ */
+static int virFDRelayPump(virFDRelayPtr relay,
+                          virFDRelayEndPtr src,
+                          virFDRelayEndPtr dst)
+{
+    bool moved = false;
+    ssize_t n;
+
+    if (src->readable && src->len < relay->bufsize) {
+        if (src->len == 0)
+            src->off = 0;
+        else if (src->off + src->len == relay->bufsize) {
+            memmove(src->buf, src->buf + src->off, src->len);
+            src->off = 0;
+        }
+
+        n = read(src->fd, src->buf + src->off + src->len,
+                 relay->bufsize - src->off - src->len);
+        if (n > 0) {
+            src->len += n;
+            moved = true;
+        } else if (n == 0) {
+            src->readable = false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            src->readable = false;
+        } else if (errno != EINTR) {
+            src->readable = false;
+            virReportSystemError(errno,
+                                 _("read of fd %d failed"),
+                                 src->fd);
+            return -1;
+        }
+    }
+
+    while (dst->writable && src->len) {
+        n = write(dst->fd, src->buf + src->off, src->len);
+        if (n > 0) {
+            src->off += n;
+            src->len -= n;
+            moved = true;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            dst->writable = false;
+        } else {
+            /* Nobody is going to take this data, so don't let it
+             * hold up whatever comes after it */
+            dst->writable = false;
+            VIR_DEBUG("Dropping %zu bytes for fd %d", src->len, dst->fd);
+            src->off = src->len = 0;
+            virReportSystemError(n < 0 ? errno : EIO,
+                                 _("write to fd %d failed"),
+                                 dst->fd);
+            return -1;
+        }
+    }
+
+    if (src->len && !dst->writable && dst->hangup) {
+        VIR_DEBUG("Dropping %zu bytes for hung up fd %d", src->len, dst->fd);
+        src->off = src->len = 0;
+    }
+
+    return moved;
+}
+
+
+/**
+ * virFDRelayRun:
+ * @relay: the relay
+ *
+ * Move data in both directions until neither can make progress
+ * without blocking, or until enough has been moved for now.
+ *
+ * Returns -1 on error, 0 if the relay needs new readiness events
+ * to make progress, or 1 if it stopped with more work to do and
+ * should be run again soon
+ */
+int virFDRelayRun(virFDRelayPtr relay)
+{
+    size_t pass;
+    int ret = 0;
+
+    for (pass = 0 ; pass < VIR_FD_RELAY_MAX_PASSES ; pass++) {
+        int rc1 = virFDRelayPump(relay, &relay->ends[0], &relay->ends[1]);
+        int rc2 = virFDRelayPump(relay, &relay->ends[1], &relay->ends[0]);
+
+        /* Keep the other direction going despite an error in one */
+        if (rc1 < 0 || rc2 < 0)
+            ret = -1;
+        if (rc1 <= 0 && rc2 <= 0)
+            return ret;
+    }
+
+    return ret < 0 ? -1 : 1;
+}
@@ -0,0 +1,52 @@
+/*
+ * virfdrelay.h: buffered forwarding of data between two file descriptors
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef __VIR_FD_RELAY_H__
+# define __VIR_FD_RELAY_H__
+
+# include "internal.h"
+
+/*
+ * A relay copies whatever arrives on either of two non-blocking
+ * file descriptors to the other one, through a buffer for each
+ * direction. When a buffer fills up because its destination is
+ * not keeping up, the relay stops reading from the source until
+ * there is room again.
+ *
+ * The caller owns the file descriptors and the event loop: it
+ * reports readiness with virFDRelayNotify, in the edge triggered
+ * sense of "may be ready now", then calls virFDRelayRun to move
+ * data until both directions would block.
+ */
+typedef struct _virFDRelay virFDRelay;
+typedef virFDRelay *virFDRelayPtr;
+
+# define VIR_FD_RELAY_DEFAULT_BUFSIZE (64 * 1024)
+
+virFDRelayPtr virFDRelayNew(int fdA, int fdB, size_t bufsize);
+void virFDRelayFree(virFDRelayPtr relay);
+
+void virFDRelayNotify(virFDRelayPtr relay, int fd, int events);
+int virFDRelayGetEvents(virFDRelayPtr relay, int fd);
+
+int virFDRelayRun(virFDRelayPtr relay) ATTRIBUTE_RETURN_CHECK;
+
+#endif /* __VIR_FD_RELAY_H__ */
@@ -0,0 +1,879 @@
+/*
+ * virpzip.c: multi-threaded block compression of data streams
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+#include "virpzip.h"
+#include "memory.h"
+#include "threads.h"
+#include "util.h"
+#include "logging.h"
+#include "virterror_internal.h"
+#include "ignore-value.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define virPZipError(code, ...)                                     \
+    virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,             \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
+#if HAVE_ZLIB
+
+/*
+ * Layout of a stream, all numbers big endian:
+ *
+ *   header:  magic[8] version:32 blocksize:32
+ *   block:   rawlen:32 zlen:32 data[zlen ? zlen : rawlen]
+ *   ...
+ *   end:     0:32 0:32
+ *   index:   offset:64 of each block, from the start of the stream
+ *   trailer: nblocks:64 indexoffset:64 magic[8]
+ */
+# define VIR_PZIP_MAGIC "LVPZIP\r\n"
+# define VIR_PZIP_INDEX_MAGIC "LVPZIDX\n"
+# define VIR_PZIP_MAGIC_LEN 8
+# define VIR_PZIP_VERSION 1
+# define VIR_PZIP_HEADER_LEN (VIR_PZIP_MAGIC_LEN + 8)
+# define VIR_PZIP_FRAME_LEN 8
+# define VIR_PZIP_TRAILER_LEN (16 + VIR_PZIP_MAGIC_LEN)
+
+/* Speed matters more than size when saving a guest */
+# define VIR_PZIP_LEVEL Z_BEST_SPEED
+
+/* Size of the buffers used to gather output and to read input in,
+ * and the alignment that O_DIRECT output is kept to */
+# define VIR_PZIP_IO_SIZE (1024 * 1024)
+# define VIR_PZIP_IO_ALIGN 4096
+
+enum {
+    VIR_PZIP_BLOCK_FREE = 0, /* waiting for the reader */
+    VIR_PZIP_BLOCK_READY,    /* read in, waiting for a worker */
+    VIR_PZIP_BLOCK_BUSY,     /* a worker is on it */
+    VIR_PZIP_BLOCK_DONE,     /* waiting for the writer */
+};
+
+typedef struct _virPZipBlock virPZipBlock;
+typedef virPZipBlock *virPZipBlockPtr;
+
+struct _virPZipBlock {
+    int state;
+
+    char *in;
+    size_t inlen;
+    char *out;
+    size_t rawlen;
+
+    /* What the writer has to deal with, either in or out */
+    char *data;
+    size_t datalen;
+    bool stored;
+};
+
+typedef struct _virPZip virPZip;
+typedef virPZip *virPZipPtr;
+
+/*
+ * The calling thread reads blocks in, the workers turn them over
+ * and a writer thread writes them out, all in turn through a ring
+ * of blocks, so that no more than a few of them are in memory
+ * however large the stream is.
+ */
+struct _virPZip {
+    virMutex lock;
+    virCond cond;
+
+    bool compress;
+    int infd;
+    const char *inname;
+    int outfd;
+    const char *outname;
+
+    virPZipBlockPtr blocks;
+    size_t nblocks;
+
+    unsigned long long nread;   /* blocks handed over by the reader */
+    unsigned long long next;    /* next block for a worker to take */
+    bool eof;                   /* the reader is done */
+    bool failed;
+    virErrorPtr error;          /* first failure, of whichever thread */
+
+    /* Blocked input or output, depending on the direction */
+    void *iobase;
+    char *iobuf;
+    size_t iolen;
+    size_t iopos;
+    unsigned long long total;   /* bytes of the stream so far */
+
+    bool direct;
+    off_t start;
+
+    unsigned long long *index;
+    size_t nindex;
+    size_t nindex_max;
+};
+
+
+static void
+virPZipPut32(char *buf, uint32_t val)
+{
+    unsigned char *p = (unsigned char *) buf;
+
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void
+virPZipPut64(char *buf, uint64_t val)
+{
+    virPZipPut32(buf, val >> 32);
+    virPZipPut32(buf + 4, val & 0xffffffff);
+}
+
+static uint32_t
+virPZipGet32(const char *buf)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+        ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint64_t
+virPZipGet64(const char *buf)
+{
+    return ((uint64_t) virPZipGet32(buf) << 32) | virPZipGet32(buf + 4);
+}
+
+
+/* Called with the lock held, once an error has been reported by
+ * the calling thread */
+static void
+virPZipFail(virPZipPtr pz)
+{
+    if (!pz->error)
+        pz->error = virSaveLastError();
+    pz->failed = true;
+    virCondBroadcast(&pz->cond);
+}
+
+/* Called with the lock held, returns false if the work is off */
+static bool
+virPZipWait(virPZipPtr pz)
+{
+    if (virCondWait(&pz->cond, &pz->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot wait for condition"));
+        virPZipFail(pz);
+    }
+    return !pz->failed;
+}
+
+
+/*
+ * Output of compression, gathered into whole buffers
+ */
+static int
+virPZipFlush(virPZipPtr pz, size_t len)
+{
+    if (safewrite(pz->outfd, pz->iobuf, len) < 0) {
+        virReportSystemError(errno, _("Unable to write %s"), pz->outname);
+        return -1;
+    }
+    pz->iopos = 0;
+    return 0;
+}
+
+static int
+virPZipPut(virPZipPtr pz, const char *data, size_t len)
+{
+    pz->total += len;
+
+    while (len) {
+        size_t want = MIN(len, pz->iolen - pz->iopos);
+
+        memcpy(pz->iobuf + pz->iopos, data, want);
+        pz->iopos += want;
+        data += want;
+        len -= want;
+
+        if (pz->iopos == pz->iolen &&
+            virPZipFlush(pz, pz->iolen) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+virPZipPutFrame(virPZipPtr pz, uint32_t rawlen, uint32_t zlen)
+{
+    char frame[VIR_PZIP_FRAME_LEN];
+
+    virPZipPut32(frame, rawlen);
+    virPZipPut32(frame + 4, zlen);
+    return virPZipPut(pz, frame, sizeof(frame));
+}
+
+static int
+virPZipPutHeader(virPZipPtr pz)
+{
+    char header[VIR_PZIP_HEADER_LEN];
+    int mode = -1;
+
+# ifdef F_GETFL
+    mode = fcntl(pz->outfd, F_GETFL);
+# endif
+    if (O_DIRECT && mode >= 0 && (mode & O_DIRECT)) {
+        /* Every write has to be aligned, including the first one */
+        pz->direct = true;
+        if ((pz->start = lseek(pz->outfd, 0, SEEK_CUR)) < 0 ||
+            pz->start % VIR_PZIP_IO_ALIGN) {
+            virReportSystemError(pz->start < 0 ? errno : EINVAL,
+                                 _("O_DIRECT write to %s needs an aligned "
+                                   "seekable file"), pz->outname);
+            return -1;
+        }
+    }
+
+    memcpy(header, VIR_PZIP_MAGIC, VIR_PZIP_MAGIC_LEN);
+    virPZipPut32(header + VIR_PZIP_MAGIC_LEN, VIR_PZIP_VERSION);
+    virPZipPut32(header + VIR_PZIP_MAGIC_LEN + 4, VIR_PZIP_BLOCK_SIZE);
+    return virPZipPut(pz, header, sizeof(header));
+}
+
+static int
+virPZipPutIndex(virPZipPtr pz)
+{
+    char buf[VIR_PZIP_TRAILER_LEN];
+    unsigned long long offset;
+    size_t i;
+
+    if (virPZipPutFrame(pz, 0, 0) < 0)
+        return -1;
+
+    offset = pz->total;
+    for (i = 0 ; i < pz->nindex ; i++) {
+        virPZipPut64(buf, pz->index[i]);
+        if (virPZipPut(pz, buf, 8) < 0)
+            return -1;
+    }
+
+    virPZipPut64(buf, pz->nindex);
+    virPZipPut64(buf + 8, offset);
+    memcpy(buf + 16, VIR_PZIP_INDEX_MAGIC, VIR_PZIP_MAGIC_LEN);
+    if (virPZipPut(pz, buf, sizeof(buf)) < 0)
+        return -1;
+
+    if (!pz->direct)
+        return pz->iopos ? virPZipFlush(pz, pz->iopos) : 0;
+
+    /* O_DIRECT can only write whole pages, so pad the last one out
+     * and cut the file back to the end of the stream */
+    if (pz->iopos) {
+        size_t len = ((pz->iopos + VIR_PZIP_IO_ALIGN - 1) &
+                      ~(VIR_PZIP_IO_ALIGN - 1));
+
+        memset(pz->iobuf + pz->iopos, 0, len - pz->iopos);
+        if (virPZipFlush(pz, len) < 0)
+            return -1;
+    }
+    if (ftruncate(pz->outfd, pz->start + pz->total) < 0) {
+        virReportSystemError(errno, _("Unable to truncate %s"), pz->outname);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Input of decompression, read in whole buffers
+ */
+static int
+virPZipGet(virPZipPtr pz, char *data, size_t len)
+{
+    pz->total += len;
+
+    while (len) {
+        size_t want;
+
+        if (pz->iopos == pz->iolen) {
+            ssize_t got;
+
+            /* Nothing gained by going through the buffer */
+            if (len >= VIR_PZIP_IO_SIZE) {
+                if ((got = saferead(pz->infd, data, len)) < 0)
+                    goto error;
+                if (got != len)
+                    goto truncated;
+                return 0;
+            }
+
+            if ((got = saferead(pz->infd, pz->iobuf, VIR_PZIP_IO_SIZE)) < 0)
+                goto error;
+            if (got == 0)
+                goto truncated;
+            pz->iolen = got;
+            pz->iopos = 0;
+        }
+
+        want = MIN(len, pz->iolen - pz->iopos);
+        memcpy(data, pz->iobuf + pz->iopos, want);
+        pz->iopos += want;
+        data += want;
+        len -= want;
+    }
+    return 0;
+
+error:
+    virReportSystemError(errno, _("Unable to read %s"), pz->inname);
+    return -1;
+
+truncated:
+    virPZipError(VIR_ERR_OPERATION_FAILED,
+                 _("compressed stream %s is truncated"), pz->inname);
+    return -1;
+}
+
+static int
+virPZipGetHeader(virPZipPtr pz)
+{
+    char header[VIR_PZIP_HEADER_LEN];
+    uint32_t version;
+    uint32_t blocksize;
+
+    if (virPZipGet(pz, header, sizeof(header)) < 0)
+        return -1;
+
+    version = virPZipGet32(header + VIR_PZIP_MAGIC_LEN);
+    blocksize = virPZipGet32(header + VIR_PZIP_MAGIC_LEN + 4);
+
+    if (memcmp(header, VIR_PZIP_MAGIC, VIR_PZIP_MAGIC_LEN) != 0) {
+        virPZipError(VIR_ERR_OPERATION_FAILED,
+                     _("%s is not a compressed stream"), pz->inname);
+        return -1;
+    }
+    if (version != VIR_PZIP_VERSION || blocksize > VIR_PZIP_BLOCK_SIZE) {
+        virPZipError(VIR_ERR_OPERATION_FAILED,
+                     _("unsupported compressed stream %s: version %u, "
+                       "block size %u"), pz->inname, version, blocksize);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+virPZipGetIndex(virPZipPtr pz)
+{
+    char buf[VIR_PZIP_TRAILER_LEN];
+    unsigned long long offset = pz->total;
+    size_t i;
+
+    for (i = 0 ; i < pz->nindex ; i++) {
+        if (virPZipGet(pz, buf, 8) < 0)
+            return -1;
+        if (virPZipGet64(buf) != pz->index[i])
+            goto corrupt;
+    }
+
+    if (virPZipGet(pz, buf, sizeof(buf)) < 0)
+        return -1;
+    if (virPZipGet64(buf) != pz->nindex ||
+        virPZipGet64(buf + 8) != offset ||
+        memcmp(buf + 16, VIR_PZIP_INDEX_MAGIC, VIR_PZIP_MAGIC_LEN) != 0)
+        goto corrupt;
+
+    return 0;
+
+corrupt:
+    virPZipError(VIR_ERR_OPERATION_FAILED,
+                 _("index of compressed stream %s does not match its "
+                   "blocks"), pz->inname);
+    return -1;
+}
+
+
+static int
+virPZipAddIndex(virPZipPtr pz, unsigned long long offset)
+{
+    if (VIR_RESIZE_N(pz->index, pz->nindex_max, pz->nindex, 1) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    pz->index[pz->nindex++] = offset;
+    return 0;
+}
+
+
+static int
+virPZipDeflate(virPZipPtr pz, virPZipBlockPtr block)
+{
+    uLongf len = compressBound(VIR_PZIP_BLOCK_SIZE);
+    int rc;
+
+    if ((rc = compress2((Bytef *) block->out, &len, (Bytef *) block->in,
+                        block->inlen, VIR_PZIP_LEVEL)) != Z_OK) {
+        virPZipError(VIR_ERR_INTERNAL_ERROR,
+                     _("Unable to compress %s: %s"), pz->inname, zError(rc));
+        return -1;
+    }
+
+    block->rawlen = block->inlen;
+    block->stored = len >= block->inlen;
+    if (block->stored) {
+        block->data = block->in;
+        block->datalen = block->inlen;
+    } else {
+        block->data = block->out;
+        block->datalen = len;
+    }
+    return 0;
+}
+
+static int
+virPZipInflate(virPZipPtr pz, virPZipBlockPtr block)
+{
+    uLongf len = block->rawlen;
+    int rc;
+
+    if (block->stored) {
+        block->data = block->in;
+        block->datalen = block->inlen;
+        return 0;
+    }
+
+    if ((rc = uncompress((Bytef *) block->out, &len, (Bytef *) block->in,
+                         block->inlen)) != Z_OK ||
+        len != block->rawlen) {
+        virPZipError(VIR_ERR_OPERATION_FAILED,
+                     _("corrupt block in compressed stream %s: %s"),
+                     pz->inname, rc != Z_OK ? zError(rc) : _("short block"));
+        return -1;
+    }
+
+    block->data = block->out;
+    block->datalen = len;
+    return 0;
+}
+
+
+static void
+virPZipWorker(void *opaque)
+{
+    virPZipPtr pz = opaque;
+
+    virMutexLock(&pz->lock);
+    while (!pz->failed) {
+        virPZipBlockPtr block;
+        int rc;
+
+        if (pz->next == pz->nread) {
+            if (pz->eof || !virPZipWait(pz))
+                break;
+            continue;
+        }
+
+        block = &pz->blocks[pz->next++ % pz->nblocks];
+        block->state = VIR_PZIP_BLOCK_BUSY;
+        virMutexUnlock(&pz->lock);
+
+        if (pz->compress)
+            rc = virPZipDeflate(pz, block);
+        else
+            rc = virPZipInflate(pz, block);
+
+        virMutexLock(&pz->lock);
+        if (rc < 0) {
+            virPZipFail(pz);
+            break;
+        }
+        block->state = VIR_PZIP_BLOCK_DONE;
+        virCondBroadcast(&pz->cond);
+    }
+    virMutexUnlock(&pz->lock);
+}
+
+
+static int
+virPZipWriteBlock(virPZipPtr pz, virPZipBlockPtr block)
+{
+    if (!pz->compress) {
+        if (safewrite(pz->outfd, block->data, block->datalen) < 0) {
+            virReportSystemError(errno, _("Unable to write %s"),
+                                 pz->outname);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (virPZipAddIndex(pz, pz->total) < 0 ||
+        virPZipPutFrame(pz, block->rawlen,
+                        block->stored ? 0 : block->datalen) < 0 ||
+        virPZipPut(pz, block->data, block->datalen) < 0)
+        return -1;
+    return 0;
+}
+
+/* Writes the blocks out in the order they were read in */
+static void
+virPZipWriter(void *opaque)
+{
+    virPZipPtr pz = opaque;
+    unsigned long long seq = 0;
+
+    virMutexLock(&pz->lock);
+    while (!pz->failed) {
+        virPZipBlockPtr block = &pz->blocks[seq % pz->nblocks];
+        int rc;
+
+        if (seq == pz->nread && pz->eof)
+            break;
+        if (seq == pz->nread || block->state != VIR_PZIP_BLOCK_DONE) {
+            if (!virPZipWait(pz))
+                break;
+            continue;
+        }
+        virMutexUnlock(&pz->lock);
+
+        rc = virPZipWriteBlock(pz, block);
+
+        virMutexLock(&pz->lock);
+        if (rc < 0) {
+            virPZipFail(pz);
+            break;
+        }
+        block->state = VIR_PZIP_BLOCK_FREE;
+        seq++;
+        virCondBroadcast(&pz->cond);
+    }
+    virMutexUnlock(&pz->lock);
+}
+
+
+/* Waits for the block the reader is to fill next, if any */
+static virPZipBlockPtr
+virPZipNextFree(virPZipPtr pz)
+{
+    virPZipBlockPtr block = &pz->blocks[pz->nread % pz->nblocks];
+
+    virMutexLock(&pz->lock);
+    while (!pz->failed && block->state != VIR_PZIP_BLOCK_FREE)
+        ignore_value(virPZipWait(pz));
+    if (pz->failed)
+        block = NULL;
+    virMutexUnlock(&pz->lock);
+    return block;
+}
+
+static void
+virPZipHandOver(virPZipPtr pz, virPZipBlockPtr block)
+{
+    virMutexLock(&pz->lock);
+    block->state = VIR_PZIP_BLOCK_READY;
+    pz->nread++;
+    virCondBroadcast(&pz->cond);
+    virMutexUnlock(&pz->lock);
+}
+
+static int
+virPZipReadRaw(virPZipPtr pz)
+{
+    virPZipBlockPtr block;
+    ssize_t got;
+
+    while ((block = virPZipNextFree(pz))) {
+        if ((got = saferead(pz->infd, block->in, VIR_PZIP_BLOCK_SIZE)) < 0) {
+            virReportSystemError(errno, _("Unable to read %s"), pz->inname);
+            return -1;
+        }
+        if (got == 0)
+            return 0;
+
+        block->inlen = got;
+        virPZipHandOver(pz, block);
+    }
+    return 0;
+}
+
+static int
+virPZipReadFrames(virPZipPtr pz)
+{
+    char frame[VIR_PZIP_FRAME_LEN];
+    virPZipBlockPtr block;
+
+    if (virPZipGetHeader(pz) < 0)
+        return -1;
+
+    for (;;) {
+        unsigned long long offset = pz->total;
+        uint32_t rawlen;
+        uint32_t zlen;
+
+        if (virPZipGet(pz, frame, sizeof(frame)) < 0)
+            return -1;
+        rawlen = virPZipGet32(frame);
+        zlen = virPZipGet32(frame + 4);
+
+        if (rawlen == 0)
+            break;
+        if (rawlen > VIR_PZIP_BLOCK_SIZE || zlen >= rawlen) {
+            virPZipError(VIR_ERR_OPERATION_FAILED,
+                         _("corrupt block header in compressed stream %s"),
+                         pz->inname);
+            return -1;
+        }
+
+        if (!(block = virPZipNextFree(pz)))
+            return 0;
+
+        block->rawlen = rawlen;
+        block->stored = zlen == 0;
+        block->inlen = zlen ? zlen : rawlen;
+        if (virPZipAddIndex(pz, offset) < 0 ||
+            virPZipGet(pz, block->in, block->inlen) < 0)
+            return -1;
+
+        virPZipHandOver(pz, block);
+    }
+
+    return virPZipGetIndex(pz);
+}
+
+
+static int
+virPZipRun(bool compress,
+           int infd, const char *inname,
+           int outfd, const char *outname,
+           unsigned int nthreads)
+{
+    virPZip pz;
+    virThreadPtr threads = NULL;
+    size_t nthreads_started = 0;
+    size_t bufsize = compressBound(VIR_PZIP_BLOCK_SIZE);
+    int ret = -1;
+    int rc;
+    size_t i;
+
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+    if (nthreads > VIR_PZIP_MAX_THREADS)
+        nthreads = VIR_PZIP_MAX_THREADS;
+
+    memset(&pz, 0, sizeof(pz));
+    pz.compress = compress;
+    pz.infd = infd;
+    pz.inname = inname;
+    pz.outfd = outfd;
+    pz.outname = outname;
+
+    if (virMutexInit(&pz.lock) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize mutex"));
+        return -1;
+    }
+    if (virCondInit(&pz.cond) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize condition"));
+        virMutexDestroy(&pz.lock);
+        return -1;
+    }
+
+    /* Enough blocks for every worker to have one on the go while
+     * the reader and the writer each deal with another */
+    pz.nblocks = 2 * nthreads + 2;
+    if (VIR_ALLOC_N(pz.blocks, pz.nblocks) < 0 ||
+        VIR_ALLOC_N(threads, nthreads + 1) < 0)
+        goto no_memory;
+    for (i = 0 ; i < pz.nblocks ; i++) {
+        if (VIR_ALLOC_N(pz.blocks[i].in, VIR_PZIP_BLOCK_SIZE) < 0 ||
+            VIR_ALLOC_N(pz.blocks[i].out, bufsize) < 0)
+            goto no_memory;
+    }
+
+# if HAVE_POSIX_MEMALIGN
+    if (posix_memalign(&pz.iobase, VIR_PZIP_IO_ALIGN, VIR_PZIP_IO_SIZE))
+        goto no_memory;
+    pz.iobuf = pz.iobase;
+# else
+    if (VIR_ALLOC_N(pz.iobuf, VIR_PZIP_IO_SIZE + VIR_PZIP_IO_ALIGN - 1) < 0)
+        goto no_memory;
+    pz.iobase = pz.iobuf;
+    pz.iobuf = (char *) (((intptr_t) pz.iobase + VIR_PZIP_IO_ALIGN - 1) &
+                         ~(intptr_t) (VIR_PZIP_IO_ALIGN - 1));
+# endif
+    pz.iolen = VIR_PZIP_IO_SIZE;
+    if (!compress)
+        pz.iopos = pz.iolen;
+
+    if (compress && virPZipPutHeader(&pz) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i <= nthreads ; i++) {
+        if (virThreadCreate(&threads[i], true,
+                            i == 0 ? virPZipWriter : virPZipWorker,
+                            &pz) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to create compression thread"));
+            virMutexLock(&pz.lock);
+            virPZipFail(&pz);
+            virMutexUnlock(&pz.lock);
+            break;
+        }
+        nthreads_started++;
+    }
+
+    if (nthreads_started == nthreads + 1) {
+        if (compress)
+            rc = virPZipReadRaw(&pz);
+        else
+            rc = virPZipReadFrames(&pz);
+
+        virMutexLock(&pz.lock);
+        if (rc < 0)
+            virPZipFail(&pz);
+        pz.eof = true;
+        virCondBroadcast(&pz.cond);
+        virMutexUnlock(&pz.lock);
+    }
+
+    for (i = 0 ; i < nthreads_started ; i++)
+        virThreadJoin(&threads[i]);
+
+    if (pz.failed)
+        goto cleanup;
+
+    if (compress && virPZipPutIndex(&pz) < 0)
+        goto cleanup;
+
+    VIR_DEBUG("Stream %s is %llu bytes in %zu blocks, %u threads",
+              compress ? outname : inname, pz.total, pz.nindex, nthreads);
+    ret = 0;
+
+cleanup:
+    if (pz.error) {
+        virSetError(pz.error);
+        virFreeError(pz.error);
+    }
+    for (i = 0 ; pz.blocks && i < pz.nblocks ; i++) {
+        VIR_FREE(pz.blocks[i].in);
+        VIR_FREE(pz.blocks[i].out);
+    }
+    VIR_FREE(pz.blocks);
+    VIR_FREE(threads);
+    VIR_FREE(pz.iobase);
+    VIR_FREE(pz.index);
+    ignore_value(virCondDestroy(&pz.cond));
+    virMutexDestroy(&pz.lock);
+    return ret;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
+
+bool
+virPZipAvailable(void)
+{
+    return true;
+}
+
+/**
+ * virPZipCompress:
+ * @infd: file descriptor to read the data from, until end of file
+ * @inname: name of @infd, for error messages
+ * @outfd: file descriptor to write the compressed stream to
+ * @outname: name of @outfd, for error messages
+ * @nthreads: number of threads compressing at once, 0 for one per CPU
+ *
+ * Returns 0 once the whole stream is written, or -1 with an error
+ * reported.
+ */
+int
+virPZipCompress(int infd, const char *inname,
+                int outfd, const char *outname,
+                unsigned int nthreads)
+{
+    return virPZipRun(true, infd, inname, outfd, outname, nthreads);
+}
+
+/**
+ * virPZipDecompress:
+ * @infd: file descriptor to read a stream made by virPZipCompress from
+ * @inname: name of @infd, for error messages
+ * @outfd: file descriptor to write the original data to
+ * @outname: name of @outfd, for error messages
+ * @nthreads: number of threads decompressing at once, 0 for one per CPU
+ *
+ * Returns 0 once the stream was read up to its index and all of it
+ * is written out, or -1 with an error reported.
+ */
+int
+virPZipDecompress(int infd, const char *inname,
+                  int outfd, const char *outname,
+                  unsigned int nthreads)
+{
+    return virPZipRun(false, infd, inname, outfd, outname, nthreads);
+}
+
+#else /* !HAVE_ZLIB */
+
+bool
+virPZipAvailable(void)
+{
+    return false;
+}
+
+int
+virPZipCompress(int infd ATTRIBUTE_UNUSED,
+                const char *inname ATTRIBUTE_UNUSED,
+                int outfd ATTRIBUTE_UNUSED,
+                const char *outname ATTRIBUTE_UNUSED,
+                unsigned int nthreads ATTRIBUTE_UNUSED)
+{
+    virPZipError(VIR_ERR_NO_SUPPORT, "%s",
+                 _("compression was not enabled at build time"));
+    return -1;
+}
+
+int
+virPZipDecompress(int infd ATTRIBUTE_UNUSED,
+                  const char *inname ATTRIBUTE_UNUSED,
+                  int outfd ATTRIBUTE_UNUSED,
+                  const char *outname ATTRIBUTE_UNUSED,
+                  unsigned int nthreads ATTRIBUTE_UNUSED)
+{
+    virPZipError(VIR_ERR_NO_SUPPORT, "%s",
+                 _("compression was not enabled at build time"));
+    return -1;
+}
+
+#endif /* !HAVE_ZLIB */
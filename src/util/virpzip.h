@@ -0,0 +1,57 @@
+/*
+ * virpzip.h: multi-threaded block compression of data streams
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef __VIR_PZIP_H__
+# define __VIR_PZIP_H__
+
+# include "internal.h"
+
+/*
+ * The input is cut into blocks of VIR_PZIP_BLOCK_SIZE bytes which
+ * are deflated independently of each other, by as many threads as
+ * asked for, and written out in their original order. Each block
+ * gets a small header giving its raw and compressed length, blocks
+ * which do not shrink are stored as they are, and the stream ends
+ * with an index of where every block starts.
+ *
+ * Decompression reads the blocks one after the other, so it works
+ * on pipes as well as files, and inflates them in parallel too.
+ *
+ * If the output of compression is a file opened with O_DIRECT, all
+ * writes are made in aligned, whole pages, and the file is cut to
+ * the real length of the stream at the end.
+ */
+
+# define VIR_PZIP_BLOCK_SIZE (1024 * 1024)
+# define VIR_PZIP_MAX_THREADS 32
+
+bool virPZipAvailable(void);
+
+int virPZipCompress(int infd, const char *inname,
+                    int outfd, const char *outname,
+                    unsigned int nthreads)
+    ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4) ATTRIBUTE_RETURN_CHECK;
+int virPZipDecompress(int infd, const char *inname,
+                      int outfd, const char *outname,
+                      unsigned int nthreads)
+    ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4) ATTRIBUTE_RETURN_CHECK;
+
+#endif /* __VIR_PZIP_H__ */
@@ -0,0 +1,199 @@
+/*
+ * virreadahead.c: reading a file ahead of another process reading it
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "virreadahead.h"
+#include "memory.h"
+#include "threads.h"
+#include "util.h"
+#include "virterror_internal.h"
+#include "ignore-value.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define virReadAheadError(code, ...)                                \
+    virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,             \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
+#if HAVE_POSIX_FADVISE
+
+/* How often the reader's offset is looked at, in ms */
+# define VIR_READ_AHEAD_INTERVAL 10
+
+struct _virReadAhead {
+    virMutex lock;
+    virCond cond;
+    virThread thread;
+    bool quit;
+
+    int fd;
+    off_t size;
+};
+
+
+/*
+ * Keeps asking for the VIR_READ_AHEAD_WINDOW bytes past the reader's
+ * file offset to be read in, each part of the file only once, until
+ * the whole file was asked for or the read ahead is stopped.
+ */
+static void
+virReadAheadWorker(void *opaque)
+{
+    virReadAheadPtr readahead = opaque;
+    off_t advised = 0;
+
+    virMutexLock(&readahead->lock);
+    while (!readahead->quit && advised < readahead->size) {
+        off_t pos = lseek(readahead->fd, 0, SEEK_CUR);
+        off_t limit;
+        unsigned long long now;
+
+        if (pos < 0)
+            break;
+        limit = MIN(pos + VIR_READ_AHEAD_WINDOW, readahead->size);
+
+        /* What the reader got past is of no more use to it */
+        advised = MAX(advised, pos);
+        if (advised < limit) {
+            ignore_value(posix_fadvise(readahead->fd, advised,
+                                       limit - advised,
+                                       POSIX_FADV_WILLNEED));
+            advised = limit;
+        }
+
+        if (virTimeMs(&now) < 0)
+            break;
+        if (virCondWaitUntil(&readahead->cond, &readahead->lock,
+                             now + VIR_READ_AHEAD_INTERVAL) < 0 &&
+            errno != ETIMEDOUT)
+            break;
+    }
+    virMutexUnlock(&readahead->lock);
+}
+
+/**
+ * virReadAheadStart:
+ * @fd: file descriptor of a regular file, whose reader has a copy of it
+ *
+ * Starts reading the file ahead of its reader, in a thread which is
+ * to be stopped with virReadAheadStop before @fd is closed.
+ *
+ * Returns the read ahead, or NULL with an error reported.
+ */
+virReadAheadPtr
+virReadAheadStart(int fd)
+{
+    virReadAheadPtr readahead;
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0) {
+        virReportSystemError(errno, "%s", _("cannot stat file"));
+        return NULL;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        virReadAheadError(VIR_ERR_ARGUMENT_UNSUPPORTED, "%s",
+                          _("only regular files can be read ahead"));
+        return NULL;
+    }
+
+    if (VIR_ALLOC(readahead) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+    readahead->fd = fd;
+    readahead->size = sb.st_size;
+
+    if (virMutexInit(&readahead->lock) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize mutex"));
+        goto error;
+    }
+    if (virCondInit(&readahead->cond) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize condition"));
+        virMutexDestroy(&readahead->lock);
+        goto error;
+    }
+
+    /* Have the kernel read ahead harder than it would by itself */
+    ignore_value(posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
+
+    if (virThreadCreate(&readahead->thread, true,
+                        virReadAheadWorker, readahead) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create read ahead thread"));
+        ignore_value(virCondDestroy(&readahead->cond));
+        virMutexDestroy(&readahead->lock);
+        goto error;
+    }
+
+    return readahead;
+
+error:
+    VIR_FREE(readahead);
+    return NULL;
+}
+
+/**
+ * virReadAheadStop:
+ * @readahead: read ahead to stop, or NULL
+ *
+ * Stops reading ahead, waits for the thread doing it and frees
+ * @readahead.
+ */
+void
+virReadAheadStop(virReadAheadPtr readahead)
+{
+    if (!readahead)
+        return;
+
+    virMutexLock(&readahead->lock);
+    readahead->quit = true;
+    virCondSignal(&readahead->cond);
+    virMutexUnlock(&readahead->lock);
+
+    virThreadJoin(&readahead->thread);
+
+    ignore_value(virCondDestroy(&readahead->cond));
+    virMutexDestroy(&readahead->lock);
+    VIR_FREE(readahead);
+}
+
+#else /* !HAVE_POSIX_FADVISE */
+
+virReadAheadPtr
+virReadAheadStart(int fd ATTRIBUTE_UNUSED)
+{
+    virReadAheadError(VIR_ERR_NO_SUPPORT, "%s",
+                      _("reading ahead is not supported on this platform"));
+    return NULL;
+}
+
+void
+virReadAheadStop(virReadAheadPtr readahead ATTRIBUTE_UNUSED)
+{
+}
+
+#endif /* !HAVE_POSIX_FADVISE */
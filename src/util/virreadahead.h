@@ -0,0 +1,44 @@
+/*
+ * virreadahead.h: reading a file ahead of another process reading it
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef __VIR_READ_AHEAD_H__
+# define __VIR_READ_AHEAD_H__
+
+# include "internal.h"
+
+/*
+ * When a child process is handed a file descriptor to read a large
+ * file from start to end, such as QEMU restoring a saved image, it
+ * shares the file offset with the copy libvirt keeps. A read ahead
+ * watches that offset and has the kernel read in the next window of
+ * the file past it, so the disk stays busy while the reader works on
+ * what it already has, instead of only reacting to each of its reads.
+ */
+typedef struct _virReadAhead virReadAhead;
+typedef virReadAhead *virReadAheadPtr;
+
+/* How far past the reader's offset the file is asked for */
+# define VIR_READ_AHEAD_WINDOW (64 * 1024 * 1024)
+
+virReadAheadPtr virReadAheadStart(int fd);
+void virReadAheadStop(virReadAheadPtr readahead);
+
+#endif /* __VIR_READ_AHEAD_H__ */
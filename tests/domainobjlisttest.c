@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "uuid.h"
+#include "capabilities.h"
+#include "domain_conf.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+#define LOOKUP_COUNT 1000
+
+struct testListInfo {
+    virDomainObjList doms;
+    int ndomains;
+    unsigned char (*uuids)[VIR_UUID_BUFLEN];
+};
+
+static virCapsPtr caps;
+
+
+static int
+testListPopulate(struct testListInfo *info, int ndomains)
+{
+    int i;
+
+    memset(info, 0, sizeof(*info));
+
+    if (virDomainObjListInit(&info->doms) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(info->uuids, ndomains) < 0)
+        return -1;
+    info->ndomains = ndomains;
+
+    for (i = 0 ; i < ndomains ; i++) {
+        virDomainDefPtr def;
+        virDomainObjPtr obj;
+
+        if (VIR_ALLOC(def) < 0)
+            return -1;
+        if (virAsprintf(&def->name, "dom%d", i) < 0 ||
+            virUUIDGenerate(def->uuid) < 0) {
+            virDomainDefFree(def);
+            return -1;
+        }
+        memcpy(info->uuids[i], def->uuid, VIR_UUID_BUFLEN);
+        /* Every other domain is running */
+        def->id = (i % 2) ? i : -1;
+
+        if (!(obj = virDomainAssignDef(caps, &info->doms, def, false))) {
+            virDomainDefFree(def);
+            return -1;
+        }
+        virDomainObjUnlock(obj);
+    }
+
+    return 0;
+}
+
+static void
+testListFree(struct testListInfo *info)
+{
+    virDomainObjListDeinit(&info->doms);
+    VIR_FREE(info->uuids);
+}
+
+
+static int
+testListLookupName(const void *data)
+{
+    const struct testListInfo *info = data;
+    char name[32];
+    int i;
+
+    for (i = 0 ; i < LOOKUP_COUNT ; i++) {
+        int n = (i * 7919) % info->ndomains;
+        virDomainObjPtr obj;
+
+        snprintf(name, sizeof(name), "dom%d", n);
+        if (!(obj = virDomainFindByName((virDomainObjListPtr)&info->doms,
+                                        name))) {
+            testError("\ndomain %s not found\n", name);
+            return -1;
+        }
+        virDomainObjUnlock(obj);
+    }
+
+    if (virDomainFindByName((virDomainObjListPtr)&info->doms, "nosuchdom")) {
+        testError("\nunexpected domain found\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+testListLookupID(const void *data)
+{
+    const struct testListInfo *info = data;
+    int i;
+
+    for (i = 0 ; i < LOOKUP_COUNT ; i++) {
+        int id = ((i * 7919) % info->ndomains) | 1;
+        virDomainObjPtr obj;
+
+        if (id >= info->ndomains)
+            continue;
+
+        if (!(obj = virDomainFindByID((virDomainObjListPtr)&info->doms, id))) {
+            testError("\ndomain with id %d not found\n", id);
+            return -1;
+        }
+        if (obj->def->id != id) {
+            testError("\nexpected domain id %d got %d\n", id, obj->def->id);
+            virDomainObjUnlock(obj);
+            return -1;
+        }
+        virDomainObjUnlock(obj);
+    }
+
+    return 0;
+}
+
+static int
+testListLookupUUID(const void *data)
+{
+    const struct testListInfo *info = data;
+    int i;
+
+    for (i = 0 ; i < LOOKUP_COUNT ; i++) {
+        int n = (i * 7919) % info->ndomains;
+        virDomainObjPtr obj;
+
+        if (!(obj = virDomainFindByUUID((virDomainObjListPtr)&info->doms,
+                                        info->uuids[n]))) {
+            testError("\ndomain %d not found by UUID\n", n);
+            return -1;
+        }
+        virDomainObjUnlock(obj);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Drivers set IDs through the list when starting and stopping
+ * domains, so make sure the ID index follows, and that the
+ * name index follows removals.
+ */
+static int
+testListConsistency(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testListInfo info;
+    virDomainObjPtr obj = NULL;
+    int ret = -1;
+
+    if (testListPopulate(&info, 10) < 0)
+        goto cleanup;
+
+    /* Stop domain 3 and start it again with a new ID */
+    if (!(obj = virDomainFindByID(&info.doms, 3)))
+        goto cleanup;
+    virDomainObjListSetID(&info.doms, obj, -1);
+    virDomainObjUnlock(obj);
+
+    if ((obj = virDomainFindByID(&info.doms, 3))) {
+        testError("\nstopped domain still found by ID\n");
+        goto cleanup;
+    }
+
+    if (!(obj = virDomainFindByName(&info.doms, "dom3")))
+        goto cleanup;
+    virDomainObjListSetID(&info.doms, obj, 42);
+    virDomainObjUnlock(obj);
+
+    if (!(obj = virDomainFindByID(&info.doms, 42)) ||
+        STRNEQ(obj->def->name, "dom3")) {
+        testError("\nrestarted domain not found by new ID\n");
+        goto cleanup;
+    }
+
+    /* Undefine it */
+    virDomainObjListSetID(&info.doms, obj, -1);
+    virDomainRemoveInactive(&info.doms, obj);
+    obj = NULL;
+
+    if ((obj = virDomainFindByName(&info.doms, "dom3")) ||
+        (obj = virDomainFindByID(&info.doms, 42)) ||
+        (obj = virDomainFindByUUID(&info.doms, info.uuids[3]))) {
+        testError("\nremoved domain still found\n");
+        goto cleanup;
+    }
+
+    if (virHashSize(info.doms.objsName) != 9) {
+        testError("\nexpected 9 names indexed, got %d\n",
+                  virHashSize(info.doms.objsName));
+        goto cleanup;
+    }
+
+    /* No entry may be left behind pointing at the removed domain */
+    if (virHashSize(info.doms.objsID) != 4) {
+        testError("\nexpected 4 IDs indexed, got %d\n",
+                  virHashSize(info.doms.objsID));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (obj)
+        virDomainObjUnlock(obj);
+    testListFree(&info);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    static const int sizes[] = { 100, 10000 };
+    int ret = 0;
+    int i;
+
+    if (!(caps = virCapabilitiesNew("x86_64", 0, 0)))
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Domain list consistency", 1,
+                    testListConsistency, NULL) < 0)
+        ret = -1;
+
+    /* Lookup times are reported with --verbose, and should
+     * be the same regardless of the number of domains */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        struct testListInfo info;
+        char title[100];
+
+        if (testListPopulate(&info, sizes[i]) < 0) {
+            testListFree(&info);
+            ret = -1;
+            continue;
+        }
+
+#define DO_TEST(what)                                                   \
+        snprintf(title, sizeof(title), "%d lookups by " #what           \
+                 " of %d domains", LOOKUP_COUNT, sizes[i]);             \
+        if (virtTestRun(title, 10, testListLookup ## what, &info) < 0)  \
+            ret = -1
+
+        DO_TEST(Name);
+        DO_TEST(ID);
+        DO_TEST(UUID);
+
+#undef DO_TEST
+
+        testListFree(&info);
+    }
+
+    virCapabilitiesFree(caps);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
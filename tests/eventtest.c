@@ -31,11 +31,19 @@
 #include "threads.h"
 #include "logging.h"
 #include "util.h"
+#include "virfile.h"
+#include "ignore-value.h"
 #include "event.h"
 #include "event_poll.h"
 
 #define NUM_FDS 31
 #define NUM_TIME 31
+#define NUM_LOOPS 3
+
+/* Built a second time as eventepolltest with this overridden */
+#ifndef EVENT_POLL_BACKEND
+# define EVENT_POLL_BACKEND VIR_EVENT_POLL_BACKEND_POLL
+#endif
 
 static struct handleInfo {
     int pipeFD[2];
@@ -53,6 +61,21 @@ static struct timerInfo {
     int delete;
 } timers[NUM_TIME];
 
+/* Loops made with virEventPollLoopNew, each run by a thread of
+ * its own. Only the thread watching a handle may dispatch it */
+static struct loopInfo {
+    virEventPollLoopPtr loop;
+    virThread thread;
+    int pipeFD[2];
+    int fired;
+    bool wrongThread;
+    bool quit;
+} loops[NUM_LOOPS];
+
+static pthread_mutex_t loopMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loopCond = PTHREAD_COND_INITIALIZER;
+static int loopsFired = 0;
+
 enum {
     EV_ERROR_NONE,
     EV_ERROR_WATCH,
@@ -112,6 +135,41 @@ testTimer(int timer, void *data)
         virEventPollRemoveTimeout(info->delete);
 }
 
+static void
+testLoopPipeReader(int watch ATTRIBUTE_UNUSED, int fd,
+                   int events ATTRIBUTE_UNUSED, void *data)
+{
+    struct loopInfo *info = data;
+    char one;
+
+    ignore_value(read(fd, &one, 1));
+
+    pthread_mutex_lock(&loopMutex);
+    if (!virThreadIsSelf(&info->thread))
+        info->wrongThread = true;
+    info->fired++;
+    loopsFired++;
+    pthread_cond_signal(&loopCond);
+    pthread_mutex_unlock(&loopMutex);
+}
+
+static void
+testLoopQuitTimer(int timer ATTRIBUTE_UNUSED, void *data)
+{
+    struct loopInfo *info = data;
+
+    info->quit = true;
+}
+
+static void
+testLoopThread(void *data)
+{
+    struct loopInfo *info = data;
+
+    while (!info->quit)
+        virEventPollLoopRunOnce(info->loop);
+}
+
 static pthread_mutex_t eventThreadMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t eventThreadRunCond = PTHREAD_COND_INITIALIZER;
 static int eventThreadRunOnce = 0;
@@ -244,6 +302,72 @@ finishJob(const char *name, int handle, int timer)
     return EXIT_SUCCESS;
 }
 
+static int
+testLoops(const char *name)
+{
+    char one = '1';
+    struct timespec waitTime;
+    int i, rc = 0;
+
+    for (i = 0 ; i < NUM_LOOPS ; i++) {
+        struct loopInfo *info = &loops[i];
+
+        if (pipe(info->pipeFD) < 0 ||
+            !(info->loop = virEventPollLoopNew()) ||
+            virEventPollLoopAddHandle(info->loop, info->pipeFD[0],
+                                      VIR_EVENT_HANDLE_READABLE,
+                                      testLoopPipeReader,
+                                      info, NULL) < 0 ||
+            virThreadCreate(&info->thread, true, testLoopThread, info) < 0) {
+            virtTestResult(name, 1, "Cannot set up loop %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Each write must only fire the handle of its own loop */
+    pthread_mutex_lock(&loopMutex);
+    for (i = 0 ; i < NUM_LOOPS ; i++) {
+        if (safewrite(loops[i].pipeFD[1], &one, 1) != 1) {
+            pthread_mutex_unlock(&loopMutex);
+            return EXIT_FAILURE;
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &waitTime);
+    waitTime.tv_sec += 5;
+    while (loopsFired < NUM_LOOPS && rc == 0)
+        rc = pthread_cond_timedwait(&loopCond, &loopMutex, &waitTime);
+    pthread_mutex_unlock(&loopMutex);
+
+    if (rc != 0) {
+        virtTestResult(name, 1, "Timed out waiting for pipe events\n");
+        return EXIT_FAILURE;
+    }
+
+    /* A timer due at once wakes each loop, and ends its thread */
+    for (i = 0 ; i < NUM_LOOPS ; i++) {
+        struct loopInfo *info = &loops[i];
+
+        if (virEventPollLoopAddTimeout(info->loop, 0, testLoopQuitTimer,
+                                       info, NULL) < 0)
+            return EXIT_FAILURE;
+        virThreadJoin(&info->thread);
+        virEventPollLoopFree(info->loop);
+        VIR_FORCE_CLOSE(info->pipeFD[0]);
+        VIR_FORCE_CLOSE(info->pipeFD[1]);
+
+        if (info->fired != 1 || info->wrongThread) {
+            virtTestResult(name, 1,
+                           "Loop %d handle fired %d times, %s\n", i,
+                           info->fired,
+                           info->wrongThread ? "in the wrong thread" : "");
+            return EXIT_FAILURE;
+        }
+    }
+
+    virtTestResult(name, 0, NULL);
+    return EXIT_SUCCESS;
+}
+
 static void
 resetAll(void)
 {
@@ -280,6 +404,9 @@ mymain(void)
         return EXIT_FAILURE;
     }
 
+    if (virEventPollSetBackend(EVENT_POLL_BACKEND) < 0)
+        return EXIT_AM_SKIP;
+
     virEventPollInit();
 
     for (i = 0 ; i < NUM_FDS ; i++) {
@@ -470,6 +597,34 @@ mymain(void)
     if (finishJob("Write duplicate", 1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
+    resetAll();
+
+    /* Close the FD while it is still watched, so that the next
+     * pipe reuses its number, and check that dropping the stale
+     * watch leaves the new one working */
+    i = handles[1].watch;
+    VIR_FORCE_CLOSE(handles[1].pipeFD[0]);
+    VIR_FORCE_CLOSE(handles[1].pipeFD[1]);
+    if (pipe(handles[1].pipeFD) < 0)
+        return EXIT_FAILURE;
+    handles[1].watch = virEventPollAddHandle(handles[1].pipeFD[0],
+                                             VIR_EVENT_HANDLE_READABLE,
+                                             testPipeReader,
+                                             &handles[1], NULL);
+    virEventPollRemoveHandle(i);
+    virEventPollRemoveHandle(handles[0].watch);
+    startJob();
+    if (safewrite(handles[1].pipeFD[1], &one, 1) != 1)
+        return EXIT_FAILURE;
+    if (finishJob("Reused FD", 1, -1) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    resetAll();
+
+    /* Loops of their own, while the default one is idle */
+    if (testLoops("Separate loops") != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
     //pthread_kill(eventThread, SIGTERM);
 
     return EXIT_SUCCESS;
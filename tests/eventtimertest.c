@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "threads.h"
+#include "logging.h"
+#include "memory.h"
+#include "util.h"
+#include "event_poll.h"
+#include "ignore-value.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+/* One hour, so the idle timers never expire during the test */
+#define IDLE_FREQUENCY (60 * 60 * 1000)
+
+#define ITERATIONS 1000
+
+struct testTimer {
+    int timer;
+    int fired;
+    int freed;
+    int action;
+    int other;
+};
+
+enum {
+    TEST_TIMER_NONE,
+    TEST_TIMER_REMOVE_SELF,     /* remove itself when it fires */
+    TEST_TIMER_ADD,             /* register another timer when it fires */
+    TEST_TIMER_DISABLE_OTHER,   /* disable the 'other' timer when it fires */
+};
+
+static struct testTimer added;
+static struct testTimer sweeper;
+
+static void
+testTimerFree(void *opaque)
+{
+    struct testTimer *t = opaque;
+    t->freed++;
+}
+
+static void
+testTimerFire(int timer, void *opaque)
+{
+    struct testTimer *t = opaque;
+
+    if (t->timer != timer)
+        return;
+    t->fired++;
+
+    switch (t->action) {
+    case TEST_TIMER_REMOVE_SELF:
+        virEventPollRemoveTimeout(timer);
+        break;
+
+    case TEST_TIMER_ADD:
+        t->action = TEST_TIMER_NONE;
+        added.timer = virEventPollAddTimeout(0, testTimerFire,
+                                             &added, testTimerFree);
+        break;
+
+    case TEST_TIMER_DISABLE_OTHER:
+        virEventPollUpdateTimeout(t->other, -1);
+        break;
+    }
+}
+
+static int
+testTimerAdd(struct testTimer *t, int frequency, int action)
+{
+    memset(t, 0, sizeof(*t));
+    t->action = action;
+    t->timer = virEventPollAddTimeout(frequency, testTimerFire,
+                                      t, testTimerFree);
+    return t->timer;
+}
+
+/* Every test keeps a zero frequency timer armed, so that
+ * running the loop never blocks */
+static int
+testRunLoop(int iterations)
+{
+    int i;
+
+    for (i = 0 ; i < iterations ; i++) {
+        if (virEventPollRunOnce() < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Run the loop once more so removed timers are purged, and
+ * their free callbacks no longer refer to the caller's stack */
+static int
+testPurge(void)
+{
+    if (testTimerAdd(&sweeper, 0, TEST_TIMER_REMOVE_SELF) < 0)
+        return -1;
+    return testRunLoop(1);
+}
+
+#define CHECK(t, expFired, expFreed)                                    \
+    do {                                                                \
+        if ((t).fired != (expFired) || (t).freed != (expFreed)) {       \
+            testError("\n%s: fired %d freed %d, expected %d %d\n",      \
+                      #t, (t).fired, (t).freed, expFired, expFreed);    \
+            goto cleanup;                                               \
+        }                                                               \
+    } while (0)
+
+
+static int
+testTimerSemantics(const void *data ATTRIBUTE_UNUSED)
+{
+    static struct testTimer busy, idle, disabled, once, adder, victim, killer;
+    int ret = -1;
+
+    memset(&added, 0, sizeof(added));
+    if (testTimerAdd(&busy, 0, TEST_TIMER_NONE) < 0 ||
+        testTimerAdd(&idle, IDLE_FREQUENCY, TEST_TIMER_NONE) < 0 ||
+        testTimerAdd(&disabled, -1, TEST_TIMER_NONE) < 0 ||
+        testTimerAdd(&once, 0, TEST_TIMER_REMOVE_SELF) < 0 ||
+        testTimerAdd(&adder, 0, TEST_TIMER_ADD) < 0 ||
+        testTimerAdd(&victim, 0, TEST_TIMER_NONE) < 0 ||
+        testTimerAdd(&killer, -1, TEST_TIMER_DISABLE_OTHER) < 0)
+        goto cleanup;
+    killer.other = victim.timer;
+
+    if (testRunLoop(1) < 0)
+        goto cleanup;
+
+    /* Timers registered by a callback wait for the next iteration */
+    CHECK(busy, 1, 0);
+    CHECK(idle, 0, 0);
+    CHECK(disabled, 0, 0);
+    CHECK(once, 1, 1);
+    CHECK(adder, 1, 0);
+    CHECK(added, 0, 0);
+    CHECK(victim, 1, 0);
+
+    /* Arm a disabled timer, which then disables another */
+    virEventPollUpdateTimeout(killer.timer, 0);
+    if (testRunLoop(1) < 0)
+        goto cleanup;
+
+    CHECK(busy, 2, 0);
+    CHECK(once, 1, 1);
+    CHECK(added, 1, 0);
+    CHECK(killer, 1, 0);
+    /* victim expires before killer, so it still fires this time */
+    CHECK(victim, 2, 0);
+
+    if (testRunLoop(2) < 0)
+        goto cleanup;
+
+    CHECK(busy, 4, 0);
+    CHECK(idle, 0, 0);
+    CHECK(disabled, 0, 0);
+    CHECK(added, 3, 0);
+    CHECK(killer, 3, 0);
+    CHECK(victim, 2, 0);
+
+    /* Removing a timer which is already gone must fail */
+    if (virEventPollRemoveTimeout(once.timer) == 0) {
+        testError("\nremoved timer %d twice\n", once.timer);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virEventPollRemoveTimeout(busy.timer);
+    virEventPollRemoveTimeout(idle.timer);
+    virEventPollRemoveTimeout(disabled.timer);
+    virEventPollRemoveTimeout(adder.timer);
+    virEventPollRemoveTimeout(added.timer);
+    virEventPollRemoveTimeout(victim.timer);
+    virEventPollRemoveTimeout(killer.timer);
+    if (testPurge() < 0)
+        ret = -1;
+    return ret;
+}
+
+
+struct testScaleInfo {
+    int ntimers;
+    struct testTimer *timers;
+    struct testTimer busy;
+};
+
+static int
+testScalePopulate(struct testScaleInfo *info, int ntimers)
+{
+    int i;
+
+    memset(info, 0, sizeof(*info));
+    if (VIR_ALLOC_N(info->timers, ntimers) < 0)
+        return -1;
+
+    for (i = 0 ; i < ntimers ; i++) {
+        if (testTimerAdd(&info->timers[i], IDLE_FREQUENCY + i,
+                         TEST_TIMER_NONE) < 0)
+            return -1;
+        info->ntimers++;
+    }
+
+    if (testTimerAdd(&info->busy, 0, TEST_TIMER_NONE) < 0)
+        return -1;
+    return 0;
+}
+
+static void
+testScaleFree(struct testScaleInfo *info)
+{
+    int i;
+
+    for (i = 0 ; i < info->ntimers ; i++)
+        virEventPollRemoveTimeout(info->timers[i].timer);
+    virEventPollRemoveTimeout(info->busy.timer);
+    ignore_value(testPurge());
+    VIR_FREE(info->timers);
+}
+
+static int
+testScaleRun(const void *data ATTRIBUTE_UNUSED)
+{
+    return testRunLoop(ITERATIONS);
+}
+
+/* Re-arming timers is what keepalive style users do all the time */
+static int
+testScaleUpdate(const void *data)
+{
+    const struct testScaleInfo *info = data;
+    int i;
+
+    for (i = 0 ; i < ITERATIONS ; i++) {
+        int n = (i * 7919) % info->ntimers;
+        virEventPollUpdateTimeout(info->timers[n].timer,
+                                  IDLE_FREQUENCY + ITERATIONS - i);
+    }
+    return testRunLoop(1);
+}
+
+
+static int
+mymain(void)
+{
+    static const int sizes[] = { 10, 50000 };
+    int ret = 0;
+    int i;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+    char *debugEnv = getenv("LIBVIRT_DEBUG");
+    if (debugEnv && *debugEnv && (virLogParseDefaultPriority(debugEnv) == -1)) {
+        fprintf(stderr, "Invalid log level setting.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (virEventPollInit() < 0)
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Timer semantics", 1, testTimerSemantics, NULL) < 0)
+        ret = -1;
+
+    /* Loop overhead is reported with --verbose, and should
+     * barely depend on the number of idle timers */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        struct testScaleInfo info;
+        char title[100];
+
+        if (testScalePopulate(&info, sizes[i]) < 0) {
+            testScaleFree(&info);
+            ret = -1;
+            continue;
+        }
+
+        snprintf(title, sizeof(title), "%d loop iterations with %d timers",
+                 ITERATIONS, sizes[i]);
+        if (virtTestRun(title, 10, testScaleRun, &info) < 0)
+            ret = -1;
+
+        snprintf(title, sizeof(title), "%d timer updates with %d timers",
+                 ITERATIONS, sizes[i]);
+        if (virtTestRun(title, 10, testScaleUpdate, &info) < 0)
+            ret = -1;
+
+        testScaleFree(&info);
+    }
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
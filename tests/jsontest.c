@@ -7,6 +7,8 @@
 
 #include "internal.h"
 #include "json.h"
+#include "buf.h"
+#include "memory.h"
 #include "testutils.h"
 
 struct testInfo {
@@ -54,10 +56,198 @@ cleanup:
 }
 
 
+/* A tree parsed into an arena must come out the same as one
+ * parsed on the heap */
+static int
+testJSONArena(const void *data)
+{
+    const struct testInfo *info = data;
+    virJSONValuePtr heap = NULL;
+    virJSONValuePtr arena = NULL;
+    char *heapstr = NULL;
+    char *arenastr = NULL;
+    int ret = -1;
+
+    heap = virJSONValueFromString(info->doc);
+    arena = virJSONValueFromBuffer(info->doc, strlen(info->doc),
+                                   VIR_JSON_PARSE_ARENA);
+
+    if (!info->pass) {
+        if (arena) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "Should not have parsed %s\n", info->doc);
+            goto cleanup;
+        }
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (!heap || !arena ||
+        !(heapstr = virJSONValueToString(heap)) ||
+        !(arenastr = virJSONValueToString(arena))) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "Fail to parse %s\n", info->doc);
+        goto cleanup;
+    }
+
+    if (STRNEQ(heapstr, arenastr)) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "Parsed %s\nand %s\n", heapstr, arenastr);
+        goto cleanup;
+    }
+
+    /* Trees in an arena are read only */
+    if (arena->type == VIR_JSON_TYPE_OBJECT &&
+        virJSONValueObjectAppendNull(arena, "extra") == 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "Appended to a tree in an arena\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(heapstr);
+    VIR_FREE(arenastr);
+    virJSONValueFree(heap);
+    virJSONValueFree(arena);
+    return ret;
+}
+
+
+#define LOOKUP_KEYS 200
+
+/* Large objects are looked up through their index, which has to
+ * agree with the members */
+static int
+testJSONLookup(const void *data ATTRIBUTE_UNUSED)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virJSONValuePtr json = NULL;
+    char *doc = NULL;
+    char key[32];
+    unsigned int flags;
+    int ret = -1;
+    int i;
+
+    virBufferAddLit(&buf, "{");
+    for (i = 0 ; i < LOOKUP_KEYS ; i++)
+        virBufferAsprintf(&buf, "%s\"key%d\": %d", i ? ", " : "", i, i);
+    virBufferAddLit(&buf, "}");
+    if (!(doc = virBufferContentAndReset(&buf)))
+        goto cleanup;
+
+    for (flags = 0 ; flags <= VIR_JSON_PARSE_ARENA ; flags++) {
+        if (!(json = virJSONValueFromBuffer(doc, strlen(doc), flags)))
+            goto cleanup;
+
+        for (i = 0 ; i < LOOKUP_KEYS ; i++) {
+            int val;
+
+            snprintf(key, sizeof(key), "key%d", i);
+            if (virJSONValueObjectGetNumberInt(json, key, &val) < 0 ||
+                val != i) {
+                if (virTestGetVerbose())
+                    fprintf(stderr, "Lookup of %s failed\n", key);
+                goto cleanup;
+            }
+        }
+
+        if (virJSONValueObjectHasKey(json, "nosuchkey")) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "Found a key that isn't there\n");
+            goto cleanup;
+        }
+
+        virJSONValueFree(json);
+        json = NULL;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(doc);
+    virJSONValueFree(json);
+    return ret;
+}
+
+
+struct testBenchInfo {
+    const char *doc;
+    unsigned int flags;
+};
+
+static int
+testJSONBench(const void *data)
+{
+    const struct testBenchInfo *info = data;
+    virJSONValuePtr json;
+    int i;
+
+    if (!(json = virJSONValueFromBuffer(info->doc, strlen(info->doc),
+                                        info->flags)))
+        return -1;
+
+    /* Look at every kind of value, so that lookups are timed too */
+    for (i = 0 ; i < virJSONValueArraySize(json) ; i++) {
+        virJSONValuePtr item = virJSONValueArrayGet(json, i);
+        virJSONValuePtr tags = virJSONValueObjectGet(item, "tags");
+        virJSONValuePtr inner;
+        double ratio;
+        bool flag;
+        int n;
+
+        if (!(inner = virJSONValueObjectGet(item, "nested")) ||
+            !(inner = virJSONValueObjectGet(inner, "depth")) ||
+            virJSONValueObjectGetNumberInt(inner, "n", &n) < 0 ||
+            n != i ||
+            !virJSONValueObjectGetString(item, "name") ||
+            virJSONValueObjectGetBoolean(item, "flag", &flag) < 0 ||
+            virJSONValueObjectGetNumberDouble(item, "ratio", &ratio) < 0 ||
+            virJSONValueObjectIsNull(item, "none") != 1 ||
+            virJSONValueArraySize(tags) != 3 ||
+            !virJSONValueGetString(virJSONValueArrayGet(tags, 2))) {
+            virJSONValueFree(json);
+            return -1;
+        }
+    }
+
+    virJSONValueFree(json);
+    return 0;
+}
+
+/* An array of @nitems objects holding every kind of value, with
+ * escapes and some nesting. Replies QEMU actually sends are timed
+ * by qemumonitorjsontest */
+static char *
+testJSONBenchDoc(int nitems)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    int i;
+
+    virBufferAddLit(&buf, "[");
+    for (i = 0 ; i < nitems ; i++) {
+        virBufferAsprintf(&buf,
+                          "%s{\"name\": \"item\\t%d\", \"flag\": %s, "
+                          "\"ratio\": %d.25e-1, \"none\": null, "
+                          "\"tags\": [\"a\", \"\\u00e9\", \"q\\\"%d\\\"\"], "
+                          "\"nested\": {\"depth\": {\"n\": %d, "
+                          "\"empty\": {}, \"list\": []}}}",
+                          i ? ", " : "", i, i % 2 ? "true" : "false",
+                          i, i, i);
+    }
+    virBufferAddLit(&buf, "]");
+
+    return virBufferContentAndReset(&buf);
+}
+
+
 static int
 mymain(void)
 {
     int ret = 0;
+    int sizes[] = { 10, 5000 };
+    int i;
 
 #define DO_TEST_FULL(name, cmd, doc, pass)                          \
     do {                                                            \
@@ -66,8 +256,17 @@ mymain(void)
             ret = -1;                                               \
     } while (0)
 
-#define DO_TEST_PARSE(name, doc)                \
-    DO_TEST_FULL(name, FromString, doc, true)
+#define DO_TEST_PARSE(name, doc)                                    \
+    do {                                                            \
+        DO_TEST_FULL(name, FromString, doc, true);                  \
+        DO_TEST_FULL(name " in an arena", Arena, doc, true);        \
+    } while (0)
+
+#define DO_TEST_PARSE_FAIL(name, doc)                               \
+    do {                                                            \
+        DO_TEST_FULL(name, FromString, doc, false);                 \
+        DO_TEST_FULL(name " in an arena", Arena, doc, false);       \
+    } while (0)
 
     DO_TEST_PARSE("Simple", "{\"return\": {}, \"id\": \"libvirt-1\"}");
     DO_TEST_PARSE("NotSoSimple", "{\"QMP\": {\"version\": {\"qemu\":"
@@ -105,6 +304,51 @@ mymain(void)
                   "\"query-uuid\"}, {\"name\": \"query-migrate\"}, {\"name\": "
                   "\"query-balloon\"}], \"id\": \"libvirt-2\"}");
 
+    DO_TEST_PARSE("Scalars", "[1, -2.5e3, \"str\", true, false, null, [], {}]");
+    DO_TEST_PARSE_FAIL("Truncated", "{\"return\": [{\"name\": \"quit\"}, ");
+    DO_TEST_PARSE_FAIL("Duplicate key", "{\"a\": 1, \"b\": 2, \"a\": 3}");
+    DO_TEST_PARSE_FAIL("Duplicate key in a large object",
+                       "{\"a\": 1, \"b\": 2, \"c\": 3, \"d\": 4, \"e\": 5, "
+                       "\"f\": 6, \"g\": 7, \"h\": 8, \"i\": 9, \"e\": 10}");
+
+    if (virtTestRun("Lookup in large objects", 1, testJSONLookup, NULL) < 0)
+        ret = -1;
+
+    /* Timings are reported with --verbose */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        struct testBenchInfo info;
+        char *doc;
+
+        if (!(doc = testJSONBenchDoc(sizes[i]))) {
+            ret = -1;
+            continue;
+        }
+        info.doc = doc;
+
+        for (info.flags = 0 ;
+             info.flags <= VIR_JSON_PARSE_ARENA ;
+             info.flags++) {
+            virJSONValuePtr json;
+            char title[100];
+
+            if (!(json = virJSONValueFromBuffer(doc, strlen(doc),
+                                                info.flags))) {
+                ret = -1;
+                continue;
+            }
+            snprintf(title, sizeof(title),
+                     "Array of %d objects%s, %zu allocations",
+                     sizes[i], info.flags ? " in an arena" : "",
+                     virJSONValueCountAllocs(json));
+            virJSONValueFree(json);
+
+            if (virtTestRun(title, 10, testJSONBench, &info) < 0)
+                ret = -1;
+        }
+
+        VIR_FREE(doc);
+    }
+
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
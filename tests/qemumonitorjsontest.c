@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "testutils.h"
+
+#if defined(WITH_QEMU) && HAVE_YAJL
+
+# include "internal.h"
+# include "memory.h"
+# include "util.h"
+# include "buf.h"
+# include "virfile.h"
+# include "json.h"
+# include "threads.h"
+# include "virterror_internal.h"
+# include "qemu/qemu_monitor.h"
+# include "qemu/qemu_monitor_json.h"
+
+# define VIR_FROM_THIS VIR_FROM_QEMU
+
+# define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+struct testReplyInfo {
+    const char *data;
+    size_t len;
+    size_t nlines;
+};
+
+
+static int
+testSplitLines(const void *data ATTRIBUTE_UNUSED)
+{
+    const char *events =
+        "{\"event\": \"BENCH\", \"data\": {\"n\": 1}}\r\n"
+        "{\"event\": \"BENCH\", \"data\": {\"n\": 2}}\r\n"
+        "{\"event\": \"BENCH\"";
+    const char *reply =
+        "{\"return\": {\"text\": \"a\\nb\"}, \"id\": \"libvirt-1\"}\r\n";
+    qemuMonitorMessage msg;
+    size_t len = strlen(reply);
+    size_t i;
+    int used;
+
+    memset(&msg, 0, sizeof(msg));
+
+    /* The partial line at the end has to wait for the rest of it */
+    used = qemuMonitorJSONIOProcess(NULL, events, strlen(events), &msg);
+    if (used != strrchr(events, '\n') + 1 - events) {
+        testError("\nused %d bytes of the events\n", used);
+        return -1;
+    }
+
+    /* Nothing of a reply cut short anywhere, including between
+     * the \r and the \n, is used until the rest of it comes in */
+    for (i = 1 ; i < len ; i++) {
+        if ((used = qemuMonitorJSONIOProcess(NULL, reply, i, &msg)) != 0) {
+            testError("\nused %d of the first %zu bytes\n", used, i);
+            return -1;
+        }
+    }
+    if ((used = qemuMonitorJSONIOProcess(NULL, reply, len, &msg)) != len) {
+        testError("\nused %d bytes of the reply\n", used);
+        return -1;
+    }
+    if (!msg.finished || !msg.rxObject) {
+        testError("\nreply not seen\n");
+        return -1;
+    }
+    virJSONValueFree(msg.rxObject);
+
+    return 0;
+}
+
+
+/*
+ * Several commands are queued at once, and QEMU answers them in
+ * whatever order it likes; each reply goes to the command whose
+ * id it carries, and none to a command not sent in full yet.
+ */
+static int
+testMatchReplies(const void *data ATTRIBUTE_UNUSED)
+{
+    const char *replies =
+        "{\"return\": 3, \"id\": \"libvirt-3\"}\r\n"
+        "{\"return\": 1, \"id\": \"libvirt-1\"}\r\n"
+        "{\"return\": 2, \"id\": \"libvirt-2\"}\r\n";
+    const char *unsent = "{\"return\": 4, \"id\": \"libvirt-4\"}\r\n";
+    static const char *ids[] = {
+        "libvirt-1", "libvirt-2", "libvirt-3", "libvirt-4"
+    };
+    qemuMonitorMessage msgs[ARRAY_CARDINALITY(ids)];
+    int ret = -1;
+    int i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0 ; i < ARRAY_CARDINALITY(ids) ; i++) {
+        msgs[i].id = ids[i];
+        if (i + 1 < ARRAY_CARDINALITY(ids))
+            msgs[i].next = &msgs[i + 1];
+    }
+    /* The last one is still being written out */
+    msgs[3].txLength = 10;
+
+    if (qemuMonitorJSONIOProcess(NULL, replies, strlen(replies),
+                                 msgs) != strlen(replies))
+        goto cleanup;
+
+    for (i = 0 ; i < 3 ; i++) {
+        unsigned long long n;
+
+        if (!msgs[i].finished || !msgs[i].rxObject ||
+            virJSONValueObjectGetNumberUlong(msgs[i].rxObject,
+                                             "return", &n) < 0 ||
+            n != i + 1) {
+            testError("\nwrong reply for %s\n", ids[i]);
+            goto cleanup;
+        }
+    }
+
+    if (qemuMonitorJSONIOProcess(NULL, unsent, strlen(unsent), msgs) >= 0 ||
+        msgs[3].finished) {
+        testError("\nreply taken by a command not sent yet\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < ARRAY_CARDINALITY(ids) ; i++)
+        virJSONValueFree(msgs[i].rxObject);
+    return ret;
+}
+
+
+static int
+testProcessReply(const void *data)
+{
+    const struct testReplyInfo *info = data;
+    qemuMonitorMessage msg;
+    int used;
+
+    memset(&msg, 0, sizeof(msg));
+
+    if ((used = qemuMonitorJSONIOProcess(NULL, info->data, info->len,
+                                         &msg)) != info->len) {
+        testError("\nused %d of %zu bytes\n", used, info->len);
+        return -1;
+    }
+    if (info->nlines == 1 && (!msg.finished || !msg.rxObject)) {
+        testError("\nreply not seen\n");
+        return -1;
+    }
+    virJSONValueFree(msg.rxObject);
+
+    return 0;
+}
+
+
+/* A query-blockstats like reply for @ndevs disks, on a single line */
+static char *
+testBuildReply(size_t ndevs)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t i;
+
+    virBufferAddLit(&buf, "{\"return\": [");
+    for (i = 0 ; i < ndevs ; i++) {
+        virBufferAsprintf(&buf,
+                          "%s{\"device\": \"drive-virtio-disk%zu\", "
+                          "\"stats\": {\"rd_bytes\": %zu, \"wr_bytes\": %zu, "
+                          "\"rd_operations\": %zu, \"wr_operations\": %zu, "
+                          "\"flush_operations\": 0, \"wr_highest_offset\": 0}, "
+                          "\"parent\": {\"stats\": {\"rd_bytes\": 0, "
+                          "\"wr_bytes\": 0}}}",
+                          i ? ", " : "", i, i * 4096, i * 8192, i, i * 2);
+    }
+    virBufferAddLit(&buf, "], \"id\": \"libvirt-42\"}\r\n");
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        return NULL;
+    }
+    return virBufferContentAndReset(&buf);
+}
+
+/* @nevents small event lines, as a chatty guest would cause */
+static char *
+testBuildEvents(size_t nevents)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t i;
+
+    for (i = 0 ; i < nevents ; i++)
+        virBufferAsprintf(&buf,
+                          "{\"timestamp\": {\"seconds\": %zu, "
+                          "\"microseconds\": 0}, \"event\": \"BENCH\", "
+                          "\"data\": {\"n\": %zu}}\r\n", i, i);
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        return NULL;
+    }
+    return virBufferContentAndReset(&buf);
+}
+
+
+/*
+ * What QEMU answers query-blockstats with for a guest with two
+ * disks, the second on a QEMU too old to time its requests
+ */
+static const char *testBlockStatsReply =
+    "{\"return\": ["
+    "{\"device\": \"drive-virtio-disk0\", "
+    "\"stats\": {\"rd_bytes\": 4096, \"wr_bytes\": 8192, "
+    "\"rd_operations\": 1, \"wr_operations\": 2, "
+    "\"flush_operations\": 3, \"rd_total_times_ns\": 40, "
+    "\"wr_total_times_ns\": 50, \"flush_total_times_ns\": 60, "
+    "\"wr_highest_offset\": 0}, "
+    "\"parent\": {\"stats\": {\"rd_bytes\": 7, \"wr_bytes\": 7, "
+    "\"rd_operations\": 7, \"wr_operations\": 7}}}, "
+    "{\"device\": \"ide0-0-0\", "
+    "\"stats\": {\"rd_bytes\": 512, \"wr_bytes\": 0, "
+    "\"rd_operations\": 5, \"wr_operations\": 0, "
+    "\"wr_highest_offset\": 0}}"
+    "], \"id\": \"%s\"}\r\n";
+
+static void
+testMonitorEOF(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
+               virDomainObjPtr vm ATTRIBUTE_UNUSED)
+{
+}
+
+static qemuMonitorCallbacks testMonitorCallbacks = {
+    .eofNotify = testMonitorEOF,
+    .errorNotify = testMonitorEOF,
+};
+
+static bool testEventQuit;
+
+static void
+testEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!testEventQuit)
+        virEventRunDefaultImpl();
+}
+
+static void
+testEventWake(int timer, void *opaque ATTRIBUTE_UNUSED)
+{
+    virEventRemoveTimeout(timer);
+}
+
+/*
+ * Plays QEMU on the far end of the monitor: reads a command, checks
+ * it is query-blockstats, replies to it, and then waits for libvirt
+ * to hang up
+ */
+static void
+testFakeQEMU(void *opaque)
+{
+    int fd = *(int *)opaque;
+    char buf[1024];
+    size_t len = 0;
+    ssize_t got;
+    virJSONValuePtr cmd = NULL;
+    const char *exe;
+    const char *id;
+    char *reply = NULL;
+
+    while (len < sizeof(buf) - 1 && !memchr(buf, '\n', len)) {
+        if ((got = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+            goto cleanup;
+        len += got;
+    }
+    buf[len] = '\0';
+
+    if (!(cmd = virJSONValueFromString(buf)) ||
+        !(exe = virJSONValueObjectGetString(cmd, "execute")) ||
+        STRNEQ(exe, "query-blockstats") ||
+        !(id = virJSONValueObjectGetString(cmd, "id")) ||
+        virAsprintf(&reply, testBlockStatsReply, id) < 0)
+        goto cleanup;
+
+    if (safewrite(fd, reply, strlen(reply)) < 0)
+        goto cleanup;
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+cleanup:
+    VIR_FREE(reply);
+    virJSONValueFree(cmd);
+    VIR_FORCE_CLOSE(fd);
+}
+
+# define CHECK_STAT(dev, stats, field, expect)                           \
+    do {                                                                \
+        if ((stats)->field != (expect)) {                               \
+            testError("\n%s " #field " is %lld, not %lld\n",            \
+                      dev, (stats)->field, (long long)(expect));        \
+            goto cleanup;                                               \
+        }                                                               \
+    } while (0)
+
+/*
+ * Get the stats of all disks through a real monitor, talking to
+ * testFakeQEMU over a UNIX socket, and check that each disk lands
+ * in the table under its guest side name, with what QEMU does not
+ * report left at -1
+ */
+static int
+testBlockStats(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObj vm;
+    virDomainChrSourceDef config;
+    struct sockaddr_un addr;
+    qemuMonitorPtr mon = NULL;
+    virHashTablePtr stats = NULL;
+    struct qemuBlockStats *disk;
+    virThread loop, qemu;
+    bool haveLoop = false;
+    bool haveQEMU = false;
+    int lfd = -1;
+    int fd = -1;
+    char *path = NULL;
+    int ret = -1;
+
+    memset(&vm, 0, sizeof(vm));
+    memset(&config, 0, sizeof(config));
+    memset(&addr, 0, sizeof(addr));
+
+    if (virAsprintf(&path, "%s/qemumonitorjsontest.sock", abs_builddir) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    unlink(path);
+
+    addr.sun_family = AF_UNIX;
+    if (virStrcpyStatic(addr.sun_path, path) == NULL ||
+        (lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0)
+        goto cleanup;
+
+    testEventQuit = false;
+    if (virThreadCreate(&loop, true, testEventLoop, NULL) < 0)
+        goto cleanup;
+    haveLoop = true;
+
+    vm.pid = getpid();
+    config.type = VIR_DOMAIN_CHR_TYPE_UNIX;
+    config.data.nix.path = path;
+    if (!(mon = qemuMonitorOpen(&vm, &config, 1, &testMonitorCallbacks)))
+        goto cleanup;
+
+    if ((fd = accept(lfd, NULL, NULL)) < 0 ||
+        virThreadCreate(&qemu, true, testFakeQEMU, &fd) < 0)
+        goto cleanup;
+    haveQEMU = true;
+
+    qemuMonitorLock(mon);
+    if (qemuMonitorGetAllBlockStatsInfo(mon, &stats) < 0) {
+        qemuMonitorUnlock(mon);
+        goto cleanup;
+    }
+    qemuMonitorUnlock(mon);
+
+    if (virHashSize(stats) != 2) {
+        testError("\n%d disks in the table\n", virHashSize(stats));
+        goto cleanup;
+    }
+
+    if (!(disk = virHashLookup(stats, "virtio-disk0"))) {
+        testError("\nno stats for virtio-disk0\n");
+        goto cleanup;
+    }
+    CHECK_STAT("virtio-disk0", disk, rd_bytes, 4096);
+    CHECK_STAT("virtio-disk0", disk, rd_req, 1);
+    CHECK_STAT("virtio-disk0", disk, rd_total_times, 40);
+    CHECK_STAT("virtio-disk0", disk, wr_bytes, 8192);
+    CHECK_STAT("virtio-disk0", disk, wr_req, 2);
+    CHECK_STAT("virtio-disk0", disk, wr_total_times, 50);
+    CHECK_STAT("virtio-disk0", disk, flush_req, 3);
+    CHECK_STAT("virtio-disk0", disk, flush_total_times, 60);
+    CHECK_STAT("virtio-disk0", disk, errs, -1);
+
+    if (!(disk = virHashLookup(stats, "ide0-0-0"))) {
+        testError("\nno stats for ide0-0-0\n");
+        goto cleanup;
+    }
+    CHECK_STAT("ide0-0-0", disk, rd_bytes, 512);
+    CHECK_STAT("ide0-0-0", disk, rd_req, 5);
+    CHECK_STAT("ide0-0-0", disk, rd_total_times, -1);
+    CHECK_STAT("ide0-0-0", disk, wr_bytes, 0);
+    CHECK_STAT("ide0-0-0", disk, wr_req, 0);
+    CHECK_STAT("ide0-0-0", disk, wr_total_times, -1);
+    CHECK_STAT("ide0-0-0", disk, flush_req, -1);
+    CHECK_STAT("ide0-0-0", disk, flush_total_times, -1);
+
+    ret = 0;
+
+cleanup:
+    virHashFree(stats);
+    if (mon)
+        qemuMonitorClose(mon);
+    if (haveQEMU)
+        virThreadJoin(&qemu);
+    else
+        VIR_FORCE_CLOSE(fd);
+    if (haveLoop) {
+        testEventQuit = true;
+        virEventAddTimeout(0, testEventWake, NULL, NULL);
+        virThreadJoin(&loop);
+    }
+    VIR_FORCE_CLOSE(lfd);
+    if (path)
+        unlink(path);
+    VIR_FREE(path);
+    return ret;
+}
+
+# undef CHECK_STAT
+
+
+static int
+mymain(void)
+{
+    struct testReplyInfo info;
+    char *reply = NULL;
+    char *events = NULL;
+    int ret = 0;
+
+    if (virtTestRun("Split lines out of the monitor stream", 1,
+                    testSplitLines, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("Match replies to queued commands", 1,
+                    testMatchReplies, NULL) < 0)
+        ret = -1;
+
+    if (virEventRegisterDefaultImpl() < 0 ||
+        virtTestRun("Get all block stats", 1, testBlockStats, NULL) < 0)
+        ret = -1;
+
+    if (!(reply = testBuildReply(20000)) ||
+        !(events = testBuildEvents(20000))) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    /* Timings are reported with --verbose. A reply should not
+     * cost more than its size would suggest */
+# define DO_TEST(name, what, lines)                                      \
+    do {                                                                \
+        info.data = what;                                               \
+        info.len = strlen(what);                                        \
+        info.nlines = lines;                                            \
+        if (virtTestRun(name, 1, testProcessReply, &info) < 0)          \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("Multi-MB reply", reply, 1);
+    DO_TEST("20000 events", events, 20000);
+
+# undef DO_TEST
+
+cleanup:
+    VIR_FREE(reply);
+    VIR_FREE(events);
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#else
+
+static int
+mymain(void)
+{
+    return EXIT_AM_SKIP;
+}
+
+#endif /* WITH_QEMU && HAVE_YAJL */
+
+VIRT_TEST_MAIN(mymain)
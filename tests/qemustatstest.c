@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutils.h"
+
+#ifdef WITH_QEMU
+
+# include "internal.h"
+# include "memory.h"
+# include "util.h"
+# include "qemu/qemu_stats.h"
+# include "qemu/qemu_migration.h"
+
+# define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+# define HISTORY 4
+
+/*
+ * Sample @n of a domain whose CPU time grows by 500ms a second,
+ * sampled every 2s, and whose disk was swapped for a new one
+ * before sample 3.
+ */
+static qemuStatsSamplePtr
+testSampleNew(int n)
+{
+    qemuStatsSamplePtr sample;
+    long long rd = n < 3 ? 1000 * n : 10;
+
+    if (!(sample = qemuStatsSampleNew(1000000 + 2000 * n)))
+        return NULL;
+
+    if (qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, false,
+                           1000000000ULL * n, "cpu.time") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           1024 * (n + 1), "balloon.current") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_LLONG, false,
+                           rd, "block.%s.rd_bytes", "vda") < 0) {
+        qemuStatsSampleFree(sample);
+        return NULL;
+    }
+
+    return sample;
+}
+
+static virTypedParameterPtr
+testFind(virDomainStatsRecordPtr record, const char *field)
+{
+    int i;
+
+    for (i = 0 ; i < record->nparams ; i++) {
+        if (STREQ(record->params[i].field, field))
+            return record->params + i;
+    }
+    return NULL;
+}
+
+static int
+testRingFill(qemuStatsRingPtr ring, int from, int to)
+{
+    int i;
+
+    for (i = from ; i < to ; i++) {
+        qemuStatsSamplePtr sample = testSampleNew(i);
+
+        if (!sample)
+            return -1;
+        qemuStatsRingPush(ring, sample);
+    }
+    return 0;
+}
+
+
+/* The ring keeps the latest samples only, and hands them out oldest
+ * first, limited to the groups asked for */
+static int
+testRingHistory(const void *data ATTRIBUTE_UNUSED)
+{
+    qemuStatsRingPtr ring;
+    virDomainStatsRecordPtr *records = NULL;
+    virTypedParameterPtr param;
+    int ret = -1;
+    int n;
+
+    if (!(ring = qemuStatsRingNew(HISTORY)) ||
+        testRingFill(ring, 0, HISTORY + 2) < 0)
+        goto cleanup;
+
+    if ((n = qemuStatsRingGet(ring, VIR_DOMAIN_STATS_CPU_TOTAL, 0,
+                              false, &records)) != HISTORY) {
+        testError("\nexpected %d samples, got %d\n", HISTORY, n);
+        goto cleanup;
+    }
+
+    if (records[HISTORY] ||
+        !(param = testFind(records[0], "timestamp")) ||
+        param->value.ul != 1000000 + 2000 * 2 ||
+        !(param = testFind(records[HISTORY - 1], "cpu.time")) ||
+        param->value.ul != 1000000000ULL * (HISTORY + 1)) {
+        testError("\nwrong samples kept\n");
+        goto cleanup;
+    }
+
+    if (testFind(records[0], "balloon.current") ||
+        testFind(records[0], "block.vda.rd_bytes")) {
+        testError("\nstats of other groups returned\n");
+        goto cleanup;
+    }
+
+    virDomainStatsRecordListFree(records);
+    records = NULL;
+
+    if ((n = qemuStatsRingGet(ring, 0, 2, false, &records)) != 2 ||
+        records[0]->dom ||
+        testFind(records[0], "cpu.time")) {
+        testError("\nlatest 2 samples of no group not right\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virDomainStatsRecordListFree(records);
+    qemuStatsRingFree(ring);
+    return ret;
+}
+
+
+static int
+testRingRates(const void *data ATTRIBUTE_UNUSED)
+{
+    unsigned int all = VIR_DOMAIN_STATS_CPU_TOTAL |
+        VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_BLOCK;
+    qemuStatsRingPtr ring;
+    virDomainStatsRecordPtr *records = NULL;
+    virTypedParameterPtr param;
+    int ret = -1;
+    int n;
+
+    if (!(ring = qemuStatsRingNew(HISTORY)))
+        goto cleanup;
+
+    /* Nothing to compute a rate from yet */
+    if (testRingFill(ring, 0, 1) < 0 ||
+        (n = qemuStatsRingGet(ring, all, 0, true, &records)) != 0 ||
+        records[0]) {
+        testError("\nrates from a single sample\n");
+        goto cleanup;
+    }
+    virDomainStatsRecordListFree(records);
+    records = NULL;
+
+    if (testRingFill(ring, 1, 4) < 0 ||
+        (n = qemuStatsRingGet(ring, all, 0, true, &records)) != 3) {
+        testError("\nexpected 3 rates\n");
+        goto cleanup;
+    }
+
+    if (!(param = testFind(records[0], "interval")) ||
+        param->value.ul != 2000 ||
+        !(param = testFind(records[0], "cpu.time")) ||
+        param->type != VIR_TYPED_PARAM_DOUBLE ||
+        param->value.d != 500000000.0 ||
+        !(param = testFind(records[0], "block.vda.rd_bytes")) ||
+        param->value.d != 500.0) {
+        testError("\nwrong rates\n");
+        goto cleanup;
+    }
+
+    /* Gauges stay as they are */
+    if (!(param = testFind(records[2], "balloon.current")) ||
+        param->type != VIR_TYPED_PARAM_ULLONG ||
+        param->value.ul != 1024 * 4) {
+        testError("\nballoon turned into a rate\n");
+        goto cleanup;
+    }
+
+    /* The new disk started from scratch */
+    if (testFind(records[1], "block.vda.rd_bytes") == NULL ||
+        testFind(records[2], "block.vda.rd_bytes") != NULL) {
+        testError("\nrate of a counter which went back\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virDomainStatsRecordListFree(records);
+    qemuStatsRingFree(ring);
+    return ret;
+}
+
+
+/* The migration timeline shares the ring, but none of its fields
+ * leak into the public stats groups */
+static int
+testRingMigration(const void *data ATTRIBUTE_UNUSED)
+{
+    unsigned int all = VIR_DOMAIN_STATS_CPU_TOTAL |
+        VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_BLOCK;
+    qemuStatsRingPtr ring;
+    qemuStatsSamplePtr sample;
+    virDomainStatsRecordPtr *records = NULL;
+    virTypedParameterPtr param;
+    int ret = -1;
+
+    if (!(ring = qemuStatsRingNew(HISTORY)) ||
+        !(sample = qemuStatsSampleNew(1000000)))
+        goto cleanup;
+
+    if (qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, false,
+                           4096, "migration.processed") < 0 ||
+        qemuStatsSampleAdd(sample, VIR_TYPED_PARAM_ULLONG, true,
+                           8192, "migration.remaining") < 0) {
+        qemuStatsSampleFree(sample);
+        goto cleanup;
+    }
+    qemuStatsRingPush(ring, sample);
+
+    if (qemuStatsRingGet(ring, all, 0, false, &records) != 1 ||
+        testFind(records[0], "migration.processed")) {
+        testError("\nmigration stats returned with the others\n");
+        goto cleanup;
+    }
+    virDomainStatsRecordListFree(records);
+    records = NULL;
+
+    if (qemuStatsRingGet(ring, QEMU_STATS_MIGRATION, 0,
+                         false, &records) != 1 ||
+        !(param = testFind(records[0], "migration.remaining")) ||
+        param->value.ul != 8192 ||
+        !testFind(records[0], "migration.processed")) {
+        testError("\nmigration stats missing from the timeline\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virDomainStatsRecordListFree(records);
+    qemuStatsRingFree(ring);
+    return ret;
+}
+
+
+# define MiB (1024ULL * 1024)
+
+struct testPollData {
+    qemuMigrationProgress prev;
+    qemuMigrationProgress cur;
+    unsigned long long rate;
+    unsigned long long dirtyRate;
+    unsigned long long wait;
+};
+
+static int
+testMigrationPoll(const void *opaque)
+{
+    const struct testPollData *data = opaque;
+    qemuMigrationProgress prev = data->prev;
+    qemuMigrationProgress cur = data->cur;
+    unsigned long long rate;
+    unsigned long long dirtyRate;
+    unsigned long long wait;
+
+    wait = qemuMigrationNextPoll(&prev, &cur, &rate, &dirtyRate);
+
+    if (wait != data->wait ||
+        rate != data->rate ||
+        dirtyRate != data->dirtyRate) {
+        testError("\nexpected wait %llu rate %llu dirty rate %llu, "
+                  "got %llu %llu %llu\n",
+                  data->wait, data->rate, data->dirtyRate,
+                  wait, rate, dirtyRate);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virtTestRun("Stats history", 1, testRingHistory, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Stats rates", 1, testRingRates, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Stats migration", 1, testRingMigration, NULL) < 0)
+        ret = -1;
+
+# define DO_TEST_POLL(name, prevElapsed, prevProcessed, prevRemaining,     \
+                      curElapsed, curProcessed, curRemaining,             \
+                      expRate, expDirtyRate, expWait)                     \
+    do {                                                                  \
+        struct testPollData data = {                                      \
+            { prevElapsed, prevProcessed, prevRemaining },                \
+            { curElapsed, curProcessed, curRemaining },                   \
+            expRate, expDirtyRate, expWait                                \
+        };                                                                \
+        if (virtTestRun("Migration poll " name, 1,                        \
+                        testMigrationPoll, &data) < 0)                    \
+            ret = -1;                                                     \
+    } while (0)
+
+    /* Two polls at once tell nothing */
+    DO_TEST_POLL("zero interval",
+                 1000, 100 * MiB, 900 * MiB,
+                 1000, 200 * MiB, 800 * MiB,
+                 0, 0, QEMU_MIGRATION_POLL_DEFAULT);
+    DO_TEST_POLL("stalled",
+                 1000, 100 * MiB, 900 * MiB,
+                 2000, 100 * MiB, 900 * MiB,
+                 0, 0, QEMU_MIGRATION_POLL_DEFAULT);
+    /* 100 MiB went out, but what remains did not shrink */
+    DO_TEST_POLL("not converging",
+                 1000, 100 * MiB, 900 * MiB,
+                 2000, 200 * MiB, 900 * MiB,
+                 100 * MiB, 100 * MiB, QEMU_MIGRATION_POLL_MAX);
+    /* Dirtied faster than sent */
+    DO_TEST_POLL("diverging",
+                 1000, 100 * MiB, 900 * MiB,
+                 2000, 200 * MiB, 950 * MiB,
+                 100 * MiB, 150 * MiB, QEMU_MIGRATION_POLL_MAX);
+    /* 100 MiB left at a net 200 MiB/s: done in 500ms, poll in 125ms */
+    DO_TEST_POLL("converging",
+                 1000, 100 * MiB, 300 * MiB,
+                 2000, 300 * MiB, 100 * MiB,
+                 200 * MiB, 0, 125);
+    /* 50 MiB left at a net 100 MiB/s: done in 500ms, poll in 125ms */
+    DO_TEST_POLL("converging while dirtied",
+                 1000, 100 * MiB, 100 * MiB,
+                 1500, 200 * MiB, 50 * MiB,
+                 200 * MiB, 100 * MiB, 125);
+    DO_TEST_POLL("clamped to min",
+                 1000, 100 * MiB, 101 * MiB,
+                 2000, 200 * MiB, 1 * MiB,
+                 100 * MiB, 0, QEMU_MIGRATION_POLL_MIN);
+    DO_TEST_POLL("clamped to max",
+                 1000, 100 * MiB, 100100 * MiB,
+                 2000, 200 * MiB, 100000 * MiB,
+                 100 * MiB, 0, QEMU_MIGRATION_POLL_MAX);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#else
+
+static int
+mymain(void)
+{
+    return EXIT_AM_SKIP;
+}
+
+#endif /* WITH_QEMU */
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "virfile.h"
+#include "storage_conf.h"
+#include "storage/storage_backend_fs.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+/* Every file any of the tests creates in the pool's directory */
+static const char *testFiles[] = {
+    "a.img", "b.img", "c.img", "d.img", "e.img",
+};
+
+/* A volume expected in the pool, and the size of its file */
+struct testVol {
+    const char *name;
+    unsigned long long capacity;
+};
+
+
+static int
+testWriteFile(const char *dir, const char *name, off_t size)
+{
+    char *path = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (virAsprintf(&path, "%s/%s", dir, name) < 0)
+        goto cleanup;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+        ftruncate(fd, size) < 0 ||
+        VIR_CLOSE(fd) < 0) {
+        testError("\ncannot write %s\n", path);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(path);
+    return ret;
+}
+
+static int
+testRemoveFile(const char *dir, const char *name)
+{
+    char *path = NULL;
+    int ret;
+
+    if (virAsprintf(&path, "%s/%s", dir, name) < 0)
+        return -1;
+
+    ret = unlink(path);
+    VIR_FREE(path);
+    return ret;
+}
+
+static void
+testRemoveDir(const char *dir)
+{
+    int i;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(testFiles) ; i++)
+        testRemoveFile(dir, testFiles[i]);
+    rmdir(dir);
+}
+
+
+static virStoragePoolObjPtr
+testPoolNew(const char *dir)
+{
+    virStoragePoolObjPtr pool;
+
+    if (VIR_ALLOC(pool) < 0)
+        return NULL;
+    if (virMutexInit(&pool->lock) < 0) {
+        VIR_FREE(pool);
+        return NULL;
+    }
+
+    if (VIR_ALLOC(pool->def) < 0 ||
+        !(pool->def->name = strdup("test")) ||
+        !(pool->def->target.path = strdup(dir))) {
+        virStoragePoolObjFree(pool);
+        return NULL;
+    }
+    pool->def->type = VIR_STORAGE_POOL_DIR;
+    pool->def->target.perms.uid = -1;
+    pool->def->target.perms.gid = -1;
+
+    return pool;
+}
+
+/* Check that the pool lists exactly the @nvols volumes in @vols */
+static int
+testPoolCheckVols(virStoragePoolObjPtr pool,
+                  const struct testVol *vols,
+                  size_t nvols)
+{
+    size_t i;
+
+    if (pool->volumes.count != nvols) {
+        testError("\n%u volumes instead of %zu\n",
+                  pool->volumes.count, nvols);
+        return -1;
+    }
+
+    for (i = 0 ; i < nvols ; i++) {
+        virStorageVolDefPtr vol;
+
+        if (!(vol = virStorageVolDefFindByName(pool, vols[i].name))) {
+            testError("\nno volume %s\n", vols[i].name);
+            return -1;
+        }
+        if (vol->capacity != vols[i].capacity) {
+            testError("\nvolume %s has capacity %llu instead of %llu\n",
+                      vols[i].name, vol->capacity, vols[i].capacity);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Check the volumes of @pool, each given as { name, capacity } */
+#define CHECK_VOLS(...)                                                 \
+    do {                                                                \
+        const struct testVol vols[] = { __VA_ARGS__ };                  \
+        if (testPoolCheckVols(pool, vols, ARRAY_CARDINALITY(vols)) < 0) \
+            goto cleanup;                                               \
+    } while (0)
+
+static int
+testPoolUpdate(virStoragePoolObjPtr pool)
+{
+    if (virStorageBackendDirectory.updatePool(NULL, pool) < 0) {
+        virErrorPtr err = virGetLastError();
+        testError("\nupdate failed: %s\n",
+                  err && err->message ? err->message : "unknown error");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Files are created, changed and deleted between refreshes, and
+ * each update has to add, re-probe and drop the matching volumes,
+ * and leave the volumes of untouched files alone
+ */
+static int
+testIncremental(const void *data)
+{
+    const char *dir = data;
+    virStoragePoolObjPtr pool = NULL;
+    virStorageVolDefPtr a, b;
+    int ret = -1;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        goto cleanup;
+    if (testWriteFile(dir, "a.img", 512) < 0 ||
+        testWriteFile(dir, "b.img", 1024) < 0)
+        goto cleanup;
+
+    if (!(pool = testPoolNew(dir)) ||
+        virStorageBackendDirectory.refreshPool(NULL, pool) < 0)
+        goto cleanup;
+
+    CHECK_VOLS({ "a.img", 512 }, { "b.img", 1024 });
+
+    /* Nothing changed, so nothing is probed again */
+    a = virStorageVolDefFindByName(pool, "a.img");
+    b = virStorageVolDefFindByName(pool, "b.img");
+    if (testPoolUpdate(pool) < 0)
+        goto cleanup;
+    if (virStorageVolDefFindByName(pool, "a.img") != a ||
+        virStorageVolDefFindByName(pool, "b.img") != b) {
+        testError("\nunchanged volumes were replaced\n");
+        goto cleanup;
+    }
+
+    /* A new file, a grown one and a deleted one */
+    if (testWriteFile(dir, "c.img", 2048) < 0 ||
+        testWriteFile(dir, "a.img", 4096) < 0 ||
+        testRemoveFile(dir, "b.img") < 0)
+        goto cleanup;
+
+    if (testPoolUpdate(pool) < 0)
+        goto cleanup;
+
+    CHECK_VOLS({ "a.img", 4096 }, { "c.img", 2048 });
+
+    ret = 0;
+
+cleanup:
+    virStoragePoolObjFree(pool);
+    testRemoveDir(dir);
+    return ret;
+}
+
+
+/*
+ * Once the directory itself is deleted and made again, what inotify
+ * reported no longer covers it, so the update has to fall back to
+ * comparing every file, and keep doing so for later updates
+ */
+static int
+testRescanLostDir(const void *data)
+{
+    const char *dir = data;
+    virStoragePoolObjPtr pool = NULL;
+    int ret = -1;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        goto cleanup;
+    if (testWriteFile(dir, "a.img", 512) < 0 ||
+        testWriteFile(dir, "b.img", 1024) < 0)
+        goto cleanup;
+
+    if (!(pool = testPoolNew(dir)) ||
+        virStorageBackendDirectory.refreshPool(NULL, pool) < 0)
+        goto cleanup;
+
+    testRemoveDir(dir);
+    if (mkdir(dir, 0700) < 0 ||
+        testWriteFile(dir, "d.img", 512) < 0)
+        goto cleanup;
+
+    if (testPoolUpdate(pool) < 0)
+        goto cleanup;
+
+    CHECK_VOLS({ "d.img", 512 });
+
+    if (testWriteFile(dir, "e.img", 1024) < 0 ||
+        testWriteFile(dir, "d.img", 8192) < 0)
+        goto cleanup;
+
+    if (testPoolUpdate(pool) < 0)
+        goto cleanup;
+
+    CHECK_VOLS({ "d.img", 8192 }, { "e.img", 1024 });
+
+    if (testRemoveFile(dir, "d.img") < 0 ||
+        testPoolUpdate(pool) < 0)
+        goto cleanup;
+
+    CHECK_VOLS({ "e.img", 1024 });
+
+    ret = 0;
+
+cleanup:
+    virStoragePoolObjFree(pool);
+    testRemoveDir(dir);
+    return ret;
+}
+
+
+/*
+ * With the volumes cleared, there is nothing to compare against,
+ * and the update has to scan the directory in full
+ */
+static int
+testRescanNoCache(const void *data)
+{
+    const char *dir = data;
+    virStoragePoolObjPtr pool = NULL;
+    int ret = -1;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        goto cleanup;
+    if (testWriteFile(dir, "a.img", 512) < 0)
+        goto cleanup;
+
+    if (!(pool = testPoolNew(dir)) ||
+        virStorageBackendDirectory.refreshPool(NULL, pool) < 0)
+        goto cleanup;
+
+    virStoragePoolObjClearVols(pool);
+    if (testWriteFile(dir, "b.img", 1024) < 0 ||
+        testPoolUpdate(pool) < 0)
+        goto cleanup;
+
+    CHECK_VOLS({ "a.img", 512 }, { "b.img", 1024 });
+
+    if (!pool->volumesPrivate) {
+        testError("\nfull rescan left nothing for the next update\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virStoragePoolObjFree(pool);
+    testRemoveDir(dir);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    char *dir = NULL;
+
+    if (virAsprintf(&dir, "%s/storagebackendfsdata-XXXXXX",
+                    abs_builddir) < 0 ||
+        !mkdtemp(dir)) {
+        VIR_FREE(dir);
+        return EXIT_FAILURE;
+    }
+
+    if (virtTestRun("Incremental refresh", 1, testIncremental, dir) < 0)
+        ret = -1;
+    if (virtTestRun("Rescan after losing the directory", 1,
+                    testRescanLostDir, dir) < 0)
+        ret = -1;
+    if (virtTestRun("Rescan without a cache", 1,
+                    testRescanNoCache, dir) < 0)
+        ret = -1;
+
+    testRemoveDir(dir);
+    VIR_FREE(dir);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "storage_conf.h"
+#include "storage/storage_driver.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+/* A pool to autostart, and the stage it is expected in */
+struct testPool {
+    int type;
+    const char *path;
+    unsigned int stage;
+};
+
+struct testInfo {
+    const struct testPool *pools;
+    size_t npools;
+};
+
+
+static int
+testStages(const void *data)
+{
+    const struct testInfo *info = data;
+    virStoragePoolObjList pools;
+    unsigned int *stages = NULL;
+    size_t i;
+    int ret = -1;
+
+    memset(&pools, 0, sizeof(pools));
+
+    if (VIR_ALLOC_N(pools.objs, info->npools) < 0 ||
+        VIR_ALLOC_N(stages, info->npools) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < info->npools ; i++) {
+        virStoragePoolObjPtr pool;
+
+        if (VIR_ALLOC(pool) < 0)
+            goto cleanup;
+        pools.objs[pools.count++] = pool;
+
+        if (VIR_ALLOC(pool->def) < 0 ||
+            !(pool->def->target.path = strdup(info->pools[i].path)))
+            goto cleanup;
+        pool->def->type = info->pools[i].type;
+    }
+
+    storageDriverAutostartStages(&pools, stages);
+
+    for (i = 0 ; i < info->npools ; i++) {
+        if (stages[i] != info->pools[i].stage) {
+            testError("\npool at %s is in stage %u, not %u\n",
+                      info->pools[i].path, stages[i],
+                      info->pools[i].stage);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < pools.count ; i++) {
+        virStoragePoolDefFree(pools.objs[i]->def);
+        VIR_FREE(pools.objs[i]);
+    }
+    VIR_FREE(pools.objs);
+    VIR_FREE(stages);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+#define DO_TEST(name, ...)                                              \
+    do {                                                                \
+        static const struct testPool pools[] = { __VA_ARGS__ };         \
+        static const struct testInfo info = {                           \
+            pools, ARRAY_CARDINALITY(pools)                             \
+        };                                                              \
+        if (virtTestRun("Autostart stages " name, 1,                    \
+                        testStages, &info) < 0)                         \
+            ret = -1;                                                   \
+    } while (0)
+
+    /* The device nodes of every block pool are under a disk pool's
+     * /dev, which must not hold any of them back */
+    DO_TEST("of block pools under /dev",
+            { VIR_STORAGE_POOL_DISK, "/dev", 2 },
+            { VIR_STORAGE_POOL_ISCSI, "/dev/disk/by-path", 0 },
+            { VIR_STORAGE_POOL_SCSI, "/dev/disk/by-id", 0 },
+            { VIR_STORAGE_POOL_MPATH, "/dev/mapper", 1 },
+            { VIR_STORAGE_POOL_LOGICAL, "/dev/vg0", 2 });
+
+    /* Nor does a directory pool at /dev */
+    DO_TEST("of block pools under a /dev directory pool",
+            { VIR_STORAGE_POOL_DIR, "/dev", 4 },
+            { VIR_STORAGE_POOL_ISCSI, "/dev/disk/by-path", 0 },
+            { VIR_STORAGE_POOL_LOGICAL, "/dev/vg0", 2 });
+
+    /* A directory in a mounted filesystem, already started later */
+    DO_TEST("of a directory in a filesystem",
+            { VIR_STORAGE_POOL_DIR, "/mnt/data/images", 4 },
+            { VIR_STORAGE_POOL_FS, "/mnt/data", 3 });
+
+    /* A filesystem mounted in a directory pool, and a directory in
+     * that filesystem, each after the one it is in */
+    DO_TEST("of nested directories and mounts",
+            { VIR_STORAGE_POOL_DIR, "/var/lib/libvirt/images/nfs/vms", 6 },
+            { VIR_STORAGE_POOL_NETFS, "/var/lib/libvirt/images/nfs", 5 },
+            { VIR_STORAGE_POOL_DIR, "/var/lib/libvirt/images/", 4 },
+            { VIR_STORAGE_POOL_DIR, "/var/lib/libvirt/images-old", 4 });
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
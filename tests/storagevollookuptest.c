@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "storage_conf.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+#define LOOKUP_COUNT 1000
+
+struct testPoolInfo {
+    virStoragePoolObjPtr pool;
+    int nvols;
+};
+
+
+static int
+testPoolAddVol(virStoragePoolObjPtr pool, const char *name,
+               const char *key, const char *path)
+{
+    virStorageVolDefPtr vol;
+
+    if (VIR_ALLOC(vol) < 0)
+        return -1;
+
+    if (!(vol->name = strdup(name)) ||
+        !(vol->key = strdup(key)) ||
+        !(vol->target.path = strdup(path)) ||
+        virStoragePoolObjAddVol(pool, vol) < 0) {
+        virStorageVolDefFree(vol);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+testPoolPopulate(struct testPoolInfo *info, int nvols)
+{
+    char name[32], key[32], path[64];
+    int i;
+
+    memset(info, 0, sizeof(*info));
+
+    if (VIR_ALLOC(info->pool) < 0)
+        return -1;
+    if (virMutexInit(&info->pool->lock) < 0) {
+        VIR_FREE(info->pool);
+        return -1;
+    }
+
+    for (i = 0 ; i < nvols ; i++) {
+        snprintf(name, sizeof(name), "vol%d.img", i);
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(path, sizeof(path), "/var/lib/libvirt/images/vol%d.img", i);
+
+        if (testPoolAddVol(info->pool, name, key, path) < 0)
+            return -1;
+        info->nvols++;
+    }
+
+    return 0;
+}
+
+static void
+testPoolFree(struct testPoolInfo *info)
+{
+    virStoragePoolObjFree(info->pool);
+    info->pool = NULL;
+}
+
+
+static int
+testPoolLookupName(const void *data)
+{
+    const struct testPoolInfo *info = data;
+    char name[32];
+    int i;
+
+    for (i = 0 ; i < LOOKUP_COUNT ; i++) {
+        int n = (i * 7919) % info->nvols;
+        virStorageVolDefPtr vol;
+
+        snprintf(name, sizeof(name), "vol%d.img", n);
+        if (!(vol = virStorageVolDefFindByName(info->pool, name)) ||
+            STRNEQ(vol->name, name)) {
+            testError("\nvolume %s not found\n", name);
+            return -1;
+        }
+    }
+
+    if (virStorageVolDefFindByName(info->pool, "nosuchvol")) {
+        testError("\nunexpected volume found\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+testPoolLookupKey(const void *data)
+{
+    const struct testPoolInfo *info = data;
+    char key[32];
+    int i;
+
+    for (i = 0 ; i < LOOKUP_COUNT ; i++) {
+        int n = (i * 7919) % info->nvols;
+        virStorageVolDefPtr vol;
+
+        snprintf(key, sizeof(key), "key%d", n);
+        if (!(vol = virStorageVolDefFindByKey(info->pool, key)) ||
+            STRNEQ(vol->key, key)) {
+            testError("\nvolume with key %s not found\n", key);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+testPoolLookupPath(const void *data)
+{
+    const struct testPoolInfo *info = data;
+    char path[64];
+    int i;
+
+    for (i = 0 ; i < LOOKUP_COUNT ; i++) {
+        int n = (i * 7919) % info->nvols;
+        virStorageVolDefPtr vol;
+
+        snprintf(path, sizeof(path), "/var/lib/libvirt/images/vol%d.img", n);
+        if (!(vol = virStorageVolDefFindByPath(info->pool, path)) ||
+            STRNEQ(vol->target.path, path)) {
+            testError("\nvolume with path %s not found\n", path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * The indexes must follow removals and refreshes, and resolve
+ * shared keys to the first volume like a linear scan would.
+ */
+static int
+testPoolConsistency(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testPoolInfo info;
+    virStorageVolDefPtr vol, dup;
+    int ret = -1;
+
+    if (testPoolPopulate(&info, 10) < 0)
+        goto cleanup;
+
+    /* Some backends derive keys from serial numbers, which
+     * two LUNs may well share */
+    if (testPoolAddVol(info.pool, "dup.img", "key3",
+                       "/var/lib/libvirt/images/dup.img") < 0)
+        goto cleanup;
+
+    vol = virStorageVolDefFindByName(info.pool, "vol3.img");
+    dup = virStorageVolDefFindByName(info.pool, "dup.img");
+    if (!vol || !dup || virStorageVolDefFindByKey(info.pool, "key3") != vol) {
+        testError("\nshared key not resolved to the first volume\n");
+        goto cleanup;
+    }
+
+    virStoragePoolObjRemoveVol(info.pool, vol);
+    virStorageVolDefFree(vol);
+
+    if (virStorageVolDefFindByName(info.pool, "vol3.img") ||
+        virStorageVolDefFindByPath(info.pool,
+                                   "/var/lib/libvirt/images/vol3.img")) {
+        testError("\nremoved volume still found\n");
+        goto cleanup;
+    }
+
+    if (virStorageVolDefFindByKey(info.pool, "key3") != dup) {
+        testError("\nshared key not handed over on removal\n");
+        goto cleanup;
+    }
+
+    if (info.pool->volumes.count != 10 ||
+        virHashSize(info.pool->volumes.objsName) != 10 ||
+        virHashSize(info.pool->volumes.objsKey) != 10) {
+        testError("\nexpected 10 volumes indexed, got %u %d %d\n",
+                  info.pool->volumes.count,
+                  virHashSize(info.pool->volumes.objsName),
+                  virHashSize(info.pool->volumes.objsKey));
+        goto cleanup;
+    }
+
+    /* A refresh starts from scratch */
+    virStoragePoolObjClearVols(info.pool);
+    if (virStorageVolDefFindByName(info.pool, "vol4.img") ||
+        testPoolAddVol(info.pool, "vol4.img", "key4", "/dev/vg/vol4") < 0 ||
+        !virStorageVolDefFindByPath(info.pool, "/dev/vg/vol4")) {
+        testError("\nindexes not reset by clearing the pool\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testPoolFree(&info);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    static const int sizes[] = { 100, 20000 };
+    int ret = 0;
+    int i;
+
+    if (virtTestRun("Volume index consistency", 1,
+                    testPoolConsistency, NULL) < 0)
+        ret = -1;
+
+    /* Lookup times are reported with --verbose, and should
+     * be the same regardless of the number of volumes */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        struct testPoolInfo info;
+        char title[100];
+
+        if (testPoolPopulate(&info, sizes[i]) < 0) {
+            testPoolFree(&info);
+            ret = -1;
+            continue;
+        }
+
+#define DO_TEST(what)                                                   \
+        snprintf(title, sizeof(title), "%d lookups by " #what           \
+                 " of %d volumes", LOOKUP_COUNT, sizes[i]);             \
+        if (virtTestRun(title, 10, testPoolLookup ## what, &info) < 0)  \
+            ret = -1
+
+        DO_TEST(Name);
+        DO_TEST(Key);
+        DO_TEST(Path);
+
+#undef DO_TEST
+
+        testPoolFree(&info);
+    }
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "threads.h"
+#include "threadpool.h"
+#include "ignore-value.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+#define BURST_JOBS 100000
+
+struct testJobState {
+    virMutex lock;
+    virCond cond;
+    size_t done;
+    bool gateOpen;
+    virCond gate;
+};
+
+enum {
+    TEST_JOB_COUNT,     /* just count the job as done */
+    TEST_JOB_BLOCK,     /* wait for the gate to open first */
+};
+
+static int jobCount = TEST_JOB_COUNT;
+static int jobBlock = TEST_JOB_BLOCK;
+
+static void
+testJobFunc(void *jobdata, void *opaque)
+{
+    struct testJobState *state = opaque;
+    int *action = jobdata;
+
+    virMutexLock(&state->lock);
+    if (*action == TEST_JOB_BLOCK) {
+        while (!state->gateOpen)
+            ignore_value(virCondWait(&state->gate, &state->lock));
+    }
+    state->done++;
+    virCondBroadcast(&state->cond);
+    virMutexUnlock(&state->lock);
+}
+
+static int
+testJobStateInit(struct testJobState *state)
+{
+    memset(state, 0, sizeof(*state));
+    if (virMutexInit(&state->lock) < 0 ||
+        virCondInit(&state->cond) < 0 ||
+        virCondInit(&state->gate) < 0)
+        return -1;
+    return 0;
+}
+
+static void
+testJobStateFree(struct testJobState *state)
+{
+    virMutexDestroy(&state->lock);
+    ignore_value(virCondDestroy(&state->cond));
+    ignore_value(virCondDestroy(&state->gate));
+}
+
+/* Wait for @count jobs to be done, failing after 10 seconds */
+static int
+testJobWait(struct testJobState *state, size_t count)
+{
+    unsigned long long then;
+    int ret = 0;
+
+    if (virTimeMs(&then) < 0)
+        return -1;
+    then += 10 * 1000;
+
+    virMutexLock(&state->lock);
+    while (state->done < count) {
+        if (virCondWaitUntil(&state->cond, &state->lock, then) < 0) {
+            testError("\nonly %zu of %zu jobs done\n", state->done, count);
+            ret = -1;
+            break;
+        }
+    }
+    virMutexUnlock(&state->lock);
+    return ret;
+}
+
+
+/* Every job is run exactly once, whichever worker ends up with it */
+static int
+testPoolAllJobs(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testJobState state;
+    virThreadPoolPtr pool = NULL;
+    int ret = -1;
+    size_t i;
+
+    if (testJobStateInit(&state) < 0)
+        return -1;
+
+    if (!(pool = virThreadPoolNew(2, 8, 0, testJobFunc, &state)))
+        goto cleanup;
+
+    for (i = 0 ; i < 10000 ; i++) {
+        if (virThreadPoolSendJob(pool, 0, &jobCount) < 0)
+            goto cleanup;
+    }
+
+    if (testJobWait(&state, 10000) < 0)
+        goto cleanup;
+
+    virThreadPoolFree(pool);
+    pool = NULL;
+
+    if (state.done != 10000) {
+        testError("\nexpected 10000 jobs done, got %zu\n", state.done);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virThreadPoolFree(pool);
+    testJobStateFree(&state);
+    return ret;
+}
+
+
+/* Priority jobs get through while the normal workers are all
+ * stuck, and normal workers run them when there are no priority
+ * workers at all */
+static int
+testPoolPriority(const void *data)
+{
+    const size_t *prioWorkers = data;
+    struct testJobState state;
+    virThreadPoolPtr pool = NULL;
+    virThreadPoolStats stats;
+    int ret = -1;
+
+    if (testJobStateInit(&state) < 0)
+        return -1;
+
+    if (!(pool = virThreadPoolNew(1, 1, *prioWorkers, testJobFunc, &state)))
+        goto cleanup;
+
+    if (*prioWorkers) {
+        if (virThreadPoolSendJob(pool, 0, &jobBlock) < 0 ||
+            virThreadPoolSendJob(pool, 1, &jobCount) < 0 ||
+            testJobWait(&state, 1) < 0)
+            goto cleanup;
+    } else {
+        if (virThreadPoolSendJob(pool, 1, &jobCount) < 0 ||
+            virThreadPoolSendJob(pool, 1, &jobCount) < 0 ||
+            testJobWait(&state, 2) < 0)
+            goto cleanup;
+    }
+
+    virThreadPoolGetStats(pool, &stats);
+    if (stats.nWorkers != 1 || stats.nPrioWorkers != *prioWorkers) {
+        testError("\nexpected %d+%zu workers, got %zu+%zu\n",
+                  1, *prioWorkers, stats.nWorkers, stats.nPrioWorkers);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexLock(&state.lock);
+    state.gateOpen = true;
+    virCondBroadcast(&state.gate);
+    virMutexUnlock(&state.lock);
+    virThreadPoolFree(pool);
+    testJobStateFree(&state);
+    return ret;
+}
+
+
+/* A pool must be allowed at least one worker */
+static int
+testPoolNoWorkers(const void *data ATTRIBUTE_UNUSED)
+{
+    virThreadPoolPtr pool;
+
+    if ((pool = virThreadPoolNew(0, 0, 0, testJobFunc, NULL))) {
+        virThreadPoolFree(pool);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stats add up, and workers are only started on demand */
+static int
+testPoolStats(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testJobState state;
+    virThreadPoolPtr pool = NULL;
+    virThreadPoolStats stats;
+    unsigned long long waited = 0, ran = 0;
+    int ret = -1;
+    size_t i;
+
+    if (testJobStateInit(&state) < 0)
+        return -1;
+
+    if (!(pool = virThreadPoolNew(0, 4, 0, testJobFunc, &state)))
+        goto cleanup;
+
+    virThreadPoolGetStats(pool, &stats);
+    if (stats.nWorkers != 0 || stats.maxWorkers != 4) {
+        testError("\nexpected 0 of 4 workers, got %zu of %zu\n",
+                  stats.nWorkers, stats.maxWorkers);
+        goto cleanup;
+    }
+
+    /* Keep every worker busy, with some jobs left waiting */
+    for (i = 0 ; i < 6 ; i++) {
+        if (virThreadPoolSendJob(pool, 0, &jobBlock) < 0)
+            goto cleanup;
+    }
+
+    virThreadPoolGetStats(pool, &stats);
+    if (stats.nWorkers == 0 || stats.nWorkers > 4 || stats.jobsDone != 0) {
+        testError("\nexpected up to 4 workers and no jobs done, got %zu %llu\n",
+                  stats.nWorkers, stats.jobsDone);
+        goto cleanup;
+    }
+
+    virMutexLock(&state.lock);
+    state.gateOpen = true;
+    virCondBroadcast(&state.gate);
+    virMutexUnlock(&state.lock);
+
+    if (testJobWait(&state, 6) < 0)
+        goto cleanup;
+
+    /* The last job is counted just after it signals completion */
+    for (i = 0 ; i < 1000 ; i++) {
+        virThreadPoolGetStats(pool, &stats);
+        if (stats.jobsDone == 6)
+            break;
+        usleep(1000);
+    }
+
+    for (i = 0 ; i < VIR_THREAD_POOL_HIST_BUCKETS ; i++) {
+        waited += stats.waitTime[i];
+        ran += stats.runTime[i];
+    }
+    if (stats.jobsDone != 6 || waited != 6 || ran != 6 ||
+        stats.jobQueueDepth != 0) {
+        testError("\nexpected 6 jobs done, got %llu %llu %llu, %zu queued\n",
+                  stats.jobsDone, waited, ran, stats.jobQueueDepth);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexLock(&state.lock);
+    state.gateOpen = true;
+    virCondBroadcast(&state.gate);
+    virMutexUnlock(&state.lock);
+    virThreadPoolFree(pool);
+    testJobStateFree(&state);
+    return ret;
+}
+
+
+/* A burst of small jobs from one submitter, as the event loop
+ * does when lots of RPC calls arrive */
+static int
+testPoolBurst(const void *data)
+{
+    const size_t *workers = data;
+    struct testJobState state;
+    virThreadPoolPtr pool = NULL;
+    int ret = -1;
+    size_t i;
+
+    if (testJobStateInit(&state) < 0)
+        return -1;
+
+    if (!(pool = virThreadPoolNew(*workers, *workers, 0,
+                                  testJobFunc, &state)))
+        goto cleanup;
+
+    for (i = 0 ; i < BURST_JOBS ; i++) {
+        if (virThreadPoolSendJob(pool, 0, &jobCount) < 0)
+            goto cleanup;
+    }
+
+    if (testJobWait(&state, BURST_JOBS) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virThreadPoolFree(pool);
+    testJobStateFree(&state);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    static const size_t prioWorkers[] = { 0, 1 };
+    static const size_t workers[] = { 1, 5, 20 };
+    int ret = 0;
+    size_t i;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    if (virtTestRun("All jobs run", 1, testPoolAllJobs, NULL) < 0)
+        ret = -1;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(prioWorkers) ; i++) {
+        char title[100];
+        snprintf(title, sizeof(title), "Priority jobs with %zu priority workers",
+                 prioWorkers[i]);
+        if (virtTestRun(title, 1, testPoolPriority, &prioWorkers[i]) < 0)
+            ret = -1;
+    }
+
+    if (virtTestRun("Pool stats", 1, testPoolStats, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("No workers", 1, testPoolNoWorkers, NULL) < 0)
+        ret = -1;
+
+    /* Throughput is reported with --verbose */
+    for (i = 0 ; i < ARRAY_CARDINALITY(workers) ; i++) {
+        char title[100];
+        snprintf(title, sizeof(title), "%d jobs with %zu workers",
+                 BURST_JOBS, workers[i]);
+        if (virtTestRun(title, 5, testPoolBurst, &workers[i]) < 0)
+            ret = -1;
+    }
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
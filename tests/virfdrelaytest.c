@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "virfile.h"
+#include "threads.h"
+#include "virfdrelay.h"
+#include "ignore-value.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+#define CHUNK 4096
+
+/* Bytes moved by the throughput test, unless VIR_FD_RELAY_BENCH_BYTES
+ * in the environment says otherwise */
+#define TEST_BENCH_BYTES (8 * 1024 * 1024)
+
+/* One side of a pty pair, as the container or console client
+ * would see it, and the master the relay works on */
+struct testPty {
+    int master;
+    int slave;
+};
+
+/* Copies @bytes of a known pattern into one slave, and checks
+ * they come out of the other one */
+struct testStream {
+    int in;
+    int out;
+    size_t bytes;
+    unsigned char seed;
+    int donefd;
+
+    virThread writer;
+    virThread reader;
+    bool hasWriter;
+    bool hasReader;
+    bool failed;
+};
+
+struct testRelayInfo {
+    size_t bytes;
+    size_t bufsize;
+    bool both;
+};
+
+
+static unsigned char
+testPattern(unsigned char seed, size_t offset)
+{
+    return (offset % 251) ^ seed;
+}
+
+static void
+testStreamWrite(void *opaque)
+{
+    struct testStream *s = opaque;
+    char buf[CHUNK];
+    size_t done = 0;
+
+    while (done < s->bytes) {
+        size_t want = MIN(sizeof(buf), s->bytes - done);
+        size_t i;
+
+        for (i = 0 ; i < want ; i++)
+            buf[i] = testPattern(s->seed, done + i);
+        if (safewrite(s->in, buf, want) != want) {
+            s->failed = true;
+            return;
+        }
+        done += want;
+    }
+}
+
+static void
+testStreamRead(void *opaque)
+{
+    struct testStream *s = opaque;
+    char buf[CHUNK];
+    size_t done = 0;
+    char c = 0;
+
+    while (done < s->bytes) {
+        ssize_t got = read(s->out, buf, MIN(sizeof(buf), s->bytes - done));
+        ssize_t i;
+
+        if (got <= 0) {
+            s->failed = true;
+            break;
+        }
+        for (i = 0 ; i < got ; i++) {
+            if ((unsigned char)buf[i] != testPattern(s->seed, done + i)) {
+                s->failed = true;
+                goto done;
+            }
+        }
+        done += got;
+    }
+
+done:
+    ignore_value(safewrite(s->donefd, &c, 1));
+}
+
+
+static int
+testPtyOpen(struct testPty *pty)
+{
+    char *path = NULL;
+    int ret = -1;
+
+    pty->master = pty->slave = -1;
+    if (virFileOpenTty(&pty->master, &path, 1) < 0)
+        goto cleanup;
+    if ((pty->slave = open(path, O_RDWR | O_NOCTTY)) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(path);
+    return ret;
+}
+
+static void
+testPtyClose(struct testPty *pty)
+{
+    VIR_FORCE_CLOSE(pty->master);
+    VIR_FORCE_CLOSE(pty->slave);
+}
+
+static int
+testPollEvents(int events)
+{
+    int ret = 0;
+
+    if (events & VIR_EVENT_HANDLE_READABLE)
+        ret |= POLLIN;
+    if (events & VIR_EVENT_HANDLE_WRITABLE)
+        ret |= POLLOUT;
+    return ret;
+}
+
+static int
+testVirEvents(int revents)
+{
+    int ret = 0;
+
+    if (revents & POLLIN)
+        ret |= VIR_EVENT_HANDLE_READABLE;
+    if (revents & POLLOUT)
+        ret |= VIR_EVENT_HANDLE_WRITABLE;
+    if (revents & POLLHUP)
+        ret |= VIR_EVENT_HANDLE_HANGUP;
+    return ret;
+}
+
+/*
+ * Relay between two ptys the way the LXC controller relays between
+ * the console and the container, with data flowing from the
+ * container out, and optionally back in at the same time
+ */
+static int
+testRelay(const void *data)
+{
+    const struct testRelayInfo *info = data;
+    struct testPty cont, app;
+    struct testStream streams[2];
+    size_t nstreams = info->both ? 2 : 1;
+    virFDRelayPtr relay = NULL;
+    int donefds[2] = { -1, -1 };
+    size_t ndone = 0;
+    int pending = 0;
+    int ret = -1;
+    size_t i;
+
+    memset(streams, 0, sizeof(streams));
+    if (testPtyOpen(&cont) < 0 || testPtyOpen(&app) < 0 ||
+        pipe(donefds) < 0) {
+        testError("\ncannot open ptys\n");
+        goto cleanup;
+    }
+
+    if (!(relay = virFDRelayNew(cont.master, app.master, info->bufsize)))
+        goto cleanup;
+
+    streams[0].in = cont.slave;
+    streams[0].out = app.slave;
+    streams[0].seed = 0x5a;
+    streams[1].in = app.slave;
+    streams[1].out = cont.slave;
+    streams[1].seed = 0xa5;
+
+    for (i = 0 ; i < nstreams ; i++) {
+        streams[i].bytes = info->bytes;
+        streams[i].donefd = donefds[1];
+        if (virThreadCreate(&streams[i].reader, true,
+                            testStreamRead, &streams[i]) < 0)
+            goto cleanup;
+        streams[i].hasReader = true;
+        if (virThreadCreate(&streams[i].writer, true,
+                            testStreamWrite, &streams[i]) < 0)
+            goto cleanup;
+        streams[i].hasWriter = true;
+    }
+
+    while (ndone < nstreams) {
+        struct pollfd fds[3];
+        char c;
+
+        fds[0].fd = cont.master;
+        fds[0].events = testPollEvents(virFDRelayGetEvents(relay,
+                                                           cont.master));
+        fds[1].fd = app.master;
+        fds[1].events = testPollEvents(virFDRelayGetEvents(relay,
+                                                           app.master));
+        fds[2].fd = donefds[0];
+        fds[2].events = POLLIN;
+
+        if (poll(fds, ARRAY_CARDINALITY(fds), pending ? 0 : 10 * 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            goto cleanup;
+        }
+
+        if (!pending && !fds[0].revents && !fds[1].revents &&
+            !fds[2].revents) {
+            testError("\nrelay stalled\n");
+            goto cleanup;
+        }
+
+        for (i = 0 ; i < 2 ; i++) {
+            if (fds[i].revents)
+                virFDRelayNotify(relay, fds[i].fd,
+                                 testVirEvents(fds[i].revents));
+        }
+        if (fds[2].revents & POLLIN) {
+            if (saferead(donefds[0], &c, 1) != 1)
+                goto cleanup;
+            ndone++;
+        }
+
+        if ((pending = virFDRelayRun(relay)) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    /* Closing the ptys unblocks any thread still waiting on them */
+    testPtyClose(&cont);
+    testPtyClose(&app);
+    for (i = 0 ; i < nstreams ; i++) {
+        if (streams[i].hasWriter)
+            virThreadJoin(&streams[i].writer);
+        if (streams[i].hasReader)
+            virThreadJoin(&streams[i].reader);
+        if (streams[i].failed) {
+            testError("\nstream %zu was corrupted\n", i);
+            ret = -1;
+        }
+    }
+    VIR_FORCE_CLOSE(donefds[0]);
+    VIR_FORCE_CLOSE(donefds[1]);
+    virFDRelayFree(relay);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    struct testRelayInfo bench = {
+        TEST_BENCH_BYTES, VIR_FD_RELAY_DEFAULT_BUFSIZE, false
+    };
+    unsigned long benchBytes;
+    const char *env;
+    char name[100];
+    int ret = 0;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    if ((env = getenv("VIR_FD_RELAY_BENCH_BYTES"))) {
+        if (virStrToLong_ul(env, NULL, 10, &benchBytes) < 0 ||
+            benchBytes == 0) {
+            fprintf(stderr, "Invalid VIR_FD_RELAY_BENCH_BYTES '%s'\n", env);
+            return EXIT_FAILURE;
+        }
+        bench.bytes = benchBytes;
+    }
+
+#define DO_TEST(name, bytes, bufsize, both)                             \
+    do {                                                                \
+        static const struct testRelayInfo info = {                     \
+            bytes, bufsize, both                                        \
+        };                                                              \
+        if (virtTestRun(name, 1, testRelay, &info) < 0)                 \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("Relay both ways", 4 * 1024 * 1024,
+            VIR_FD_RELAY_DEFAULT_BUFSIZE, true);
+    DO_TEST("Relay both ways with tiny buffers", 64 * 1024, 7, true);
+
+    /* Throughput is reported with --verbose. A one byte buffer
+     * moves data the way the controller used to */
+    DO_TEST("Relay 256 KiB byte by byte", 256 * 1024, 1, false);
+    snprintf(name, sizeof(name), "Relay %zu bytes", bench.bytes);
+    if (virtTestRun(name, 1, testRelay, &bench) < 0)
+        ret = -1;
+
+#undef DO_TEST
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
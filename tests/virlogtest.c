@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "virfile.h"
+#include "threads.h"
+#include "logging.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+#define WRITER_THREADS 8
+#define WRITER_MESSAGES 1000
+#define BENCH_MESSAGES 100000
+
+struct testWriter {
+    virThread thread;
+    int id;
+};
+
+/* Every call goes through the same call site, and so the same
+ * cached decision */
+static void
+testLogInfo(int n)
+{
+    VIR_INFO("site test %d", n);
+}
+
+static int
+testLogged(int n, bool expected)
+{
+    char *log = virtTestLogContentAndReset();
+    char match[32];
+    bool found;
+
+    if (!log)
+        return -1;
+
+    snprintf(match, sizeof(match), "site test %d\n", n);
+    found = strstr(log, match) != NULL;
+    VIR_FREE(log);
+
+    if (found != expected) {
+        testError("\nmessage %d %s\n", n,
+                  expected ? "not logged" : "logged anyway");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Call sites notice when priorities or filters change */
+static int
+testLogSiteChanges(const void *data ATTRIBUTE_UNUSED)
+{
+    char *log = virtTestLogContentAndReset();
+
+    VIR_FREE(log);
+
+    if (virLogSetBufferPriority(VIR_LOG_ERROR) < 0 ||
+        virLogSetDefaultPriority(VIR_LOG_WARN) < 0)
+        return -1;
+
+    testLogInfo(1);
+    if (testLogged(1, false) < 0)
+        return -1;
+
+    if (virLogSetDefaultPriority(VIR_LOG_INFO) < 0)
+        return -1;
+    testLogInfo(2);
+    if (testLogged(2, true) < 0)
+        return -1;
+
+    if (virLogDefineFilter("virlogtest", VIR_LOG_ERROR, 0) < 0)
+        return -1;
+    testLogInfo(3);
+    if (testLogged(3, false) < 0)
+        return -1;
+
+    /* Redefining a filter counts as a change too */
+    if (virLogDefineFilter("virlogtest", VIR_LOG_INFO, 0) < 0)
+        return -1;
+    testLogInfo(4);
+    if (testLogged(4, true) < 0)
+        return -1;
+
+    if (virLogDefineFilter("virlogtest", VIR_LOG_WARN, 0) < 0)
+        return -1;
+    testLogInfo(5);
+    if (testLogged(5, false) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+static void
+testLogWriter(void *opaque)
+{
+    struct testWriter *writer = opaque;
+    int i;
+
+    for (i = 0 ; i < WRITER_MESSAGES ; i++)
+        VIR_INFO("ring writer %d message %d", writer->id, i);
+}
+
+/*
+ * Several threads log to the debug buffer at once, with none of
+ * their messages going to any output. The buffer is big enough for
+ * all of them, so once dumped it must hold every message whole, and
+ * each thread's in order.
+ */
+static int
+testLogBufferWriters(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testWriter writers[WRITER_THREADS];
+    int last[WRITER_THREADS];
+    char path[] = "/tmp/virlogtest.XXXXXX";
+    char *outputs = NULL;
+    char *dump = NULL;
+    char *line, *next;
+    int fd;
+    int ret = -1;
+    int i;
+
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    VIR_FORCE_CLOSE(fd);
+
+    /* The dump goes to file outputs, which only want errors here */
+    if (virAsprintf(&outputs, "4:file:%s", path) < 0 ||
+        virLogParseOutputs(outputs) < 0 ||
+        virLogSetBufferSize(1024) < 0 ||
+        virLogSetBufferPriority(VIR_LOG_INFO) < 0 ||
+        virLogSetDefaultPriority(VIR_LOG_WARN) < 0 ||
+        virLogDefineFilter("virlogtest", VIR_LOG_WARN, 0) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < WRITER_THREADS ; i++) {
+        writers[i].id = i;
+        last[i] = -1;
+        if (virThreadCreate(&writers[i].thread, true,
+                            testLogWriter, &writers[i]) < 0) {
+            while (--i >= 0)
+                virThreadJoin(&writers[i].thread);
+            goto cleanup;
+        }
+    }
+    for (i = 0 ; i < WRITER_THREADS ; i++)
+        virThreadJoin(&writers[i].thread);
+
+    virLogEmergencyDumpAll(SIGUSR2);
+
+    if (virFileReadAll(path, 10 * 1024 * 1024, &dump) < 0)
+        goto cleanup;
+
+    if (!(line = strstr(dump, "====== start of log =====\n\n"))) {
+        testError("\nno dump of the buffer found\n");
+        goto cleanup;
+    }
+
+    line += strlen("====== start of log =====\n\n");
+
+    for ( ; (next = strchr(line, '\n')) ; line = next + 1) {
+        const char *msg;
+        int id, n;
+
+        *next = '\0';
+        if (*line == '\0')
+            break;
+
+        if (!(msg = strstr(line, " : ring writer ")) ||
+            sscanf(msg, " : ring writer %d message %d", &id, &n) != 2 ||
+            id < 0 || id >= WRITER_THREADS) {
+            testError("\nmangled message '%s'\n", line);
+            goto cleanup;
+        }
+        if (n != last[id] + 1) {
+            testError("\nmessage %d of writer %d after %d\n", n, id, last[id]);
+            goto cleanup;
+        }
+        last[id] = n;
+    }
+
+    for (i = 0 ; i < WRITER_THREADS ; i++) {
+        if (last[i] != WRITER_MESSAGES - 1) {
+            testError("\nlast message of writer %d is %d\n", i, last[i]);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    unlink(path);
+    VIR_FREE(outputs);
+    VIR_FREE(dump);
+    return ret;
+}
+
+
+static int
+testLogBench(const void *data ATTRIBUTE_UNUSED)
+{
+    int i;
+
+    for (i = 0 ; i < BENCH_MESSAGES ; i++)
+        VIR_INFO("benchmark message %d", i);
+
+    return 0;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virtTestRun("Call sites follow filter changes", 1,
+                    testLogSiteChanges, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("Concurrent writers to the debug buffer", 1,
+                    testLogBufferWriters, NULL) < 0)
+        ret = -1;
+
+    /* Timings are reported with --verbose. Messages which are kept
+     * in the debug buffer have to be formatted, the others should
+     * cost next to nothing */
+    if (virLogDefineFilter("virlogtest", VIR_LOG_WARN, 0) < 0 ||
+        virLogSetBufferPriority(VIR_LOG_INFO) < 0 ||
+        virtTestRun("100000 messages kept in the debug buffer", 5,
+                    testLogBench, NULL) < 0)
+        ret = -1;
+
+    if (virLogSetBufferPriority(VIR_LOG_WARN) < 0 ||
+        virtTestRun("100000 messages not wanted at all", 5,
+                    testLogBench, NULL) < 0)
+        ret = -1;
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
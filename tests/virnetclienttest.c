@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "testutils.h"
+#include "util.h"
+#include "virterror_internal.h"
+#include "memory.h"
+#include "logging.h"
+#include "threads.h"
+#include "ignore-value.h"
+
+#include "rpc/virnetclient.h"
+#include "rpc/virnetclientstream.h"
+#include "rpc/virnetsocket.h"
+
+#define VIR_FROM_THIS VIR_FROM_RPC
+
+#ifndef WIN32
+
+# define TEST_PROGRAM 0x20110707
+# define TEST_VERSION 1
+# define TEST_PROC_INCREMENT 1
+# define TEST_PROC_QUIT 2
+# define TEST_PROC_STREAM 3
+
+/* Calls made by the benchmark, unless VIR_NET_CLIENT_BENCH_CALLS
+ * in the environment says otherwise */
+# define TEST_CALLS 10000
+
+/* Threads sharing the connection in the concurrent benchmark */
+# define TEST_THREADS 64
+
+
+static int testServerReadFull(virNetSocketPtr sock, virNetMessagePtr msg)
+{
+    while (msg->bufferOffset < msg->bufferLength) {
+        ssize_t ret = virNetSocketRead(sock,
+                                       msg->buffer + msg->bufferOffset,
+                                       msg->bufferLength - msg->bufferOffset);
+        if (ret <= 0)
+            return -1;
+        msg->bufferOffset += ret;
+    }
+    return 0;
+}
+
+static int testServerWriteFull(virNetSocketPtr sock, virNetMessagePtr msg)
+{
+    while (msg->bufferOffset < msg->bufferLength) {
+        ssize_t ret = virNetSocketWrite(sock,
+                                        msg->buffer + msg->bufferOffset,
+                                        msg->bufferLength - msg->bufferOffset);
+        if (ret <= 0)
+            return -1;
+        msg->bufferOffset += ret;
+    }
+    return 0;
+}
+
+/* Most calls the server reads before it replies to them */
+# define TEST_SERVER_BATCH 64
+
+static bool testServerReadable(virNetSocketPtr sock)
+{
+    struct pollfd fd = { .fd = virNetSocketGetFD(sock), .events = POLLIN };
+
+    return poll(&fd, 1, 0) == 1 && (fd.revents & POLLIN);
+}
+
+static int testServerReadCall(virNetSocketPtr sock, virNetMessagePtr msg,
+                              unsigned int *val)
+{
+    virNetMessageClear(msg);
+    msg->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
+    if (virNetMessageGrowBuffer(msg, msg->bufferLength) < 0 ||
+        testServerReadFull(sock, msg) < 0 ||
+        virNetMessageDecodeLength(msg) < 0 ||
+        virNetMessageGrowBuffer(msg, msg->bufferLength) < 0 ||
+        testServerReadFull(sock, msg) < 0 ||
+        virNetMessageDecodeHeader(msg) < 0 ||
+        virNetMessageDecodePayload(msg, (xdrproc_t)xdr_u_int, val) < 0)
+        return -1;
+    return 0;
+}
+
+static int testServerReply(virNetSocketPtr sock, virNetMessagePtr msg,
+                           unsigned int val)
+{
+    virNetMessageHeader header = msg->header;
+
+    virNetMessageClear(msg);
+    msg->header = header;
+    msg->header.type = VIR_NET_REPLY;
+    msg->header.status = VIR_NET_OK;
+
+    if (virNetMessageEncodeHeader(msg) < 0 ||
+        virNetMessageEncodePayload(msg, (xdrproc_t)xdr_u_int, &val) < 0)
+        return -1;
+    msg->bufferOffset = 0;
+
+    return testServerWriteFull(sock, msg);
+}
+
+/*
+ * A server which replies to every call with its argument plus
+ * one, until told to quit or the client goes away. It reads all
+ * the calls already sent before replying to any of them, and then
+ * replies to the last one first, so that replies come back out of
+ * order whenever the client has several calls in flight. It owns
+ * the socket, so if it gives up the client sees EOF rather than
+ * waiting forever.
+ */
+static void testServer(void *opaque)
+{
+    virNetSocketPtr sock = opaque;
+    virNetMessagePtr msgs[TEST_SERVER_BATCH];
+    unsigned int vals[TEST_SERVER_BATCH];
+    bool quit = false;
+    size_t i;
+
+    for (i = 0 ; i < TEST_SERVER_BATCH ; i++) {
+        if (!(msgs[i] = virNetMessageNew(false))) {
+            while (i-- > 0)
+                virNetMessageFree(msgs[i]);
+            virNetSocketFree(sock);
+            return;
+        }
+    }
+
+    while (!quit) {
+        size_t n = 0;
+
+        do {
+            if (testServerReadCall(sock, msgs[n], &vals[n]) < 0)
+                goto cleanup;
+            if (msgs[n]->header.proc == TEST_PROC_QUIT)
+                quit = true;
+            n++;
+        } while (!quit && n < TEST_SERVER_BATCH &&
+                 testServerReadable(sock));
+
+        while (n-- > 0) {
+            if (testServerReply(sock, msgs[n], vals[n] + 1) < 0)
+                goto cleanup;
+        }
+    }
+
+cleanup:
+    for (i = 0 ; i < TEST_SERVER_BATCH ; i++)
+        virNetMessageFree(msgs[i]);
+    virNetSocketFree(sock);
+}
+
+
+struct testCallsWorker {
+    virNetClientPtr client;
+    virNetClientProgramPtr prog;
+    unsigned int first;
+    unsigned int ncalls;
+    int ret;
+};
+
+static void testClientCallsWorker(void *opaque)
+{
+    struct testCallsWorker *worker = opaque;
+    unsigned int i;
+
+    for (i = worker->first ; i < worker->first + worker->ncalls ; i++) {
+        unsigned int reply = 0;
+
+        if (virNetClientProgramCall(worker->prog, worker->client,
+                                    i, TEST_PROC_INCREMENT,
+                                    (xdrproc_t)xdr_u_int, &i,
+                                    (xdrproc_t)xdr_u_int, &reply) < 0)
+            return;
+
+        if (reply != i + 1) {
+            VIR_DEBUG("Expected reply %u to call %u, got %u", i + 1, i, reply);
+            return;
+        }
+    }
+
+    worker->ret = 0;
+}
+
+
+/*
+ * Many small calls, which is what scripts driving virsh, or agents
+ * polling the daemon, mostly make: the cost of each is all in the
+ * RPC layer rather than the payload. They are made one after the
+ * other, or by many threads sharing the connection like a
+ * management app polling the info of all its guests does, each
+ * thread making its share of the calls
+ */
+static int testClientCalls(const void *data)
+{
+    const unsigned int nthreads = *(const unsigned int *)data;
+    virNetSocketPtr lsock = NULL; /* Listen socket */
+    virNetSocketPtr ssock = NULL; /* Server socket */
+    virNetClientPtr client = NULL;
+    virNetClientProgramPtr prog = NULL;
+    virThread server;
+    bool haveServer = false;
+    virThreadPtr threads = NULL;
+    struct testCallsWorker *workers = NULL;
+    unsigned int nworkers = 0;
+    unsigned int ncalls = TEST_CALLS;
+    unsigned long long start, end;
+    const char *env;
+    unsigned int i;
+    int ret = -1;
+
+    char *path;
+    if (progname[0] == '/') {
+        if (virAsprintf(&path, "%s-test.sock", progname) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    } else {
+        if (virAsprintf(&path, "%s/%s-test.sock", abs_builddir, progname) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    if ((env = getenv("VIR_NET_CLIENT_BENCH_CALLS")) &&
+        virStrToLong_ui(env, NULL, 10, &ncalls) < 0) {
+        VIR_DEBUG("Invalid VIR_NET_CLIENT_BENCH_CALLS '%s'", env);
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(threads, nthreads) < 0 ||
+        VIR_ALLOC_N(workers, nthreads) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (virNetSocketNewListenUNIX(path, 0700, -1, getgid(), &lsock) < 0)
+        goto cleanup;
+
+    if (virNetSocketListen(lsock, 0) < 0)
+        goto cleanup;
+
+    if (!(client = virNetClientNewUNIX(path, false, NULL)))
+        goto cleanup;
+
+    if (virNetSocketAccept(lsock, &ssock) < 0 || !ssock) {
+        VIR_DEBUG("Unexpected client socket missing");
+        goto cleanup;
+    }
+
+    if (virNetSocketSetBlocking(ssock, true) < 0)
+        goto cleanup;
+
+    if (!(prog = virNetClientProgramNew(TEST_PROGRAM, TEST_VERSION,
+                                        NULL, 0, NULL)) ||
+        virNetClientAddProgram(client, prog) < 0)
+        goto cleanup;
+
+    if (virThreadCreate(&server, true, testServer, ssock) < 0)
+        goto cleanup;
+    ssock = NULL;
+    haveServer = true;
+
+    if (virTimeMs(&start) < 0)
+        goto cleanup;
+
+    for (nworkers = 0 ; nworkers < nthreads ; nworkers++) {
+        struct testCallsWorker *worker = &workers[nworkers];
+
+        worker->client = client;
+        worker->prog = prog;
+        worker->first = ncalls / nthreads * nworkers;
+        worker->ncalls = ncalls / nthreads;
+        if (nworkers == nthreads - 1)
+            worker->ncalls = ncalls - worker->first;
+        worker->ret = -1;
+
+        if (virThreadCreate(&threads[nworkers], true,
+                            testClientCallsWorker, worker) < 0)
+            goto cleanup;
+    }
+
+    for (i = 0 ; i < nworkers ; i++)
+        virThreadJoin(&threads[i]);
+    nworkers = 0;
+
+    if (virTimeMs(&end) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < nthreads ; i++) {
+        if (workers[i].ret < 0)
+            goto cleanup;
+    }
+
+    if (virTestGetVerbose())
+        fprintf(stderr, "\n%u calls by %u threads in %llu ms, %llu calls/s ... ",
+                ncalls, nthreads, end - start,
+                end > start ? ncalls * 1000ULL / (end - start) : 0);
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < nworkers ; i++)
+        virThreadJoin(&threads[i]);
+    /* The client only lets go of its socket from the event loop,
+     * which nothing runs here, so the server would not see it hang
+     * up: ask it to stop instead */
+    if (haveServer) {
+        unsigned int dummy = 0;
+        ignore_value(virNetClientProgramCall(prog, client, ncalls,
+                                             TEST_PROC_QUIT,
+                                             (xdrproc_t)xdr_u_int, &dummy,
+                                             (xdrproc_t)xdr_u_int, &dummy));
+        virThreadJoin(&server);
+    }
+    virNetClientClose(client);
+    virNetClientProgramFree(prog);
+    virNetClientFree(client);
+    virNetSocketFree(ssock);
+    virNetSocketFree(lsock);
+    VIR_FREE(workers);
+    VIR_FREE(threads);
+    VIR_FREE(path);
+    return ret;
+}
+
+
+/*
+ * Packets received for a stream are queued with the buffers they
+ * were read into, and the stream is full from the high mark until
+ * it has been read down to the low mark
+ */
+# define TEST_PACKET_LEN 1000
+# define TEST_PACKETS 5
+
+static int testClientStreamQueue(const void *data ATTRIBUTE_UNUSED)
+{
+    virNetSocketPtr lsock = NULL; /* Listen socket */
+    virNetSocketPtr ssock = NULL; /* Server socket */
+    virNetClientPtr client = NULL;
+    virNetClientProgramPtr prog = NULL;
+    virNetClientStreamPtr st = NULL;
+    virNetMessagePtr msg = NULL;
+    char buf[TEST_PACKET_LEN * TEST_PACKETS];
+    char got[sizeof(buf)];
+    size_t i;
+    int ret = -1;
+
+    char *path;
+    if (progname[0] == '/') {
+        if (virAsprintf(&path, "%s-test.sock", progname) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    } else {
+        if (virAsprintf(&path, "%s/%s-test.sock", abs_builddir, progname) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    for (i = 0 ; i < sizeof(buf) ; i++)
+        buf[i] = i % 251;
+
+    if (virNetSocketNewListenUNIX(path, 0700, -1, getgid(), &lsock) < 0)
+        goto cleanup;
+
+    if (virNetSocketListen(lsock, 0) < 0)
+        goto cleanup;
+
+    if (!(client = virNetClientNewUNIX(path, false, NULL)))
+        goto cleanup;
+
+    if (virNetSocketAccept(lsock, &ssock) < 0 || !ssock) {
+        VIR_DEBUG("Unexpected client socket missing");
+        goto cleanup;
+    }
+
+    if (!(prog = virNetClientProgramNew(TEST_PROGRAM, TEST_VERSION,
+                                        NULL, 0, NULL)) ||
+        !(st = virNetClientStreamNew(prog, TEST_PROC_STREAM, 1)))
+        goto cleanup;
+
+    /* Full at the third packet, no longer full at the last one */
+    if (virNetClientSetStreamQueueLimits(client,
+                                         TEST_PACKET_LEN * 3,
+                                         TEST_PACKET_LEN) < 0 ||
+        virNetClientAddStream(client, st) < 0)
+        goto cleanup;
+
+    if (!(msg = virNetMessageNew(false)))
+        goto cleanup;
+
+    for (i = 0 ; i < TEST_PACKETS ; i++) {
+        msg->header.prog = TEST_PROGRAM;
+        msg->header.vers = TEST_VERSION;
+        msg->header.proc = TEST_PROC_STREAM;
+        msg->header.type = VIR_NET_STREAM;
+        msg->header.serial = 1;
+        msg->header.status = VIR_NET_CONTINUE;
+
+        if (virNetMessageEncodeHeader(msg) < 0 ||
+            virNetMessageEncodePayloadRaw(msg, buf + i * TEST_PACKET_LEN,
+                                          TEST_PACKET_LEN) < 0 ||
+            virNetMessageDecodeHeader(msg) < 0)
+            goto cleanup;
+
+        if (virNetClientStreamQueuePacket(st, msg) < 0)
+            goto cleanup;
+
+        if (msg->buffer) {
+            VIR_DEBUG("Packet %zu was copied rather than handed over", i);
+            goto cleanup;
+        }
+
+        if (virNetClientStreamIsFull(st) != (i >= 2)) {
+            VIR_DEBUG("Expected stream %sfull after packet %zu",
+                      i >= 2 ? "" : "not ", i);
+            goto cleanup;
+        }
+    }
+
+    /* Reads straddling packets, down to the low mark and beyond */
+    for (i = 0 ; i < sizeof(got) ; ) {
+        size_t want = TEST_PACKET_LEN * 3 / 2;
+        size_t left;
+        int rv;
+
+        if ((rv = virNetClientStreamRecvPacket(st, client, got + i,
+                                               want, true)) < 0)
+            goto cleanup;
+        if (rv != MIN(want, sizeof(got) - i)) {
+            VIR_DEBUG("Expected %zu bytes, got %d",
+                      MIN(want, sizeof(got) - i), rv);
+            goto cleanup;
+        }
+        i += rv;
+
+        left = sizeof(got) - i;
+        if (virNetClientStreamIsFull(st) != (left > TEST_PACKET_LEN)) {
+            VIR_DEBUG("Expected stream %sfull with %zu bytes left",
+                      left > TEST_PACKET_LEN ? "" : "not ", left);
+            goto cleanup;
+        }
+    }
+
+    if (memcmp(buf, got, sizeof(buf)) != 0) {
+        virtTestDifferenceBin(stderr, buf, got, sizeof(buf));
+        goto cleanup;
+    }
+
+    /* Nothing left, and no more to wait for */
+    if (virNetClientStreamRecvPacket(st, client, got, sizeof(got), true) != -2) {
+        VIR_DEBUG("Expected no data to be available");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virNetMessageFree(msg);
+    if (st) {
+        virNetClientRemoveStream(client, st);
+        virNetClientStreamFree(st);
+    }
+    virNetClientProgramFree(prog);
+    virNetClientClose(client);
+    virNetClientFree(client);
+    virNetSocketFree(ssock);
+    virNetSocketFree(lsock);
+    VIR_FREE(path);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    unsigned int sequential = 1;
+    unsigned int concurrent = TEST_THREADS;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (virEventRegisterDefaultImpl() < 0)
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Client small calls", 1, testClientCalls, &sequential) < 0)
+        ret = -1;
+    if (virtTestRun("Client concurrent calls", 1, testClientCalls, &concurrent) < 0)
+        ret = -1;
+    if (virtTestRun("Client stream queue", 1, testClientStreamQueue, NULL) < 0)
+        ret = -1;
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#else
+
+static int
+mymain(void)
+{
+    return EXIT_AM_SKIP;
+}
+
+#endif
+
+VIRT_TEST_MAIN(mymain)
@@ -36,6 +36,7 @@
 static int testMessageHeaderEncode(const void *args ATTRIBUTE_UNUSED)
 {
     static virNetMessage msg;
+    int ret = -1;
     static const char expect[] = {
         0x00, 0x00, 0x00, 0x1c,  /* Length */
         0x11, 0x22, 0x33, 0x44,  /* Program */
@@ -55,43 +56,43 @@ static int testMessageHeaderEncode(const void *args ATTRIBUTE_UNUSED)
     msg.header.status = VIR_NET_OK;
 
     if (virNetMessageEncodeHeader(&msg) < 0)
-        return -1;
+        goto cleanup;
 
     if (ARRAY_CARDINALITY(expect) != msg.bufferOffset) {
         VIR_DEBUG("Expect message offset %zu got %zu",
                   sizeof(expect), msg.bufferOffset);
-        return -1;
+        goto cleanup;
     }
 
-    if (msg.bufferLength != sizeof(msg.buffer)) {
-        VIR_DEBUG("Expect message offset %zu got %zu",
-                  sizeof(msg.buffer), msg.bufferLength);
-        return -1;
+    if (msg.bufferLength != VIR_NET_MESSAGE_INITIAL) {
+        VIR_DEBUG("Expect message length %zu got %zu",
+                  (size_t)VIR_NET_MESSAGE_INITIAL, msg.bufferLength);
+        goto cleanup;
     }
 
     if (memcmp(expect, msg.buffer, sizeof(expect)) != 0) {
         virtTestDifferenceBin(stderr, expect, msg.buffer, sizeof(expect));
-        return -1;
+        goto cleanup;
     }
 
-    return 0;
+    ret = 0;
+cleanup:
+    virNetMessageClear(&msg);
+    return ret;
 }
 
 static int testMessageHeaderDecode(const void *args ATTRIBUTE_UNUSED)
 {
-    static virNetMessage msg = {
-        .bufferOffset = 0,
-        .bufferLength = 0x4,
-        .buffer = {
-            0x00, 0x00, 0x00, 0x1c,  /* Length */
-            0x11, 0x22, 0x33, 0x44,  /* Program */
-            0x00, 0x00, 0x00, 0x01,  /* Version */
-            0x00, 0x00, 0x06, 0x66,  /* Procedure */
-            0x00, 0x00, 0x00, 0x01,  /* Type */
-            0x00, 0x00, 0x00, 0x99,  /* Serial */
-            0x00, 0x00, 0x00, 0x01,  /* Status */
-        },
-        .header = { 0, 0, 0, 0, 0, 0 },
+    static virNetMessage msg;
+    int ret = -1;
+    static const char input[] = {
+        0x00, 0x00, 0x00, 0x1c,  /* Length */
+        0x11, 0x22, 0x33, 0x44,  /* Program */
+        0x00, 0x00, 0x00, 0x01,  /* Version */
+        0x00, 0x00, 0x06, 0x66,  /* Procedure */
+        0x00, 0x00, 0x00, 0x01,  /* Type */
+        0x00, 0x00, 0x00, 0x99,  /* Serial */
+        0x00, 0x00, 0x00, 0x01,  /* Status */
     };
 
     msg.header.prog = 0x11223344;
@@ -101,66 +102,74 @@ static int testMessageHeaderDecode(const void *args ATTRIBUTE_UNUSED)
     msg.header.serial = 0x99;
     msg.header.status = VIR_NET_OK;
 
+    if (virNetMessageGrowBuffer(&msg, sizeof(input)) < 0)
+        goto cleanup;
+    memcpy(msg.buffer, input, sizeof(input));
+    msg.bufferLength = 0x4;
+
     if (virNetMessageDecodeLength(&msg) < 0) {
         VIR_DEBUG("Failed to decode message header");
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferOffset != 0x4) {
         VIR_DEBUG("Expecting offset %zu got %zu",
                   (size_t)4, msg.bufferOffset);
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferLength != 0x1c) {
         VIR_DEBUG("Expecting length %zu got %zu",
                   (size_t)0x1c, msg.bufferLength);
-        return -1;
+        goto cleanup;
     }
 
     if (virNetMessageDecodeHeader(&msg) < 0) {
         VIR_DEBUG("Failed to decode message header");
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferOffset != msg.bufferLength) {
         VIR_DEBUG("Expect message offset %zu got %zu",
                   msg.bufferOffset, msg.bufferLength);
-        return -1;
+        goto cleanup;
     }
 
     if (msg.header.prog != 0x11223344) {
         VIR_DEBUG("Expect prog %d got %d",
                   0x11223344, msg.header.prog);
-        return -1;
+        goto cleanup;
     }
     if (msg.header.vers != 0x1) {
         VIR_DEBUG("Expect vers %d got %d",
                   0x11223344, msg.header.vers);
-        return -1;
+        goto cleanup;
     }
     if (msg.header.proc != 0x666) {
         VIR_DEBUG("Expect proc %d got %d",
                   0x666, msg.header.proc);
-        return -1;
+        goto cleanup;
     }
     if (msg.header.type != VIR_NET_REPLY) {
         VIR_DEBUG("Expect type %d got %d",
                   VIR_NET_REPLY, msg.header.type);
-        return -1;
+        goto cleanup;
     }
     if (msg.header.serial != 0x99) {
         VIR_DEBUG("Expect serial %d got %d",
                   0x99, msg.header.serial);
-        return -1;
+        goto cleanup;
     }
     if (msg.header.status != VIR_NET_ERROR) {
         VIR_DEBUG("Expect status %d got %d",
                   VIR_NET_ERROR, msg.header.status);
-        return -1;
+        goto cleanup;
     }
 
-    return 0;
+    ret = 0;
+cleanup:
+    virNetMessageClear(&msg);
+    return ret;
 }
 
 static int testMessagePayloadEncode(const void *args ATTRIBUTE_UNUSED)
@@ -267,166 +276,173 @@ cleanup:
     VIR_FREE(err.str1);
     VIR_FREE(err.str2);
     VIR_FREE(err.str3);
+    virNetMessageClear(&msg);
     return ret;
 }
 
 static int testMessagePayloadDecode(const void *args ATTRIBUTE_UNUSED)
 {
     virNetMessageError err;
-    static virNetMessage msg = {
-        .bufferOffset = 0,
-        .bufferLength = 0x4,
-        .buffer = {
-            0x00, 0x00, 0x00, 0x74,  /* Length */
-            0x11, 0x22, 0x33, 0x44,  /* Program */
-            0x00, 0x00, 0x00, 0x01,  /* Version */
-            0x00, 0x00, 0x06, 0x66,  /* Procedure */
-            0x00, 0x00, 0x00, 0x02,  /* Type */
-            0x00, 0x00, 0x00, 0x99,  /* Serial */
-            0x00, 0x00, 0x00, 0x01,  /* Status */
-
-            0x00, 0x00, 0x00, 0x01,  /* Error code */
-            0x00, 0x00, 0x00, 0x07,  /* Error domain */
-            0x00, 0x00, 0x00, 0x01,  /* Error message pointer */
-            0x00, 0x00, 0x00, 0x0b,  /* Error message length */
-            'H', 'e', 'l', 'l',  /* Error message string */
-            'o', ' ', 'W', 'o',
-            'r', 'l', 'd', '\0',
-            0x00, 0x00, 0x00, 0x02,  /* Error level */
-            0x00, 0x00, 0x00, 0x00,  /* Error domain pointer */
-            0x00, 0x00, 0x00, 0x01,  /* Error str1 pointer */
-            0x00, 0x00, 0x00, 0x03,  /* Error str1 length */
-            'O', 'n', 'e', '\0',  /* Error str1 message */
-            0x00, 0x00, 0x00, 0x01,  /* Error str2 pointer */
-            0x00, 0x00, 0x00, 0x03,  /* Error str2 length */
-            'T', 'w', 'o', '\0',  /* Error str2 message */
-            0x00, 0x00, 0x00, 0x01,  /* Error str3 pointer */
-            0x00, 0x00, 0x00, 0x05,  /* Error str3 length */
-            'T', 'h', 'r', 'e',  /* Error str3 message */
-            'e', '\0', '\0', '\0',
-            0x00, 0x00, 0x00, 0x01,  /* Error int1 */
-            0x00, 0x00, 0x00, 0x02,  /* Error int2 */
-            0x00, 0x00, 0x00, 0x00,  /* Error network pointer */
-        },
-        .header = { 0, 0, 0, 0, 0, 0 },
+    static virNetMessage msg;
+    int ret = -1;
+    static const char input[] = {
+        0x00, 0x00, 0x00, 0x74,  /* Length */
+        0x11, 0x22, 0x33, 0x44,  /* Program */
+        0x00, 0x00, 0x00, 0x01,  /* Version */
+        0x00, 0x00, 0x06, 0x66,  /* Procedure */
+        0x00, 0x00, 0x00, 0x02,  /* Type */
+        0x00, 0x00, 0x00, 0x99,  /* Serial */
+        0x00, 0x00, 0x00, 0x01,  /* Status */
+
+        0x00, 0x00, 0x00, 0x01,  /* Error code */
+        0x00, 0x00, 0x00, 0x07,  /* Error domain */
+        0x00, 0x00, 0x00, 0x01,  /* Error message pointer */
+        0x00, 0x00, 0x00, 0x0b,  /* Error message length */
+        'H', 'e', 'l', 'l',  /* Error message string */
+        'o', ' ', 'W', 'o',
+        'r', 'l', 'd', '\0',
+        0x00, 0x00, 0x00, 0x02,  /* Error level */
+        0x00, 0x00, 0x00, 0x00,  /* Error domain pointer */
+        0x00, 0x00, 0x00, 0x01,  /* Error str1 pointer */
+        0x00, 0x00, 0x00, 0x03,  /* Error str1 length */
+        'O', 'n', 'e', '\0',  /* Error str1 message */
+        0x00, 0x00, 0x00, 0x01,  /* Error str2 pointer */
+        0x00, 0x00, 0x00, 0x03,  /* Error str2 length */
+        'T', 'w', 'o', '\0',  /* Error str2 message */
+        0x00, 0x00, 0x00, 0x01,  /* Error str3 pointer */
+        0x00, 0x00, 0x00, 0x05,  /* Error str3 length */
+        'T', 'h', 'r', 'e',  /* Error str3 message */
+        'e', '\0', '\0', '\0',
+        0x00, 0x00, 0x00, 0x01,  /* Error int1 */
+        0x00, 0x00, 0x00, 0x02,  /* Error int2 */
+        0x00, 0x00, 0x00, 0x00,  /* Error network pointer */
     };
     memset(&err, 0, sizeof(err));
 
+    if (virNetMessageGrowBuffer(&msg, sizeof(input)) < 0)
+        goto cleanup;
+    memcpy(msg.buffer, input, sizeof(input));
+    msg.bufferLength = 0x4;
+
     if (virNetMessageDecodeLength(&msg) < 0) {
         VIR_DEBUG("Failed to decode message header");
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferOffset != 0x4) {
         VIR_DEBUG("Expecting offset %zu got %zu",
                   (size_t)4, msg.bufferOffset);
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferLength != 0x74) {
         VIR_DEBUG("Expecting length %zu got %zu",
                   (size_t)0x74, msg.bufferLength);
-        return -1;
+        goto cleanup;
     }
 
     if (virNetMessageDecodeHeader(&msg) < 0) {
         VIR_DEBUG("Failed to decode message header");
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferOffset != 28) {
         VIR_DEBUG("Expect message offset %zu got %zu",
                   msg.bufferOffset, (size_t)28);
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferLength != 0x74) {
         VIR_DEBUG("Expecting length %zu got %zu",
                   (size_t)0x1c, msg.bufferLength);
-        return -1;
+        goto cleanup;
     }
 
     if (virNetMessageDecodePayload(&msg, (xdrproc_t)xdr_virNetMessageError, &err) < 0) {
         VIR_DEBUG("Failed to decode message payload");
-        return -1;
+        goto cleanup;
     }
 
     if (err.code != VIR_ERR_INTERNAL_ERROR) {
         VIR_DEBUG("Expect code %d got %d",
                   VIR_ERR_INTERNAL_ERROR, err.code);
-        return -1;
+        goto cleanup;
     }
 
     if (err.domain != VIR_FROM_RPC) {
         VIR_DEBUG("Expect domain %d got %d",
                   VIR_ERR_RPC, err.domain);
-        return -1;
+        goto cleanup;
     }
 
     if (err.message == NULL ||
         STRNEQ(*err.message, "Hello World")) {
         VIR_DEBUG("Expect str1 'Hello World' got %s",
                   err.message ? *err.message : "(null)");
-        return -1;
+        goto cleanup;
     }
 
     if (err.dom != NULL) {
         VIR_DEBUG("Expect NULL dom");
-        return -1;
+        goto cleanup;
     }
 
     if (err.level != VIR_ERR_ERROR) {
         VIR_DEBUG("Expect leve %d got %d",
                   VIR_ERR_ERROR, err.level);
-        return -1;
+        goto cleanup;
     }
 
     if (err.str1 == NULL ||
         STRNEQ(*err.str1, "One")) {
         VIR_DEBUG("Expect str1 'One' got %s",
                   err.str1 ? *err.str1 : "(null)");
-        return -1;
+        goto cleanup;
     }
 
     if (err.str2 == NULL ||
         STRNEQ(*err.str2, "Two")) {
         VIR_DEBUG("Expect str3 'Two' got %s",
                   err.str2 ? *err.str2 : "(null)");
-        return -1;
+        goto cleanup;
     }
 
     if (err.str3 == NULL ||
         STRNEQ(*err.str3, "Three")) {
         VIR_DEBUG("Expect str3 'Three' got %s",
                   err.str3 ? *err.str3 : "(null)");
-        return -1;
+        goto cleanup;
     }
 
     if (err.int1 != 1) {
         VIR_DEBUG("Expect int1 1 got %d",
                   err.int1);
-        return -1;
+        goto cleanup;
     }
 
     if (err.int2 != 2) {
         VIR_DEBUG("Expect int2 2 got %d",
                   err.int2);
-        return -1;
+        goto cleanup;
     }
 
     if (err.net != NULL) {
         VIR_DEBUG("Expect NULL network");
-        return -1;
+        goto cleanup;
     }
 
+    ret = 0;
+cleanup:
     xdr_free((xdrproc_t)xdr_virNetMessageError, (void*)&err);
-    return 0;
+    virNetMessageClear(&msg);
+    return ret;
 }
 
 static int testMessagePayloadStreamEncode(const void *args ATTRIBUTE_UNUSED)
 {
     char stream[] = "The quick brown fox jumps over the lazy dog";
     static virNetMessage msg;
+    int ret = -1;
     static const char expect[] = {
         0x00, 0x00, 0x00, 0x47,  /* Length */
         0x11, 0x22, 0x33, 0x44,  /* Program */
@@ -458,29 +474,195 @@ static int testMessagePayloadStreamEncode(const void *args ATTRIBUTE_UNUSED)
     msg.header.status = VIR_NET_CONTINUE;
 
     if (virNetMessageEncodeHeader(&msg) < 0)
-        return -1;
+        goto cleanup;
 
     if (virNetMessageEncodePayloadRaw(&msg, stream, strlen(stream)) < 0)
-        return -1;
+        goto cleanup;
 
     if (ARRAY_CARDINALITY(expect) != msg.bufferLength) {
         VIR_DEBUG("Expect message length %zu got %zu",
                   sizeof(expect), msg.bufferLength);
-        return -1;
+        goto cleanup;
     }
 
     if (msg.bufferOffset != 0) {
         VIR_DEBUG("Expect message offset 0 got %zu",
                   msg.bufferOffset);
-        return -1;
+        goto cleanup;
     }
 
     if (memcmp(expect, msg.buffer, sizeof(expect)) != 0) {
         virtTestDifferenceBin(stderr, expect, msg.buffer, sizeof(expect));
-        return -1;
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    virNetMessageClear(&msg);
+    return ret;
+}
+
+
+static int testMessagePayloadGrow(const void *args ATTRIBUTE_UNUSED)
+{
+    static virNetMessage msg;
+    char *stream = NULL;
+    size_t len = VIR_NET_MESSAGE_INITIAL * 8;
+    int ret = -1;
+
+    memset(&msg, 0, sizeof(msg));
+
+    if (VIR_ALLOC_N(stream, VIR_NET_MESSAGE_MAX) < 0)
+        goto cleanup;
+    memset(stream, 'x', VIR_NET_MESSAGE_MAX);
+
+    msg.header.prog = 0x11223344;
+    msg.header.vers = 0x01;
+    msg.header.proc = 0x666;
+    msg.header.type = VIR_NET_STREAM;
+    msg.header.serial = 0x99;
+    msg.header.status = VIR_NET_CONTINUE;
+
+    if (virNetMessageEncodeHeader(&msg) < 0)
+        goto cleanup;
+
+    if (msg.bufferSize != VIR_NET_MESSAGE_INITIAL) {
+        VIR_DEBUG("Expect buffer size %zu got %zu",
+                  (size_t)VIR_NET_MESSAGE_INITIAL, msg.bufferSize);
+        goto cleanup;
+    }
+
+    if (virNetMessageEncodePayloadRaw(&msg, stream, len) < 0)
+        goto cleanup;
+
+    if (msg.bufferLength != len + 28) {
+        VIR_DEBUG("Expect message length %zu got %zu",
+                  len + 28, msg.bufferLength);
+        goto cleanup;
+    }
+
+    if (msg.bufferSize < msg.bufferLength) {
+        VIR_DEBUG("Expect buffer size at least %zu got %zu",
+                  msg.bufferLength, msg.bufferSize);
+        goto cleanup;
+    }
+
+    if (memcmp(stream, msg.buffer + 28, len) != 0) {
+        VIR_DEBUG("Stream data corrupted when growing buffer");
+        goto cleanup;
+    }
+
+    /* Data beyond the protocol limit must be rejected */
+    virNetMessageClear(&msg);
+    if (virNetMessageEncodeHeader(&msg) < 0)
+        goto cleanup;
+
+    if (virNetMessageEncodePayloadRaw(&msg, stream, VIR_NET_MESSAGE_MAX) == 0) {
+        VIR_DEBUG("Expected oversized payload to be rejected");
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    VIR_FREE(stream);
+    virNetMessageClear(&msg);
+    return ret;
+}
+
+static int testMessageBufferPool(const void *args ATTRIBUTE_UNUSED)
+{
+    virNetMessagePtr msg = NULL;
+    virNetMessagePoolStats before, after;
+    int ret = -1;
+
+    virNetMessagePoolDrain();
+
+    if (!(msg = virNetMessageNew(false)))
+        goto cleanup;
+    if (virNetMessageEncodeHeader(msg) < 0)
+        goto cleanup;
+    virNetMessageFree(msg);
+
+    virNetMessagePoolGetStats(&before);
+    if (before.smallFree != 1) {
+        VIR_DEBUG("Expect 1 free small buffer got %zu", before.smallFree);
+        msg = NULL;
+        goto cleanup;
+    }
+
+    if (!(msg = virNetMessageNew(false)))
+        goto cleanup;
+    if (virNetMessageEncodeHeader(msg) < 0)
+        goto cleanup;
+
+    virNetMessagePoolGetStats(&after);
+    if (after.smallHits != before.smallHits + 1 ||
+        after.smallMisses != before.smallMisses ||
+        after.smallFree != 0) {
+        VIR_DEBUG("Expect buffer reuse, got hits %llu->%llu misses %llu->%llu",
+                  before.smallHits, after.smallHits,
+                  before.smallMisses, after.smallMisses);
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    virNetMessageFree(msg);
+    virNetMessagePoolDrain();
+    return ret;
+}
+
+static int testMessageQueue(const void *args ATTRIBUTE_UNUSED)
+{
+    virNetMessageQueue queue = { NULL, NULL };
+    virNetMessagePtr msgs[3] = { NULL, NULL, NULL };
+    virNetMessagePtr msg;
+    int ret = -1;
+    int i;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(msgs) ; i++) {
+        if (!(msgs[i] = virNetMessageNew(false)))
+            goto cleanup;
+    }
+
+    virNetMessageQueuePush(&queue, msgs[0]);
+    virNetMessageQueuePush(&queue, msgs[1]);
+    if (virNetMessageQueueServe(&queue) != msgs[0]) {
+        VIR_DEBUG("Expect first message served first");
+        goto cleanup;
+    }
+
+    /* Pushing after serving still appends at the tail */
+    virNetMessageQueuePush(&queue, msgs[2]);
+    if (queue.tail != msgs[2] ||
+        virNetMessageQueueServe(&queue) != msgs[1] ||
+        virNetMessageQueueServe(&queue) != msgs[2]) {
+        VIR_DEBUG("Expect messages served in push order");
+        goto cleanup;
+    }
+
+    if (queue.head || queue.tail ||
+        virNetMessageQueueServe(&queue) != NULL) {
+        VIR_DEBUG("Expect empty queue");
+        goto cleanup;
     }
 
-    return 0;
+    /* And an emptied queue can be used again */
+    virNetMessageQueuePush(&queue, msgs[1]);
+    if (queue.head != msgs[1] || queue.tail != msgs[1] ||
+        msgs[1]->next != NULL) {
+        VIR_DEBUG("Expect single message queue");
+        goto cleanup;
+    }
+    virNetMessageQueueServe(&queue);
+
+    ret = 0;
+cleanup:
+    while ((msg = virNetMessageQueueServe(&queue)))
+        ;
+    for (i = 0 ; i < ARRAY_CARDINALITY(msgs) ; i++)
+        virNetMessageFree(msgs[i]);
+    return ret;
 }
 
 
@@ -506,6 +688,15 @@ mymain(void)
     if (virtTestRun("Message Payload Stream Encode", 1, testMessagePayloadStreamEncode, NULL) < 0)
         ret = -1;
 
+    if (virtTestRun("Message Payload Grow", 1, testMessagePayloadGrow, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("Message Buffer Pool", 1, testMessageBufferPool, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("Message Queue", 1, testMessageQueue, NULL) < 0)
+        ret = -1;
+
     return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
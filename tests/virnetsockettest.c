@@ -320,6 +320,79 @@ cleanup:
     return ret;
 }
 
+
+static int testSocketUNIXWritev(const void *data ATTRIBUTE_UNUSED)
+{
+    virNetSocketPtr lsock = NULL; /* Listen socket */
+    virNetSocketPtr ssock = NULL; /* Server socket */
+    virNetSocketPtr csock = NULL; /* Client socket */
+    char one[] = "Hello ", two[] = "", three[] = "World";
+    struct iovec iov[] = {
+        { one, sizeof(one) - 1 },
+        { two, sizeof(two) - 1 },
+        { three, sizeof(three) - 1 },
+    };
+    char buf[sizeof("Hello World")];
+    size_t got = 0;
+    int ret = -1;
+
+    char *path;
+    if (progname[0] == '/') {
+        if (virAsprintf(&path, "%s-test.sock", progname) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    } else {
+        if (virAsprintf(&path, "%s/%s-test.sock", abs_builddir, progname) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    if (virNetSocketNewListenUNIX(path, 0700, -1, getgid(), &lsock) < 0)
+        goto cleanup;
+
+    if (virNetSocketListen(lsock, 0) < 0)
+        goto cleanup;
+
+    if (virNetSocketNewConnectUNIX(path, false, NULL, &csock) < 0)
+        goto cleanup;
+
+    if (virNetSocketAccept(lsock, &ssock) < 0) {
+        VIR_DEBUG("Unexpected client socket missing");
+        goto cleanup;
+    }
+
+    /* All buffers go out in one go, in order */
+    if (virNetSocketWritev(ssock, iov, ARRAY_CARDINALITY(iov)) !=
+        sizeof(buf) - 1) {
+        VIR_DEBUG("Expected all buffers written at once");
+        goto cleanup;
+    }
+
+    while (got < sizeof(buf) - 1) {
+        ssize_t n = virNetSocketRead(csock, buf + got, sizeof(buf) - 1 - got);
+        if (n < 0)
+            goto cleanup;
+        got += n;
+    }
+    buf[got] = '\0';
+
+    if (STRNEQ(buf, "Hello World")) {
+        VIR_DEBUG("Unexpected data '%s'", buf);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(path);
+    virNetSocketFree(lsock);
+    virNetSocketFree(ssock);
+    virNetSocketFree(csock);
+    return ret;
+}
+
 static int testSocketCommandNormal(const void *data ATTRIBUTE_UNUSED)
 {
     virNetSocketPtr csock = NULL; /* Client socket */
@@ -488,6 +561,9 @@ mymain(void)
     if (virtTestRun("Socket UNIX Addrs", 1, testSocketUNIXAddrs, NULL) < 0)
         ret = -1;
 
+    if (virtTestRun("Socket UNIX Writev", 1, testSocketUNIXWritev, NULL) < 0)
+        ret = -1;
+
     if (virtTestRun("Socket External Command /dev/zero", 1, testSocketCommandNormal, NULL) < 0)
         ret = -1;
     if (virtTestRun("Socket External Command /dev/does-not-exist", 1, testSocketCommandFail, NULL) < 0)
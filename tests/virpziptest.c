@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "virfile.h"
+#include "virpzip.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+/* Where a save image puts the compressed stream, after its header */
+#define HEADER_LEN 4096
+
+struct testInfo {
+    size_t len;
+    unsigned int nthreads;
+    bool direct;
+};
+
+struct testFiles {
+    char raw[32];
+    char zip[32];
+    char out[32];
+};
+
+/*
+ * Guest memory, more or less: runs of zero pages, of text and of
+ * noise, with a run straddling each block boundary
+ */
+static char *
+testData(size_t len)
+{
+    char *data;
+    unsigned int seed = 42;
+    size_t i;
+
+    if (VIR_ALLOC_N(data, len) < 0)
+        return NULL;
+
+    for (i = 0 ; i < len ; i++) {
+        switch ((i / (VIR_PZIP_BLOCK_SIZE / 3)) % 3) {
+        case 0:
+            break;
+        case 1:
+            data[i] = "libvirt save image "[i % 19];
+            break;
+        case 2:
+            seed = seed * 1103515245 + 12345;
+            data[i] = seed >> 16;
+            break;
+        }
+    }
+    return data;
+}
+
+static int
+testFilesCreate(struct testFiles *files)
+{
+    char *paths[] = { files->raw, files->zip, files->out };
+    int fd;
+    int i;
+
+    strcpy(files->raw, "/tmp/virpziptest.raw.XXXXXX");
+    strcpy(files->zip, "/tmp/virpziptest.zip.XXXXXX");
+    strcpy(files->out, "/tmp/virpziptest.out.XXXXXX");
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(paths) ; i++) {
+        if ((fd = mkstemp(paths[i])) < 0)
+            return -1;
+        VIR_FORCE_CLOSE(fd);
+    }
+    return 0;
+}
+
+static void
+testFilesRemove(struct testFiles *files)
+{
+    unlink(files->raw);
+    unlink(files->zip);
+    unlink(files->out);
+}
+
+static int
+testWriteFile(const char *path, const char *data, size_t len)
+{
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_WRONLY | O_TRUNC)) < 0)
+        return -1;
+    if (safewrite(fd, data, len) == len)
+        ret = 0;
+    if (VIR_CLOSE(fd) < 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * Compress @info->len bytes into a file, after a header the way a
+ * save image has it, and get them back out again
+ */
+static int
+testRoundTrip(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    struct testFiles files;
+    char header[HEADER_LEN];
+    char *data = NULL;
+    char *back = NULL;
+    int infd = -1;
+    int outfd = -1;
+    int ret = -1;
+    int len;
+
+    memset(header, 'H', sizeof(header));
+
+    if (testFilesCreate(&files) < 0 ||
+        !(data = testData(info->len)) ||
+        testWriteFile(files.raw, data, info->len) < 0)
+        goto cleanup;
+
+    if ((infd = open(files.raw, O_RDONLY)) < 0 ||
+        (outfd = open(files.zip, O_WRONLY | O_TRUNC)) < 0 ||
+        safewrite(outfd, header, sizeof(header)) != sizeof(header))
+        goto cleanup;
+
+    if (info->direct &&
+        fcntl(outfd, F_SETFL, fcntl(outfd, F_GETFL) | O_DIRECT) < 0) {
+        /* Not every file system can do it; tmpfs can't */
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (virPZipCompress(infd, files.raw, outfd, files.zip,
+                        info->nthreads) < 0) {
+        testError("\ncompression failed\n");
+        goto cleanup;
+    }
+    VIR_FORCE_CLOSE(infd);
+    if (VIR_CLOSE(outfd) < 0)
+        goto cleanup;
+
+    if ((infd = open(files.zip, O_RDONLY)) < 0 ||
+        lseek(infd, sizeof(header), SEEK_SET) != sizeof(header) ||
+        (outfd = open(files.out, O_WRONLY | O_TRUNC)) < 0)
+        goto cleanup;
+
+    if (virPZipDecompress(infd, files.zip, outfd, files.out,
+                          info->nthreads) < 0) {
+        testError("\ndecompression failed\n");
+        goto cleanup;
+    }
+    if (VIR_CLOSE(outfd) < 0)
+        goto cleanup;
+
+    if ((len = virFileReadAll(files.out, info->len + 1, &back)) < 0)
+        goto cleanup;
+    if (len != info->len || memcmp(data, back, len) != 0) {
+        testError("\ngot %d bytes back, not the %zu put in\n",
+                  len, info->len);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(infd);
+    VIR_FORCE_CLOSE(outfd);
+    testFilesRemove(&files);
+    VIR_FREE(data);
+    VIR_FREE(back);
+    return ret;
+}
+
+
+/* A damaged or cut short stream is refused, not passed on */
+static int
+testCorrupt(const void *opaque ATTRIBUTE_UNUSED)
+{
+    struct testFiles files;
+    size_t len = 3 * VIR_PZIP_BLOCK_SIZE;
+    char *data = NULL;
+    char *zip = NULL;
+    int zlen;
+    int infd = -1;
+    int outfd = -1;
+    int ret = -1;
+    int i;
+
+    if (testFilesCreate(&files) < 0 ||
+        !(data = testData(len)) ||
+        testWriteFile(files.raw, data, len) < 0)
+        goto cleanup;
+
+    if ((infd = open(files.raw, O_RDONLY)) < 0 ||
+        (outfd = open(files.zip, O_WRONLY | O_TRUNC)) < 0 ||
+        virPZipCompress(infd, files.raw, outfd, files.zip, 2) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(infd);
+    VIR_FORCE_CLOSE(outfd);
+
+    if ((zlen = virFileReadAll(files.zip, 2 * len, &zip)) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < 2 ; i++) {
+        /* First a byte of the index, then the end of the stream */
+        if (i == 0) {
+            zip[zlen - 30] ^= 1;
+            if (testWriteFile(files.zip, zip, zlen) < 0)
+                goto cleanup;
+        } else {
+            zip[zlen - 30] ^= 1;
+            if (testWriteFile(files.zip, zip, zlen / 2) < 0)
+                goto cleanup;
+        }
+
+        if ((infd = open(files.zip, O_RDONLY)) < 0 ||
+            (outfd = open(files.out, O_WRONLY | O_TRUNC)) < 0)
+            goto cleanup;
+        if (virPZipDecompress(infd, files.zip, outfd, files.out, 2) == 0) {
+            testError("\n%s stream accepted\n",
+                      i == 0 ? "corrupt" : "truncated");
+            goto cleanup;
+        }
+        VIR_FORCE_CLOSE(infd);
+        VIR_FORCE_CLOSE(outfd);
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(infd);
+    VIR_FORCE_CLOSE(outfd);
+    testFilesRemove(&files);
+    VIR_FREE(data);
+    VIR_FREE(zip);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    struct testInfo info;
+    int ret = 0;
+
+    if (!virPZipAvailable())
+        return EXIT_AM_SKIP;
+
+#define DO_TEST(name, length, threads, odirect)                         \
+    do {                                                                \
+        info.len = length;                                              \
+        info.nthreads = threads;                                        \
+        info.direct = odirect;                                          \
+        if (virtTestRun(name, 1, testRoundTrip, &info) < 0)             \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("Empty stream", 0, 2, false);
+    DO_TEST("Single byte", 1, 2, false);
+    DO_TEST("Exactly one block", VIR_PZIP_BLOCK_SIZE, 2, false);
+    DO_TEST("Blocks and a bit, one thread", 7 * VIR_PZIP_BLOCK_SIZE / 2,
+            1, false);
+    DO_TEST("Blocks and a bit, many threads", 7 * VIR_PZIP_BLOCK_SIZE / 2,
+            8, false);
+    DO_TEST("Blocks and a bit, O_DIRECT", 7 * VIR_PZIP_BLOCK_SIZE / 2,
+            4, true);
+
+    if (virtTestRun("Corrupt streams", 1, testCorrupt, NULL) < 0)
+        ret = -1;
+
+    /* Timings are reported with --verbose; with more threads the
+     * same data should go through in a fraction of the time */
+    DO_TEST("64 MiB with one thread", 64 * VIR_PZIP_BLOCK_SIZE, 1, false);
+    DO_TEST("64 MiB with a thread per CPU", 64 * VIR_PZIP_BLOCK_SIZE,
+            0, false);
+
+#undef DO_TEST
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "virfile.h"
+#include "virreadahead.h"
+#include "ignore-value.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+/* Where a save image puts the stream, after its header and XML */
+#define HEADER_LEN 4096
+
+/* How QEMU's migration stream lays out RAM: each page is an 8 byte
+ * big endian address with flags in its low bits, followed by the
+ * page, or by a single byte it is filled with */
+#define PAGE_SIZE 4096
+#define RAM_SAVE_FLAG_COMPRESS 0x02
+#define RAM_SAVE_FLAG_PAGE 0x08
+#define RAM_SAVE_FLAG_EOS 0x10
+
+struct testInfo {
+    char path[64];
+    char *ram;          /* memory of the guest that was saved */
+    size_t len;
+    bool readahead;
+};
+
+
+/*
+ * Memory of a guest which has been up for a while: most pages hold
+ * data, with runs of zero pages here and there
+ */
+static char *
+testGuestRAM(size_t len)
+{
+    char *ram;
+    unsigned int seed = 42;
+    size_t i;
+
+    if (VIR_ALLOC_N(ram, len) < 0)
+        return NULL;
+
+    for (i = 0 ; i < len ; i++) {
+        if ((i / PAGE_SIZE) % 16 < 12) {
+            seed = seed * 1103515245 + 12345;
+            ram[i] = seed >> 16;
+        }
+    }
+    return ram;
+}
+
+static int
+testWriteRecord(FILE *fp, uint64_t addr, int flags)
+{
+    uint64_t hdr = addr | flags;
+    unsigned char buf[8];
+    int i;
+
+    for (i = 0 ; i < 8 ; i++)
+        buf[i] = hdr >> (56 - 8 * i);
+    return fwrite(buf, sizeof(buf), 1, fp) == 1 ? 0 : -1;
+}
+
+/* Save @ram into a file the way QEMU writes it out */
+static int
+testWriteImage(struct testInfo *info)
+{
+    static const char header[HEADER_LEN];
+    FILE *fp = NULL;
+    int fd;
+    size_t i;
+    int ret = -1;
+
+    strcpy(info->path, "/tmp/virreadaheadtest.XXXXXX");
+    if ((fd = mkstemp(info->path)) < 0 ||
+        !(fp = fdopen(fd, "w"))) {
+        VIR_FORCE_CLOSE(fd);
+        return -1;
+    }
+
+    if (fwrite(header, sizeof(header), 1, fp) != 1)
+        goto cleanup;
+
+    for (i = 0 ; i < info->len ; i += PAGE_SIZE) {
+        const char *page = info->ram + i;
+
+        if (page[0] == '\0' && memcmp(page, page + 1, PAGE_SIZE - 1) == 0) {
+            if (testWriteRecord(fp, i, RAM_SAVE_FLAG_COMPRESS) < 0 ||
+                fputc(0, fp) == EOF)
+                goto cleanup;
+        } else {
+            if (testWriteRecord(fp, i, RAM_SAVE_FLAG_PAGE) < 0 ||
+                fwrite(page, PAGE_SIZE, 1, fp) != 1)
+                goto cleanup;
+        }
+    }
+    if (testWriteRecord(fp, 0, RAM_SAVE_FLAG_EOS) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (VIR_FCLOSE(fp) < 0)
+        ret = -1;
+    return ret;
+}
+
+
+struct testReader {
+    int fd;
+    char buf[32 * 1024];
+    size_t len;
+    size_t pos;
+};
+
+static int
+testRead(struct testReader *reader, char *data, size_t len)
+{
+    while (len > 0) {
+        size_t n;
+
+        if (reader->pos == reader->len) {
+            ssize_t got = read(reader->fd, reader->buf, sizeof(reader->buf));
+
+            if (got <= 0)
+                return -1;
+            reader->len = got;
+            reader->pos = 0;
+        }
+
+        n = MIN(len, reader->len - reader->pos);
+        memcpy(data, reader->buf + reader->pos, n);
+        reader->pos += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Restore from the image the way QEMU does, reading the stream from
+ * the fd through a small buffer, after dropping the image from the
+ * cache; the memory it ends up with has to be what was saved
+ */
+static int
+testRestore(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    virReadAheadPtr readahead = NULL;
+    struct testReader *reader = NULL;
+    char *ram = NULL;
+    unsigned long long then = 0, now = 0;
+    int ret = -1;
+
+    if (VIR_ALLOC(reader) < 0)
+        goto cleanup;
+    reader->fd = -1;
+    if (VIR_ALLOC_N(ram, info->len) < 0)
+        goto cleanup;
+
+    if ((reader->fd = open(info->path, O_RDONLY)) < 0)
+        goto cleanup;
+#if HAVE_POSIX_FADVISE
+    if (fdatasync(reader->fd) < 0 && errno != EINVAL)
+        goto cleanup;
+    ignore_value(posix_fadvise(reader->fd, 0, 0, POSIX_FADV_DONTNEED));
+#endif
+
+    if (lseek(reader->fd, HEADER_LEN, SEEK_SET) != HEADER_LEN)
+        goto cleanup;
+
+    ignore_value(virTimeMs(&then));
+    if (info->readahead &&
+        !(readahead = virReadAheadStart(reader->fd)))
+        goto cleanup;
+
+    for (;;) {
+        unsigned char buf[8];
+        uint64_t hdr = 0;
+        uint64_t addr;
+        int i;
+
+        if (testRead(reader, (char *)buf, sizeof(buf)) < 0) {
+            testError("\nstream ends early\n");
+            goto cleanup;
+        }
+        for (i = 0 ; i < 8 ; i++)
+            hdr = (hdr << 8) | buf[i];
+        addr = hdr & ~(uint64_t)(PAGE_SIZE - 1);
+
+        if (hdr & RAM_SAVE_FLAG_EOS)
+            break;
+        if (addr + PAGE_SIZE > info->len) {
+            testError("\npage at %llu is out of range\n",
+                      (unsigned long long)addr);
+            goto cleanup;
+        }
+
+        if (hdr & RAM_SAVE_FLAG_COMPRESS) {
+            char fill;
+
+            if (testRead(reader, &fill, 1) < 0)
+                goto cleanup;
+            memset(ram + addr, fill, PAGE_SIZE);
+        } else if (testRead(reader, ram + addr, PAGE_SIZE) < 0) {
+            goto cleanup;
+        }
+    }
+    ignore_value(virTimeMs(&now));
+
+    if (memcmp(ram, info->ram, info->len) != 0) {
+        testError("\nrestored memory differs from what was saved\n");
+        goto cleanup;
+    }
+
+    if (virTestGetVerbose())
+        fprintf(stderr, "\n%zu MiB restored in %llu ms %s read ahead\n",
+                info->len / (1024 * 1024), now - then,
+                info->readahead ? "with" : "without");
+
+    ret = 0;
+
+cleanup:
+    virReadAheadStop(readahead);
+    if (reader)
+        VIR_FORCE_CLOSE(reader->fd);
+    VIR_FREE(reader);
+    VIR_FREE(ram);
+    return ret;
+}
+
+
+/* Only a regular file has anything to read ahead of */
+static int
+testPipe(const void *opaque ATTRIBUTE_UNUSED)
+{
+    virReadAheadPtr readahead;
+    int fds[2];
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    readahead = virReadAheadStart(fds[0]);
+    virReadAheadStop(readahead);
+    VIR_FORCE_CLOSE(fds[0]);
+    VIR_FORCE_CLOSE(fds[1]);
+
+    if (readahead) {
+        testError("\nread ahead of a pipe\n");
+        return -1;
+    }
+    virResetLastError();
+    return 0;
+}
+
+
+/*
+ * Save the memory of a guest as QEMU would, and time restoring it
+ * from a cold cache with and without reading ahead; the timings and
+ * image size are reported with --verbose
+ */
+static int
+testBenchmark(size_t len)
+{
+    struct testInfo info;
+    struct stat sb;
+    int ret = -1;
+
+    memset(&info, 0, sizeof(info));
+    info.len = len;
+
+    if (!(info.ram = testGuestRAM(len)) ||
+        testWriteImage(&info) < 0 ||
+        stat(info.path, &sb) < 0)
+        goto cleanup;
+
+    if (virTestGetVerbose())
+        fprintf(stderr, "%zu MiB of memory saved in %lld KiB\n",
+                len / (1024 * 1024), (long long) sb.st_size / 1024);
+
+    ret = 0;
+    info.readahead = false;
+    if (virtTestRun("Restore without read ahead", 1,
+                    testRestore, &info) < 0)
+        ret = -1;
+    info.readahead = true;
+    if (virtTestRun("Restore with read ahead", 1,
+                    testRestore, &info) < 0)
+        ret = -1;
+
+cleanup:
+    if (*info.path)
+        unlink(info.path);
+    VIR_FREE(info.ram);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virtTestRun("Pipe", 1, testPipe, NULL) < 0)
+        ret = -1;
+
+#if HAVE_POSIX_FADVISE
+    if (testBenchmark(64 * 1024 * 1024) < 0)
+        ret = -1;
+#endif
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -1284,6 +1284,144 @@ cmdDomIfstat (vshControl *ctl, const vshCmd *cmd)
     return true;
 }
 
+/* "domstats" command
+ */
+static const vshCmdInfo info_domstats[] = {
+    {"help", N_("get statistics of all running domains")},
+    {"desc", N_("Get the statistics of every running domain in one go. "
+                "Without any options, all groups of statistics are returned.")},
+    {NULL,NULL}
+};
+
+static const vshCmdOptDef opts_domstats[] = {
+    {"state", VSH_OT_BOOL, 0, N_("report domain state")},
+    {"cpu-total", VSH_OT_BOOL, 0, N_("report total cpu time")},
+    {"balloon", VSH_OT_BOOL, 0, N_("report balloon size")},
+    {"interface", VSH_OT_BOOL, 0, N_("report network interface stats")},
+    {"block", VSH_OT_BOOL, 0, N_("report block device stats")},
+    {NULL, 0, 0, NULL}
+};
+
+static bool
+cmdDomstats(vshControl *ctl, const vshCmd *cmd)
+{
+    virDomainStatsRecordPtr *records = NULL;
+    virDomainStatsRecordPtr *next;
+    unsigned int stats = 0;
+    int i;
+
+    if (!vshConnectionUsability(ctl, ctl->conn))
+        return false;
+
+    if (vshCommandOptBool(cmd, "state"))
+        stats |= VIR_DOMAIN_STATS_STATE;
+    if (vshCommandOptBool(cmd, "cpu-total"))
+        stats |= VIR_DOMAIN_STATS_CPU_TOTAL;
+    if (vshCommandOptBool(cmd, "balloon"))
+        stats |= VIR_DOMAIN_STATS_BALLOON;
+    if (vshCommandOptBool(cmd, "interface"))
+        stats |= VIR_DOMAIN_STATS_INTERFACE;
+    if (vshCommandOptBool(cmd, "block"))
+        stats |= VIR_DOMAIN_STATS_BLOCK;
+
+    if (virConnectGetAllDomainStats(ctl->conn, stats, &records, 0) < 0) {
+        vshError(ctl, "%s", _("Failed to get domain stats"));
+        return false;
+    }
+
+    for (next = records ; *next ; next++) {
+        vshPrint(ctl, "Domain: '%s'\n", virDomainGetName((*next)->dom));
+        for (i = 0 ; i < (*next)->nparams ; i++) {
+            char *value = vshGetTypedParamValue(ctl, (*next)->params + i);
+
+            if (value)
+                vshPrint(ctl, "  %s=%s\n", (*next)->params[i].field, value);
+            VIR_FREE(value);
+        }
+        vshPrint(ctl, "\n");
+    }
+
+    virDomainStatsRecordListFree(records);
+    return true;
+}
+
+/* "domstatsamples" command
+ */
+static const vshCmdInfo info_domstatsamples[] = {
+    {"help", N_("get the latest stats samples of a domain")},
+    {"desc", N_("Get the statistics the daemon sampled for a domain, "
+                "oldest first. Without any group options, all groups "
+                "are returned.")},
+    {NULL,NULL}
+};
+
+static const vshCmdOptDef opts_domstatsamples[] = {
+    {"domain", VSH_OT_DATA, VSH_OFLAG_REQ, N_("domain name, id or uuid")},
+    {"count", VSH_OT_INT, 0, N_("number of samples, all kept by default")},
+    {"rates", VSH_OT_BOOL, 0, N_("report rates per second")},
+    {"cpu-total", VSH_OT_BOOL, 0, N_("report total cpu time")},
+    {"balloon", VSH_OT_BOOL, 0, N_("report balloon size")},
+    {"interface", VSH_OT_BOOL, 0, N_("report network interface stats")},
+    {"block", VSH_OT_BOOL, 0, N_("report block device stats")},
+    {NULL, 0, 0, NULL}
+};
+
+static bool
+cmdDomstatsamples(vshControl *ctl, const vshCmd *cmd)
+{
+    virDomainPtr dom;
+    virDomainStatsRecordPtr *records = NULL;
+    virDomainStatsRecordPtr *next;
+    unsigned int stats = 0;
+    unsigned int flags = 0;
+    unsigned int count = 0;
+    int i;
+
+    if (!vshConnectionUsability(ctl, ctl->conn))
+        return false;
+
+    if (vshCommandOptUInt(cmd, "count", &count) < 0) {
+        vshError(ctl, "%s", _("Unable to parse integer parameter"));
+        return false;
+    }
+
+    if (vshCommandOptBool(cmd, "rates"))
+        flags |= VIR_DOMAIN_STATS_SAMPLES_RATES;
+    if (vshCommandOptBool(cmd, "cpu-total"))
+        stats |= VIR_DOMAIN_STATS_CPU_TOTAL;
+    if (vshCommandOptBool(cmd, "balloon"))
+        stats |= VIR_DOMAIN_STATS_BALLOON;
+    if (vshCommandOptBool(cmd, "interface"))
+        stats |= VIR_DOMAIN_STATS_INTERFACE;
+    if (vshCommandOptBool(cmd, "block"))
+        stats |= VIR_DOMAIN_STATS_BLOCK;
+
+    if (!(dom = vshCommandOptDomain(ctl, cmd, NULL)))
+        return false;
+
+    if (virDomainGetStatsSamples(dom, stats, count, &records, flags) < 0) {
+        vshError(ctl, _("Failed to get stats samples of domain %s"),
+                 virDomainGetName(dom));
+        virDomainFree(dom);
+        return false;
+    }
+
+    for (next = records ; *next ; next++) {
+        for (i = 0 ; i < (*next)->nparams ; i++) {
+            char *value = vshGetTypedParamValue(ctl, (*next)->params + i);
+
+            if (value)
+                vshPrint(ctl, "%s=%s\n", (*next)->params[i].field, value);
+            VIR_FREE(value);
+        }
+        vshPrint(ctl, "\n");
+    }
+
+    virDomainStatsRecordListFree(records);
+    virDomainFree(dom);
+    return true;
+}
+
 /* "domif-setlink" command
  */
 static const vshCmdInfo info_domif_setlink[] = {
@@ -3494,6 +3632,65 @@ cleanup:
     return ret;
 }
 
+/*
+ * "domjobtimeline" command
+ */
+static const vshCmdInfo info_domjobtimeline[] = {
+    {"help", N_("show the progress of the last migration")},
+    {"desc", N_("Print how the latest migration, save or dump of a "
+                "domain progressed, oldest sample first.")},
+    {NULL, NULL}
+};
+
+static const vshCmdOptDef opts_domjobtimeline[] = {
+    {"domain", VSH_OT_DATA, VSH_OFLAG_REQ, N_("domain name, id or uuid")},
+    {"count", VSH_OT_INT, 0, N_("number of samples, all kept by default")},
+    {NULL, 0, 0, NULL}
+};
+
+static bool
+cmdDomjobtimeline(vshControl *ctl, const vshCmd *cmd)
+{
+    virDomainPtr dom;
+    virDomainStatsRecordPtr *records = NULL;
+    virDomainStatsRecordPtr *next;
+    unsigned int count = 0;
+    int i;
+
+    if (!vshConnectionUsability(ctl, ctl->conn))
+        return false;
+
+    if (vshCommandOptUInt(cmd, "count", &count) < 0) {
+        vshError(ctl, "%s", _("Unable to parse integer parameter"));
+        return false;
+    }
+
+    if (!(dom = vshCommandOptDomain(ctl, cmd, NULL)))
+        return false;
+
+    if (virDomainGetMigrationTimeline(dom, count, &records, 0) < 0) {
+        vshError(ctl, _("Failed to get migration timeline of domain %s"),
+                 virDomainGetName(dom));
+        virDomainFree(dom);
+        return false;
+    }
+
+    for (next = records ; *next ; next++) {
+        for (i = 0 ; i < (*next)->nparams ; i++) {
+            char *value = vshGetTypedParamValue(ctl, (*next)->params + i);
+
+            if (value)
+                vshPrint(ctl, "%s=%s\n", (*next)->params[i].field, value);
+            VIR_FREE(value);
+        }
+        vshPrint(ctl, "\n");
+    }
+
+    virDomainStatsRecordListFree(records);
+    virDomainFree(dom);
+    return true;
+}
+
 /*
  * "domjobabort" command
  */
@@ -7961,6 +8158,7 @@ static const vshCmdInfo info_pool_refresh[] = {
 
 static const vshCmdOptDef opts_pool_refresh[] = {
     {"pool", VSH_OT_DATA, VSH_OFLAG_REQ, N_("pool name or uuid")},
+    {"full", VSH_OT_BOOL, 0, N_("rescan every volume, not only changed ones")},
     {NULL, 0, 0, NULL}
 };
 
@@ -7970,6 +8168,7 @@ cmdPoolRefresh(vshControl *ctl, const vshCmd *cmd)
     virStoragePoolPtr pool;
     bool ret = true;
     const char *name;
+    unsigned int flags = 0;
 
     if (!vshConnectionUsability(ctl, ctl->conn))
         return false;
@@ -7977,7 +8176,10 @@ cmdPoolRefresh(vshControl *ctl, const vshCmd *cmd)
     if (!(pool = vshCommandOptPool(ctl, cmd, "pool", &name)))
         return false;
 
-    if (virStoragePoolRefresh(pool, 0) == 0) {
+    if (vshCommandOptBool(cmd, "full"))
+        flags |= VIR_STORAGE_POOL_REFRESH_FULL;
+
+    if (virStoragePoolRefresh(pool, flags) == 0) {
         vshPrint(ctl, _("Pool %s refreshed\n"), name);
     } else {
         vshError(ctl, _("Failed to refresh pool %s"), name);
@@ -13938,6 +14140,8 @@ static const vshCmdDef domManagementCmds[] = {
     {"domif-setlink", cmdDomIfSetLink, opts_domif_setlink, info_domif_setlink, 0},
     {"domjobabort", cmdDomjobabort, opts_domjobabort, info_domjobabort, 0},
     {"domjobinfo", cmdDomjobinfo, opts_domjobinfo, info_domjobinfo, 0},
+    {"domjobtimeline", cmdDomjobtimeline, opts_domjobtimeline,
+     info_domjobtimeline, 0},
     {"domname", cmdDomname, opts_domname, info_domname, 0},
     {"domuuid", cmdDomuuid, opts_domuuid, info_domuuid, 0},
     {"domxml-from-native", cmdDomXMLFromNative, opts_domxmlfromnative,
@@ -14002,6 +14206,9 @@ static const vshCmdDef domMonitoringCmds[] = {
     {"dominfo", cmdDominfo, opts_dominfo, info_dominfo, 0},
     {"dommemstat", cmdDomMemStat, opts_dommemstat, info_dommemstat, 0},
     {"domstate", cmdDomstate, opts_domstate, info_domstate, 0},
+    {"domstats", cmdDomstats, opts_domstats, info_domstats, 0},
+    {"domstatsamples", cmdDomstatsamples, opts_domstatsamples,
+     info_domstatsamples, 0},
     {"list", cmdList, opts_list, info_list, 0},
     {NULL, NULL, NULL, NULL, 0}
 };